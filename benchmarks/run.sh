@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Benchmark runner for the Enki compiler
+# Compiles every benchmark with the given compiler flags and times the result
+
+set -e
+
+COMPILER="./enki"
+BENCH_DIR="./benchmarks"
+BENCH_OUTPUT_DIR="./build/benchmarks"
+
+# Extra flags are passed straight to 'enki compile', e.g. --backend=c
+ENKI_FLAGS="$*"
+
+mkdir -p "$BENCH_OUTPUT_DIR"
+
+for bench in "$BENCH_DIR"/*.enki; do
+    name=$(basename "$bench" .enki)
+    exe="$BENCH_OUTPUT_DIR/$name"
+
+    compile_start=$(date +%s.%N)
+    if ! $COMPILER compile $ENKI_FLAGS -o "$exe" "$bench" > "$exe.log" 2>&1; then
+        echo "$name: compilation failed, see $exe.log"
+        continue
+    fi
+    compile_end=$(date +%s.%N)
+
+    run_start=$(date +%s.%N)
+    "$exe" > /dev/null
+    run_end=$(date +%s.%N)
+
+    awk -v name="$name" \
+        -v compile="$(awk "BEGIN { print $compile_end - $compile_start }")" \
+        -v run="$(awk "BEGIN { print $run_end - $run_start }")" \
+        'BEGIN { printf "%-28s compile %6.3fs   run %6.3fs\n", name, compile, run }'
+done
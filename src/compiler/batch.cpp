@@ -0,0 +1,159 @@
+#include "batch.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fmt/format.h>
+#include <fstream>
+#include <iostream>
+#include <spdlog/spdlog.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+
+// A compile and what it printed, kept until the compiles of the inputs
+// before it have been printed
+struct Job {
+  std::FILE *out = nullptr;
+  std::FILE *err = nullptr;
+  int code = 0;
+  bool done = false;
+};
+
+void flush_output() {
+  std::cout.flush();
+  std::fflush(stdout);
+  std::fflush(stderr);
+}
+
+void replay(std::FILE *file, std::FILE *to) {
+  if (!file) {
+    return;
+  }
+  std::rewind(file);
+  char buffer[4096];
+  size_t n;
+  while ((n = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    std::fwrite(buffer, 1, n, to);
+  }
+  std::fclose(file);
+}
+
+} // namespace
+
+bool expand_inputs(const std::vector<std::string> &args,
+                   std::vector<std::string> &inputs) {
+  for (const auto &arg : args) {
+    if (!arg.starts_with("@")) {
+      inputs.push_back(arg);
+      continue;
+    }
+    std::ifstream list(arg.substr(1));
+    if (!list.is_open()) {
+      spdlog::error("Could not open input list: {}", arg.substr(1));
+      return false;
+    }
+    for (std::string line; std::getline(list, line);) {
+      auto first = line.find_first_not_of(" \t\r");
+      if (first == std::string::npos || line[first] == '#') {
+        continue;
+      }
+      auto last = line.find_last_not_of(" \t\r");
+      inputs.push_back(line.substr(first, last - first + 1));
+    }
+  }
+  return true;
+}
+
+int compile_batch(
+    const std::vector<std::string> &inputs, unsigned jobs,
+    Ref<ModuleContext> modules,
+    const std::function<int(const std::string &input, Ref<ModuleContext>)>
+        &compile) {
+  std::vector<Job> compiles(inputs.size());
+  std::unordered_map<pid_t, size_t> running;
+  size_t started = 0;
+  size_t printed = 0;
+
+  auto print_finished = [&] {
+    for (; printed < compiles.size() && compiles[printed].done; ++printed) {
+      replay(compiles[printed].out, stdout);
+      replay(compiles[printed].err, stderr);
+      std::fflush(stdout);
+    }
+  };
+
+  while (started < inputs.size() || !running.empty()) {
+    if (started < inputs.size() && running.size() < jobs) {
+      auto &job = compiles[started];
+      modules->preload(inputs[started]);
+      // Without somewhere to keep its output the compile prints right away
+      job.out = std::tmpfile();
+      job.err = std::tmpfile();
+      flush_output();
+      pid_t pid = fork();
+      if (pid == 0) {
+        if (job.out && job.err) {
+          dup2(fileno(job.out), STDOUT_FILENO);
+          dup2(fileno(job.err), STDERR_FILENO);
+        }
+        int code = compile(inputs[started], modules);
+        flush_output();
+        std::exit(code);
+      }
+      if (pid < 0) {
+        spdlog::error("[batch] Could not start the compile of {}: {}",
+                      inputs[started], std::strerror(errno));
+        job.code = 1;
+        job.done = true;
+      } else {
+        running[pid] = started;
+      }
+      ++started;
+      print_finished();
+      continue;
+    }
+
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    auto finished = running.find(pid);
+    if (finished == running.end()) {
+      continue;
+    }
+    auto &job = compiles[finished->second];
+    job.code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    job.done = true;
+    running.erase(finished);
+    print_finished();
+  }
+
+  // Compiles that could not be waited for
+  for (const auto &[pid, index] : running) {
+    compiles[index].code = 1;
+    compiles[index].done = true;
+  }
+  print_finished();
+
+  std::vector<std::string> failed;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (compiles[i].code != 0) {
+      failed.push_back(inputs[i]);
+    }
+  }
+  if (failed.empty()) {
+    return 0;
+  }
+  fmt::print(stderr, "[batch] {} of {} inputs failed:\n", failed.size(),
+             inputs.size());
+  for (const auto &input : failed) {
+    fmt::print(stderr, "  {}\n", input);
+  }
+  return 1;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "modules.hpp"
+#include <functional>
+#include <string>
+#include <vector>
+
+// Compiles several inputs of one `enki compile` against the same modules.
+// The modules an input imports are loaded into `modules` before its compile
+// starts, so a module shared by many inputs is parsed once. Each compile
+// then runs in a process forked from this one, at most `jobs` at a time, and
+// its output is printed once it is done, in the order of the inputs.
+//
+// Returns 0 when every compile succeeded, and otherwise 1 after listing the
+// inputs that failed on stderr.
+int compile_batch(
+    const std::vector<std::string> &inputs, unsigned jobs,
+    Ref<ModuleContext> modules,
+    const std::function<int(const std::string &input, Ref<ModuleContext>)>
+        &compile);
+
+// The inputs named on the command line, with every `@file` replaced by the
+// files it lists, one per line. Blank lines and lines starting with `#` are
+// skipped. Returns false after reporting a list that cannot be read.
+bool expand_inputs(const std::vector<std::string> &args,
+                   std::vector<std::string> &inputs);
@@ -1,5 +1,8 @@
 #include "codegen.hpp"
+#include "../definitions/lowering.hpp"
 #include "../utils/logging.hpp"
+#include "tailcalls.hpp"
+#include <algorithm>
 #include <spdlog/spdlog.h>
 
 static void unimplemented(CodegenContext &ctx, ASTNode *node) {
@@ -12,6 +15,10 @@ static void unimplemented(CodegenContext &ctx, ASTNode *node) {
 static void gen_block(CodegenContext &ctx, Ref<Block> block);
 static void gen_ast(CodegenContext &ctx, Ref<ASTNode> node);
 
+static bool is_io_builtin(std::string_view name) {
+  return name == "print" || name == "eprint" || name == "flush";
+}
+
 static std::string type_with_name(Ref<Type> type, const std::string &name) {
   assert(type != nullptr && "Type is null");
   spdlog::debug("[codegen] Generating code for type: {}", type->to_string());
@@ -52,6 +59,377 @@ static std::string type_with_name(Ref<Type> type, const std::string &name) {
   }
 }
 
+// Layout of a string in the generated C++, where it is a std::string
+static constexpr Layout cpp_string_layout = {
+    static_cast<int>(sizeof(std::string)),
+    static_cast<int>(alignof(std::string))};
+
+// Whether copying a value of this type is a plain memcpy, i.e. it owns no heap
+// memory the way std::string does
+static bool is_trivially_copyable(Ref<Type> type) {
+  if (type->base_type == BaseType::String)
+    return false;
+  if (type->base_type == BaseType::Struct) {
+    for (const auto &field : std::get<Ref<Struct>>(type->structure)->fields) {
+      if (!is_trivially_copyable(field->type))
+        return false;
+    }
+  }
+  return true;
+}
+
+// Values that fit in two registers and copy trivially are passed by value,
+// everything else (strings, large structs, structs holding strings) by const
+// reference so that calls don't copy.
+ParamPassing param_passing(Ref<Type> type) {
+  constexpr int max_by_value_size = 16;
+  if (type->base_type != BaseType::Struct &&
+      type->base_type != BaseType::String) {
+    return ParamPassing::ByValue;
+  }
+  if (is_trivially_copyable(type) &&
+      type_layout(type, cpp_string_layout).size <= max_by_value_size) {
+    return ParamPassing::ByValue;
+  }
+  return ParamPassing::ByConstRef;
+}
+
+// Per-function information about a local variable or parameter, collected to
+// decide parameter passing and where std::move can be emitted.
+struct LocalInfo {
+  Ref<Type> type;
+  bool is_parameter = false;
+  int declarations = 0;
+  int loop_depth = 0;
+  bool assigned = false;
+  bool address_taken = false;
+  // How a parameter is received, see function_param_passing
+  ParamPassing passing = ParamPassing::ByValue;
+  struct Use {
+    const Identifier *identifier;
+    int statement;
+    int loop_depth;
+    bool movable_position; // Direct call or struct instantiation argument
+  };
+  std::vector<Use> uses;
+};
+
+struct LocalAnalysis {
+  std::unordered_map<std::string_view, LocalInfo> locals;
+  int loop_depth = 0;
+  int statement = 0;
+  // Writes through a pointer, to a field or to an element, any of which can
+  // reach the argument of a parameter received by reference
+  bool stores = false;
+  // Functions called by name, and whether anything else is called
+  std::vector<std::string_view> calls;
+  bool calls_unknown = false;
+  // Parameter passing of the functions that can be called, empty while the
+  // passing itself is being worked out
+  const std::unordered_map<std::string_view, std::vector<ParamPassing>>
+      *callees = nullptr;
+};
+
+// Whether an argument moved into parameter `index` of the callee ends up in
+// a parameter taken by value, moving into a const reference is a no-op
+static bool moves_into(const LocalAnalysis &analysis,
+                       const Ref<Identifier> &callee, size_t index) {
+  if (!callee || !analysis.callees)
+    return false;
+  auto found = analysis.callees->find(callee->name);
+  if (found == analysis.callees->end())
+    return false;
+  return index < found->second.size() &&
+         found->second[index] == ParamPassing::ByValue;
+}
+
+static void collect_uses(LocalAnalysis &analysis, Ref<Expression> expr,
+                         bool movable_position = false) {
+  if (!expr)
+    return;
+  switch (expr->get_type()) {
+  case ASTType::Identifier: {
+    auto ident = std::static_pointer_cast<Identifier>(expr);
+    auto it = analysis.locals.find(ident->name);
+    if (it != analysis.locals.end()) {
+      it->second.uses.push_back({ident.get(), analysis.statement,
+                                 analysis.loop_depth, movable_position});
+    }
+    break;
+  }
+  case ASTType::Call: {
+    auto call = std::static_pointer_cast<Call>(expr);
+    auto callee = std::dynamic_pointer_cast<Identifier>(call->callee);
+    if (callee)
+      analysis.calls.push_back(callee->name);
+    else
+      analysis.calls_unknown = true;
+    for (size_t i = 0; i < call->arguments.size(); ++i) {
+      const auto &arg = call->arguments[i];
+      collect_uses(analysis, arg,
+                   moves_into(analysis, callee, i) &&
+                       arg->get_type() == ASTType::Identifier);
+    }
+    break;
+  }
+  case ASTType::StructInstantiation:
+    for (const auto &arg :
+         std::static_pointer_cast<StructInstantiation>(expr)->arguments) {
+      collect_uses(analysis, arg, arg->get_type() == ASTType::Identifier);
+    }
+    break;
+  case ASTType::BinaryOp: {
+    auto binop = std::static_pointer_cast<BinaryOp>(expr);
+    collect_uses(analysis, binop->left);
+    collect_uses(analysis, binop->right);
+    break;
+  }
+  case ASTType::Dot:
+    // The right hand side is a field or enum member name, not a variable
+    collect_uses(analysis, std::static_pointer_cast<Dot>(expr)->left);
+    break;
+  case ASTType::Dereference:
+    collect_uses(analysis,
+                 std::static_pointer_cast<Dereference>(expr)->expression);
+    break;
+  case ASTType::Index: {
+    auto index = std::static_pointer_cast<Index>(expr);
+    collect_uses(analysis, index->base);
+    collect_uses(analysis, index->index);
+    break;
+  }
+  case ASTType::AddressOf: {
+    auto inner = std::static_pointer_cast<AddressOf>(expr)->expression;
+    if (auto ident = std::dynamic_pointer_cast<Identifier>(inner)) {
+      auto it = analysis.locals.find(ident->name);
+      if (it != analysis.locals.end())
+        it->second.address_taken = true;
+    }
+    collect_uses(analysis, inner);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+static void collect_uses(LocalAnalysis &analysis, Ref<Statement> stmt) {
+  if (!stmt)
+    return;
+  analysis.statement++;
+  switch (stmt->get_type()) {
+  case ASTType::VarDecl: {
+    auto var_decl = std::static_pointer_cast<VarDecl>(stmt);
+    collect_uses(analysis, var_decl->expression);
+    auto &local = analysis.locals[var_decl->identifier->name];
+    local.type = var_decl->type;
+    local.declarations++;
+    local.loop_depth = analysis.loop_depth;
+    break;
+  }
+  case ASTType::Assignment: {
+    auto assignment = std::static_pointer_cast<Assignment>(stmt);
+    if (auto ident =
+            std::dynamic_pointer_cast<Identifier>(assignment->assignee)) {
+      auto it = analysis.locals.find(ident->name);
+      if (it != analysis.locals.end())
+        it->second.assigned = true;
+    } else {
+      analysis.stores = true;
+      collect_uses(analysis, assignment->assignee);
+    }
+    collect_uses(analysis, assignment->expression);
+    break;
+  }
+  case ASTType::Return:
+    // Returned locals are left bare so the C++ compiler can apply NRVO, or
+    // an implicit move where it can't
+    collect_uses(analysis, std::static_pointer_cast<Return>(stmt)->expression);
+    break;
+  case ASTType::ExpressionStatement:
+    collect_uses(analysis,
+                 std::static_pointer_cast<ExpressionStatement>(stmt)->expression);
+    break;
+  case ASTType::If: {
+    auto if_stmt = std::static_pointer_cast<If>(stmt);
+    collect_uses(analysis, if_stmt->condition);
+    collect_uses(analysis, if_stmt->then_branch);
+    collect_uses(analysis, if_stmt->else_branch);
+    break;
+  }
+  case ASTType::While: {
+    auto while_stmt = std::static_pointer_cast<While>(stmt);
+    analysis.loop_depth++;
+    collect_uses(analysis, while_stmt->condition);
+    collect_uses(analysis, while_stmt->body);
+    analysis.loop_depth--;
+    break;
+  }
+  case ASTType::Block:
+    for (const auto &inner : std::static_pointer_cast<Block>(stmt)->statements)
+      collect_uses(analysis, inner);
+    break;
+  default:
+    // Nested definitions are analysed on their own
+    break;
+  }
+}
+
+static LocalAnalysis analyze_locals(
+    Ref<FunctionDefinition> func_def,
+    const std::unordered_map<std::string_view, std::vector<ParamPassing>>
+        *callees = nullptr) {
+  LocalAnalysis analysis;
+  analysis.callees = callees;
+  for (const auto &param : func_def->parameters) {
+    auto &local = analysis.locals[param->identifier->name];
+    local.type = param->type;
+    local.is_parameter = true;
+    local.declarations++;
+  }
+  collect_uses(analysis, func_def->body);
+  return analysis;
+}
+
+// What the parameter passing of a program is worked out from
+struct ProgramFunctions {
+  std::vector<std::pair<Ref<FunctionDefinition>, LocalAnalysis>> functions;
+  // Externs that cannot write through the pointers they are given
+  std::unordered_set<std::string_view> pure_externs;
+};
+
+// Collects every function defined in stmt, nested ones and generated enum
+// to_string functions included
+static void collect_functions(ProgramFunctions &program, Ref<Statement> stmt) {
+  if (!stmt)
+    return;
+  switch (stmt->get_type()) {
+  case ASTType::FunctionDefinition: {
+    auto func_def = std::static_pointer_cast<FunctionDefinition>(stmt);
+    if (func_def->body)
+      program.functions.emplace_back(func_def, analyze_locals(func_def));
+    collect_functions(program, func_def->body);
+    break;
+  }
+  case ASTType::Extern: {
+    auto ext = std::static_pointer_cast<Extern>(stmt);
+    if (std::find(ext->annotations.begin(), ext->annotations.end(), "pure") !=
+        ext->annotations.end())
+      program.pure_externs.insert(ext->identifier->name);
+    break;
+  }
+  case ASTType::EnumDefinition: {
+    auto enum_def = std::static_pointer_cast<EnumDefinition>(stmt);
+    if (enum_def->to_string_function)
+      collect_functions(program, enum_def->to_string_function);
+    break;
+  }
+  case ASTType::Block:
+    for (const auto &inner : std::static_pointer_cast<Block>(stmt)->statements)
+      collect_functions(program, inner);
+    break;
+  case ASTType::If: {
+    auto if_stmt = std::static_pointer_cast<If>(stmt);
+    collect_functions(program, if_stmt->then_branch);
+    collect_functions(program, if_stmt->else_branch);
+    break;
+  }
+  case ASTType::While:
+    collect_functions(program, std::static_pointer_cast<While>(stmt)->body);
+    break;
+  default:
+    break;
+  }
+}
+
+// Records how every function of the program receives its parameters. A
+// parameter is only received by const reference when the function never
+// writes to it or takes its address, and neither the function nor anything
+// it calls can write through a pointer: the argument could be reached
+// through a pointer passed alongside it, and a write would show through the
+// reference where a copy would have kept the old value. Tail calls reassign
+// the parameters before jumping back to the top, so they are all taken by
+// value.
+static void collect_param_passing(CodegenContext &ctx,
+                                  const Ref<Program> &program) {
+  ProgramFunctions functions;
+  for (const auto &stmt : program->body->statements)
+    collect_functions(functions, stmt);
+
+  // A function may write through a pointer when it does so itself or calls
+  // anything other than a function that may not, an I/O builtin or a pure
+  // extern. Grows until nothing changes.
+  std::unordered_set<std::string_view> may_store;
+  for (const auto &[func_def, analysis] : functions.functions) {
+    if (analysis.stores || analysis.calls_unknown)
+      may_store.insert(func_def->identifier->name);
+  }
+  std::unordered_set<std::string_view> defined;
+  for (const auto &[func_def, analysis] : functions.functions)
+    defined.insert(func_def->identifier->name);
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (const auto &[func_def, analysis] : functions.functions) {
+      auto name = func_def->identifier->name;
+      if (may_store.contains(name))
+        continue;
+      bool stores = std::any_of(
+          analysis.calls.begin(), analysis.calls.end(),
+          [&](std::string_view callee) {
+            if (defined.contains(callee))
+              return may_store.contains(callee);
+            return !is_io_builtin(callee) &&
+                   !functions.pure_externs.contains(callee);
+          });
+      if (stores) {
+        may_store.insert(name);
+        changed = true;
+      }
+    }
+  }
+
+  for (const auto &[func_def, analysis] : functions.functions) {
+    bool by_value = has_tail_calls(func_def) ||
+                    may_store.contains(func_def->identifier->name);
+    auto &passing = ctx.parameters[func_def->identifier->name];
+    passing.clear();
+    for (const auto &param : func_def->parameters) {
+      const auto &local = analysis.locals.at(param->identifier->name);
+      passing.push_back(by_value || local.assigned || local.address_taken
+                            ? ParamPassing::ByValue
+                            : param_passing(local.type));
+    }
+  }
+}
+
+// Marks the uses that can be emitted as std::move: the last use of a local
+// that owns memory, when it is passed straight into a by-value parameter of a
+// call or into a struct, is not inside a loop the variable outlives, and the
+// variable does not appear elsewhere in the same statement (argument
+// evaluation order is unspecified).
+static void mark_last_uses(CodegenContext &ctx, const LocalAnalysis &analysis) {
+  for (const auto &[name, local] : analysis.locals) {
+    if (local.uses.empty() || local.declarations != 1 ||
+        local.address_taken || !local.type ||
+        is_trivially_copyable(local.type)) {
+      continue;
+    }
+    if (local.is_parameter && local.passing == ParamPassing::ByConstRef) {
+      continue;
+    }
+    const auto &last = local.uses.back();
+    if (!last.movable_position || last.loop_depth != local.loop_depth)
+      continue;
+    auto same_statement =
+        std::count_if(local.uses.begin(), local.uses.end(),
+                      [&](const LocalInfo::Use &use) {
+                        return use.statement == last.statement;
+                      });
+    if (same_statement == 1)
+      ctx.last_uses.insert(last.identifier);
+  }
+}
+
 static void gen_enum_definition(CodegenContext &ctx,
                                 Ref<EnumDefinition> enum_def) {
   spdlog::debug("[codegen] Generating code for enum definition: {}",
@@ -111,19 +489,25 @@ static void gen_var_decl(CodegenContext &ctx, Ref<VarDecl> var_decl) {
 static void gen_call(CodegenContext &ctx, Ref<Call> call) {
   spdlog::debug("[codegen] Generating code for function call");
 
+  // Output builtins live in the enki::io runtime (src/runtime/enki_io.hpp)
   if (auto ident = std::dynamic_pointer_cast<Identifier>(call->callee);
-      ident && ident->name == "print") {
-    ctx.output += "std::cout << ";
+      ident && is_io_builtin(ident->name)) {
+    ctx.output += "enki::io::" + std::string(ident->name) + "(";
     for (const auto &arg : call->arguments) {
       gen_ast(ctx, arg);
       if (&arg != &call->arguments.back()) {
-        ctx.output += " << ";
+        ctx.output += ", ";
       }
     }
-    ctx.output += " << std::endl;\n";
+    ctx.output += ")";
     return;
   }
 
+  // libc allocators return void *, which C++ does not turn into the typed
+  // pointer an extern like `malloc(int) -> &int` declares by itself
+  bool cast = call->etype && call->etype->base_type == BaseType::Pointer;
+  if (cast)
+    ctx.output += "static_cast<" + type_with_name(call->etype, "") + ">(";
   gen_ast(ctx, call->callee);
   ctx.output += "(";
   for (const auto &arg : call->arguments) {
@@ -132,7 +516,7 @@ static void gen_call(CodegenContext &ctx, Ref<Call> call) {
       ctx.output += ", ";
     }
   }
-  ctx.output += ")";
+  ctx.output += cast ? "))" : ")";
 }
 
 static void gen_struct_instantiation(CodegenContext &ctx, Ref<StructInstantiation> struct_inst) {
@@ -172,6 +556,21 @@ static void gen_binary_op(CodegenContext &ctx, Ref<BinaryOp> binop) {
   case BinaryOpType::Equals:
     ctx.output += " == ";
     break;
+  case BinaryOpType::NotEquals:
+    ctx.output += " != ";
+    break;
+  case BinaryOpType::LessThan:
+    ctx.output += " < ";
+    break;
+  case BinaryOpType::GreaterThan:
+    ctx.output += " > ";
+    break;
+  case BinaryOpType::LessThanOrEqual:
+    ctx.output += " <= ";
+    break;
+  case BinaryOpType::GreaterThanOrEqual:
+    ctx.output += " >= ";
+    break;
   default:
     spdlog::error("[codegen] Unhandled binary operation: {}",
                   magic_enum::enum_name(binop->op));
@@ -188,12 +587,31 @@ static void gen_function_definition(CodegenContext &ctx,
   if (!func_def->body)
     return;
 
+  auto analysis = analyze_locals(func_def, &ctx.parameters);
+  // Tail calls reassign the parameters before jumping back to the top
+  bool tail_calls = has_tail_calls(func_def);
+  if (tail_calls) {
+    for (const auto &param : func_def->parameters)
+      analysis.locals.at(param->identifier->name).assigned = true;
+  }
+  const auto &passing = ctx.parameters.at(func_def->identifier->name);
+  for (size_t i = 0; i < passing.size(); ++i) {
+    analysis.locals.at(func_def->parameters[i]->identifier->name).passing =
+        passing[i];
+  }
+  mark_last_uses(ctx, analysis);
+
   ctx.output += type_with_name(func_def->return_type,
                                std::string(func_def->identifier->name));
   ctx.output += "(";
   for (const auto &param : func_def->parameters) {
-    ctx.output +=
-        type_with_name(param->type, std::string(param->identifier->name));
+    auto name = std::string(param->identifier->name);
+    if (analysis.locals.at(param->identifier->name).passing ==
+        ParamPassing::ByConstRef) {
+      ctx.output += "const " + type_with_name(param->type, "&" + name);
+    } else {
+      ctx.output += type_with_name(param->type, name);
+    }
     if (&param != &func_def->parameters.back()) {
       ctx.output += ", ";
     }
@@ -201,7 +619,33 @@ static void gen_function_definition(CodegenContext &ctx,
   ctx.output += ")";
 
   // Generate code for the function body
-  gen_ast(ctx, func_def->body);
+  if (tail_calls) {
+    ctx.output += "{\nenki_tail_call:\n";
+    gen_ast(ctx, func_def->body);
+    ctx.output += "}\n";
+  } else {
+    gen_ast(ctx, func_def->body);
+  }
+}
+
+// `return f(...)` inside f: the arguments are evaluated into temporaries
+// first, they may read the parameters being replaced
+static void gen_tail_call(CodegenContext &ctx, Ref<Return> ret) {
+  auto call = std::static_pointer_cast<Call>(ret->expression);
+  const auto &params = ret->function->definition->parameters;
+  ctx.output += "{\n";
+  for (size_t i = 0; i < params.size(); ++i) {
+    ctx.output += type_with_name(params[i]->type,
+                                 "enki_tail_arg" + std::to_string(i)) +
+                  " = ";
+    gen_ast(ctx, call->arguments[i]);
+    ctx.output += ";\n";
+  }
+  for (size_t i = 0; i < params.size(); ++i) {
+    ctx.output += std::string(params[i]->identifier->name) +
+                  " = std::move(enki_tail_arg" + std::to_string(i) + ");\n";
+  }
+  ctx.output += "goto enki_tail_call;\n}\n";
 }
 
 static void gen_ast(CodegenContext &ctx, Ref<ASTNode> stmt) {
@@ -212,12 +656,15 @@ static void gen_ast(CodegenContext &ctx, Ref<ASTNode> stmt) {
     gen_function_definition(ctx,
                             std::static_pointer_cast<FunctionDefinition>(stmt));
     break;
-  case ASTType::EnumDefinition:
-    gen_enum_definition(ctx, std::static_pointer_cast<EnumDefinition>(stmt));
-    gen_function_definition(
-        ctx,
-        std::static_pointer_cast<EnumDefinition>(stmt)->to_string_function);
+  case ASTType::EnumDefinition: {
+    auto enum_def = std::static_pointer_cast<EnumDefinition>(stmt);
+    gen_enum_definition(ctx, enum_def);
+    // Dropped by remove_unreachable_declarations when it is never called
+    if (enum_def->to_string_function) {
+      gen_function_definition(ctx, enum_def->to_string_function);
+    }
     break;
+  }
   case ASTType::Extern:
     // noop, externs don't codegen
     break;
@@ -240,9 +687,15 @@ static void gen_ast(CodegenContext &ctx, Ref<ASTNode> stmt) {
   case ASTType::BinaryOp:
     gen_binary_op(ctx, std::static_pointer_cast<BinaryOp>(stmt));
     break;
-  case ASTType::Identifier:
-    ctx.output += std::string(std::static_pointer_cast<Identifier>(stmt)->name);
+  case ASTType::Identifier: {
+    auto ident = std::static_pointer_cast<Identifier>(stmt);
+    if (ctx.last_uses.contains(ident.get())) {
+      ctx.output += "std::move(" + std::string(ident->name) + ")";
+    } else {
+      ctx.output += std::string(ident->name);
+    }
     break;
+  }
   case ASTType::Literal: {
     auto literal = std::static_pointer_cast<Literal>(stmt);
     if (literal->type->base_type == BaseType::String) {
@@ -261,11 +714,17 @@ static void gen_ast(CodegenContext &ctx, Ref<ASTNode> stmt) {
     gen_struct_instantiation(ctx,
             std::static_pointer_cast<StructInstantiation>(stmt));
     break;
-  case ASTType::Return:
+  case ASTType::Return: {
+    auto ret = std::static_pointer_cast<Return>(stmt);
+    if (ret->tail_call) {
+      gen_tail_call(ctx, ret);
+      break;
+    }
     ctx.output += "return ";
-    gen_ast(ctx, std::static_pointer_cast<Return>(stmt)->expression);
+    gen_ast(ctx, ret->expression);
     ctx.output += ";\n";
     break;
+  }
   case ASTType::Dereference:
     ctx.output += "(*(";
     gen_ast(ctx, std::static_pointer_cast<Dereference>(stmt)->expression);
@@ -276,6 +735,13 @@ static void gen_ast(CodegenContext &ctx, Ref<ASTNode> stmt) {
     gen_ast(ctx, std::static_pointer_cast<AddressOf>(stmt)->expression);
     ctx.output += "))\n";
     break;
+  case ASTType::Index:
+    ctx.output += "(";
+    gen_ast(ctx, std::static_pointer_cast<Index>(stmt)->base);
+    ctx.output += ")[";
+    gen_ast(ctx, std::static_pointer_cast<Index>(stmt)->index);
+    ctx.output += "]";
+    break;
   case ASTType::Assignment:
     gen_ast(ctx, std::static_pointer_cast<Assignment>(stmt)->assignee);
     ctx.output += " = ";
@@ -318,10 +784,12 @@ std::string codegen(Ref<Program> program) {
   spdlog::debug("[codegen] Starting code generation for program");
   CodegenContext ctx;
 
-  ctx.output += "#include <iostream>\n";
+  ctx.output += "#include \"enki_io.hpp\"\n";
   ctx.output += "#include <string>\n";
+  ctx.output += "#include <utility>\n";
   ctx.output += "#include <stdlib.h>\n";
 
+  collect_param_passing(ctx, program);
   for (const auto &stmt : program->body->statements) {
       gen_ast(ctx, stmt);
   }
@@ -1,11 +1,27 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include "../definitions/ast.hpp"
 #include "../definitions/types.hpp"
 
+// How a parameter is received by the generated C++ function
+enum class ParamPassing { ByValue, ByConstRef };
+
 struct CodegenContext {
     std::string output;
+    // Identifier uses that are the last use of a movable local, and are
+    // emitted wrapped in std::move
+    std::unordered_set<const Identifier *> last_uses;
+    // How each function receives its parameters, collected before any code
+    // is emitted so a call can tell whether moving into it gains anything
+    std::unordered_map<std::string_view, std::vector<ParamPassing>>
+        parameters;
 };
 
+ParamPassing param_passing(Ref<Type> type);
+
 std::string codegen(Ref<Program> program);
\ No newline at end of file
@@ -0,0 +1,792 @@
+#include "codegen_c.hpp"
+#include "../utils/logging.hpp"
+#include "tailcalls.hpp"
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+#include <unordered_set>
+
+static void unimplemented(CodegenContext &ctx, ASTNode *node) {
+  spdlog::error("[codegen_c] Unimplemented node kind: {}",
+                magic_enum::enum_name(node->get_type()));
+  spdlog::info("[codegen_c] current output: \n{}", ctx.output);
+  std::exit(1);
+}
+
+static void gen_block(CodegenContext &ctx, Ref<Block> block);
+static void gen_ast(CodegenContext &ctx, Ref<ASTNode> node);
+
+static std::string type_with_name(Ref<Type> type, const std::string &name) {
+  assert(type != nullptr && "Type is null");
+  switch (type->base_type) {
+  case BaseType::Int:
+    return "int " + name;
+  case BaseType::Float:
+    return "float " + name;
+  case BaseType::String:
+    return "enki_str " + name;
+  case BaseType::Bool:
+    return "bool " + name;
+  case BaseType::Void:
+    return "void " + name;
+  case BaseType::Char:
+    return "char " + name;
+  case BaseType::Enum:
+    return std::string(std::get<Ref<Enum>>(type->structure)->name) + " " + name;
+  case BaseType::Struct:
+    return std::string(std::get<Ref<Struct>>(type->structure)->name) + " " +
+           name;
+  case BaseType::Pointer:
+    return type_with_name(std::get<Ref<Type>>(type->structure), "*" + name);
+
+  case BaseType::Unknown:
+  case BaseType::Any:
+    spdlog::error("[codegen_c] Found an Any type in code generation, probably "
+                  "missed by typechecker. Location: {}",
+                  type->span.start.to_string());
+    exit(1);
+  default:
+    spdlog::warn("[codegen_c] Unhandled base type: {}",
+                 magic_enum::enum_name(type->base_type));
+    exit(1);
+  }
+}
+
+// C has a single namespace for enumerators, so members are prefixed with the
+// name of their enum, e.g. Color.Red becomes Color_Red
+static std::string enum_member_name(std::string_view enum_name,
+                                    std::string_view member) {
+  return std::string(enum_name) + "_" + std::string(member);
+}
+
+static void gen_enum_definition(CodegenContext &ctx,
+                                Ref<EnumDefinition> enum_def) {
+  spdlog::debug("[codegen_c] Generating code for enum definition: {}",
+                enum_def->identifier->name);
+  ctx.output += "typedef enum {\n";
+  for (const auto &member : enum_def->members) {
+    ctx.output +=
+        "  " + enum_member_name(enum_def->identifier->name, member->name) +
+        ",\n";
+  }
+  ctx.output += "} " + std::string(enum_def->identifier->name) + ";\n";
+}
+
+static void gen_struct_definition(CodegenContext &ctx,
+                                  Ref<StructDefinition> struct_def) {
+  spdlog::debug("[codegen_c] Generating code for struct definition: {}",
+                struct_def->identifier->name);
+  ctx.output += "struct " + std::string(struct_def->identifier->name) + " {\n";
+  for (const auto &field : struct_def->fields) {
+    ctx.output +=
+        "  " + type_with_name(field->type, std::string(field->name)) + ";\n";
+  }
+  ctx.output += "};\n";
+}
+
+static std::string function_signature(Ref<FunctionDefinition> func_def) {
+  std::string signature = type_with_name(
+      func_def->return_type, std::string(func_def->identifier->name));
+  signature += "(";
+  if (func_def->parameters.empty()) {
+    signature += "void";
+  }
+  for (const auto &param : func_def->parameters) {
+    signature +=
+        type_with_name(param->type, std::string(param->identifier->name));
+    if (&param != &func_def->parameters.back()) {
+      signature += ", ";
+    }
+  }
+  signature += ")";
+  return signature;
+}
+
+static void gen_extern(CodegenContext &ctx, Ref<Extern> extern_stmt) {
+  // libc functions are declared by the headers included in the prelude, and
+  // externs taking a type (sizeof) map onto C operators
+  if (extern_stmt->module_path.empty() || extern_stmt->module_path == "libc") {
+    return;
+  }
+  std::string prototype = "extern " +
+                          type_with_name(extern_stmt->return_type,
+                                         std::string(extern_stmt->identifier->name)) +
+                          "(";
+  for (size_t i = 0; i < extern_stmt->args.size(); ++i) {
+    if (extern_stmt->args[i]->base_type == BaseType::Type) {
+      return;
+    }
+    prototype += type_with_name(extern_stmt->args[i], "");
+    if (i + 1 < extern_stmt->args.size()) {
+      prototype += ", ";
+    }
+  }
+  ctx.output += prototype + ");\n";
+}
+
+static void gen_if_statement(CodegenContext &ctx, Ref<If> ifstmt) {
+  ctx.output += "if (";
+  gen_ast(ctx, ifstmt->condition);
+  ctx.output += ")";
+  gen_ast(ctx, ifstmt->then_branch);
+  if (ifstmt->else_branch) {
+    ctx.output += " else ";
+    gen_ast(ctx, ifstmt->else_branch);
+  }
+}
+
+static void gen_while_statement(CodegenContext &ctx, Ref<While> while_stmt) {
+  ctx.output += "while (";
+  gen_ast(ctx, while_stmt->condition);
+  ctx.output += ")";
+  gen_ast(ctx, while_stmt->body);
+}
+
+static void gen_var_decl(CodegenContext &ctx, Ref<VarDecl> var_decl) {
+  spdlog::debug("[codegen_c] Generating code for variable declaration: {}",
+                var_decl->identifier->name);
+  ctx.output +=
+      type_with_name(var_decl->type, std::string(var_decl->identifier->name));
+  if (var_decl->expression) {
+    ctx.output += " = ";
+    gen_ast(ctx, var_decl->expression);
+  }
+  ctx.output += ";\n";
+}
+
+// print has no overloading to lean on in C, so the runtime writer is picked
+// from the typechecked type of each argument. eprint formats the same way,
+// but brackets the line so it goes to stderr after pending stdout.
+static void gen_print(CodegenContext &ctx, Ref<Call> call, bool to_stderr) {
+  if (to_stderr) {
+    ctx.output += "enki_eprint_begin();\n";
+  }
+  for (const auto &arg : call->arguments) {
+    switch (arg->etype->base_type) {
+    case BaseType::Int:
+    case BaseType::Enum:
+      ctx.output += "enki_write_int(";
+      break;
+    case BaseType::Float:
+      ctx.output += "enki_write_float(";
+      break;
+    case BaseType::Bool:
+      ctx.output += "enki_write_bool(";
+      break;
+    case BaseType::Char:
+      ctx.output += "enki_write_char(";
+      break;
+    case BaseType::String:
+      ctx.output += "enki_write_str(";
+      break;
+    case BaseType::Pointer:
+      ctx.output += "enki_write_ptr(";
+      break;
+    default:
+      spdlog::error("[codegen_c] Cannot print a value of type {}",
+                    arg->etype->to_string());
+      exit(1);
+    }
+    gen_ast(ctx, arg);
+    ctx.output += ");\n";
+  }
+  ctx.output += "enki_write_newline()";
+  if (to_stderr) {
+    ctx.output += ";\nenki_eprint_end()";
+  }
+}
+
+static void gen_call(CodegenContext &ctx, Ref<Call> call) {
+  if (auto ident = std::dynamic_pointer_cast<Identifier>(call->callee)) {
+    if (ident->name == "print" || ident->name == "eprint") {
+      gen_print(ctx, call, ident->name == "eprint");
+      return;
+    }
+    if (ident->name == "flush") {
+      ctx.output += "enki_flush()";
+      return;
+    }
+  }
+
+  gen_ast(ctx, call->callee);
+  ctx.output += "(";
+  for (const auto &arg : call->arguments) {
+    gen_ast(ctx, arg);
+    if (&arg != &call->arguments.back()) {
+      ctx.output += ", ";
+    }
+  }
+  ctx.output += ")";
+}
+
+static void gen_struct_instantiation(CodegenContext &ctx,
+                                     Ref<StructInstantiation> struct_inst) {
+  ctx.output += "(" + std::string(struct_inst->identifier->name) + "){";
+  for (size_t i = 0; i < struct_inst->arguments.size(); ++i) {
+    gen_ast(ctx, struct_inst->arguments[i]);
+    if (i < struct_inst->arguments.size() - 1) {
+      ctx.output += ", ";
+    }
+  }
+  ctx.output += "}";
+}
+
+static void gen_binary_op(CodegenContext &ctx, Ref<BinaryOp> binop) {
+  // Signed overflow is undefined in C, enki ints wrap around
+  if (binop->etype && binop->etype->base_type == BaseType::Int &&
+      (binop->op == BinaryOpType::Add || binop->op == BinaryOpType::Subtract ||
+       binop->op == BinaryOpType::Multiply)) {
+    ctx.output += binop->op == BinaryOpType::Add        ? "enki_add("
+                  : binop->op == BinaryOpType::Subtract ? "enki_sub("
+                                                        : "enki_mul(";
+    gen_ast(ctx, binop->left);
+    ctx.output += ", ";
+    gen_ast(ctx, binop->right);
+    ctx.output += ")";
+    return;
+  }
+
+  // Strings compare by content, not by pointer
+  if (binop->left->etype &&
+      binop->left->etype->base_type == BaseType::String &&
+      (binop->op == BinaryOpType::Equals ||
+       binop->op == BinaryOpType::NotEquals)) {
+    ctx.output += binop->op == BinaryOpType::Equals ? "enki_str_eq("
+                                                    : "!enki_str_eq(";
+    gen_ast(ctx, binop->left);
+    ctx.output += ", ";
+    gen_ast(ctx, binop->right);
+    ctx.output += ")";
+    return;
+  }
+
+  ctx.output += "(";
+  gen_ast(ctx, binop->left);
+  switch (binop->op) {
+  case BinaryOpType::Add:
+    ctx.output += " + ";
+    break;
+  case BinaryOpType::Subtract:
+    ctx.output += " - ";
+    break;
+  case BinaryOpType::Multiply:
+    ctx.output += " * ";
+    break;
+  case BinaryOpType::Divide:
+    ctx.output += " / ";
+    break;
+  case BinaryOpType::Modulo:
+    ctx.output += " % ";
+    break;
+  case BinaryOpType::Equals:
+    ctx.output += " == ";
+    break;
+  case BinaryOpType::NotEquals:
+    ctx.output += " != ";
+    break;
+  case BinaryOpType::LessThan:
+    ctx.output += " < ";
+    break;
+  case BinaryOpType::GreaterThan:
+    ctx.output += " > ";
+    break;
+  case BinaryOpType::LessThanOrEqual:
+    ctx.output += " <= ";
+    break;
+  case BinaryOpType::GreaterThanOrEqual:
+    ctx.output += " >= ";
+    break;
+  }
+  gen_ast(ctx, binop->right);
+  ctx.output += ")";
+}
+
+static void gen_function_definition(CodegenContext &ctx,
+                                    Ref<FunctionDefinition> func_def) {
+  spdlog::debug("[codegen_c] Generating code for function: {}",
+                func_def->identifier->name);
+  if (!func_def->body)
+    return;
+
+  ctx.output += function_signature(func_def);
+  // The top level statements run first, see gen_globals
+  bool is_main = func_def->identifier->name == "main";
+  if (has_tail_calls(func_def) || is_main) {
+    ctx.output += "{\n";
+    if (is_main)
+      ctx.output += "enki_init_globals();\n";
+    if (has_tail_calls(func_def))
+      ctx.output += "enki_tail_call:;\n";
+    gen_ast(ctx, func_def->body);
+    ctx.output += "}\n";
+  } else {
+    gen_ast(ctx, func_def->body);
+  }
+}
+
+// Names a statement or expression uses, for telling whether a nested
+// function reaches into the one around it
+static void collect_names(const Ref<ASTNode> &node,
+                          std::unordered_set<std::string_view> &names) {
+  if (!node)
+    return;
+  switch (node->get_type()) {
+  case ASTType::Identifier:
+    names.insert(std::static_pointer_cast<Identifier>(node)->name);
+    break;
+  case ASTType::Call: {
+    auto call = std::static_pointer_cast<Call>(node);
+    collect_names(call->callee, names);
+    for (const auto &arg : call->arguments)
+      collect_names(arg, names);
+    break;
+  }
+  case ASTType::StructInstantiation:
+    for (const auto &arg :
+         std::static_pointer_cast<StructInstantiation>(node)->arguments)
+      collect_names(arg, names);
+    break;
+  case ASTType::BinaryOp: {
+    auto binop = std::static_pointer_cast<BinaryOp>(node);
+    collect_names(binop->left, names);
+    collect_names(binop->right, names);
+    break;
+  }
+  case ASTType::Dot:
+    // The right hand side is a field or enum member name
+    collect_names(std::static_pointer_cast<Dot>(node)->left, names);
+    break;
+  case ASTType::Dereference:
+    collect_names(std::static_pointer_cast<Dereference>(node)->expression,
+                  names);
+    break;
+  case ASTType::AddressOf:
+    collect_names(std::static_pointer_cast<AddressOf>(node)->expression, names);
+    break;
+  case ASTType::Index:
+    collect_names(std::static_pointer_cast<Index>(node)->base, names);
+    collect_names(std::static_pointer_cast<Index>(node)->index, names);
+    break;
+  case ASTType::VarDecl:
+    collect_names(std::static_pointer_cast<VarDecl>(node)->expression, names);
+    break;
+  case ASTType::Assignment:
+    collect_names(std::static_pointer_cast<Assignment>(node)->assignee, names);
+    collect_names(std::static_pointer_cast<Assignment>(node)->expression,
+                  names);
+    break;
+  case ASTType::Return:
+    collect_names(std::static_pointer_cast<Return>(node)->expression, names);
+    break;
+  case ASTType::ExpressionStatement:
+    collect_names(
+        std::static_pointer_cast<ExpressionStatement>(node)->expression, names);
+    break;
+  case ASTType::If: {
+    auto if_stmt = std::static_pointer_cast<If>(node);
+    collect_names(if_stmt->condition, names);
+    collect_names(if_stmt->then_branch, names);
+    collect_names(if_stmt->else_branch, names);
+    break;
+  }
+  case ASTType::While:
+    collect_names(std::static_pointer_cast<While>(node)->condition, names);
+    collect_names(std::static_pointer_cast<While>(node)->body, names);
+    break;
+  case ASTType::Block:
+    for (const auto &stmt : std::static_pointer_cast<Block>(node)->statements)
+      collect_names(stmt, names);
+    break;
+  case ASTType::FunctionDefinition:
+    collect_names(std::static_pointer_cast<FunctionDefinition>(node)->body,
+                  names);
+    break;
+  default:
+    break;
+  }
+}
+
+// The locals a function declares directly, its parameters included
+static void collect_locals(const Ref<Statement> &stmt,
+                           std::unordered_set<std::string_view> &locals) {
+  if (!stmt)
+    return;
+  switch (stmt->get_type()) {
+  case ASTType::VarDecl:
+    locals.insert(std::static_pointer_cast<VarDecl>(stmt)->identifier->name);
+    break;
+  case ASTType::If:
+    collect_locals(std::static_pointer_cast<If>(stmt)->then_branch, locals);
+    collect_locals(std::static_pointer_cast<If>(stmt)->else_branch, locals);
+    break;
+  case ASTType::While:
+    collect_locals(std::static_pointer_cast<While>(stmt)->body, locals);
+    break;
+  case ASTType::Block:
+    for (const auto &inner : std::static_pointer_cast<Block>(stmt)->statements)
+      collect_locals(inner, locals);
+    break;
+  default:
+    break;
+  }
+}
+
+// C has no nested functions, so functions defined inside another are hoisted
+// to the top level, ahead of it. They cannot use the locals of the functions
+// around them then, which is an error.
+static void collect_nested(const Ref<FunctionDefinition> &func_def,
+                           const Ref<Statement> &stmt,
+                           std::vector<Ref<FunctionDefinition>> &functions) {
+  if (!stmt)
+    return;
+  switch (stmt->get_type()) {
+  case ASTType::FunctionDefinition: {
+    auto nested = std::static_pointer_cast<FunctionDefinition>(stmt);
+    collect_nested(nested, nested->body, functions);
+    std::unordered_set<std::string_view> outer;
+    for (const auto &param : func_def->parameters)
+      outer.insert(param->identifier->name);
+    collect_locals(func_def->body, outer);
+    std::unordered_set<std::string_view> own;
+    for (const auto &param : nested->parameters)
+      own.insert(param->identifier->name);
+    collect_locals(nested->body, own);
+    std::unordered_set<std::string_view> used;
+    collect_names(nested->body, used);
+    for (auto name : used) {
+      if (outer.contains(name) && !own.contains(name)) {
+        LOG_ERROR_EXIT(fmt::format("[codegen_c] The C backend cannot compile "
+                                   "'{}', it uses '{}' of the function "
+                                   "around it",
+                                   nested->identifier->name, name),
+                       nested->span, "");
+      }
+    }
+    functions.push_back(nested);
+    break;
+  }
+  case ASTType::If:
+    collect_nested(func_def, std::static_pointer_cast<If>(stmt)->then_branch,
+                   functions);
+    collect_nested(func_def, std::static_pointer_cast<If>(stmt)->else_branch,
+                   functions);
+    break;
+  case ASTType::While:
+    collect_nested(func_def, std::static_pointer_cast<While>(stmt)->body,
+                   functions);
+    break;
+  case ASTType::Block:
+    for (const auto &inner : std::static_pointer_cast<Block>(stmt)->statements)
+      collect_nested(func_def, inner, functions);
+    break;
+  default:
+    break;
+  }
+}
+
+// The functions to emit for func_def, those hoisted out of it first
+static std::vector<Ref<FunctionDefinition>>
+with_nested(const Ref<FunctionDefinition> &func_def) {
+  std::vector<Ref<FunctionDefinition>> functions;
+  collect_nested(func_def, func_def->body, functions);
+  functions.push_back(func_def);
+  return functions;
+}
+
+// `return f(...)` inside f: the arguments are evaluated into temporaries
+// first, they may read the parameters being replaced
+static void gen_tail_call(CodegenContext &ctx, Ref<Return> ret) {
+  auto call = std::static_pointer_cast<Call>(ret->expression);
+  const auto &params = ret->function->definition->parameters;
+  ctx.output += "{\n";
+  for (size_t i = 0; i < params.size(); ++i) {
+    ctx.output += type_with_name(params[i]->type,
+                                 "enki_tail_arg" + std::to_string(i)) +
+                  " = ";
+    gen_ast(ctx, call->arguments[i]);
+    ctx.output += ";\n";
+  }
+  for (size_t i = 0; i < params.size(); ++i) {
+    ctx.output += std::string(params[i]->identifier->name) +
+                  " = enki_tail_arg" + std::to_string(i) + ";\n";
+  }
+  ctx.output += "goto enki_tail_call;\n}\n";
+}
+
+static void gen_literal(CodegenContext &ctx, Ref<Literal> literal) {
+  switch (literal->type->base_type) {
+  case BaseType::String:
+    ctx.output += "ENKI_STR(\"" + std::string(literal->value) + "\")";
+    break;
+  case BaseType::Char:
+    ctx.output += "'" + std::string(literal->value) + "'";
+    break;
+  case BaseType::Float:
+    ctx.output += std::string(literal->value) + "f";
+    break;
+  default:
+    ctx.output += std::string(literal->value);
+    break;
+  }
+}
+
+static void gen_ast(CodegenContext &ctx, Ref<ASTNode> stmt) {
+  switch (stmt->get_type()) {
+  case ASTType::FunctionDefinition:
+    // Hoisted to the top level, see collect_nested
+    break;
+  case ASTType::EnumDefinition:
+    gen_enum_definition(ctx, std::static_pointer_cast<EnumDefinition>(stmt));
+    break;
+  case ASTType::Extern:
+    gen_extern(ctx, std::static_pointer_cast<Extern>(stmt));
+    break;
+  case ASTType::StructDefinition:
+    gen_struct_definition(ctx,
+                          std::static_pointer_cast<StructDefinition>(stmt));
+    break;
+  case ASTType::VarDecl:
+    gen_var_decl(ctx, std::static_pointer_cast<VarDecl>(stmt));
+    break;
+  case ASTType::If:
+    gen_if_statement(ctx, std::static_pointer_cast<If>(stmt));
+    break;
+  case ASTType::While:
+    gen_while_statement(ctx, std::static_pointer_cast<While>(stmt));
+    break;
+  case ASTType::Block:
+    gen_block(ctx, std::static_pointer_cast<Block>(stmt));
+    break;
+  case ASTType::BinaryOp:
+    gen_binary_op(ctx, std::static_pointer_cast<BinaryOp>(stmt));
+    break;
+  case ASTType::Identifier:
+    ctx.output += std::string(std::static_pointer_cast<Identifier>(stmt)->name);
+    break;
+  case ASTType::Literal:
+    gen_literal(ctx, std::static_pointer_cast<Literal>(stmt));
+    break;
+  case ASTType::ExpressionStatement:
+    gen_ast(ctx,
+            std::static_pointer_cast<ExpressionStatement>(stmt)->expression);
+    ctx.output += ";\n";
+    break;
+  case ASTType::StructInstantiation:
+    gen_struct_instantiation(
+        ctx, std::static_pointer_cast<StructInstantiation>(stmt));
+    break;
+  case ASTType::Return: {
+    auto ret = std::static_pointer_cast<Return>(stmt);
+    if (ret->tail_call) {
+      gen_tail_call(ctx, ret);
+      break;
+    }
+    ctx.output += "return";
+    if (ret->expression) {
+      ctx.output += " ";
+      gen_ast(ctx, ret->expression);
+    }
+    ctx.output += ";\n";
+    break;
+  }
+  case ASTType::Dereference:
+    ctx.output += "(*(";
+    gen_ast(ctx, std::static_pointer_cast<Dereference>(stmt)->expression);
+    ctx.output += "))";
+    break;
+  case ASTType::AddressOf:
+    ctx.output += "(&(";
+    gen_ast(ctx, std::static_pointer_cast<AddressOf>(stmt)->expression);
+    ctx.output += "))";
+    break;
+  case ASTType::Index:
+    ctx.output += "(";
+    gen_ast(ctx, std::static_pointer_cast<Index>(stmt)->base);
+    ctx.output += ")[";
+    gen_ast(ctx, std::static_pointer_cast<Index>(stmt)->index);
+    ctx.output += "]";
+    break;
+  case ASTType::Assignment:
+    gen_ast(ctx, std::static_pointer_cast<Assignment>(stmt)->assignee);
+    ctx.output += " = ";
+    gen_ast(ctx, std::static_pointer_cast<Assignment>(stmt)->expression);
+    ctx.output += ";\n";
+    break;
+  case ASTType::Call:
+    gen_call(ctx, std::static_pointer_cast<Call>(stmt));
+    break;
+  case ASTType::Dot: {
+    auto dot = std::static_pointer_cast<Dot>(stmt);
+    if (dot->left->etype->base_type == BaseType::Enum) {
+      auto enum_type = std::get<Ref<Enum>>(dot->left->etype->structure);
+      ctx.output += enum_member_name(
+          enum_type->name, std::static_pointer_cast<Identifier>(dot->right)->name);
+      break;
+    }
+    gen_ast(ctx, dot->left);
+    ctx.output += ".";
+    gen_ast(ctx, dot->right);
+    break;
+  }
+  default:
+    unimplemented(ctx, stmt.get());
+    break;
+  }
+}
+
+static void gen_block(CodegenContext &ctx, Ref<Block> block) {
+  ctx.output += "{\n";
+  for (const auto &stmt : block->statements) {
+    gen_ast(ctx, stmt);
+  }
+  ctx.output += "}\n";
+}
+
+static void gen_prelude(CodegenContext &ctx) {
+  ctx.output += "#include \"enki_rt.h\"\n";
+  ctx.output += "#include <stdlib.h>\n";
+  ctx.output += "#include <string.h>\n";
+}
+
+// C needs every name declared before use, so types come first (forward
+// typedefs, then enums and definitions in source order), followed by
+// prototypes for every function. Returns the functions, enum to_string
+// functions included, in the order their bodies are emitted.
+static std::vector<Ref<FunctionDefinition>>
+gen_declarations(CodegenContext &ctx, Ref<Program> program) {
+  std::vector<Ref<FunctionDefinition>> functions;
+  for (const auto &stmt : program->body->statements) {
+    if (stmt->get_type() == ASTType::StructDefinition) {
+      auto name = std::string(
+          std::static_pointer_cast<StructDefinition>(stmt)->identifier->name);
+      ctx.output += "typedef struct " + name + " " + name + ";\n";
+    }
+  }
+  for (const auto &stmt : program->body->statements) {
+    switch (stmt->get_type()) {
+    case ASTType::EnumDefinition: {
+      auto enum_def = std::static_pointer_cast<EnumDefinition>(stmt);
+      gen_enum_definition(ctx, enum_def);
+      if (enum_def->to_string_function)
+        functions.push_back(enum_def->to_string_function);
+      break;
+    }
+    case ASTType::StructDefinition:
+      gen_struct_definition(ctx,
+                            std::static_pointer_cast<StructDefinition>(stmt));
+      break;
+    case ASTType::Extern:
+      gen_extern(ctx, std::static_pointer_cast<Extern>(stmt));
+      break;
+    case ASTType::FunctionDefinition:
+      for (const auto &func_def :
+           with_nested(std::static_pointer_cast<FunctionDefinition>(stmt)))
+        functions.push_back(func_def);
+      break;
+    default:
+      break;
+    }
+  }
+
+  for (const auto &func_def : functions) {
+    if (func_def->body || func_def->external) {
+      ctx.output += function_signature(func_def) + ";\n";
+    }
+  }
+  ctx.output += "void enki_init_globals(void);\n";
+  return functions;
+}
+
+static bool is_declaration(const Ref<Statement> &stmt) {
+  switch (stmt->get_type()) {
+  case ASTType::EnumDefinition:
+  case ASTType::StructDefinition:
+  case ASTType::Extern:
+  case ASTType::FunctionDefinition:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// The globals are defined zeroed at file scope, where C only takes constant
+// initializers, and the top level statements run in order in
+// enki_init_globals, which main calls first
+static void gen_globals(CodegenContext &ctx, Ref<Program> program) {
+  for (const auto &stmt : program->body->statements) {
+    if (stmt->get_type() == ASTType::VarDecl) {
+      auto var_decl = std::static_pointer_cast<VarDecl>(stmt);
+      ctx.output += type_with_name(var_decl->type,
+                                   std::string(var_decl->identifier->name)) +
+                    ";\n";
+    }
+  }
+  ctx.output += "void enki_init_globals(void) {\n";
+  for (const auto &stmt : program->body->statements) {
+    if (is_declaration(stmt)) {
+      continue;
+    }
+    if (stmt->get_type() == ASTType::VarDecl) {
+      auto var_decl = std::static_pointer_cast<VarDecl>(stmt);
+      if (var_decl->expression) {
+        ctx.output += std::string(var_decl->identifier->name) + " = ";
+        gen_ast(ctx, var_decl->expression);
+        ctx.output += ";\n";
+      }
+      continue;
+    }
+    gen_ast(ctx, stmt);
+  }
+  ctx.output += "}\n";
+}
+
+std::string codegen_c(Ref<Program> program) {
+  spdlog::debug("[codegen_c] Starting code generation for program");
+  CodegenContext ctx;
+
+  gen_prelude(ctx);
+  auto functions = gen_declarations(ctx, program);
+  gen_globals(ctx, program);
+  for (const auto &func_def : functions) {
+    gen_function_definition(ctx, func_def);
+  }
+
+  spdlog::debug("[codegen_c] Code generation completed");
+  return ctx.output;
+}
+
+std::string codegen_c_header(Ref<Program> program) {
+  CodegenContext ctx;
+  gen_prelude(ctx);
+  gen_declarations(ctx, program);
+  // Top level lets are defined once, in the unit of the globals
+  for (const auto &stmt : program->body->statements) {
+    if (stmt->get_type() == ASTType::VarDecl) {
+      auto var_decl = std::static_pointer_cast<VarDecl>(stmt);
+      ctx.output += "extern " +
+                    type_with_name(var_decl->type,
+                                   std::string(var_decl->identifier->name)) +
+                    ";\n";
+    }
+  }
+  return ctx.output;
+}
+
+std::string codegen_c_globals(Ref<Program> program,
+                              const std::string &header_name) {
+  CodegenContext ctx;
+  ctx.output += "#include \"" + header_name + "\"\n";
+  gen_globals(ctx, program);
+  return ctx.output;
+}
+
+std::string
+codegen_c_functions(const std::vector<Ref<FunctionDefinition>> &functions,
+                    const std::string &header_name) {
+  CodegenContext ctx;
+  ctx.output += "#include \"" + header_name + "\"\n";
+  for (const auto &func_def : functions) {
+    for (const auto &emitted : with_nested(func_def))
+      gen_function_definition(ctx, emitted);
+  }
+  return ctx.output;
+}
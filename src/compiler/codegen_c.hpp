@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "../definitions/ast.hpp"
+#include "../definitions/types.hpp"
+#include "codegen.hpp"
+
+// Emits plain C11 that links against the bundled runtime in src/runtime
+// (enki_rt.h/.c) instead of the C++ standard library.
+std::string codegen_c(Ref<Program> program);
+
+// The same code split into translation units that are compiled on their own,
+// for incremental builds. The header declares everything in the program:
+// types, externs, prototypes and the globals as `extern`s. Every other unit
+// includes it by `header_name`.
+std::string codegen_c_header(Ref<Program> program);
+// The top level statements, which define the globals
+std::string codegen_c_globals(Ref<Program> program,
+                              const std::string &header_name);
+// The given functions in one unit
+std::string
+codegen_c_functions(const std::vector<Ref<FunctionDefinition>> &functions,
+                    const std::string &header_name);
@@ -0,0 +1,811 @@
+/* LLVM backend. The typed AST is walked once per function and printed as
+textual LLVM IR. Every local lives in an alloca and expressions are emitted in
+evaluation order without any cleverness, turning that into good SSA is left to
+the pass pipeline run by the driver (mem2reg/SROA, GVN, the vectorizers).
+Pointers are typed, matching LLVM 14 which is the oldest supported version. */
+
+#include "codegen_llvm.hpp"
+#include "../definitions/lowering.hpp"
+#include "../utils/logging.hpp"
+#include "tailcalls.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include <unordered_map>
+
+namespace {
+
+// Triple of the machine the compiler was built for, so `opt` picks the right
+// cost model for the vectorizers. Empty lets the tools use their default.
+std::string host_triple() {
+#if defined(__x86_64__) && defined(__linux__)
+  return "x86_64-pc-linux-gnu";
+#elif defined(__aarch64__) && defined(__linux__)
+  return "aarch64-unknown-linux-gnu";
+#elif defined(__x86_64__) && defined(__APPLE__)
+  return "x86_64-apple-macosx";
+#elif defined(__aarch64__) && defined(__APPLE__)
+  return "arm64-apple-macosx";
+#else
+  return "";
+#endif
+}
+
+std::string llvm_type(const Ref<Type> &type) {
+  switch (type->base_type) {
+  case BaseType::Void:
+    return "void";
+  case BaseType::Int:
+  case BaseType::Enum:
+    return "i32";
+  case BaseType::Float:
+    return "float";
+  case BaseType::Bool:
+    return "i1";
+  case BaseType::Char:
+    return "i8";
+  case BaseType::String:
+    return "%enki_str";
+  case BaseType::Struct:
+    return "%" + std::string(std::get<Ref<Struct>>(type->structure)->name);
+  case BaseType::Pointer: {
+    auto pointee = std::get<Ref<Type>>(type->structure);
+    // There is no void* in LLVM, i8* is the conventional stand-in
+    if (!pointee || pointee->base_type == BaseType::Void)
+      return "i8*";
+    return llvm_type(pointee) + "*";
+  }
+  default:
+    spdlog::error("[codegen_llvm] Unhandled type in code generation: {}",
+                  type->to_string());
+    std::exit(1);
+  }
+}
+
+// Bytes of a c"..." array constant, anything unprintable as \XX
+std::string escape_bytes(const std::string &text) {
+  std::string result;
+  char hex[4];
+  for (unsigned char c : text) {
+    if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\') {
+      result += static_cast<char>(c);
+    } else {
+      std::snprintf(hex, sizeof(hex), "\\%02X", c);
+      result += hex;
+    }
+  }
+  return result;
+}
+
+// LLVM wants float constants as the hex bits of the equivalent double
+std::string float_constant(float value) {
+  double widened = value;
+  uint64_t bits;
+  std::memcpy(&bits, &widened, sizeof(bits));
+  char buffer[24];
+  std::snprintf(buffer, sizeof(buffer), "0x%016llX",
+                static_cast<unsigned long long>(bits));
+  return buffer;
+}
+
+struct Value {
+  std::string type;
+  std::string repr; // A %register or a constant
+};
+
+struct Local {
+  Ref<Type> type;
+  std::string address; // The alloca holding the value
+};
+
+struct ProgramInfo {
+  std::unordered_map<std::string_view, Ref<Extern>> externs;
+  std::unordered_map<std::string_view, std::vector<std::string_view>> enums;
+  std::unordered_map<std::string_view, Ref<Struct>> structs;
+  std::string globals; // String constants
+  std::unordered_map<std::string, std::string> strings; // Interned globals
+  const std::string *source;
+};
+
+class FunctionEmitter {
+public:
+  FunctionEmitter(ProgramInfo &program) : program(program) {}
+
+  std::string emit_function(const Ref<FunctionDefinition> &func_def);
+
+private:
+  ProgramInfo &program;
+  std::string allocas; // Hoisted to the entry block so mem2reg sees them
+  std::string body;
+  std::vector<std::unordered_map<std::string_view, Local>> scopes;
+  std::unordered_map<std::string, int> name_counts;
+  int temp_count = 0;
+  bool terminated = false;
+  std::string return_type;
+  bool void_main = false;
+  // Self tail calls store the new arguments and branch back to this label
+  std::vector<Ref<Parameter>> parameters;
+  std::string tail_label;
+
+  [[noreturn]] void unsupported(const std::string &what, const Span &span) {
+    LOG_ERROR_EXIT("[codegen_llvm] " + what +
+                       " is not supported by the LLVM backend",
+                   span, *program.source);
+    std::exit(1);
+  }
+
+  std::string temp() { return "%t" + std::to_string(temp_count++); }
+  std::string unique(const std::string &name) {
+    return name + "." + std::to_string(name_counts[name]++);
+  }
+
+  // Code after a return or a branch is unreachable but still has to sit in
+  // a block, so a fresh one is opened for it
+  void emit(const std::string &line) {
+    if (terminated) {
+      body += unique("dead") + ":\n";
+      terminated = false;
+    }
+    body += "  " + line + "\n";
+  }
+  void terminate(const std::string &line) {
+    emit(line);
+    terminated = true;
+  }
+  void label(const std::string &name) {
+    if (!terminated)
+      body += "  br label %" + name + "\n";
+    body += name + ":\n";
+    terminated = false;
+  }
+
+  std::string instruction(const std::string &text) {
+    auto dst = temp();
+    emit(dst + " = " + text);
+    return dst;
+  }
+
+  std::string alloca_for(const std::string &name, const std::string &type) {
+    auto address = "%" + unique(name + ".addr");
+    allocas += "  " + address + " = alloca " + type + "\n";
+    return address;
+  }
+
+  Value load(const std::string &type, const std::string &address) {
+    return {type, instruction("load " + type + ", " + type + "* " + address)};
+  }
+  void store(const Value &value, const std::string &address) {
+    emit("store " + value.type + " " + value.repr + ", " + value.type + "* " +
+         address);
+  }
+
+  // Pointers to void and to concrete types are interchangeable in Enki, LLVM
+  // needs an explicit bitcast between them
+  Value coerce(const Value &value, const std::string &type) {
+    if (value.type == type || value.type.back() != '*' || type.back() != '*')
+      return value;
+    return {type, instruction("bitcast " + value.type + " " + value.repr +
+                              " to " + type)};
+  }
+
+  Local *find_local(std::string_view name) {
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+      auto found = it->find(name);
+      if (found != it->end())
+        return &found->second;
+    }
+    return nullptr;
+  }
+
+  void declare_local(std::string_view name, const Ref<Type> &type,
+                     const Value &value) {
+    auto ty = llvm_type(type);
+    Local local{type, alloca_for(std::string(name), ty)};
+    store(coerce(value, ty), local.address);
+    scopes.back()[name] = local;
+  }
+
+  std::string string_constant(const std::string &text) {
+    auto found = program.strings.find(text);
+    if (found != program.strings.end())
+      return found->second;
+    auto name = "@.str." + std::to_string(program.strings.size());
+    program.globals += name + " = private unnamed_addr constant [" +
+                       std::to_string(text.size() + 1) + " x i8] c\"" +
+                       escape_bytes(text) + "\\00\"\n";
+    program.strings[text] = name;
+    return name;
+  }
+
+  Value lower_literal(const Ref<Literal> &literal) {
+    switch (literal->type->base_type) {
+    case BaseType::Int:
+      return {"i32", std::string(literal->value)};
+    case BaseType::Bool:
+      return {"i1", literal->value == "true" ? "true" : "false"};
+    case BaseType::Char:
+      return {"i8", std::to_string(static_cast<int>(
+                        static_cast<signed char>(unescape(literal->value)[0])))};
+    case BaseType::Float:
+      return {"float", float_constant(std::stof(std::string(literal->value)))};
+    case BaseType::String: {
+      auto text = unescape(literal->value);
+      auto array = "[" + std::to_string(text.size() + 1) + " x i8]";
+      return {"%enki_str", "{ i8* getelementptr inbounds (" + array + ", " +
+                               array + "* " + string_constant(text) +
+                               ", i64 0, i64 0), i64 " +
+                               std::to_string(text.size()) + " }"};
+    }
+    default:
+      unsupported("Literal of type " + literal->type->to_string(),
+                  literal->span);
+    }
+  }
+
+  int field_index(const Ref<Dot> &dot, Ref<Type> &field_type) {
+    if (dot->left->etype->base_type != BaseType::Struct ||
+        dot->right->get_type() != ASTType::Identifier) {
+      unsupported("This member access", dot->span);
+    }
+    auto struct_type = std::get<Ref<Struct>>(dot->left->etype->structure);
+    auto name = std::static_pointer_cast<Identifier>(dot->right)->name;
+    for (size_t i = 0; i < struct_type->fields.size(); ++i) {
+      if (struct_type->fields[i]->name == name) {
+        field_type = struct_type->fields[i]->type;
+        return static_cast<int>(i);
+      }
+    }
+    unsupported("Unknown field '" + std::string(name) + "'", dot->span);
+  }
+
+  bool is_lvalue(const Ref<Expression> &expr) {
+    switch (expr->get_type()) {
+    case ASTType::Identifier:
+    case ASTType::Dereference:
+    case ASTType::Index:
+      return true;
+    case ASTType::Dot:
+      return is_lvalue(std::static_pointer_cast<Dot>(expr)->left);
+    default:
+      return false;
+    }
+  }
+
+  // Address of an lvalue expression, typed as a pointer to its value
+  std::string address_of(const Ref<Expression> &expr) {
+    switch (expr->get_type()) {
+    case ASTType::Identifier: {
+      auto ident = std::static_pointer_cast<Identifier>(expr);
+      auto local = find_local(ident->name);
+      if (!local)
+        unsupported("Global '" + std::string(ident->name) + "'", expr->span);
+      return local->address;
+    }
+    case ASTType::Dot: {
+      auto dot = std::static_pointer_cast<Dot>(expr);
+      Ref<Type> field_type;
+      int index = field_index(dot, field_type);
+      auto struct_ty = llvm_type(dot->left->etype);
+      auto base = address_of(dot->left);
+      return instruction("getelementptr inbounds " + struct_ty + ", " +
+                         struct_ty + "* " + base + ", i32 0, i32 " +
+                         std::to_string(index));
+    }
+    case ASTType::Dereference: {
+      auto deref = std::static_pointer_cast<Dereference>(expr);
+      return coerce(lower_expression(deref->expression),
+                    llvm_type(expr->etype) + "*")
+          .repr;
+    }
+    case ASTType::Index: {
+      auto index = std::static_pointer_cast<Index>(expr);
+      auto element = llvm_type(expr->etype);
+      auto base = coerce(lower_expression(index->base), element + "*");
+      auto offset = coerce(lower_expression(index->index), "i32");
+      return instruction("getelementptr inbounds " + element + ", " +
+                         element + "* " + base.repr + ", i32 " + offset.repr);
+    }
+    default:
+      unsupported("Taking the address of this expression", expr->span);
+    }
+  }
+
+  Value lower_dot(const Ref<Dot> &dot) {
+    if (dot->left->etype->base_type == BaseType::Enum) {
+      auto enum_type = std::get<Ref<Enum>>(dot->left->etype->structure);
+      auto member = std::static_pointer_cast<Identifier>(dot->right)->name;
+      const auto &members = program.enums[enum_type->name];
+      auto it = std::find(members.begin(), members.end(), member);
+      return {"i32", std::to_string(it - members.begin())};
+    }
+    Ref<Type> field_type;
+    int index = field_index(dot, field_type);
+    if (is_lvalue(dot))
+      return load(llvm_type(field_type), address_of(dot));
+    auto aggregate = lower_expression(dot->left);
+    return {llvm_type(field_type),
+            instruction("extractvalue " + aggregate.type + " " +
+                        aggregate.repr + ", " + std::to_string(index))};
+  }
+
+  Value lower_binary_op(const Ref<BinaryOp> &binop) {
+    auto operand_type = binop->left->etype;
+    auto left = lower_expression(binop->left);
+    auto right = lower_expression(binop->right);
+
+    if (operand_type->base_type == BaseType::String) {
+      if (binop->op != BinaryOpType::Equals &&
+          binop->op != BinaryOpType::NotEquals) {
+        unsupported("This string operator", binop->span);
+      }
+      auto equal = instruction("call zeroext i1 @enki_str_eq(" +
+                               split_string(left) + ", " +
+                               split_string(right) + ")");
+      if (binop->op == BinaryOpType::Equals)
+        return {"i1", equal};
+      return {"i1", instruction("xor i1 " + equal + ", true")};
+    }
+
+    bool is_float = operand_type->base_type == BaseType::Float;
+    if (left.type.back() == '*')
+      right = coerce(right, left.type);
+    auto operands = left.type + " " + left.repr + ", " + right.repr;
+    auto arithmetic = [&](const char *int_op, const char *float_op) {
+      return Value{left.type, instruction(std::string(is_float ? float_op
+                                                               : int_op) +
+                                          " " + operands)};
+    };
+    // Signed comparisons for integers, ordered ones for floats (NaN compares
+    // false), except != which has to be true for NaN like in C
+    auto compare = [&](const char *int_cond, const char *float_cond) {
+      return Value{"i1", instruction(is_float ? std::string("fcmp ") +
+                                                    float_cond + " " + operands
+                                              : std::string("icmp ") +
+                                                    int_cond + " " + operands)};
+    };
+    switch (binop->op) {
+    case BinaryOpType::Add:
+      return arithmetic("add", "fadd");
+    case BinaryOpType::Subtract:
+      return arithmetic("sub", "fsub");
+    case BinaryOpType::Multiply:
+      return arithmetic("mul", "fmul");
+    case BinaryOpType::Divide:
+      return arithmetic("sdiv", "fdiv");
+    case BinaryOpType::Modulo:
+      return arithmetic("srem", "frem");
+    case BinaryOpType::Equals:
+      return compare("eq", "oeq");
+    case BinaryOpType::NotEquals:
+      return compare("ne", "une");
+    case BinaryOpType::LessThan:
+      return compare("slt", "olt");
+    case BinaryOpType::GreaterThan:
+      return compare("sgt", "ogt");
+    case BinaryOpType::LessThanOrEqual:
+      return compare("sle", "ole");
+    case BinaryOpType::GreaterThanOrEqual:
+      return compare("sge", "oge");
+    }
+    unsupported("This operator", binop->span);
+  }
+
+  // Strings are passed to the runtime as separate data and length arguments,
+  // which is how the C ABI passes a 16 byte struct of two integers anyway
+  std::string split_string(const Value &string) {
+    auto data = instruction("extractvalue %enki_str " + string.repr + ", 0");
+    auto len = instruction("extractvalue %enki_str " + string.repr + ", 1");
+    return "i8* " + data + ", i64 " + len;
+  }
+
+  void lower_print(const Ref<Call> &call_expr, bool to_stderr) {
+    if (to_stderr)
+      emit("call void @enki_eprint_begin()");
+    for (const auto &arg : call_expr->arguments) {
+      auto value = lower_expression(arg);
+      switch (arg->etype->base_type) {
+      case BaseType::Int:
+      case BaseType::Enum: {
+        auto wide = instruction("sext i32 " + value.repr + " to i64");
+        emit("call void @enki_write_int(i64 " + wide + ")");
+        break;
+      }
+      case BaseType::Float: {
+        auto wide = instruction("fpext float " + value.repr + " to double");
+        emit("call void @enki_write_float(double " + wide + ")");
+        break;
+      }
+      case BaseType::Bool:
+        emit("call void @enki_write_bool(i1 zeroext " + value.repr + ")");
+        break;
+      case BaseType::Char:
+        emit("call void @enki_write_char(i8 signext " + value.repr + ")");
+        break;
+      case BaseType::Pointer:
+        emit("call void @enki_write_ptr(i8* " +
+             coerce(value, "i8*").repr + ")");
+        break;
+      case BaseType::String:
+        emit("call void @enki_write_str(" + split_string(value) + ")");
+        break;
+      default:
+        unsupported("Printing a " + arg->etype->to_string(), arg->span);
+      }
+    }
+    emit("call void @enki_write_newline()");
+    if (to_stderr)
+      emit("call void @enki_eprint_end()");
+  }
+
+  // sizeof(T) folds to the usual getelementptr-from-null constant, so the
+  // layout is whatever the target data layout says
+  Value sizeof_named_type(std::string_view name, const Ref<Call> &call_expr) {
+    std::string type;
+    if (name == "int" || program.enums.contains(name)) {
+      type = "i32";
+    } else if (name == "float") {
+      type = "float";
+    } else if (name == "bool") {
+      type = "i1";
+    } else if (name == "char") {
+      type = "i8";
+    } else if (name == "string") {
+      type = "%enki_str";
+    } else if (program.structs.contains(name)) {
+      type = "%" + std::string(name);
+    } else {
+      unsupported("sizeof(" + std::string(name) + ")", call_expr->span);
+    }
+    return {"i32", "ptrtoint (" + type + "* getelementptr (" + type + ", " +
+                       type + "* null, i32 1) to i32)"};
+  }
+
+  Value lower_call(const Ref<Call> &call_expr) {
+    if (call_expr->callee->get_type() != ASTType::Identifier)
+      unsupported("Calling this expression", call_expr->span);
+    auto name = std::static_pointer_cast<Identifier>(call_expr->callee)->name;
+    if (name == "print" || name == "eprint") {
+      lower_print(call_expr, name == "eprint");
+      return {"void", ""};
+    }
+    if (name == "flush") {
+      emit("call void @enki_flush()");
+      return {"void", ""};
+    }
+
+    std::string args;
+    auto ext = program.externs.find(name);
+    if (ext != program.externs.end()) {
+      if (!ext->second->args.empty() &&
+          ext->second->args[0]->base_type == BaseType::Type) {
+        auto type_name =
+            std::static_pointer_cast<Identifier>(call_expr->arguments[0])->name;
+        return sizeof_named_type(type_name, call_expr);
+      }
+    }
+    for (size_t i = 0; i < call_expr->arguments.size(); ++i) {
+      auto value = lower_expression(call_expr->arguments[i]);
+      if (ext != program.externs.end()) {
+        auto param = ext->second->args[i];
+        if (param->base_type == BaseType::Int) {
+          // C sizes and counts are 64 bit, see declare_extern
+          value = {"i64", instruction("sext i32 " + value.repr + " to i64")};
+        } else {
+          value = coerce(value, llvm_type(param));
+        }
+      } else {
+        value = coerce(value, llvm_type(call_expr->arguments[i]->etype));
+      }
+      if (!args.empty())
+        args += ", ";
+      args += value.type + " " + value.repr;
+    }
+
+    auto return_type = llvm_type(call_expr->etype);
+    auto text = "call " + return_type + " @" + std::string(name) + "(" + args + ")";
+    if (return_type == "void") {
+      emit(text);
+      return {"void", ""};
+    }
+    return {return_type, instruction(text)};
+  }
+
+  Value lower_struct_instantiation(const Ref<StructInstantiation> &inst) {
+    auto type = "%" + std::string(inst->struct_type->name);
+    Value aggregate{type, "undef"};
+    for (size_t i = 0; i < inst->arguments.size(); ++i) {
+      auto field = coerce(lower_expression(inst->arguments[i]),
+                          llvm_type(inst->struct_type->fields[i]->type));
+      aggregate.repr = instruction("insertvalue " + type + " " +
+                                   aggregate.repr + ", " + field.type + " " +
+                                   field.repr + ", " + std::to_string(i));
+    }
+    return aggregate;
+  }
+
+  Value lower_expression(const Ref<Expression> &expr) {
+    switch (expr->get_type()) {
+    case ASTType::Literal:
+      return lower_literal(std::static_pointer_cast<Literal>(expr));
+    case ASTType::Identifier: {
+      auto ident = std::static_pointer_cast<Identifier>(expr);
+      auto local = find_local(ident->name);
+      if (!local)
+        unsupported("Global '" + std::string(ident->name) + "'", expr->span);
+      return load(llvm_type(local->type), local->address);
+    }
+    case ASTType::BinaryOp:
+      return lower_binary_op(std::static_pointer_cast<BinaryOp>(expr));
+    case ASTType::Call:
+      return lower_call(std::static_pointer_cast<Call>(expr));
+    case ASTType::Dot:
+      return lower_dot(std::static_pointer_cast<Dot>(expr));
+    case ASTType::AddressOf: {
+      auto inner = std::static_pointer_cast<AddressOf>(expr)->expression;
+      return {llvm_type(inner->etype) + "*", address_of(inner)};
+    }
+    case ASTType::Dereference:
+    case ASTType::Index:
+      return load(llvm_type(expr->etype), address_of(expr));
+    case ASTType::StructInstantiation:
+      return lower_struct_instantiation(
+          std::static_pointer_cast<StructInstantiation>(expr));
+    default:
+      unsupported(std::string(magic_enum::enum_name(expr->get_type())),
+                  expr->span);
+    }
+  }
+
+  void lower_assignment(const Ref<Assignment> &assignment) {
+    auto value = lower_expression(assignment->expression);
+    Ref<Type> type = assignment->assignee->etype;
+    if (assignment->assignee->get_type() == ASTType::Identifier) {
+      auto local = find_local(
+          std::static_pointer_cast<Identifier>(assignment->assignee)->name);
+      if (!local)
+        unsupported("Assigning to a global", assignment->span);
+      type = local->type;
+    }
+    if (!type)
+      unsupported("This assignment", assignment->span);
+    store(coerce(value, llvm_type(type)), address_of(assignment->assignee));
+  }
+
+  // Every argument is computed before the first store, they may read the
+  // parameters being replaced
+  void lower_tail_call(const Ref<Call> &call) {
+    std::vector<Value> values;
+    for (size_t i = 0; i < parameters.size(); ++i) {
+      values.push_back(coerce(lower_expression(call->arguments[i]),
+                              llvm_type(parameters[i]->type)));
+    }
+    for (size_t i = 0; i < parameters.size(); ++i)
+      store(values[i], scopes.front().at(parameters[i]->identifier->name)
+                           .address);
+    terminate("br label %" + tail_label);
+  }
+
+  void lower_statement(const Ref<Statement> &stmt) {
+    switch (stmt->get_type()) {
+    case ASTType::Block:
+      scopes.emplace_back();
+      for (const auto &child : std::static_pointer_cast<Block>(stmt)->statements)
+        lower_statement(child);
+      scopes.pop_back();
+      break;
+    case ASTType::VarDecl: {
+      auto var_decl = std::static_pointer_cast<VarDecl>(stmt);
+      Value value{llvm_type(var_decl->type), "zeroinitializer"};
+      if (var_decl->expression)
+        value = lower_expression(var_decl->expression);
+      declare_local(var_decl->identifier->name, var_decl->type, value);
+      break;
+    }
+    case ASTType::Assignment:
+      lower_assignment(std::static_pointer_cast<Assignment>(stmt));
+      break;
+    case ASTType::ExpressionStatement:
+      lower_expression(
+          std::static_pointer_cast<ExpressionStatement>(stmt)->expression);
+      break;
+    case ASTType::If: {
+      auto if_stmt = std::static_pointer_cast<If>(stmt);
+      auto then_label = unique("if.then");
+      auto else_label = unique("if.else");
+      auto end_label = unique("if.end");
+      auto condition = lower_expression(if_stmt->condition);
+      terminate("br i1 " + condition.repr + ", label %" + then_label +
+                ", label %" + else_label);
+      label(then_label);
+      lower_statement(if_stmt->then_branch);
+      if (!terminated)
+        terminate("br label %" + end_label);
+      label(else_label);
+      if (if_stmt->else_branch)
+        lower_statement(if_stmt->else_branch);
+      label(end_label);
+      break;
+    }
+    case ASTType::While: {
+      auto while_stmt = std::static_pointer_cast<While>(stmt);
+      auto head_label = unique("while.head");
+      auto body_label = unique("while.body");
+      auto end_label = unique("while.end");
+      label(head_label);
+      auto condition = lower_expression(while_stmt->condition);
+      terminate("br i1 " + condition.repr + ", label %" + body_label +
+                ", label %" + end_label);
+      label(body_label);
+      lower_statement(while_stmt->body);
+      if (!terminated)
+        terminate("br label %" + head_label);
+      label(end_label);
+      break;
+    }
+    case ASTType::Return: {
+      auto ret = std::static_pointer_cast<Return>(stmt);
+      if (ret->tail_call) {
+        lower_tail_call(std::static_pointer_cast<Call>(ret->expression));
+        break;
+      }
+      if (!ret->expression) {
+        terminate(void_main ? "ret i32 0" : "ret void");
+        break;
+      }
+      auto value = coerce(lower_expression(ret->expression), return_type);
+      terminate("ret " + value.type + " " + value.repr);
+      break;
+    }
+    default:
+      unsupported(std::string(magic_enum::enum_name(stmt->get_type())),
+                  stmt->span);
+    }
+  }
+};
+
+std::string FunctionEmitter::emit_function(
+    const Ref<FunctionDefinition> &func_def) {
+  auto name = std::string(func_def->identifier->name);
+  return_type = llvm_type(func_def->return_type);
+  // main is the only symbol the linker needs, the rest stay internal so the
+  // optimizer is free to inline and drop them
+  bool is_main = name == "main";
+  void_main = is_main && return_type == "void";
+  if (void_main)
+    return_type = "i32";
+
+  scopes.emplace_back();
+  std::string params;
+  for (const auto &param : func_def->parameters) {
+    auto type = llvm_type(param->type);
+    auto incoming = "%" + std::string(param->identifier->name);
+    if (!params.empty())
+      params += ", ";
+    params += type + " " + incoming;
+    declare_local(param->identifier->name, param->type, {type, incoming});
+  }
+  if (has_tail_calls(func_def)) {
+    parameters = func_def->parameters;
+    tail_label = unique("tailcall");
+    label(tail_label);
+  }
+
+  lower_statement(func_def->body);
+  // Falling off the end returns a zero value (exit code 0 for main)
+  if (!terminated) {
+    terminate(return_type == "void" ? "ret void"
+                                    : "ret " + return_type + " " +
+                                          (return_type.back() == '*'
+                                               ? "null"
+                                               : "zeroinitializer"));
+  }
+  scopes.pop_back();
+
+  return "define " + std::string(is_main ? "" : "internal ") + return_type +
+         " @" + name + "(" + params + ") {\nentry:\n" + allocas + body +
+         "}\n\n";
+}
+
+// C sizes and counts (malloc, memset, ...) are 64 bit, so int parameters of
+// externs are declared as i64 and sign extended at the call. Callees that
+// take a C int only look at the low half, which makes this safe either way.
+std::string declare_extern(const Ref<Extern> &ext) {
+  std::string params;
+  for (const auto &arg : ext->args) {
+    if (!params.empty())
+      params += ", ";
+    params += arg->base_type == BaseType::Int ? "i64" : llvm_type(arg);
+  }
+  return "declare " + llvm_type(ext->return_type) + " @" +
+         std::string(ext->identifier->name) + "(" + params + ")\n";
+}
+
+} // namespace
+
+std::string codegen_llvm(Ref<Program> program) {
+  spdlog::debug("[codegen_llvm] Starting code generation for program");
+  ProgramInfo info;
+  info.source = program->source_buffer.get();
+
+  std::string output = "; Generated by the Enki compiler\n";
+  auto triple = host_triple();
+  if (!triple.empty())
+    output += "target triple = \"" + triple + "\"\n";
+  output += "\n%enki_str = type { i8*, i64 }\n";
+
+  std::vector<Ref<FunctionDefinition>> functions;
+  std::string declarations;
+  for (const auto &stmt : program->body->statements) {
+    switch (stmt->get_type()) {
+    case ASTType::FunctionDefinition: {
+      auto func_def = std::static_pointer_cast<FunctionDefinition>(stmt);
+      if (func_def->body)
+        functions.push_back(func_def);
+      break;
+    }
+    case ASTType::EnumDefinition: {
+      auto enum_def = std::static_pointer_cast<EnumDefinition>(stmt);
+      auto &members = info.enums[enum_def->identifier->name];
+      for (const auto &member : enum_def->members)
+        members.push_back(member->name);
+      if (enum_def->to_string_function)
+        functions.push_back(enum_def->to_string_function);
+      break;
+    }
+    case ASTType::StructDefinition: {
+      auto name = std::static_pointer_cast<StructDefinition>(stmt)->identifier->name;
+      if (auto struct_type = resolved_struct(
+              program, std::static_pointer_cast<StructDefinition>(stmt))) {
+        info.structs[name] = struct_type;
+        std::string fields;
+        for (const auto &field : struct_type->fields) {
+          if (!fields.empty())
+            fields += ", ";
+          fields += llvm_type(field->type);
+        }
+        output += "%" + std::string(name) + " = type { " + fields + " }\n";
+      }
+      break;
+    }
+    case ASTType::Extern: {
+      auto ext = std::static_pointer_cast<Extern>(stmt);
+      info.externs[ext->identifier->name] = ext;
+      // sizeof is folded at the call, there is nothing to link against
+      if (ext->args.empty() || ext->args[0]->base_type != BaseType::Type)
+        declarations += declare_extern(ext);
+      break;
+    }
+    case ASTType::Import:
+      break;
+    default:
+      LOG_ERROR_EXIT("[codegen_llvm] Top level statements are not supported "
+                     "by the LLVM backend",
+                     stmt->span, *program->source_buffer);
+    }
+  }
+
+  std::string definitions;
+  for (const auto &func_def : functions) {
+    FunctionEmitter emitter(info);
+    definitions += emitter.emit_function(func_def);
+  }
+
+  output += "\n" + info.globals + "\n" + definitions;
+  output += "; Runtime, see src/runtime/enki_rt.h\n"
+            "declare zeroext i1 @enki_str_eq(i8*, i64, i8*, i64)\n"
+            "declare void @enki_write_int(i64)\n"
+            "declare void @enki_write_float(double)\n"
+            "declare void @enki_write_bool(i1 zeroext)\n"
+            "declare void @enki_write_char(i8 signext)\n"
+            "declare void @enki_write_str(i8*, i64)\n"
+            "declare void @enki_write_ptr(i8*)\n"
+            "declare void @enki_write_newline()\n"
+            "declare void @enki_flush()\n"
+            "declare void @enki_eprint_begin()\n"
+            "declare void @enki_eprint_end()\n";
+  output += declarations;
+
+  spdlog::debug("[codegen_llvm] Code generation completed");
+  return output;
+}
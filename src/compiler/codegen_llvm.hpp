@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+#include "../definitions/ast.hpp"
+#include "../definitions/types.hpp"
+
+// Emits textual LLVM IR (.ll) for the typechecked program. Locals are
+// allocas, so the output relies on `opt` (mem2reg and friends) to be fast.
+// Runtime calls target src/runtime/enki_rt.h.
+std::string codegen_llvm(Ref<Program> program);
@@ -0,0 +1,1519 @@
+/* Native x86-64 backend. Each function is lowered from the typed AST to a
+small machine level IR over virtual registers, virtual registers are assigned
+to physical registers with a linear scan allocator (Poletto & Sarkar), and the
+result is encoded directly into an ELF object. There is no instruction
+selection beyond a fixed pattern per IR op, the point is fast builds rather
+than fast code. */
+
+#include "codegen_native.hpp"
+#include "../definitions/lowering.hpp"
+#include "../utils/logging.hpp"
+#include "tailcalls.hpp"
+#include <algorithm>
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+// ---------------------------------------------------------------------------
+// Machine IR
+// ---------------------------------------------------------------------------
+
+// Int holds 32 bit integers (int, bool, char and enums) in general purpose
+// registers, Ptr holds 64 bit values (pointers and addresses), Float holds
+// single precision values in SSE registers. Structs and strings are never in
+// registers, expressions of those types evaluate to their address.
+enum class ValueClass { Int, Ptr, Float };
+
+enum class Op {
+  Imm,        // dst = imm (bit pattern for Float)
+  Mov,        // dst = a
+  Add,        // dst = a + b
+  Sub,        // dst = a - b
+  Mul,        // dst = a * b
+  Div,        // dst = a / b
+  Mod,        // dst = a % b
+  Cmp,        // dst = a <cond> b
+  AddImm,     // dst = a + imm, Ptr only
+  AddIndex,   // dst = a + b * imm with b sign extended, Ptr only
+  SlotAddr,   // dst = rbp + imm
+  RodataAddr, // dst = .rodata + imm
+  Load,       // dst = [a + imm], width bytes
+  Store,      // [a + imm] = b, width bytes
+  Copy,       // [a] = [b], imm bytes
+  Call,       // dst = calls[call](args)
+  Label,      // imm is the label id
+  Jump,       // goto imm
+  JumpIfZero, // if a == 0 goto imm
+  Return,     // return a, a is -1 for void
+};
+
+enum class Cond { Eq, Ne, Lt, Gt, Le, Ge };
+
+struct Inst {
+  Op op;
+  int dst = -1;
+  int a = -1;
+  int b = -1;
+  int64_t imm = 0;
+  int width = 0;
+  Cond cond = Cond::Eq;
+  int call = -1;
+};
+
+struct CallSite {
+  std::string symbol;
+  std::vector<int> args;
+  bool promote_floats = false; // float arguments are passed as double
+  bool returns_bool = false;   // only the low byte of eax is defined
+};
+
+struct MachineFunction {
+  std::string name;
+  Span span;
+  std::vector<ValueClass> vregs;
+  std::vector<Inst> insts;
+  std::vector<CallSite> calls;
+  std::vector<int> params; // Defined on entry from the argument registers
+  int frame_size = 0;      // Bytes of stack slots below rbp
+  int label_count = 0;
+};
+
+// ---------------------------------------------------------------------------
+// Types and layout
+// ---------------------------------------------------------------------------
+
+bool is_aggregate(const Ref<Type> &type) {
+  return type->base_type == BaseType::String ||
+         type->base_type == BaseType::Struct;
+}
+
+ValueClass value_class(const Ref<Type> &type) {
+  switch (type->base_type) {
+  case BaseType::Float:
+    return ValueClass::Float;
+  case BaseType::Pointer:
+  case BaseType::String:
+  case BaseType::Struct:
+    return ValueClass::Ptr;
+  default:
+    return ValueClass::Int;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Lowering from the AST
+// ---------------------------------------------------------------------------
+
+struct ProgramInfo {
+  std::unordered_map<std::string_view, Ref<FunctionDefinition>> functions;
+  std::unordered_map<std::string_view, Ref<Extern>> externs;
+  std::unordered_map<std::string_view, std::vector<std::string_view>> enums;
+  std::unordered_map<std::string_view, Ref<Struct>> structs;
+  std::vector<uint8_t> rodata;
+  std::unordered_map<std::string, int> strings; // Interned .rodata offsets
+  const std::string *source;
+};
+
+struct Local {
+  Ref<Type> type;
+  int vreg = -1; // Scalars that never have their address taken
+  int slot = 0;  // rbp relative offset for everything else
+};
+
+class Lowering {
+public:
+  Lowering(ProgramInfo &program, MachineFunction &fn)
+      : program(program), fn(fn) {}
+
+  void lower_function(const Ref<FunctionDefinition> &func_def);
+
+private:
+  ProgramInfo &program;
+  MachineFunction &fn;
+  std::vector<std::unordered_map<std::string_view, Local>> scopes;
+  std::unordered_set<std::string_view> address_taken;
+  int result_address = -1; // Hidden pointer for struct/string results
+  // Self tail calls rebind the parameters and jump back to this label
+  std::vector<Ref<Parameter>> parameters;
+  int tail_label = -1;
+
+  [[noreturn]] void unsupported(const std::string &what, const Span &span) {
+    LOG_ERROR_EXIT("[codegen_native] " + what +
+                       " is not supported by the native backend",
+                   span, *program.source);
+    std::exit(1);
+  }
+
+  int new_vreg(ValueClass cls) {
+    fn.vregs.push_back(cls);
+    return static_cast<int>(fn.vregs.size() - 1);
+  }
+  int new_label() { return fn.label_count++; }
+  void emit(Inst inst) { fn.insts.push_back(inst); }
+
+  int alloc_slot(int size, int align) {
+    fn.frame_size = (fn.frame_size + size + align - 1) / align * align;
+    return -fn.frame_size;
+  }
+
+  int imm(ValueClass cls, int64_t value) {
+    int dst = new_vreg(cls);
+    emit({Op::Imm, dst, -1, -1, value});
+    return dst;
+  }
+  int slot_address(int slot) {
+    int dst = new_vreg(ValueClass::Ptr);
+    emit({Op::SlotAddr, dst, -1, -1, slot});
+    return dst;
+  }
+  int load(int address, int offset, const Ref<Type> &type) {
+    int dst = new_vreg(value_class(type));
+    emit({Op::Load, dst, address, -1, offset, type_size(type)});
+    return dst;
+  }
+  void store(int address, int offset, int value, const Ref<Type> &type) {
+    emit({Op::Store, -1, address, value, offset, type_size(type)});
+  }
+  void copy(int dst_address, int src_address, const Ref<Type> &type) {
+    emit({Op::Copy, -1, dst_address, src_address, type_size(type)});
+  }
+  int call(CallSite site, int dst, const Span &span = Span{}) {
+    auto floats = std::count_if(site.args.begin(), site.args.end(), [&](int arg) {
+      return fn.vregs[arg] == ValueClass::Float;
+    });
+    if (floats > 8 || site.args.size() - floats > 6) {
+      unsupported("Calls with more than 6 integer or 8 float arguments",
+                  span);
+    }
+    fn.calls.push_back(std::move(site));
+    Inst inst{Op::Call, dst};
+    inst.call = static_cast<int>(fn.calls.size() - 1);
+    emit(inst);
+    return dst;
+  }
+
+  Local *find_local(std::string_view name) {
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+      auto found = it->find(name);
+      if (found != it->end())
+        return &found->second;
+    }
+    return nullptr;
+  }
+
+  // Binds a new local to an initial value (a vreg for scalars, an address for
+  // aggregates)
+  void declare_local(std::string_view name, const Ref<Type> &type, int value) {
+    Local local{type};
+    if (is_aggregate(type)) {
+      local.slot = alloc_slot(type_size(type), type_align(type));
+      copy(slot_address(local.slot), value, type);
+    } else if (address_taken.contains(name)) {
+      local.slot = alloc_slot(8, 8);
+      store(slot_address(local.slot), 0, value, type);
+    } else {
+      local.vreg = new_vreg(value_class(type));
+      emit({Op::Mov, local.vreg, value});
+    }
+    scopes.back()[name] = local;
+  }
+
+  int string_constant(const std::string &text) {
+    auto found = program.strings.find(text);
+    if (found != program.strings.end())
+      return found->second;
+    int offset = static_cast<int>(program.rodata.size());
+    program.rodata.insert(program.rodata.end(), text.begin(), text.end());
+    program.rodata.push_back(0);
+    program.strings[text] = offset;
+    return offset;
+  }
+
+  int lower_literal(const Ref<Literal> &literal) {
+    switch (literal->type->base_type) {
+    case BaseType::Int:
+      return imm(ValueClass::Int, std::stoll(std::string(literal->value)));
+    case BaseType::Bool:
+      return imm(ValueClass::Int, literal->value == "true" ? 1 : 0);
+    case BaseType::Char:
+      return imm(ValueClass::Int,
+                 static_cast<unsigned char>(unescape(literal->value)[0]));
+    case BaseType::Float: {
+      float value = std::stof(std::string(literal->value));
+      uint32_t bits;
+      std::memcpy(&bits, &value, sizeof(bits));
+      return imm(ValueClass::Float, bits);
+    }
+    case BaseType::String: {
+      auto text = unescape(literal->value);
+      int address = slot_address(alloc_slot(16, 8));
+      int data = new_vreg(ValueClass::Ptr);
+      emit({Op::RodataAddr, data, -1, -1, string_constant(text)});
+      emit({Op::Store, -1, address, data, 0, 8});
+      emit({Op::Store, -1, address,
+            imm(ValueClass::Ptr, static_cast<int64_t>(text.size())), 8, 8});
+      return address;
+    }
+    default:
+      unsupported("Literal of type " + literal->type->to_string(),
+                  literal->span);
+    }
+  }
+
+  // Address of an lvalue expression
+  int address_of(const Ref<Expression> &expr) {
+    switch (expr->get_type()) {
+    case ASTType::Identifier: {
+      auto ident = std::static_pointer_cast<Identifier>(expr);
+      auto local = find_local(ident->name);
+      if (!local || local->vreg != -1) {
+        unsupported("Taking the address of '" + std::string(ident->name) + "'",
+                    expr->span);
+      }
+      return slot_address(local->slot);
+    }
+    case ASTType::Dot: {
+      auto dot = std::static_pointer_cast<Dot>(expr);
+      auto base = address_of(dot->left);
+      auto [offset, type] = dot_field(dot);
+      if (offset == 0)
+        return base;
+      int dst = new_vreg(ValueClass::Ptr);
+      emit({Op::AddImm, dst, base, -1, offset});
+      return dst;
+    }
+    case ASTType::Dereference:
+      return lower_expression(
+          std::static_pointer_cast<Dereference>(expr)->expression);
+    case ASTType::Index: {
+      auto index = std::static_pointer_cast<Index>(expr);
+      int base = lower_expression(index->base);
+      int offset = lower_expression(index->index);
+      int dst = new_vreg(ValueClass::Ptr);
+      emit({Op::AddIndex, dst, base, offset, type_size(expr->etype)});
+      return dst;
+    }
+    default:
+      unsupported("Taking the address of this expression", expr->span);
+    }
+  }
+
+  std::pair<int, Ref<Type>> dot_field(const Ref<Dot> &dot) {
+    if (dot->left->etype->base_type != BaseType::Struct ||
+        dot->right->get_type() != ASTType::Identifier) {
+      unsupported("This member access", dot->span);
+    }
+    auto field = std::static_pointer_cast<Identifier>(dot->right);
+    return field_offset(std::get<Ref<Struct>>(dot->left->etype->structure),
+                        field->name);
+  }
+
+  int lower_dot(const Ref<Dot> &dot) {
+    if (dot->left->etype->base_type == BaseType::Enum) {
+      auto enum_type = std::get<Ref<Enum>>(dot->left->etype->structure);
+      auto member = std::static_pointer_cast<Identifier>(dot->right)->name;
+      const auto &members = program.enums[enum_type->name];
+      auto it = std::find(members.begin(), members.end(), member);
+      return imm(ValueClass::Int, it - members.begin());
+    }
+    auto address = address_of(dot);
+    auto [offset, type] = dot_field(dot);
+    return is_aggregate(type) ? address : load(address, 0, type);
+  }
+
+  int lower_binary_op(const Ref<BinaryOp> &binop) {
+    auto operand_type = binop->left->etype;
+    if (operand_type->base_type == BaseType::String) {
+      if (binop->op != BinaryOpType::Equals &&
+          binop->op != BinaryOpType::NotEquals) {
+        unsupported("This string operator", binop->span);
+      }
+      int left = lower_expression(binop->left);
+      int right = lower_expression(binop->right);
+      CallSite site{"enki_str_eq", {}, false, true};
+      expand_string(site, left);
+      expand_string(site, right);
+      int equal = call(site, new_vreg(ValueClass::Int));
+      if (binop->op == BinaryOpType::Equals)
+        return equal;
+      int dst = new_vreg(ValueClass::Int);
+      emit({Op::Cmp, dst, equal, imm(ValueClass::Int, 0), 0, 0, Cond::Eq});
+      return dst;
+    }
+
+    int left = lower_expression(binop->left);
+    int right = lower_expression(binop->right);
+    auto cls = value_class(operand_type);
+    auto arithmetic = [&](Op op) {
+      int dst = new_vreg(cls);
+      emit({op, dst, left, right});
+      return dst;
+    };
+    auto compare = [&](Cond cond) {
+      int dst = new_vreg(ValueClass::Int);
+      emit({Op::Cmp, dst, left, right, 0, 0, cond});
+      return dst;
+    };
+    switch (binop->op) {
+    case BinaryOpType::Add:
+      return arithmetic(Op::Add);
+    case BinaryOpType::Subtract:
+      return arithmetic(Op::Sub);
+    case BinaryOpType::Multiply:
+      return arithmetic(Op::Mul);
+    case BinaryOpType::Divide:
+      return arithmetic(Op::Div);
+    case BinaryOpType::Modulo:
+      if (cls == ValueClass::Float)
+        unsupported("Float modulo", binop->span);
+      return arithmetic(Op::Mod);
+    case BinaryOpType::Equals:
+      return compare(Cond::Eq);
+    case BinaryOpType::NotEquals:
+      return compare(Cond::Ne);
+    case BinaryOpType::LessThan:
+      return compare(Cond::Lt);
+    case BinaryOpType::GreaterThan:
+      return compare(Cond::Gt);
+    case BinaryOpType::LessThanOrEqual:
+      return compare(Cond::Le);
+    case BinaryOpType::GreaterThanOrEqual:
+      return compare(Cond::Ge);
+    }
+    return -1;
+  }
+
+  // Strings are passed to the runtime by value, which the ABI splits into
+  // two integer registers
+  void expand_string(CallSite &site, int address) {
+    auto ptr_type = std::make_shared<Type>(Type{BaseType::Pointer});
+    site.args.push_back(load(address, 0, ptr_type));
+    site.args.push_back(load(address, 8, ptr_type));
+  }
+
+  void lower_print(const Ref<Call> &call_expr, bool to_stderr) {
+    if (to_stderr)
+      call({"enki_eprint_begin"}, -1);
+    for (const auto &arg : call_expr->arguments) {
+      int value = lower_expression(arg);
+      CallSite site;
+      switch (arg->etype->base_type) {
+      case BaseType::Int:
+      case BaseType::Enum:
+        site.symbol = "enki_write_int";
+        break;
+      case BaseType::Float:
+        site.symbol = "enki_write_float";
+        site.promote_floats = true;
+        break;
+      case BaseType::Bool:
+        site.symbol = "enki_write_bool";
+        break;
+      case BaseType::Char:
+        site.symbol = "enki_write_char";
+        break;
+      case BaseType::Pointer:
+        site.symbol = "enki_write_ptr";
+        break;
+      case BaseType::String:
+        site.symbol = "enki_write_str";
+        expand_string(site, value);
+        call(site, -1);
+        continue;
+      default:
+        unsupported("Printing a " + arg->etype->to_string(), arg->span);
+      }
+      site.args.push_back(value);
+      call(site, -1);
+    }
+    call({"enki_write_newline"}, -1);
+    if (to_stderr)
+      call({"enki_eprint_end"}, -1);
+  }
+
+  int lower_call(const Ref<Call> &call_expr) {
+    auto name = std::static_pointer_cast<Identifier>(call_expr->callee)->name;
+    if (name == "print" || name == "eprint") {
+      lower_print(call_expr, name == "eprint");
+      return -1;
+    }
+    if (name == "flush") {
+      call({"enki_flush"}, -1);
+      return -1;
+    }
+
+    if (auto ext = program.externs.find(name); ext != program.externs.end()) {
+      // sizeof(T) is folded, everything else is a plain C call
+      if (!ext->second->args.empty() &&
+          ext->second->args[0]->base_type == BaseType::Type) {
+        auto type_name =
+            std::static_pointer_cast<Identifier>(call_expr->arguments[0])->name;
+        return imm(ValueClass::Int, sizeof_named_type(type_name, call_expr));
+      }
+      CallSite site{std::string(name)};
+      for (const auto &arg : call_expr->arguments) {
+        if (is_aggregate(arg->etype))
+          unsupported("Passing a struct or string to an extern", arg->span);
+        site.args.push_back(lower_expression(arg));
+      }
+      auto return_type = ext->second->return_type;
+      site.returns_bool = return_type->base_type == BaseType::Bool;
+      if (is_aggregate(return_type))
+        unsupported("Returning a struct or string from an extern",
+                    call_expr->span);
+      int dst = return_type->base_type == BaseType::Void
+                    ? -1
+                    : new_vreg(value_class(return_type));
+      return call(site, dst, call_expr->span);
+    }
+
+    auto func = program.functions.find(name);
+    if (func == program.functions.end()) {
+      unsupported("Calling '" + std::string(name) + "'", call_expr->span);
+    }
+    auto return_type = func->second->return_type;
+    CallSite site{std::string(name)};
+    int result = -1;
+    if (is_aggregate(return_type)) {
+      result = slot_address(
+          alloc_slot(type_size(return_type), type_align(return_type)));
+      site.args.push_back(result);
+    }
+    // Aggregates are passed by address, the callee makes its own copy
+    for (const auto &arg : call_expr->arguments) {
+      site.args.push_back(lower_expression(arg));
+    }
+    site.returns_bool = return_type->base_type == BaseType::Bool;
+    if (result != -1) {
+      call(site, -1, call_expr->span);
+      return result;
+    }
+    int dst = return_type->base_type == BaseType::Void
+                  ? -1
+                  : new_vreg(value_class(return_type));
+    return call(site, dst, call_expr->span);
+  }
+
+  int64_t sizeof_named_type(std::string_view name, const Ref<Call> &call_expr) {
+    auto type = std::make_shared<Type>();
+    if (name == "int") {
+      type->base_type = BaseType::Int;
+    } else if (name == "float") {
+      type->base_type = BaseType::Float;
+    } else if (name == "bool") {
+      type->base_type = BaseType::Bool;
+    } else if (name == "char") {
+      type->base_type = BaseType::Char;
+    } else if (name == "string") {
+      type->base_type = BaseType::String;
+    } else if (auto found = program.structs.find(name);
+               found != program.structs.end()) {
+      type->base_type = BaseType::Struct;
+      type->structure = found->second;
+    } else if (program.enums.contains(name)) {
+      type->base_type = BaseType::Enum;
+    } else {
+      unsupported("sizeof(" + std::string(name) + ")", call_expr->span);
+    }
+    return type_size(type);
+  }
+
+  int lower_expression(const Ref<Expression> &expr) {
+    switch (expr->get_type()) {
+    case ASTType::Literal:
+      return lower_literal(std::static_pointer_cast<Literal>(expr));
+    case ASTType::Identifier: {
+      auto ident = std::static_pointer_cast<Identifier>(expr);
+      auto local = find_local(ident->name);
+      if (!local)
+        unsupported("Global '" + std::string(ident->name) + "'", expr->span);
+      if (local->vreg != -1)
+        return local->vreg;
+      if (is_aggregate(local->type))
+        return slot_address(local->slot);
+      return load(slot_address(local->slot), 0, local->type);
+    }
+    case ASTType::BinaryOp:
+      return lower_binary_op(std::static_pointer_cast<BinaryOp>(expr));
+    case ASTType::Call:
+      return lower_call(std::static_pointer_cast<Call>(expr));
+    case ASTType::Dot:
+      return lower_dot(std::static_pointer_cast<Dot>(expr));
+    case ASTType::AddressOf:
+      return address_of(std::static_pointer_cast<AddressOf>(expr)->expression);
+    case ASTType::Dereference: {
+      int pointer = lower_expression(
+          std::static_pointer_cast<Dereference>(expr)->expression);
+      return is_aggregate(expr->etype) ? pointer
+                                       : load(pointer, 0, expr->etype);
+    }
+    case ASTType::Index: {
+      int address = address_of(expr);
+      return is_aggregate(expr->etype) ? address
+                                       : load(address, 0, expr->etype);
+    }
+    case ASTType::StructInstantiation: {
+      auto inst = std::static_pointer_cast<StructInstantiation>(expr);
+      auto type = std::make_shared<Type>(Type{BaseType::Struct});
+      type->structure = inst->struct_type;
+      int address = slot_address(alloc_slot(type_size(type), type_align(type)));
+      for (size_t i = 0; i < inst->arguments.size(); ++i) {
+        auto field = inst->struct_type->fields[i];
+        auto [offset, field_type] =
+            field_offset(inst->struct_type, field->name);
+        int value = lower_expression(inst->arguments[i]);
+        if (is_aggregate(field_type)) {
+          int field_address = new_vreg(ValueClass::Ptr);
+          emit({Op::AddImm, field_address, address, -1, offset});
+          copy(field_address, value, field_type);
+        } else {
+          store(address, offset, value, field_type);
+        }
+      }
+      return address;
+    }
+    default:
+      unsupported(std::string(magic_enum::enum_name(expr->get_type())),
+                  expr->span);
+    }
+  }
+
+  void lower_assignment(const Ref<Assignment> &assignment) {
+    auto type = assignment->assignee->etype;
+    int value = lower_expression(assignment->expression);
+    if (assignment->assignee->get_type() == ASTType::Identifier) {
+      auto name =
+          std::static_pointer_cast<Identifier>(assignment->assignee)->name;
+      auto local = find_local(name);
+      if (!local)
+        unsupported("Assigning to a global", assignment->span);
+      if (local->vreg != -1) {
+        emit({Op::Mov, local->vreg, value});
+        return;
+      }
+      type = local->type;
+    }
+    if (!type)
+      unsupported("This assignment", assignment->span);
+    int address = address_of(assignment->assignee);
+    if (is_aggregate(type)) {
+      copy(address, value, type);
+    } else {
+      store(address, 0, value, type);
+    }
+  }
+
+  // The arguments are copied out before any parameter changes, they may read
+  // the parameters being replaced
+  void lower_tail_call(const Ref<Call> &call) {
+    std::vector<int> values;
+    for (size_t i = 0; i < parameters.size(); ++i) {
+      const auto &type = parameters[i]->type;
+      int value = lower_expression(call->arguments[i]);
+      int copy_of = -1;
+      if (is_aggregate(type)) {
+        copy_of = slot_address(alloc_slot(type_size(type), type_align(type)));
+        copy(copy_of, value, type);
+      } else {
+        copy_of = new_vreg(value_class(type));
+        emit({Op::Mov, copy_of, value});
+      }
+      values.push_back(copy_of);
+    }
+    for (size_t i = 0; i < parameters.size(); ++i) {
+      const auto &type = parameters[i]->type;
+      const auto &local = scopes.front().at(parameters[i]->identifier->name);
+      if (local.vreg != -1) {
+        emit({Op::Mov, local.vreg, values[i]});
+      } else if (is_aggregate(type)) {
+        copy(slot_address(local.slot), values[i], type);
+      } else {
+        store(slot_address(local.slot), 0, values[i], type);
+      }
+    }
+    emit({Op::Jump, -1, -1, -1, tail_label});
+  }
+
+  void lower_statement(const Ref<Statement> &stmt) {
+    switch (stmt->get_type()) {
+    case ASTType::Block:
+      scopes.emplace_back();
+      for (const auto &child : std::static_pointer_cast<Block>(stmt)->statements)
+        lower_statement(child);
+      scopes.pop_back();
+      break;
+    case ASTType::VarDecl: {
+      auto var_decl = std::static_pointer_cast<VarDecl>(stmt);
+      if (!var_decl->expression)
+        unsupported("A declaration without initializer", var_decl->span);
+      declare_local(var_decl->identifier->name, var_decl->type,
+                    lower_expression(var_decl->expression));
+      break;
+    }
+    case ASTType::Assignment:
+      lower_assignment(std::static_pointer_cast<Assignment>(stmt));
+      break;
+    case ASTType::ExpressionStatement:
+      lower_expression(
+          std::static_pointer_cast<ExpressionStatement>(stmt)->expression);
+      break;
+    case ASTType::If: {
+      auto if_stmt = std::static_pointer_cast<If>(stmt);
+      int else_label = new_label();
+      int end_label = new_label();
+      emit({Op::JumpIfZero, -1, lower_expression(if_stmt->condition), -1,
+            else_label});
+      lower_statement(if_stmt->then_branch);
+      emit({Op::Jump, -1, -1, -1, end_label});
+      emit({Op::Label, -1, -1, -1, else_label});
+      if (if_stmt->else_branch)
+        lower_statement(if_stmt->else_branch);
+      emit({Op::Label, -1, -1, -1, end_label});
+      break;
+    }
+    case ASTType::While: {
+      auto while_stmt = std::static_pointer_cast<While>(stmt);
+      int head_label = new_label();
+      int end_label = new_label();
+      emit({Op::Label, -1, -1, -1, head_label});
+      emit({Op::JumpIfZero, -1, lower_expression(while_stmt->condition), -1,
+            end_label});
+      lower_statement(while_stmt->body);
+      emit({Op::Jump, -1, -1, -1, head_label});
+      emit({Op::Label, -1, -1, -1, end_label});
+      break;
+    }
+    case ASTType::Return: {
+      auto ret = std::static_pointer_cast<Return>(stmt);
+      if (ret->tail_call) {
+        lower_tail_call(std::static_pointer_cast<Call>(ret->expression));
+      } else if (!ret->expression) {
+        emit({Op::Return});
+      } else if (result_address != -1) {
+        copy(result_address, lower_expression(ret->expression),
+             ret->expression->etype);
+        emit({Op::Return});
+      } else {
+        emit({Op::Return, -1, lower_expression(ret->expression)});
+      }
+      break;
+    }
+    default:
+      unsupported(std::string(magic_enum::enum_name(stmt->get_type())),
+                  stmt->span);
+    }
+  }
+};
+
+void Lowering::lower_function(const Ref<FunctionDefinition> &func_def) {
+  fn.name = func_def->identifier->name;
+  fn.span = func_def->span;
+  collect_address_taken(func_def->body, address_taken);
+  scopes.emplace_back();
+
+  if (is_aggregate(func_def->return_type)) {
+    result_address = new_vreg(ValueClass::Ptr);
+    fn.params.push_back(result_address);
+  }
+  std::vector<std::pair<Ref<Parameter>, int>> incoming;
+  for (const auto &param : func_def->parameters) {
+    int vreg = new_vreg(value_class(param->type));
+    fn.params.push_back(vreg);
+    incoming.emplace_back(param, vreg);
+  }
+  auto float_params = std::count_if(
+      fn.params.begin(), fn.params.end(),
+      [&](int param) { return fn.vregs[param] == ValueClass::Float; });
+  if (float_params > 8 || fn.params.size() - float_params > 6) {
+    unsupported("Functions with more than 6 integer or 8 float parameters",
+                func_def->span);
+  }
+  for (const auto &[param, vreg] : incoming) {
+    if (!is_aggregate(param->type) &&
+        !address_taken.contains(param->identifier->name)) {
+      scopes.back()[param->identifier->name] = Local{param->type, vreg};
+    } else {
+      declare_local(param->identifier->name, param->type, vreg);
+    }
+  }
+  if (has_tail_calls(func_def)) {
+    parameters = func_def->parameters;
+    tail_label = new_label();
+    emit({Op::Label, -1, -1, -1, tail_label});
+  }
+
+  lower_statement(func_def->body);
+  scopes.pop_back();
+}
+
+// ---------------------------------------------------------------------------
+// Linear scan register allocation
+// ---------------------------------------------------------------------------
+
+enum Reg : int {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+constexpr int XMM_SCRATCH = 15;
+constexpr int ARG_GPRS[] = {RDI, RSI, RDX, RCX, R8, R9};
+
+// rax, rcx, rdx, rsi and rdi are scratch registers for the instruction
+// patterns and argument setup, so they are never allocated. r10/r11 and
+// xmm8-xmm13 are clobbered by calls and only hold values that don't live
+// across one.
+constexpr int CALLEE_SAVED[] = {RBX, R12, R13, R14, R15};
+constexpr int CALLER_SAVED[] = {R10, R11};
+constexpr int XMM_ALLOCATABLE[] = {8, 9, 10, 11, 12, 13};
+
+struct Location {
+  bool in_register = false;
+  int reg = 0;
+  int offset = 0; // rbp relative, for spilled values
+};
+
+struct Allocation {
+  std::vector<Location> locations;
+  std::vector<int> used_callee_saved;
+};
+
+struct Interval {
+  int vreg;
+  int start;
+  int end;
+  bool crosses_call;
+};
+
+Allocation allocate_registers(MachineFunction &fn) {
+  std::vector<int> start(fn.vregs.size(), INT32_MAX);
+  std::vector<int> end(fn.vregs.size(), -1);
+  auto touch = [&](int vreg, int position) {
+    if (vreg < 0)
+      return;
+    start[vreg] = std::min(start[vreg], position);
+    end[vreg] = std::max(end[vreg], position);
+  };
+
+  for (int param : fn.params)
+    touch(param, 0);
+  std::vector<int> label_position(fn.label_count, 0);
+  std::vector<int> call_positions;
+  for (int i = 0; i < static_cast<int>(fn.insts.size()); ++i) {
+    const auto &inst = fn.insts[i];
+    touch(inst.dst, i + 1);
+    touch(inst.a, i + 1);
+    touch(inst.b, i + 1);
+    if (inst.op == Op::Call) {
+      call_positions.push_back(i + 1);
+      for (int arg : fn.calls[inst.call].args)
+        touch(arg, i + 1);
+    }
+    if (inst.op == Op::Label)
+      label_position[inst.imm] = i + 1;
+  }
+
+  // A value live into a loop must survive until the back edge, repeated
+  // until stable so nested loops propagate outwards
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < static_cast<int>(fn.insts.size()); ++i) {
+      const auto &inst = fn.insts[i];
+      if (inst.op != Op::Jump || label_position[inst.imm] > i + 1)
+        continue;
+      int head = label_position[inst.imm];
+      for (size_t v = 0; v < fn.vregs.size(); ++v) {
+        if (start[v] < head && end[v] >= head && end[v] < i + 1) {
+          end[v] = i + 1;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  std::vector<Interval> intervals;
+  for (size_t v = 0; v < fn.vregs.size(); ++v) {
+    if (end[v] < 0)
+      continue;
+    auto call = std::upper_bound(call_positions.begin(), call_positions.end(),
+                                 start[v]);
+    bool crosses = call != call_positions.end() && *call < end[v];
+    intervals.push_back({static_cast<int>(v), start[v], end[v], crosses});
+  }
+  std::sort(intervals.begin(), intervals.end(),
+            [](const Interval &a, const Interval &b) {
+              return a.start < b.start;
+            });
+
+  Allocation allocation;
+  allocation.locations.resize(fn.vregs.size());
+  std::vector<Interval> active;
+  std::unordered_set<int> busy_gprs, busy_xmms;
+
+  auto spill = [&](int vreg) {
+    fn.frame_size += 8;
+    allocation.locations[vreg] = Location{false, 0, -fn.frame_size};
+  };
+  auto candidates = [&](const Interval &interval) {
+    std::vector<int> regs;
+    if (fn.vregs[interval.vreg] == ValueClass::Float) {
+      if (!interval.crosses_call)
+        regs.assign(std::begin(XMM_ALLOCATABLE), std::end(XMM_ALLOCATABLE));
+      return regs;
+    }
+    if (!interval.crosses_call)
+      regs.assign(std::begin(CALLER_SAVED), std::end(CALLER_SAVED));
+    regs.insert(regs.end(), std::begin(CALLEE_SAVED), std::end(CALLEE_SAVED));
+    return regs;
+  };
+
+  for (const auto &current : intervals) {
+    // Expire intervals that ended before this one starts
+    for (auto it = active.begin(); it != active.end();) {
+      if (it->end < current.start) {
+        auto &busy = fn.vregs[it->vreg] == ValueClass::Float ? busy_xmms
+                                                              : busy_gprs;
+        busy.erase(allocation.locations[it->vreg].reg);
+        it = active.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    auto &busy =
+        fn.vregs[current.vreg] == ValueClass::Float ? busy_xmms : busy_gprs;
+    auto regs = candidates(current);
+    auto free_reg = std::find_if(regs.begin(), regs.end(),
+                                 [&](int reg) { return !busy.contains(reg); });
+    if (free_reg != regs.end()) {
+      allocation.locations[current.vreg] = Location{true, *free_reg};
+      busy.insert(*free_reg);
+      active.push_back(current);
+      continue;
+    }
+
+    // No register left, spill whichever interval ends last
+    auto victim = active.end();
+    for (auto it = active.begin(); it != active.end(); ++it) {
+      if (fn.vregs[it->vreg] != fn.vregs[current.vreg])
+        continue;
+      int reg = allocation.locations[it->vreg].reg;
+      if (std::find(regs.begin(), regs.end(), reg) == regs.end())
+        continue;
+      if (victim == active.end() || it->end > victim->end)
+        victim = it;
+    }
+    if (victim != active.end() && victim->end > current.end) {
+      allocation.locations[current.vreg] = allocation.locations[victim->vreg];
+      spill(victim->vreg);
+      active.erase(victim);
+      active.push_back(current);
+    } else {
+      spill(current.vreg);
+    }
+  }
+
+  for (int reg : CALLEE_SAVED) {
+    for (const auto &location : allocation.locations) {
+      if (location.in_register && location.reg == reg &&
+          std::find(allocation.used_callee_saved.begin(),
+                    allocation.used_callee_saved.end(),
+                    reg) == allocation.used_callee_saved.end()) {
+        allocation.used_callee_saved.push_back(reg);
+      }
+    }
+  }
+  return allocation;
+}
+
+// ---------------------------------------------------------------------------
+// x86-64 encoding
+// ---------------------------------------------------------------------------
+
+// Register or [base + disp32] memory operand
+struct Operand {
+  bool memory;
+  int reg;
+  int32_t disp = 0;
+};
+
+Operand reg(int r) { return {false, r}; }
+Operand mem(int base, int32_t disp) { return {true, base, disp}; }
+
+enum ConditionCode : uint8_t {
+  CC_P = 0xA,
+  CC_NP = 0xB,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_AE = 0x3,
+  CC_A = 0x7,
+  CC_L = 0xC,
+  CC_GE = 0xD,
+  CC_LE = 0xE,
+  CC_G = 0xF,
+};
+
+class Assembler {
+public:
+  explicit Assembler(std::vector<uint8_t> &code) : code(code) {}
+
+  size_t position() const { return code.size(); }
+
+  void byte(uint8_t value) { code.push_back(value); }
+  void imm32(int64_t value) {
+    for (int i = 0; i < 4; ++i)
+      byte(static_cast<uint8_t>(value >> (8 * i)));
+  }
+  void patch32(size_t at, int32_t value) {
+    for (int i = 0; i < 4; ++i)
+      code[at + i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+
+  // [prefix] [REX] opcode ModRM [SIB] [disp32], with `r` in ModRM.reg
+  void emit(std::initializer_list<uint8_t> opcode, int r, Operand rm,
+            bool wide, uint8_t prefix = 0) {
+    if (prefix)
+      byte(prefix);
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((r >> 3) & 1) << 2 |
+                  ((rm.reg >> 3) & 1);
+    if (rex != 0x40)
+      byte(rex);
+    for (auto op : opcode)
+      byte(op);
+    if (!rm.memory) {
+      byte(0xC0 | (r & 7) << 3 | (rm.reg & 7));
+      return;
+    }
+    byte(0x80 | (r & 7) << 3 | (rm.reg & 7));
+    if ((rm.reg & 7) == RSP)
+      byte(0x24); // SIB with no index
+    imm32(rm.disp);
+  }
+
+  void mov_store(Operand dst, int src, bool wide) {
+    emit({0x89}, src, dst, wide);
+  }
+  void mov_load(int dst, Operand src, bool wide) {
+    emit({0x8B}, dst, src, wide);
+  }
+  void store8(Operand dst, int src) { emit({0x88}, src, dst, false); }
+  void movzx8(int dst, Operand src) { emit({0x0F, 0xB6}, dst, src, false); }
+  void movsxd(int dst, Operand src) { emit({0x63}, dst, src, true); }
+  void lea(int dst, Operand src) { emit({0x8D}, dst, src, true); }
+  void alu(uint8_t opcode, int dst, Operand src, bool wide) {
+    emit({opcode}, dst, src, wide);
+  }
+  void imul(int dst, Operand src, bool wide) {
+    emit({0x0F, 0xAF}, dst, src, wide);
+  }
+  void idiv(Operand src) { emit({0xF7}, 7, src, false); }
+  void cdq() { byte(0x99); }
+  void setcc(uint8_t cc, int dst) { emit({0x0F, uint8_t(0x90 + cc)}, 0, reg(dst), false); }
+  void test32(int a, int b) { emit({0x85}, b, reg(a), false); }
+  void mov_imm32(int dst, int64_t value) {
+    if (dst >= 8)
+      byte(0x41);
+    byte(0xB8 + (dst & 7));
+    imm32(value);
+  }
+  void mov_imm64(int dst, int64_t value) {
+    byte(0x48 | ((dst >> 3) & 1));
+    byte(0xB8 + (dst & 7));
+    for (int i = 0; i < 8; ++i)
+      byte(static_cast<uint8_t>(value >> (8 * i)));
+  }
+  void add_imm32(int dst, int64_t value) {
+    emit({0x81}, 0, reg(dst), true);
+    imm32(value);
+  }
+
+  void movss_load(int dst, Operand src) {
+    emit({0x0F, 0x10}, dst, src, false, 0xF3);
+  }
+  void movss_store(Operand dst, int src) {
+    emit({0x0F, 0x11}, src, dst, false, 0xF3);
+  }
+  void sse(uint8_t opcode, int dst, Operand src) {
+    emit({0x0F, opcode}, dst, src, false, 0xF3);
+  }
+  void ucomiss(int a, Operand b) { emit({0x0F, 0x2E}, a, b, false); }
+  void movd_to_xmm(int dst, int src) {
+    emit({0x0F, 0x6E}, dst, reg(src), false, 0x66);
+  }
+
+  // rel32 jumps, the displacement is returned for patching
+  size_t jmp() {
+    byte(0xE9);
+    imm32(0);
+    return position() - 4;
+  }
+  size_t jcc(uint8_t cc) {
+    byte(0x0F);
+    byte(0x80 + cc);
+    imm32(0);
+    return position() - 4;
+  }
+  size_t call() {
+    byte(0xE8);
+    imm32(0);
+    return position() - 4;
+  }
+
+private:
+  std::vector<uint8_t> &code;
+};
+
+constexpr uint8_t ALU_ADD = 0x03;
+constexpr uint8_t ALU_SUB = 0x2B;
+constexpr uint8_t ALU_CMP = 0x3B;
+constexpr uint8_t SSE_ADD = 0x58;
+constexpr uint8_t SSE_MUL = 0x59;
+constexpr uint8_t SSE_CVTSS2SD = 0x5A;
+constexpr uint8_t SSE_SUB = 0x5C;
+constexpr uint8_t SSE_DIV = 0x5E;
+
+struct CallFixup {
+  size_t at;
+  std::string symbol;
+};
+
+class Emitter {
+public:
+  Emitter(ElfObject &object, uint32_t rodata_symbol)
+      : object(object), as(object.text), rodata_symbol(rodata_symbol) {}
+
+  void emit_function(const MachineFunction &fn, const Allocation &allocation);
+  void resolve_calls();
+
+private:
+  ElfObject &object;
+  Assembler as;
+  uint32_t rodata_symbol;
+  const MachineFunction *fn = nullptr;
+  const Allocation *allocation = nullptr;
+  std::unordered_map<std::string, size_t> function_offsets;
+  std::vector<CallFixup> call_fixups;
+
+  Operand loc(int vreg) const {
+    const auto &location = allocation->locations[vreg];
+    return location.in_register ? reg(location.reg)
+                                : mem(RBP, location.offset);
+  }
+  bool wide(int vreg) const { return fn->vregs[vreg] == ValueClass::Ptr; }
+  bool is_float(int vreg) const {
+    return fn->vregs[vreg] == ValueClass::Float;
+  }
+
+  // Moves between a vreg's home and a scratch register
+  void get(int scratch, int vreg) {
+    if (is_float(vreg)) {
+      as.movss_load(scratch, loc(vreg));
+    } else {
+      as.mov_load(scratch, loc(vreg), wide(vreg));
+    }
+  }
+  void put(int vreg, int scratch) {
+    if (is_float(vreg)) {
+      as.movss_store(loc(vreg), scratch);
+    } else {
+      as.mov_store(loc(vreg), scratch, wide(vreg));
+    }
+  }
+
+  void emit_inst(const Inst &inst, std::vector<size_t> &labels,
+                 std::vector<std::pair<size_t, int>> &jumps,
+                 std::vector<size_t> &returns);
+  void emit_compare(const Inst &inst);
+  void emit_call(const Inst &inst);
+  void emit_copy(const Inst &inst);
+};
+
+void Emitter::emit_compare(const Inst &inst) {
+  if (is_float(inst.a)) {
+    // ucomiss sets the flags like an unsigned compare, less-than is done by
+    // swapping the operands. Unordered (NaN) compares only satisfy !=.
+    bool swap = inst.cond == Cond::Lt || inst.cond == Cond::Le;
+    get(XMM_SCRATCH, swap ? inst.b : inst.a);
+    as.ucomiss(XMM_SCRATCH, loc(swap ? inst.a : inst.b));
+    switch (inst.cond) {
+    case Cond::Eq:
+      as.setcc(CC_E, RAX);
+      as.setcc(CC_NP, RCX);
+      as.emit({0x20}, RCX, reg(RAX), false); // and al, cl
+      break;
+    case Cond::Ne:
+      as.setcc(CC_NE, RAX);
+      as.setcc(CC_P, RCX);
+      as.emit({0x08}, RCX, reg(RAX), false); // or al, cl
+      break;
+    case Cond::Lt:
+    case Cond::Gt:
+      as.setcc(CC_A, RAX);
+      break;
+    case Cond::Le:
+    case Cond::Ge:
+      as.setcc(CC_AE, RAX);
+      break;
+    }
+  } else {
+    get(RAX, inst.a);
+    as.alu(ALU_CMP, RAX, loc(inst.b), wide(inst.a));
+    static const uint8_t codes[] = {CC_E, CC_NE, CC_L, CC_G, CC_LE, CC_GE};
+    as.setcc(codes[static_cast<int>(inst.cond)], RAX);
+  }
+  as.movzx8(RAX, reg(RAX));
+  put(inst.dst, RAX);
+}
+
+void Emitter::emit_call(const Inst &inst) {
+  const auto &site = fn->calls[inst.call];
+  size_t next_gpr = 0;
+  int next_xmm = 0;
+  for (int arg : site.args) {
+    if (is_float(arg)) {
+      as.movss_load(next_xmm, loc(arg));
+      if (site.promote_floats)
+        as.sse(SSE_CVTSS2SD, next_xmm, reg(next_xmm));
+      next_xmm++;
+      continue;
+    }
+    int target = ARG_GPRS[next_gpr++];
+    if (wide(arg)) {
+      as.mov_load(target, loc(arg), true);
+    } else {
+      // C callees may read the full 64 bit register (e.g. size_t)
+      as.movsxd(target, loc(arg));
+    }
+  }
+
+  call_fixups.push_back({as.call(), site.symbol});
+
+  if (inst.dst < 0)
+    return;
+  if (is_float(inst.dst)) {
+    as.movss_store(loc(inst.dst), 0);
+    return;
+  }
+  if (site.returns_bool)
+    as.movzx8(RAX, reg(RAX));
+  put(inst.dst, RAX);
+}
+
+void Emitter::emit_copy(const Inst &inst) {
+  as.mov_load(RDI, loc(inst.a), true);
+  as.mov_load(RSI, loc(inst.b), true);
+  int offset = 0;
+  for (; offset + 8 <= inst.imm; offset += 8) {
+    as.mov_load(RAX, mem(RSI, offset), true);
+    as.mov_store(mem(RDI, offset), RAX, true);
+  }
+  for (; offset + 4 <= inst.imm; offset += 4) {
+    as.mov_load(RAX, mem(RSI, offset), false);
+    as.mov_store(mem(RDI, offset), RAX, false);
+  }
+  for (; offset < inst.imm; ++offset) {
+    as.movzx8(RAX, mem(RSI, offset));
+    as.store8(mem(RDI, offset), RAX);
+  }
+}
+
+void Emitter::emit_inst(const Inst &inst, std::vector<size_t> &labels,
+                        std::vector<std::pair<size_t, int>> &jumps,
+                        std::vector<size_t> &returns) {
+  switch (inst.op) {
+  case Op::Imm:
+    if (is_float(inst.dst)) {
+      as.mov_imm32(RAX, inst.imm);
+      as.movd_to_xmm(XMM_SCRATCH, RAX);
+      put(inst.dst, XMM_SCRATCH);
+    } else {
+      if (wide(inst.dst))
+        as.mov_imm64(RAX, inst.imm);
+      else
+        as.mov_imm32(RAX, inst.imm);
+      put(inst.dst, RAX);
+    }
+    break;
+  case Op::Mov:
+    if (is_float(inst.dst)) {
+      get(XMM_SCRATCH, inst.a);
+      put(inst.dst, XMM_SCRATCH);
+    } else if (!loc(inst.dst).memory) {
+      as.mov_load(loc(inst.dst).reg, loc(inst.a), wide(inst.dst));
+    } else if (!loc(inst.a).memory) {
+      as.mov_store(loc(inst.dst), loc(inst.a).reg, wide(inst.dst));
+    } else {
+      get(RAX, inst.a);
+      put(inst.dst, RAX);
+    }
+    break;
+  case Op::Add:
+  case Op::Sub:
+  case Op::Mul:
+    if (is_float(inst.dst)) {
+      static const uint8_t ops[] = {SSE_ADD, SSE_SUB, SSE_MUL};
+      get(XMM_SCRATCH, inst.a);
+      as.sse(ops[static_cast<int>(inst.op) - static_cast<int>(Op::Add)],
+             XMM_SCRATCH, loc(inst.b));
+      put(inst.dst, XMM_SCRATCH);
+    } else {
+      get(RAX, inst.a);
+      if (inst.op == Op::Mul)
+        as.imul(RAX, loc(inst.b), wide(inst.dst));
+      else
+        as.alu(inst.op == Op::Add ? ALU_ADD : ALU_SUB, RAX, loc(inst.b),
+               wide(inst.dst));
+      put(inst.dst, RAX);
+    }
+    break;
+  case Op::Div:
+  case Op::Mod:
+    if (is_float(inst.dst)) {
+      get(XMM_SCRATCH, inst.a);
+      as.sse(SSE_DIV, XMM_SCRATCH, loc(inst.b));
+      put(inst.dst, XMM_SCRATCH);
+    } else {
+      get(RAX, inst.a);
+      as.cdq();
+      as.idiv(loc(inst.b));
+      put(inst.dst, inst.op == Op::Div ? RAX : RDX);
+    }
+    break;
+  case Op::Cmp:
+    emit_compare(inst);
+    break;
+  case Op::AddImm:
+    get(RAX, inst.a);
+    as.add_imm32(RAX, inst.imm);
+    put(inst.dst, RAX);
+    break;
+  case Op::AddIndex:
+    as.movsxd(RCX, loc(inst.b));
+    as.mov_imm32(RDX, inst.imm);
+    as.imul(RCX, reg(RDX), true);
+    get(RAX, inst.a);
+    as.alu(ALU_ADD, RAX, reg(RCX), true);
+    put(inst.dst, RAX);
+    break;
+  case Op::SlotAddr:
+    as.lea(RAX, mem(RBP, static_cast<int32_t>(inst.imm)));
+    put(inst.dst, RAX);
+    break;
+  case Op::RodataAddr:
+    // lea rax, [rip + disp32]
+    as.byte(0x48);
+    as.byte(0x8D);
+    as.byte(0x05);
+    object.relocations.push_back(
+        {as.position(), rodata_symbol, R_X86_64_PC32, inst.imm - 4});
+    as.imm32(0);
+    put(inst.dst, RAX);
+    break;
+  case Op::Load:
+    get(RAX, inst.a);
+    if (is_float(inst.dst)) {
+      as.movss_load(XMM_SCRATCH, mem(RAX, inst.imm));
+      put(inst.dst, XMM_SCRATCH);
+      break;
+    }
+    if (inst.width == 1)
+      as.movzx8(RCX, mem(RAX, inst.imm));
+    else
+      as.mov_load(RCX, mem(RAX, inst.imm), inst.width == 8);
+    put(inst.dst, RCX);
+    break;
+  case Op::Store:
+    get(RAX, inst.a);
+    if (is_float(inst.b)) {
+      get(XMM_SCRATCH, inst.b);
+      as.movss_store(mem(RAX, inst.imm), XMM_SCRATCH);
+      break;
+    }
+    get(RCX, inst.b);
+    if (inst.width == 1)
+      as.store8(mem(RAX, inst.imm), RCX);
+    else
+      as.mov_store(mem(RAX, inst.imm), RCX, inst.width == 8);
+    break;
+  case Op::Copy:
+    emit_copy(inst);
+    break;
+  case Op::Call:
+    emit_call(inst);
+    break;
+  case Op::Label:
+    labels[inst.imm] = as.position();
+    break;
+  case Op::Jump:
+    jumps.emplace_back(as.jmp(), inst.imm);
+    break;
+  case Op::JumpIfZero:
+    get(RAX, inst.a);
+    as.test32(RAX, RAX);
+    jumps.emplace_back(as.jcc(CC_E), inst.imm);
+    break;
+  case Op::Return:
+    if (inst.a >= 0)
+      get(is_float(inst.a) ? 0 : RAX, inst.a);
+    returns.push_back(as.jmp());
+    break;
+  }
+}
+
+void Emitter::emit_function(const MachineFunction &machine_fn,
+                            const Allocation &alloc) {
+  fn = &machine_fn;
+  allocation = &alloc;
+  while (as.position() % 16 != 0)
+    as.byte(0x90);
+  size_t start = as.position();
+  function_offsets[fn->name] = start;
+
+  // Frame: [rbp - frame_size, rbp) holds slots and spills, callee saved
+  // registers go below that. rsp stays 16 byte aligned for calls.
+  int save_area = static_cast<int>(alloc.used_callee_saved.size()) * 8;
+  int frame = (fn->frame_size + save_area + 15) / 16 * 16;
+  as.byte(0x55);                                 // push rbp
+  as.byte(0x48), as.byte(0x89), as.byte(0xE5);   // mov rbp, rsp
+  if (frame > 0) {
+    as.byte(0x48), as.byte(0x81), as.byte(0xEC); // sub rsp, imm32
+    as.imm32(frame);
+  }
+  for (size_t i = 0; i < alloc.used_callee_saved.size(); ++i) {
+    as.mov_store(mem(RBP, -fn->frame_size - 8 * static_cast<int>(i + 1)),
+                 alloc.used_callee_saved[i], true);
+  }
+
+  size_t next_gpr = 0;
+  int next_xmm = 0;
+  for (int param : fn->params) {
+    // Parameters that are never read have no location
+    bool used = alloc.locations[param].in_register ||
+                alloc.locations[param].offset != 0;
+    if (is_float(param)) {
+      if (used)
+        as.movss_store(loc(param), next_xmm);
+      next_xmm++;
+    } else {
+      if (used)
+        as.mov_store(loc(param), ARG_GPRS[next_gpr], true);
+      next_gpr++;
+    }
+  }
+
+  std::vector<size_t> labels(fn->label_count, 0);
+  std::vector<std::pair<size_t, int>> jumps;
+  std::vector<size_t> returns;
+  for (const auto &inst : fn->insts) {
+    emit_inst(inst, labels, jumps, returns);
+  }
+
+  // Falling off the end returns 0, which is what main needs
+  as.emit({0x31}, RAX, reg(RAX), false); // xor eax, eax
+  size_t epilogue = as.position();
+  for (size_t i = 0; i < alloc.used_callee_saved.size(); ++i) {
+    as.mov_load(alloc.used_callee_saved[i],
+                mem(RBP, -fn->frame_size - 8 * static_cast<int>(i + 1)), true);
+  }
+  as.byte(0xC9); // leave
+  as.byte(0xC3); // ret
+
+  for (const auto &[at, label] : jumps) {
+    as.patch32(at, static_cast<int32_t>(labels[label] - (at + 4)));
+  }
+  for (auto at : returns) {
+    as.patch32(at, static_cast<int32_t>(epilogue - (at + 4)));
+  }
+
+  bool is_main = fn->name == "main";
+  object.symbols.push_back(ElfSymbol{fn->name, ElfSection::Text, start,
+                                     as.position() - start, is_main, true});
+}
+
+// Calls between Enki functions are resolved directly, everything else (the
+// runtime and externs) becomes a relocation for the linker
+void Emitter::resolve_calls() {
+  for (const auto &fixup : call_fixups) {
+    auto target = function_offsets.find(fixup.symbol);
+    if (target != function_offsets.end()) {
+      as.patch32(fixup.at,
+                 static_cast<int32_t>(target->second - (fixup.at + 4)));
+      continue;
+    }
+    object.relocations.push_back(
+        {fixup.at, object.symbol(fixup.symbol), R_X86_64_PLT32, -4});
+  }
+}
+
+} // namespace
+
+ElfObject codegen_native(Ref<Program> program) {
+  spdlog::debug("[codegen_native] Starting code generation for program");
+  ProgramInfo info;
+  info.source = program->source_buffer.get();
+
+  std::vector<Ref<FunctionDefinition>> functions;
+  for (const auto &stmt : program->body->statements) {
+    switch (stmt->get_type()) {
+    case ASTType::FunctionDefinition: {
+      auto func_def = std::static_pointer_cast<FunctionDefinition>(stmt);
+      if (func_def->body)
+        functions.push_back(func_def);
+      break;
+    }
+    case ASTType::EnumDefinition: {
+      auto enum_def = std::static_pointer_cast<EnumDefinition>(stmt);
+      auto &members = info.enums[enum_def->identifier->name];
+      for (const auto &member : enum_def->members)
+        members.push_back(member->name);
+      if (enum_def->to_string_function)
+        functions.push_back(enum_def->to_string_function);
+      break;
+    }
+    case ASTType::StructDefinition: {
+      auto struct_def = std::static_pointer_cast<StructDefinition>(stmt);
+      if (auto struct_type = resolved_struct(program, struct_def))
+        info.structs[struct_def->identifier->name] = struct_type;
+      break;
+    }
+    case ASTType::Extern: {
+      auto ext = std::static_pointer_cast<Extern>(stmt);
+      info.externs[ext->identifier->name] = ext;
+      break;
+    }
+    case ASTType::Import:
+      break;
+    default:
+      LOG_ERROR_EXIT("[codegen_native] Top level statements are not supported "
+                     "by the native backend",
+                     stmt->span, *program->source_buffer);
+    }
+  }
+  for (const auto &func_def : functions)
+    info.functions[func_def->identifier->name] = func_def;
+
+  std::vector<MachineFunction> machine_functions(functions.size());
+  for (size_t i = 0; i < functions.size(); ++i) {
+    Lowering lowering(info, machine_functions[i]);
+    lowering.lower_function(functions[i]);
+  }
+
+  ElfObject object;
+  uint32_t rodata_symbol = object.rodata_symbol();
+  Emitter emitter(object, rodata_symbol);
+  for (auto &machine_fn : machine_functions) {
+    auto allocation = allocate_registers(machine_fn);
+    spdlog::debug("[codegen_native] {}: {} vregs, {} bytes of frame",
+                  machine_fn.name, machine_fn.vregs.size(),
+                  machine_fn.frame_size);
+    emitter.emit_function(machine_fn, allocation);
+  }
+  emitter.resolve_calls();
+  object.rodata = std::move(info.rodata);
+
+  spdlog::debug("[codegen_native] Code generation completed");
+  return object;
+}
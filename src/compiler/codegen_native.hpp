@@ -0,0 +1,10 @@
+#pragma once
+
+#include "../definitions/ast.hpp"
+#include "../definitions/types.hpp"
+#include "elf_writer.hpp"
+
+// Lowers the typechecked program straight to x86-64 machine code (System V
+// ABI) and returns it as a relocatable ELF object. Calls to print and friends
+// go to the C runtime in src/runtime, which has to be linked in.
+ElfObject codegen_native(Ref<Program> program);
@@ -0,0 +1,246 @@
+#include "elf_writer.hpp"
+#include <fstream>
+#include <spdlog/spdlog.h>
+
+// Section indices in the emitted object, the order is fixed
+enum SectionIndex : uint16_t {
+  SHN_TEXT = 1,
+  SHN_RODATA,
+  SHN_NOTE_STACK,
+  SHN_SYMTAB,
+  SHN_STRTAB,
+  SHN_RELA_TEXT,
+  SHN_SHSTRTAB,
+  SECTION_COUNT,
+};
+
+constexpr uint32_t SHT_PROGBITS = 1;
+constexpr uint32_t SHT_SYMTAB = 2;
+constexpr uint32_t SHT_STRTAB = 3;
+constexpr uint32_t SHT_RELA = 4;
+constexpr uint64_t SHF_ALLOC = 0x2;
+constexpr uint64_t SHF_EXECINSTR = 0x4;
+constexpr uint64_t SHF_INFO_LINK = 0x40;
+
+constexpr uint8_t STB_LOCAL = 0;
+constexpr uint8_t STB_GLOBAL = 1;
+constexpr uint8_t STT_NOTYPE = 0;
+constexpr uint8_t STT_FUNC = 2;
+constexpr uint8_t STT_SECTION = 3;
+
+namespace {
+
+struct ByteWriter {
+  std::vector<uint8_t> bytes;
+
+  void u8(uint8_t value) { bytes.push_back(value); }
+  void u16(uint16_t value) { le(value, 2); }
+  void u32(uint32_t value) { le(value, 4); }
+  void u64(uint64_t value) { le(value, 8); }
+  void le(uint64_t value, int size) {
+    for (int i = 0; i < size; ++i) {
+      bytes.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+  }
+  void append(const std::vector<uint8_t> &data) {
+    bytes.insert(bytes.end(), data.begin(), data.end());
+  }
+  void align(size_t alignment) {
+    while (bytes.size() % alignment != 0) {
+      bytes.push_back(0);
+    }
+  }
+};
+
+struct StringTable {
+  std::vector<uint8_t> bytes{0};
+
+  uint32_t add(const std::string &name) {
+    if (name.empty()) {
+      return 0;
+    }
+    auto offset = static_cast<uint32_t>(bytes.size());
+    bytes.insert(bytes.end(), name.begin(), name.end());
+    bytes.push_back(0);
+    return offset;
+  }
+};
+
+struct SectionHeader {
+  uint32_t name = 0;
+  uint32_t type = 0;
+  uint64_t flags = 0;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  uint32_t link = 0;
+  uint32_t info = 0;
+  uint64_t alignment = 1;
+  uint64_t entry_size = 0;
+};
+
+uint16_t section_index(ElfSection section) {
+  switch (section) {
+  case ElfSection::Text:
+    return SHN_TEXT;
+  case ElfSection::Rodata:
+    return SHN_RODATA;
+  case ElfSection::Undefined:
+    break;
+  }
+  return 0;
+}
+
+} // namespace
+
+uint32_t ElfObject::symbol(const std::string &name) {
+  for (uint32_t i = 0; i < symbols.size(); ++i) {
+    if (symbols[i].name == name) {
+      return i;
+    }
+  }
+  symbols.push_back(ElfSymbol{name, ElfSection::Undefined, 0, 0, true, false});
+  return static_cast<uint32_t>(symbols.size() - 1);
+}
+
+uint32_t ElfObject::rodata_symbol() {
+  for (uint32_t i = 0; i < symbols.size(); ++i) {
+    if (symbols[i].name.empty() && symbols[i].section == ElfSection::Rodata) {
+      return i;
+    }
+  }
+  symbols.push_back(ElfSymbol{"", ElfSection::Rodata, 0, 0, false, false});
+  return static_cast<uint32_t>(symbols.size() - 1);
+}
+
+std::vector<uint8_t> ElfObject::serialize() const {
+  // ELF requires local symbols to precede global ones, so symbols are
+  // reordered and relocations remapped to the final indices
+  std::vector<uint32_t> order;
+  for (uint32_t i = 0; i < symbols.size(); ++i) {
+    if (!symbols[i].global)
+      order.push_back(i);
+  }
+  auto first_global = static_cast<uint32_t>(order.size() + 1);
+  for (uint32_t i = 0; i < symbols.size(); ++i) {
+    if (symbols[i].global)
+      order.push_back(i);
+  }
+  std::vector<uint32_t> final_index(symbols.size());
+  for (uint32_t i = 0; i < order.size(); ++i) {
+    final_index[order[i]] = i + 1;
+  }
+
+  StringTable strtab;
+  ByteWriter symtab;
+  symtab.bytes.resize(24, 0); // Null symbol
+  for (auto index : order) {
+    const auto &sym = symbols[index];
+    bool is_section = sym.name.empty();
+    uint8_t type = is_section ? STT_SECTION
+                              : (sym.function ? STT_FUNC : STT_NOTYPE);
+    symtab.u32(strtab.add(sym.name));
+    symtab.u8(static_cast<uint8_t>(
+        ((sym.global ? STB_GLOBAL : STB_LOCAL) << 4) | type));
+    symtab.u8(0);
+    symtab.u16(section_index(sym.section));
+    symtab.u64(sym.value);
+    symtab.u64(sym.size);
+  }
+
+  ByteWriter rela;
+  for (const auto &reloc : relocations) {
+    rela.u64(reloc.offset);
+    rela.u64((static_cast<uint64_t>(final_index[reloc.symbol]) << 32) |
+             reloc.type);
+    rela.u64(static_cast<uint64_t>(reloc.addend));
+  }
+
+  StringTable shstrtab;
+  SectionHeader headers[SECTION_COUNT];
+  headers[SHN_TEXT] = {shstrtab.add(".text"), SHT_PROGBITS,
+                       SHF_ALLOC | SHF_EXECINSTR};
+  headers[SHN_TEXT].alignment = 16;
+  headers[SHN_RODATA] = {shstrtab.add(".rodata"), SHT_PROGBITS, SHF_ALLOC};
+  headers[SHN_RODATA].alignment = 8;
+  // Marks the stack as non-executable for the linker
+  headers[SHN_NOTE_STACK] = {shstrtab.add(".note.GNU-stack"), SHT_PROGBITS};
+  headers[SHN_SYMTAB] = {shstrtab.add(".symtab"), SHT_SYMTAB};
+  headers[SHN_SYMTAB].link = SHN_STRTAB;
+  headers[SHN_SYMTAB].info = first_global;
+  headers[SHN_SYMTAB].alignment = 8;
+  headers[SHN_SYMTAB].entry_size = 24;
+  headers[SHN_STRTAB] = {shstrtab.add(".strtab"), SHT_STRTAB};
+  headers[SHN_RELA_TEXT] = {shstrtab.add(".rela.text"), SHT_RELA,
+                            SHF_INFO_LINK};
+  headers[SHN_RELA_TEXT].link = SHN_SYMTAB;
+  headers[SHN_RELA_TEXT].info = SHN_TEXT;
+  headers[SHN_RELA_TEXT].alignment = 8;
+  headers[SHN_RELA_TEXT].entry_size = 24;
+  headers[SHN_SHSTRTAB] = {shstrtab.add(".shstrtab"), SHT_STRTAB};
+
+  // Section contents follow the 64 byte ELF header
+  ByteWriter body;
+  body.bytes.resize(64, 0);
+  auto place = [&](SectionIndex index, const std::vector<uint8_t> &data) {
+    body.align(headers[index].alignment);
+    headers[index].offset = body.bytes.size();
+    headers[index].size = data.size();
+    body.append(data);
+  };
+  place(SHN_TEXT, text);
+  place(SHN_RODATA, rodata);
+  place(SHN_NOTE_STACK, {});
+  place(SHN_SYMTAB, symtab.bytes);
+  place(SHN_STRTAB, strtab.bytes);
+  place(SHN_RELA_TEXT, rela.bytes);
+  place(SHN_SHSTRTAB, shstrtab.bytes);
+  body.align(8);
+  uint64_t section_headers_offset = body.bytes.size();
+
+  for (const auto &header : headers) {
+    body.u32(header.name);
+    body.u32(header.type);
+    body.u64(header.flags);
+    body.u64(0); // sh_addr
+    body.u64(header.offset);
+    body.u64(header.size);
+    body.u32(header.link);
+    body.u32(header.info);
+    body.u64(header.alignment);
+    body.u64(header.entry_size);
+  }
+
+  ByteWriter elf_header;
+  elf_header.append({0x7f, 'E', 'L', 'F', 2 /* 64 bit */, 1 /* LE */,
+                     1 /* version */, 0 /* SysV ABI */});
+  elf_header.bytes.resize(16, 0);
+  elf_header.u16(1);  // ET_REL
+  elf_header.u16(62); // EM_X86_64
+  elf_header.u32(1);  // EV_CURRENT
+  elf_header.u64(0);  // e_entry
+  elf_header.u64(0);  // e_phoff
+  elf_header.u64(section_headers_offset);
+  elf_header.u32(0);  // e_flags
+  elf_header.u16(64); // e_ehsize
+  elf_header.u16(0);  // e_phentsize
+  elf_header.u16(0);  // e_phnum
+  elf_header.u16(64); // e_shentsize
+  elf_header.u16(SECTION_COUNT);
+  elf_header.u16(SHN_SHSTRTAB);
+  std::copy(elf_header.bytes.begin(), elf_header.bytes.end(),
+            body.bytes.begin());
+
+  return body.bytes;
+}
+
+bool write_elf_object(const ElfObject &object, const std::string &path) {
+  auto bytes = object.serialize();
+  std::ofstream output(path, std::ios::binary);
+  if (!output.is_open()) {
+    spdlog::error("[elf] Could not open object file: {}", path);
+    return false;
+  }
+  output.write(reinterpret_cast<const char *>(bytes.data()),
+               static_cast<std::streamsize>(bytes.size()));
+  return output.good();
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Minimal ELF64 relocatable object (ET_REL) for x86-64, holding a .text and a
+// .rodata section. Only what the native backend needs: function symbols,
+// undefined symbols for externs/runtime calls and PC-relative relocations.
+
+enum class ElfSection { Undefined, Text, Rodata };
+
+struct ElfSymbol {
+  std::string name;
+  ElfSection section = ElfSection::Undefined;
+  uint64_t value = 0;
+  uint64_t size = 0;
+  bool global = false;
+  bool function = false;
+};
+
+struct ElfRelocation {
+  uint64_t offset; // Offset into .text
+  uint32_t symbol; // Index into ElfObject::symbols
+  uint32_t type;
+  int64_t addend;
+};
+
+// x86-64 relocation types used by the backend
+constexpr uint32_t R_X86_64_PC32 = 2;
+constexpr uint32_t R_X86_64_PLT32 = 4;
+
+struct ElfObject {
+  std::vector<uint8_t> text;
+  std::vector<uint8_t> rodata;
+  std::vector<ElfSymbol> symbols;
+  std::vector<ElfRelocation> relocations;
+
+  // Returns the index of the symbol with the given name, adding an undefined
+  // global symbol if it doesn't exist yet
+  uint32_t symbol(const std::string &name);
+  // Index of the section symbol for .rodata, used for string constants
+  uint32_t rodata_symbol();
+
+  std::vector<uint8_t> serialize() const;
+};
+
+bool write_elf_object(const ElfObject &object, const std::string &path);
@@ -0,0 +1,601 @@
+#include "incremental.hpp"
+#include "../utils/hash.hpp"
+#include "codegen_c.hpp"
+#include "injections.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "tailcalls.hpp"
+#include "typecheck.hpp"
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <set>
+#include <span>
+#include <spdlog/spdlog.h>
+#include <unordered_map>
+#include <unordered_set>
+
+using json = nlohmann::json;
+
+namespace {
+
+// Bumped whenever the layout of the units or the state changes
+constexpr uint64_t state_version = 2;
+
+constexpr const char *header_name = "program.h";
+
+enum class DeclarationKind { Function, Type, Extern, Global };
+
+// What other declarations see of a top level declaration
+struct Declaration {
+  DeclarationKind kind;
+  uint64_t signature = 0;
+  std::set<std::string> signature_references;
+};
+
+// A translation unit and what it was generated from
+struct Unit {
+  std::string stem; // Name of the unit's files in the build directory
+  std::string name; // Name reported by --explain-rebuild
+  uint64_t signature = 0;
+  uint64_t body = 0;
+  std::set<std::string> references;
+  // Null for the unit of the top level statements and those of modules
+  Ref<Statement> statement;
+  std::string module; // Path of the imported module the unit is built from
+};
+
+struct Fingerprints {
+  std::map<std::string, Declaration> declarations;
+  std::vector<Unit> units;
+};
+
+// A unit as the previous build left it
+struct BuiltUnit {
+  std::string name;
+  uint64_t signature = 0;
+  uint64_t body = 0;
+  std::set<std::string> references;
+};
+
+struct State {
+  uint64_t compiler = 0;
+  std::map<std::string, uint64_t> interfaces;
+  std::map<std::string, BuiltUnit> units;
+};
+
+uint64_t hash_tokens(uint64_t hash, std::span<const Token> tokens) {
+  for (const auto &token : tokens) {
+    hash = hash::fnv1a(hash, static_cast<uint64_t>(token.type));
+    hash = hash::fnv1a(hash, token.value);
+  }
+  return hash;
+}
+
+// The tokens a top level statement was parsed from
+std::span<const Token> tokens_of(const std::vector<Token> &tokens,
+                                 const Ref<Statement> &stmt) {
+  auto first = std::lower_bound(
+      tokens.begin(), tokens.end(), stmt->span.start.pos,
+      [](const Token &token, int pos) { return token.span.start.pos < pos; });
+  auto last = std::lower_bound(
+      first, tokens.end(), stmt->span.end.pos,
+      [](const Token &token, int pos) { return token.span.start.pos < pos; });
+  return {first, last};
+}
+
+DeclarationKind kind_of(const Ref<Statement> &stmt) {
+  switch (stmt->get_type()) {
+  case ASTType::FunctionDefinition:
+    return DeclarationKind::Function;
+  case ASTType::StructDefinition:
+  case ASTType::EnumDefinition:
+    return DeclarationKind::Type;
+  case ASTType::Extern:
+    return DeclarationKind::Extern;
+  default:
+    return DeclarationKind::Global;
+  }
+}
+
+// Names of the top level declarations among the identifiers of the tokens.
+// Calls to the to_string function injected for an enum name the enum.
+std::set<std::string>
+references_in(std::span<const Token> tokens,
+              const std::map<std::string, Declaration> &declarations,
+              std::string_view self) {
+  std::set<std::string> references;
+  for (const auto &token : tokens) {
+    if (token.type != TokenType::Identifier || token.value == self)
+      continue;
+    std::string name(token.value);
+    if (!declarations.contains(name) && name.ends_with("_to_string")) {
+      name.resize(name.size() - std::string_view("_to_string").size());
+    }
+    if (declarations.contains(name) && name != self) {
+      references.insert(name);
+    }
+  }
+  return references;
+}
+
+// Files of the unit of an imported module, named after its path
+std::string module_stem(const std::string &path) {
+  std::string stem = "module_";
+  for (char c : path) {
+    stem += std::isalnum(static_cast<unsigned char>(c)) ? c : '_';
+  }
+  return stem;
+}
+
+// Everything but a function's body is its signature, annotations included
+std::pair<std::span<const Token>, std::span<const Token>>
+split(const Ref<Statement> &stmt, std::span<const Token> tokens) {
+  if (stmt->get_type() != ASTType::FunctionDefinition)
+    return {tokens, {}};
+  auto body = std::find_if(tokens.begin(), tokens.end(), [](const Token &t) {
+    return t.type == TokenType::LCurly;
+  });
+  auto at = static_cast<size_t>(body - tokens.begin());
+  return {tokens.first(at), tokens.subspan(at)};
+}
+
+Declaration declaration_of(const Ref<Statement> &stmt,
+                           std::span<const Token> tokens) {
+  Declaration declaration{kind_of(stmt)};
+  declaration.signature = hash_tokens(
+      hash::fnv1a(hash::fnv_offset, static_cast<uint64_t>(declaration.kind)),
+      split(stmt, tokens).first);
+  if (stmt->get_type() == ASTType::FunctionDefinition) {
+    for (auto annotation :
+         std::static_pointer_cast<FunctionDefinition>(stmt)->annotations) {
+      declaration.signature = hash::fnv1a(declaration.signature, annotation);
+    }
+  }
+  return declaration;
+}
+
+Fingerprints fingerprint(const Ref<Program> &program,
+                         const std::vector<Token> &tokens,
+                         ModuleContext &module_context,
+                         const std::vector<std::string> &imported) {
+  Fingerprints result;
+  using Tokens = std::pair<Ref<Statement>, std::span<const Token>>;
+
+  // The declarations of an imported module are fingerprinted from its source
+  // one at a time, like the program's own, so that only the units using one
+  // that changed are rebuilt. The unit of the module itself is keyed by the
+  // module, which changes with its source and with the modules it imports.
+  std::vector<Unit> module_units;
+  std::vector<std::vector<Token>> module_tokens;
+  module_tokens.reserve(imported.size());
+  std::vector<Tokens> module_statements;
+  for (const auto &path : imported) {
+    module_units.push_back({module_stem(path), path, 0,
+                            module_context.keys.at(path), {}, nullptr, path});
+    module_tokens.push_back(
+        lex(*module_context.modules.at(path)->source_buffer, path));
+    for (const auto &stmt : module_context.declarations(path)) {
+      auto stmt_tokens = tokens_of(module_tokens.back(), stmt);
+      if (!stmt_tokens.empty()) {
+        module_statements.emplace_back(stmt, stmt_tokens);
+      }
+    }
+  }
+
+  // Injected builtins have no tokens and nothing to rebuild
+  std::vector<Tokens> statements;
+  for (const auto &stmt : program->body->statements) {
+    auto stmt_tokens = tokens_of(tokens, stmt);
+    if (!stmt_tokens.empty()) {
+      statements.emplace_back(stmt, stmt_tokens);
+    }
+  }
+
+  // The program's declarations shadow those of its modules
+  for (const auto *list : {&module_statements, &statements}) {
+    for (const auto &[stmt, stmt_tokens] : *list) {
+      auto name = declared_name(stmt);
+      if (!name.empty()) {
+        result.declarations[std::string(name)] =
+            declaration_of(stmt, stmt_tokens);
+      }
+    }
+  }
+
+  // The top level statements of the modules run with the program's
+  uint64_t module_globals = hash::fnv_offset;
+  std::set<std::string> module_globals_references;
+  for (const auto &[stmt, stmt_tokens] : module_statements) {
+    auto name = declared_name(stmt);
+    if (!name.empty()) {
+      result.declarations[std::string(name)].signature_references =
+          references_in(split(stmt, stmt_tokens).first, result.declarations,
+                        name);
+    }
+    if (kind_of(stmt) == DeclarationKind::Global) {
+      module_globals = hash_tokens(module_globals, stmt_tokens);
+      auto references = references_in(stmt_tokens, result.declarations, name);
+      module_globals_references.insert(references.begin(), references.end());
+    }
+  }
+
+  Unit globals{"globals", "globals", 0, hash::fnv_offset};
+  for (const auto &[stmt, stmt_tokens] : statements) {
+    auto name = declared_name(stmt);
+    auto [signature, body] = split(stmt, stmt_tokens);
+    if (!name.empty()) {
+      result.declarations[std::string(name)].signature_references =
+          references_in(signature, result.declarations, name);
+    }
+    auto references = references_in(stmt_tokens, result.declarations, name);
+
+    switch (stmt->get_type()) {
+    case ASTType::FunctionDefinition:
+      if (!std::static_pointer_cast<FunctionDefinition>(stmt)->body)
+        break;
+      result.units.push_back({"fn_" + std::string(name), std::string(name),
+                              result.declarations[std::string(name)].signature,
+                              hash_tokens(hash::fnv_offset, body), references,
+                              stmt});
+      break;
+    case ASTType::EnumDefinition:
+      result.units.push_back({"enum_" + std::string(name),
+                              std::string(name) + "_to_string",
+                              result.declarations[std::string(name)].signature,
+                              0, references, stmt});
+      break;
+    case ASTType::StructDefinition:
+    case ASTType::Extern:
+    case ASTType::Import: // The units of the modules
+      break;
+    default:
+      globals.body = hash_tokens(globals.body, stmt_tokens);
+      globals.references.insert(references.begin(), references.end());
+      break;
+    }
+  }
+  if (module_globals != hash::fnv_offset) {
+    globals.body = hash::fnv1a(globals.body, module_globals);
+    globals.references.insert(module_globals_references.begin(),
+                              module_globals_references.end());
+  }
+  // Always built, it defines the enki_init_globals main calls
+  result.units.push_back(std::move(globals));
+  result.units.insert(result.units.end(), module_units.begin(),
+                      module_units.end());
+  return result;
+}
+
+// The signature of a declaration together with the interfaces of the
+// declarations its signature names. Declarations naming each other through
+// pointers stop at the one the cycle started from.
+uint64_t interface_of(const std::string &name, const Fingerprints &current,
+                      std::map<std::string, uint64_t> &interfaces,
+                      std::set<std::string> &visiting) {
+  if (auto known = interfaces.find(name); known != interfaces.end())
+    return known->second;
+  const auto &declaration = current.declarations.at(name);
+  if (!visiting.insert(name).second)
+    return declaration.signature;
+  uint64_t interface = declaration.signature;
+  for (const auto &reference : declaration.signature_references) {
+    interface = hash::fnv1a(hash::fnv1a(interface, reference),
+                            interface_of(reference, current, interfaces,
+                                         visiting));
+  }
+  visiting.erase(name);
+  interfaces[name] = interface;
+  return interface;
+}
+
+uint64_t compiler_key(const IncrementalOptions &options) {
+  uint64_t key = hash::fnv1a(hash::executable_key(), state_version);
+  key = hash::fnv1a(key, static_cast<uint64_t>(options.opt_level));
+  return hash::fnv1a(key, options.runtime_dir);
+}
+
+std::optional<State> load_state(const std::filesystem::path &path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    return std::nullopt;
+  }
+  try {
+    auto j = json::parse(file);
+    State state;
+    state.compiler = j.at("compiler").get<uint64_t>();
+    state.interfaces =
+        j.at("interfaces").get<std::map<std::string, uint64_t>>();
+    for (const auto &[stem, unit] : j.at("units").items()) {
+      state.units[stem] = {unit.at("name").get<std::string>(),
+                           unit.at("signature").get<uint64_t>(),
+                           unit.at("body").get<uint64_t>(),
+                           unit.at("references").get<std::set<std::string>>()};
+    }
+    return state;
+  } catch (const std::exception &error) {
+    spdlog::warn("[incremental] Ignoring unreadable {}: {}", path.string(),
+                 error.what());
+    return std::nullopt;
+  }
+}
+
+void save_state(const std::filesystem::path &path, const State &state) {
+  json j;
+  j["compiler"] = state.compiler;
+  j["interfaces"] = state.interfaces;
+  j["units"] = json::object();
+  for (const auto &[stem, unit] : state.units) {
+    j["units"][stem] = {{"name", unit.name},
+                        {"signature", unit.signature},
+                        {"body", unit.body},
+                        {"references", unit.references}};
+  }
+  std::ofstream file(path, std::ios::trunc);
+  if (!file.is_open()) {
+    spdlog::warn("[incremental] Could not write {}", path.string());
+    return;
+  }
+  file << j.dump(2) << std::endl;
+}
+
+// Why the unit has to be built again, nullopt when its object can be reused
+std::optional<std::string>
+rebuild_reason(const Unit &unit, const std::optional<State> &previous,
+               uint64_t compiler, const Fingerprints &current,
+               const std::map<std::string, uint64_t> &interfaces,
+               const std::filesystem::path &object) {
+  if (!previous) {
+    return "no previous build";
+  }
+  if (previous->compiler != compiler) {
+    return "compiler or options changed";
+  }
+  auto built = previous->units.find(unit.stem);
+  if (built == previous->units.end()) {
+    return "new";
+  }
+  if (!std::filesystem::exists(object)) {
+    return "object missing";
+  }
+  if (built->second.signature != unit.signature) {
+    // The unit of an enum is built from all of it
+    return unit.statement->get_type() == ASTType::EnumDefinition
+               ? "definition changed"
+               : "signature changed";
+  }
+  if (built->second.body != unit.body) {
+    if (!unit.module.empty())
+      return "module changed";
+    return unit.statement ? "body changed" : "top level statements changed";
+  }
+
+  // Names the unit used before but no longer does are checked as well, one
+  // may have been shadowing a declaration that went away
+  auto references = unit.references;
+  references.insert(built->second.references.begin(),
+                    built->second.references.end());
+  for (const auto &reference : references) {
+    auto now = interfaces.find(reference);
+    auto before = previous->interfaces.find(reference);
+    if (now == interfaces.end() && before == previous->interfaces.end())
+      continue;
+    if (now == interfaces.end())
+      return reference + " was removed";
+    if (before == previous->interfaces.end())
+      return reference + " was added";
+    if (now->second != before->second) {
+      bool function = current.declarations.at(reference).kind ==
+                      DeclarationKind::Function;
+      return (function ? "signature of " : "definition of ") + reference +
+             " changed";
+    }
+  }
+  return std::nullopt;
+}
+
+bool write_file(const std::filesystem::path &path, const std::string &text) {
+  std::ofstream file(path, std::ios::trunc);
+  if (!file.is_open()) {
+    spdlog::error("[incremental] Could not write {}", path.string());
+    return false;
+  }
+  file << text;
+  return true;
+}
+
+} // namespace
+
+int build_incremental(const std::string &source, const std::string &filename,
+                      Ref<ModuleContext> module_context,
+                      const IncrementalOptions &options) {
+  std::filesystem::path directory = options.output + ".build";
+  std::error_code error;
+  std::filesystem::create_directories(directory, error);
+  if (error) {
+    spdlog::error("[incremental] Could not create {}: {}", directory.string(),
+                  error.message());
+    return 1;
+  }
+
+  auto state_path = directory / "state.json";
+  auto previous = load_state(state_path);
+  auto compiler = compiler_key(options);
+  auto object_of = [&](const Unit &unit) {
+    return directory / (unit.stem + ".o");
+  };
+
+  // A module whose unit is reused only has to be typechecked against, its
+  // interface is enough
+  if (module_context->write_interfaces) {
+    module_context->use_interface = [&](const std::string &path,
+                                        uint64_t key) {
+      if (!previous || previous->compiler != compiler)
+        return false;
+      auto built = previous->units.find(module_stem(path));
+      return built != previous->units.end() && built->second.body == key &&
+             std::filesystem::exists(directory / (module_stem(path) + ".o"));
+    };
+  }
+
+  auto buffer = std::make_shared<std::string>(source);
+  auto tokens = lex(*buffer, filename);
+  module_context->load_imports(filename, *buffer, tokens);
+  auto program = parse(tokens, buffer, module_context);
+  perform_injections(program);
+  auto imported = module_context->imported_paths(program->body->statements);
+
+  auto current = fingerprint(program, tokens, *module_context, imported);
+  std::map<std::string, uint64_t> interfaces;
+  for (const auto &[name, declaration] : current.declarations) {
+    std::set<std::string> visiting;
+    interface_of(name, current, interfaces, visiting);
+  }
+
+  std::vector<std::pair<const Unit *, std::string>> rebuilt;
+  std::unordered_set<std::string_view> reused_bodies;
+  for (const auto &unit : current.units) {
+    auto reason = rebuild_reason(unit, previous, compiler, current, interfaces,
+                                 object_of(unit));
+    if (reason) {
+      rebuilt.emplace_back(&unit, *reason);
+    } else if (unit.statement &&
+               unit.statement->get_type() == ASTType::FunctionDefinition) {
+      reused_bodies.insert(
+          std::static_pointer_cast<FunctionDefinition>(unit.statement)
+              ->identifier->name);
+    }
+  }
+
+  typecheck(program, reused_bodies);
+  link_modules(program);
+  // The functions of every unit that is rebuilt, by unit
+  std::unordered_map<const Unit *, std::vector<Ref<FunctionDefinition>>>
+      functions;
+  std::vector<Ref<Statement>> checked;
+  for (const auto &[unit, reason] : rebuilt) {
+    if (!unit->module.empty()) {
+      for (const auto &stmt : module_context->declarations(unit->module)) {
+        if (stmt->get_type() == ASTType::FunctionDefinition) {
+          functions[unit].push_back(
+              std::static_pointer_cast<FunctionDefinition>(stmt));
+          checked.push_back(stmt);
+        } else if (stmt->get_type() == ASTType::EnumDefinition) {
+          functions[unit].push_back(
+              std::static_pointer_cast<EnumDefinition>(stmt)
+                  ->to_string_function);
+        }
+      }
+    } else if (unit->statement) {
+      checked.push_back(unit->statement);
+    }
+  }
+  mark_tail_calls(program, checked);
+
+  // The header changes whenever any declaration does, the units compiled
+  // against an older one only use the parts that stayed the same
+  if (!write_file(directory / header_name, codegen_c_header(program))) {
+    return 1;
+  }
+
+  std::unordered_map<const Unit *, std::string_view> reasons;
+  for (const auto &[unit, reason] : rebuilt) {
+    reasons[unit] = reason;
+  }
+  State next;
+  next.compiler = compiler;
+  next.interfaces = interfaces;
+  for (const auto &unit : current.units) {
+    if (!reasons.contains(&unit))
+      next.units[unit.stem] = previous->units.at(unit.stem);
+  }
+
+  for (const auto &[unit, reason] : rebuilt) {
+    std::string code;
+    if (!unit->module.empty()) {
+      code = codegen_c_functions(functions[unit], header_name);
+    } else if (!unit->statement) {
+      code = codegen_c_globals(program, header_name);
+    } else if (unit->statement->get_type() == ASTType::EnumDefinition) {
+      code = codegen_c_functions(
+          {std::static_pointer_cast<EnumDefinition>(unit->statement)
+               ->to_string_function},
+          header_name);
+    } else {
+      code = codegen_c_functions(
+          {std::static_pointer_cast<FunctionDefinition>(unit->statement)},
+          header_name);
+    }
+    auto c_file = directory / (unit->stem + ".c");
+    if (!write_file(c_file, code)) {
+      save_state(state_path, next);
+      return 1;
+    }
+    std::string compile_cmd = "cc -std=c11 -O" +
+                              std::to_string(options.opt_level) + " -I" +
+                              options.runtime_dir + " -c -o " +
+                              object_of(*unit).string() + " " +
+                              c_file.string();
+    spdlog::info("[incremental] Compiling {} with command: {}", unit->name,
+                 compile_cmd);
+    if (system(compile_cmd.c_str()) != 0) {
+      spdlog::error("[incremental] Failed to compile {}", c_file.string());
+      // Whatever is left of the object must not be taken for a good one
+      std::filesystem::remove(object_of(*unit), error);
+      save_state(state_path, next);
+      return 1;
+    }
+    next.units[unit->stem] = {unit->name, unit->signature, unit->body,
+                              unit->references};
+  }
+
+  // Units of declarations that are gone
+  std::vector<std::string> removed;
+  if (previous) {
+    for (const auto &[stem, unit] : previous->units) {
+      if (next.units.contains(stem))
+        continue;
+      removed.push_back(unit.name);
+      std::filesystem::remove(directory / (stem + ".c"), error);
+      std::filesystem::remove(directory / (stem + ".o"), error);
+    }
+  }
+  save_state(state_path, next);
+
+  if (options.explain) {
+    for (const auto &unit : current.units) {
+      if (auto reason = reasons.find(&unit); reason != reasons.end()) {
+        fmt::print(stderr, "rebuilt {}: {}\n", unit.name, reason->second);
+      } else {
+        fmt::print(stderr, "reused {}\n", unit.name);
+      }
+    }
+    for (const auto &name : removed) {
+      fmt::print(stderr, "removed {}\n", name);
+    }
+  }
+
+  if (rebuilt.empty() && removed.empty() &&
+      std::filesystem::exists(options.output)) {
+    spdlog::info("[incremental] {} is up to date", options.output);
+    return 0;
+  }
+  std::string link_cmd = "cc -o " + options.output;
+  for (const auto &unit : current.units) {
+    link_cmd += " " + object_of(unit).string();
+  }
+  link_cmd += " " + options.runtime_object;
+  spdlog::info("[incremental] Linking with command: {}", link_cmd);
+  if (system(link_cmd.c_str()) != 0) {
+    spdlog::error("[incremental] Failed to link {}", options.output);
+    // Otherwise the next build would find an up to date executable
+    std::filesystem::remove(options.output, error);
+    return 1;
+  }
+  return 0;
+}
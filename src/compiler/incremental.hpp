@@ -0,0 +1,34 @@
+#pragma once
+
+#include "../definitions/ast.hpp"
+#include "modules.hpp"
+#include <string>
+
+struct IncrementalOptions {
+  std::string output; // The executable
+  int opt_level = 2;
+  std::string runtime_dir;    // Holds enki_rt.h
+  std::string runtime_object; // Linked into the executable
+  // Report every unit that was rebuilt, and why, on stderr
+  bool explain = false;
+};
+
+// Builds the program with the C backend, one translation unit per function,
+// one per enum for its to_string function, one for the top level statements
+// and one per imported module, which is rebuilt whenever its cache key
+// changes. The units, their objects and a fingerprint of every top level
+// declaration are kept in `<output>.build` between builds.
+//
+// A declaration is fingerprinted by its tokens, comments and layout do not
+// count, split into its signature and, for functions, its body. The interface
+// of a declaration is its signature together with the interfaces of the
+// declarations named in it, so that a struct used by a function's parameters
+// is part of that function's interface. A unit is rebuilt when its own
+// signature or body changed, or the interface of a declaration it names did.
+// Only the bodies of the functions being rebuilt are typechecked, the others
+// are only checked up to their signatures.
+//
+// Returns the exit code of the compile.
+int build_incremental(const std::string &source, const std::string &filename,
+                      Ref<ModuleContext> module_context,
+                      const IncrementalOptions &options);
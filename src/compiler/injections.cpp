@@ -23,34 +23,58 @@ void scan_and_inject_statements(std::vector<Ref<Statement>> &statements) {
   // This ensures they're added to the correct scope
 }
 
+// Builds the declaration of a compiler-provided function. Builtins have no
+// body, codegen lowers calls to them onto the runtime instead.
+static Ref<FunctionDefinition>
+make_builtin(std::string_view name, BaseType return_type,
+             const std::vector<BaseType> &parameter_types) {
+  auto func_def = std::make_shared<FunctionDefinition>();
+  func_def->identifier = std::make_shared<Identifier>();
+  func_def->identifier->name = name;
+  func_def->identifier->span = Span{};
+  func_def->return_type = std::make_shared<Type>();
+  func_def->return_type->base_type = return_type;
+  func_def->function = std::make_shared<Function>();
+  func_def->function->name = name;
+  func_def->function->return_type = func_def->return_type;
+  func_def->function->definition = func_def;
+  func_def->function->scope = std::make_shared<Scope>();
+
+  for (auto parameter_type : parameter_types) {
+    auto param = std::make_shared<Parameter>();
+    param->identifier = std::make_shared<Identifier>();
+    param->identifier->name = "value";
+    param->identifier->span = Span{};
+    param->type = std::make_shared<Type>();
+    param->type->base_type = parameter_type;
+    func_def->parameters.push_back(param);
+  }
+
+  func_def->body = nullptr;
+  return func_def;
+}
+
 // Helper to inject the built-in print function
 void inject_builtin_print(std::vector<Ref<Statement>> &statements) {
-  auto print_func_def = std::make_shared<FunctionDefinition>();
-  print_func_def->identifier = std::make_shared<Identifier>();
-  print_func_def->identifier->name = "print";
-  print_func_def->identifier->span = Span{};
-  print_func_def->return_type = std::make_shared<Type>();
-  print_func_def->return_type->base_type = BaseType::Void;
-  print_func_def->function = std::make_shared<Function>();
-  print_func_def->function->name = "print";
-  print_func_def->function->return_type = print_func_def->return_type;
-  print_func_def->function->definition = print_func_def;
-  print_func_def->function->scope = std::make_shared<Scope>();
-  
-  // Add an Any parameter to print function
-  auto param = std::make_shared<Parameter>();
-  param->identifier = std::make_shared<Identifier>();
-  param->identifier->name = "value";
-  param->identifier->span = Span{};
-  param->type = std::make_shared<Type>();
-  param->type->base_type = BaseType::Any;
-  print_func_def->parameters.push_back(param);
-  
-  print_func_def->body = nullptr;
-  statements.insert(statements.begin(), print_func_def);
+  statements.insert(statements.begin(),
+                    make_builtin("print", BaseType::Void, {BaseType::Any}));
   spdlog::debug("[injections] Injected built-in print function with Any parameter");
 }
 
+// eprint writes a line to stderr, flushing buffered stdout first
+void inject_builtin_eprint(std::vector<Ref<Statement>> &statements) {
+  statements.insert(statements.begin(),
+                    make_builtin("eprint", BaseType::Void, {BaseType::Any}));
+  spdlog::debug("[injections] Injected built-in eprint function with Any parameter");
+}
+
+// flush writes out everything print has buffered so far
+void inject_builtin_flush(std::vector<Ref<Statement>> &statements) {
+  statements.insert(statements.begin(),
+                    make_builtin("flush", BaseType::Void, {}));
+  spdlog::debug("[injections] Injected built-in flush function");
+}
+
 void perform_injections(Ref<Program> program) {
   spdlog::debug("[injections] Starting injection pass");
   if (!program || !program->body) {
@@ -59,6 +83,8 @@ void perform_injections(Ref<Program> program) {
   }
   // Inject built-in print function at the start
   inject_builtin_print(program->body->statements);
+  inject_builtin_eprint(program->body->statements);
+  inject_builtin_flush(program->body->statements);
   // Scan the program body and inject necessary functions
   scan_and_inject_statements(program->body->statements);
   spdlog::debug("[injections] Injection pass complete");
@@ -160,9 +160,15 @@ std::vector<Token> lex(const std::string_view &source,
     case '*':
       simple_token(TokenType::Asterisk);
       continue;
+    case '%':
+      simple_token(TokenType::Percent);
+      continue;
     case '&':
       simple_token(TokenType::Ampersand);
       continue;
+    case '@':
+      simple_token(TokenType::At);
+      continue;
     case '<': {
       if (peek(1) == '=') {
         simple_token(TokenType::LessThanEquals, 2);
@@ -0,0 +1,1080 @@
+#include "lsp.hpp"
+#include "../utils/logging.hpp"
+#include "injections.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "typecheck.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fmt/format.h>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <spdlog/spdlog.h>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+using json = nlohmann::json;
+using Clock = std::chrono::steady_clock;
+
+// How long edits to a document have to pause before it is typechecked
+constexpr auto typecheck_delay = std::chrono::milliseconds(150);
+
+constexpr int method_not_found = -32601;
+constexpr int internal_error = -32603;
+
+// An error in a declaration, lines relative to its first line
+struct Problem {
+  int row, col, end_row, end_col;
+  std::string message;
+};
+
+Problem problem_at(const Span &span, const std::string &message) {
+  Problem problem{span.start.row, span.start.col, span.end.row, span.end.col,
+                  message};
+  if (problem.end_row < problem.row ||
+      (problem.end_row == problem.row && problem.end_col <= problem.col)) {
+    problem.end_row = problem.row;
+    problem.end_col = problem.col + 1;
+  }
+  return problem;
+}
+
+// A top level declaration, lexed and parsed on its own. Its spans count
+// from its first line and name the file `<path>#<id>`, which tells the
+// declarations of a document apart.
+struct Declaration {
+  std::shared_ptr<std::string> source;
+  std::string name;
+  std::vector<Token> tokens;
+  std::vector<Ref<Statement>> statements;
+  std::optional<Problem> error;
+};
+
+// A declaration and the line of the document it starts on
+struct Placed {
+  Ref<Declaration> declaration;
+  int line;
+};
+
+struct Document {
+  std::string uri;
+  std::string path;
+  std::string text;
+  std::vector<Placed> declarations;
+  // Edited since it was last typechecked, which is due at `due`
+  bool dirty = false;
+  Clock::time_point due;
+  // The last typechecked program, its global scope answers lookups outside
+  // of functions
+  Ref<Program> checked;
+};
+
+// How many brackets the line leaves open, ignoring literals and comments
+int open_brackets(std::string_view line) {
+  int depth = 0;
+  char quote = 0;
+  for (size_t i = 0; i < line.size(); ++i) {
+    char c = line[i];
+    if (quote) {
+      if (c == '\\') {
+        ++i;
+      } else if (c == quote) {
+        quote = 0;
+      }
+      continue;
+    }
+    if (c == '/' && i + 1 < line.size() && line[i + 1] == '/') {
+      break;
+    }
+    if (c == '"' || c == '\'') {
+      quote = c;
+    } else if (c == '{' || c == '(' || c == '[') {
+      ++depth;
+    } else if (c == '}' || c == ')' || c == ']') {
+      --depth;
+    }
+  }
+  return depth;
+}
+
+// The text of every top level declaration with the line it starts on. A
+// declaration starts on an unindented line outside any bracket, unless the
+// line is a comment, closes a bracket or follows an annotation; whatever
+// comes before the first one belongs to it.
+std::vector<std::pair<int, std::string>>
+split_declarations(const std::string &text) {
+  std::vector<std::pair<int, std::string>> parts;
+  int depth = 0;
+  bool annotated = false;
+  int line = 0;
+  for (size_t start = 0; start < text.size(); ++line) {
+    auto end = text.find('\n', start);
+    end = end == std::string::npos ? text.size() : end + 1;
+    std::string_view current(text.data() + start, end - start);
+    start = end;
+
+    bool blank = current.find_first_not_of(" \t\r\n") == std::string::npos;
+    bool indented = !blank && std::isspace(current[0]);
+    bool comment = current.starts_with("//");
+    bool closing = !blank && (current[0] == '}' || current[0] == ')' ||
+                              current[0] == ']');
+    if (parts.empty() || (depth == 0 && !annotated && !blank && !indented &&
+                          !comment && !closing)) {
+      parts.push_back({line, ""});
+    }
+    parts.back().second.append(current);
+    depth = std::max(0, depth + open_brackets(current));
+    if (!blank && !comment) {
+      annotated = current[0] == '@';
+    }
+  }
+  return parts;
+}
+
+std::string path_of(const std::string &uri) {
+  std::string encoded =
+      uri.starts_with("file://") ? uri.substr(7) : std::string(uri);
+  std::string path;
+  for (size_t i = 0; i < encoded.size(); ++i) {
+    if (encoded[i] == '%' && i + 2 < encoded.size()) {
+      path += static_cast<char>(std::stoi(encoded.substr(i + 1, 2), nullptr, 16));
+      i += 2;
+    } else {
+      path += encoded[i];
+    }
+  }
+  return path;
+}
+
+std::string uri_of(const std::string &path) {
+  std::string uri = "file://";
+  for (unsigned char c : std::filesystem::absolute(path).string()) {
+    if (std::isalnum(c) || std::string_view("/-._~").find(c) !=
+                               std::string_view::npos) {
+      uri += static_cast<char>(c);
+    } else {
+      uri += fmt::format("%{:02X}", c);
+    }
+  }
+  return uri;
+}
+
+json range_of(int row, int col, int end_row, int end_col) {
+  return {{"start", {{"line", row}, {"character", col}}},
+          {"end", {{"line", end_row}, {"character", end_col}}}};
+}
+
+// Line `row` of `text`, without its newline, empty past the last line
+std::string_view line_of(std::string_view text, int row) {
+  size_t start = 0;
+  for (; row > 0; --row) {
+    start = text.find('\n', start);
+    if (start == std::string_view::npos) {
+      return {};
+    }
+    ++start;
+  }
+  return text.substr(start, text.find('\n', start) - start);
+}
+
+// UTF-16 code units of the first `col` bytes of a line, a byte past its end
+// counting as one
+int utf16_column(std::string_view line, int col) {
+  int units = 0;
+  for (int i = 0; i < col; ++i) {
+    auto c = i < static_cast<int>(line.size())
+                 ? static_cast<unsigned char>(line[i])
+                 : 0;
+    // Continuation bytes belong to the character before, and characters of
+    // four bytes take two code units
+    units += (c & 0xC0) == 0x80 ? 0 : c >= 0xF0 ? 2 : 1;
+  }
+  return units;
+}
+
+// The byte offset in a line of its first `units` UTF-16 code units
+size_t utf8_column(std::string_view line, size_t units) {
+  size_t offset = 0;
+  while (offset < line.size()) {
+    auto c = static_cast<unsigned char>(line[offset]);
+    size_t width = c >= 0xF0 ? 2 : 1;
+    if (width > units) {
+      break;
+    }
+    units -= width;
+    do {
+      ++offset;
+    } while (offset < line.size() &&
+             (static_cast<unsigned char>(line[offset]) & 0xC0) == 0x80);
+  }
+  return offset;
+}
+
+// `define name(a: int) -> int` for functions, the type for anything else
+std::string describe(const Symbol &symbol) {
+  if (!symbol.type) {
+    return std::string(symbol.name);
+  }
+  if (symbol.type->base_type != BaseType::Function) {
+    return fmt::format("{}: {}", symbol.name, symbol.type->to_string());
+  }
+  auto function = std::get<Ref<Function>>(symbol.type->structure);
+  std::string parameters;
+  for (const auto &parameter : function->parameters) {
+    if (!parameters.empty()) {
+      parameters += ", ";
+    }
+    parameters += fmt::format(
+        "{}: {}", parameter->name,
+        parameter->type ? parameter->type->to_string() : "?");
+  }
+  return fmt::format(
+      "define {}({}) -> {}", symbol.name, parameters,
+      function->return_type ? function->return_type->to_string() : "void");
+}
+
+int completion_kind(SymbolType type) {
+  switch (type) {
+  case SymbolType::Function:
+    return 3;
+  case SymbolType::Enum:
+    return 13;
+  case SymbolType::Struct:
+    return 22;
+  default:
+    return 6;
+  }
+}
+
+// What is under a byte offset of a declaration: the smallest typed
+// expression and identifier around it, and the scope of the innermost block
+// it is in. Calls span only their callee and simple statements end where
+// their last expression does, so only definitions, blocks, ifs and loops are
+// skipped by their span.
+class Finder {
+public:
+  explicit Finder(size_t offset) : offset(offset) {}
+
+  void statement(const Ref<Statement> &stmt);
+
+  Ref<Expression> expression;
+  Ref<Identifier> identifier;
+  Ref<Scope> scope;
+
+private:
+  bool contains(const Span &span) const {
+    return span.start.pos <= static_cast<int>(offset) &&
+           static_cast<int>(offset) <= span.end.pos &&
+           span.start.pos < span.end.pos;
+  }
+  static int size(const Span &span) { return span.end.pos - span.start.pos; }
+
+  void visit(const Ref<Expression> &expr, bool named = true);
+  void name(const Ref<Identifier> &ident);
+
+  size_t offset;
+};
+
+void Finder::name(const Ref<Identifier> &ident) {
+  if (ident && contains(ident->span) &&
+      (!identifier || size(ident->span) <= size(identifier->span))) {
+    identifier = ident;
+  }
+}
+
+// The names on the right of a dot are fields and enum members, not symbols
+void Finder::visit(const Ref<Expression> &expr, bool named) {
+  if (!expr) {
+    return;
+  }
+  if (expr->etype && contains(expr->span) &&
+      (!expression || size(expr->span) <= size(expression->span))) {
+    expression = expr;
+  }
+  switch (expr->get_type()) {
+  case ASTType::Identifier:
+    if (named) {
+      name(std::static_pointer_cast<Identifier>(expr));
+    }
+    break;
+  case ASTType::Call: {
+    auto call = std::static_pointer_cast<Call>(expr);
+    visit(call->callee, named);
+    for (const auto &argument : call->arguments) {
+      visit(argument);
+    }
+    break;
+  }
+  case ASTType::BinaryOp: {
+    auto binary = std::static_pointer_cast<BinaryOp>(expr);
+    visit(binary->left);
+    visit(binary->right);
+    break;
+  }
+  case ASTType::StructInstantiation: {
+    auto instantiation = std::static_pointer_cast<StructInstantiation>(expr);
+    name(instantiation->identifier);
+    for (const auto &argument : instantiation->arguments) {
+      visit(argument);
+    }
+    break;
+  }
+  case ASTType::Dot: {
+    auto dot = std::static_pointer_cast<Dot>(expr);
+    visit(dot->left, named);
+    visit(dot->right, false);
+    break;
+  }
+  case ASTType::Dereference:
+    visit(std::static_pointer_cast<Dereference>(expr)->expression);
+    break;
+  case ASTType::AddressOf:
+    visit(std::static_pointer_cast<AddressOf>(expr)->expression);
+    break;
+  case ASTType::Index: {
+    auto index = std::static_pointer_cast<Index>(expr);
+    visit(index->base);
+    visit(index->index);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+void Finder::statement(const Ref<Statement> &stmt) {
+  if (!stmt) {
+    return;
+  }
+  switch (stmt->get_type()) {
+  case ASTType::FunctionDefinition: {
+    auto func_def = std::static_pointer_cast<FunctionDefinition>(stmt);
+    if (!contains(func_def->span)) {
+      break;
+    }
+    name(func_def->identifier);
+    for (const auto &parameter : func_def->parameters) {
+      name(parameter->identifier);
+    }
+    if (func_def->body) {
+      if (func_def->body->scope) {
+        scope = func_def->body->scope;
+      }
+      for (const auto &inner : func_def->body->statements) {
+        statement(inner);
+      }
+    }
+    break;
+  }
+  case ASTType::Block: {
+    auto block = std::static_pointer_cast<Block>(stmt);
+    if (!contains(block->span)) {
+      break;
+    }
+    if (block->scope) {
+      scope = block->scope;
+    }
+    for (const auto &inner : block->statements) {
+      statement(inner);
+    }
+    break;
+  }
+  case ASTType::VarDecl: {
+    auto var_decl = std::static_pointer_cast<VarDecl>(stmt);
+    name(var_decl->identifier);
+    visit(var_decl->expression);
+    break;
+  }
+  case ASTType::If: {
+    auto if_stmt = std::static_pointer_cast<If>(stmt);
+    if (contains(if_stmt->span)) {
+      visit(if_stmt->condition);
+      statement(if_stmt->then_branch);
+      statement(if_stmt->else_branch);
+    }
+    break;
+  }
+  case ASTType::While: {
+    auto while_stmt = std::static_pointer_cast<While>(stmt);
+    if (contains(while_stmt->span)) {
+      visit(while_stmt->condition);
+      statement(while_stmt->body);
+    }
+    break;
+  }
+  case ASTType::Return:
+    visit(std::static_pointer_cast<Return>(stmt)->expression);
+    break;
+  case ASTType::ExpressionStatement:
+    visit(std::static_pointer_cast<ExpressionStatement>(stmt)->expression);
+    break;
+  case ASTType::Assignment: {
+    auto assignment = std::static_pointer_cast<Assignment>(stmt);
+    visit(assignment->assignee);
+    visit(assignment->expression);
+    break;
+  }
+  case ASTType::StructDefinition:
+    name(std::static_pointer_cast<StructDefinition>(stmt)->identifier);
+    break;
+  case ASTType::EnumDefinition:
+    name(std::static_pointer_cast<EnumDefinition>(stmt)->identifier);
+    break;
+  case ASTType::Extern:
+    name(std::static_pointer_cast<Extern>(stmt)->identifier);
+    break;
+  default:
+    break;
+  }
+}
+
+class LanguageServer {
+public:
+  LanguageServer(std::ostream &out, Ref<ModuleContext> modules)
+      : out(out), modules(std::move(modules)) {}
+
+  int run(std::istream &in);
+
+private:
+  void handle(const std::string &method, const json &message);
+  void send(const json &message);
+  void respond(const json &id, const json &result) {
+    send({{"jsonrpc", "2.0"}, {"id", id}, {"result", result}});
+  }
+
+  // Parses the declarations of a document whose text changed, and schedules
+  // typechecking it
+  void update(Document &document);
+  Ref<Declaration> parse_declaration(const std::string &text,
+                                     const std::string &path);
+
+  void check_loop();
+  void check(const std::string &uri, const std::string &path,
+             const std::vector<Placed> &declarations);
+  // Typechecks the declarations as one program, returns its first error
+  std::optional<Problem> typecheck_declarations(
+      const std::string &path, const std::vector<Placed> &declarations,
+      Ref<Program> &program, std::string &where);
+  void forget_changed_modules();
+
+  // The declaration at a position of a document and the byte offset of the
+  // position in it
+  std::optional<std::pair<Placed, size_t>> locate(const Document &document,
+                                                  const json &position);
+  // The document and line a span points to
+  std::optional<json> location_of(const Span &span);
+  Ref<Scope> scope_at(const Document &document, const Finder &finder);
+
+  json hover(const Document &document, const json &position);
+  json definition(const Document &document, const json &position);
+  json completion(const Document &document, const json &position);
+
+  // The byte offset in a line of a position's character, and the reverse.
+  // Both count bytes once the client agreed to UTF-8, and UTF-16 code units
+  // otherwise.
+  size_t byte_column(std::string_view line, const json &position) const {
+    auto character = position.at("character").get<size_t>();
+    return utf8 ? std::min(character, line.size())
+                : utf8_column(line, character);
+  }
+  int client_column(std::string_view line, int col) const {
+    return utf8 ? col : utf16_column(line, col);
+  }
+  // A range in `text`, which starts on line `line` of its file
+  json range_in(std::string_view text, int line, int row, int col,
+                int end_row, int end_col) const {
+    return range_of(line + row, client_column(line_of(text, row), col),
+                    line + end_row,
+                    client_column(line_of(text, end_row), end_col));
+  }
+
+  std::ostream &out;
+  std::mutex output;
+  Ref<ModuleContext> modules;
+  std::unordered_map<std::string, std::filesystem::file_time_type>
+      module_times;
+  int next_declaration = 0;
+  bool shutdown = false;
+  // Whether positions count bytes, see `initialize`
+  bool utf8 = false;
+
+  // `edits` guards the documents and their declarations between the reader
+  // and the typechecking thread. `typed` guards the ASTs, which typechecking
+  // changes, and the modules.
+  std::mutex edits;
+  std::mutex typed;
+  std::condition_variable wake;
+  bool stopping = false;
+  std::unordered_map<std::string, std::unique_ptr<Document>> documents;
+};
+
+std::optional<json> read_message(std::istream &in) {
+  size_t length = 0;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty()) {
+      break;
+    }
+    constexpr std::string_view header = "Content-Length:";
+    if (line.starts_with(header)) {
+      length = std::stoul(line.substr(header.size()));
+    }
+  }
+  if (!in || length == 0) {
+    return std::nullopt;
+  }
+  std::string body(length, '\0');
+  if (!in.read(body.data(), length)) {
+    return std::nullopt;
+  }
+  return json::parse(body, nullptr, false);
+}
+
+void LanguageServer::send(const json &message) {
+  auto body = message.dump();
+  std::lock_guard lock(output);
+  out << "Content-Length: " << body.size() << "\r\n\r\n" << body;
+  out.flush();
+}
+
+int LanguageServer::run(std::istream &in) {
+  std::thread checker([this] { check_loop(); });
+  int code = 1;
+  while (auto message = read_message(in)) {
+    if (!message->is_object()) {
+      spdlog::warn("[lsp] Ignoring a message that is not a JSON object");
+      continue;
+    }
+    auto method = message->value("method", "");
+    if (method == "exit") {
+      code = shutdown ? 0 : 1;
+      break;
+    }
+    try {
+      handle(method, *message);
+    } catch (const std::exception &error) {
+      spdlog::warn("[lsp] {} failed: {}", method, error.what());
+      if (message->contains("id")) {
+        send({{"jsonrpc", "2.0"},
+              {"id", (*message)["id"]},
+              {"error", {{"code", internal_error}, {"message", error.what()}}}});
+      }
+    }
+  }
+  {
+    std::lock_guard lock(edits);
+    stopping = true;
+  }
+  wake.notify_all();
+  checker.join();
+  return code;
+}
+
+void LanguageServer::handle(const std::string &method, const json &message) {
+  const json params = message.value("params", json::object());
+  const bool request = message.contains("id");
+
+  if (method == "initialize") {
+    // Positions count UTF-16 code units unless the client also takes bytes,
+    // which is how everything else counts them
+    auto encodings = params.value(
+        json::json_pointer("/capabilities/general/positionEncodings"),
+        json::array());
+    utf8 = std::find(encodings.begin(), encodings.end(), "utf-8") !=
+           encodings.end();
+    respond(message["id"],
+            {{"capabilities",
+              {{"positionEncoding", utf8 ? "utf-8" : "utf-16"},
+               {"textDocumentSync", {{"openClose", true}, {"change", 2}}},
+               {"hoverProvider", true},
+               {"definitionProvider", true},
+               {"completionProvider", json::object()}}},
+             {"serverInfo", {{"name", "enki"}}}});
+    return;
+  }
+  if (method == "shutdown") {
+    shutdown = true;
+    respond(message["id"], nullptr);
+    return;
+  }
+
+  if (method == "textDocument/didOpen") {
+    const auto &item = params.at("textDocument");
+    auto document = std::make_unique<Document>();
+    document->uri = item.at("uri");
+    document->path = path_of(document->uri);
+    document->text = item.at("text");
+    auto &opened = *document;
+    {
+      std::lock_guard lock(edits);
+      documents[opened.uri] = std::move(document);
+    }
+    update(opened);
+    return;
+  }
+  if (method == "textDocument/didClose") {
+    std::string uri = params.at("textDocument").at("uri");
+    {
+      std::lock_guard checking(typed);
+      std::lock_guard lock(edits);
+      documents.erase(uri);
+    }
+    send({{"jsonrpc", "2.0"},
+          {"method", "textDocument/publishDiagnostics"},
+          {"params", {{"uri", uri}, {"diagnostics", json::array()}}}});
+    return;
+  }
+
+  std::string uri =
+      params.contains("textDocument") ? params["textDocument"].value("uri", "")
+                                      : "";
+  auto found = documents.find(uri);
+  if (method == "textDocument/didChange") {
+    if (found == documents.end()) {
+      return;
+    }
+    auto &text = found->second->text;
+    for (const auto &change : params.at("contentChanges")) {
+      if (!change.contains("range")) {
+        text = change.at("text");
+        continue;
+      }
+      // Byte offsets of the start and end of the range
+      size_t offsets[2];
+      const char *ends[2] = {"start", "end"};
+      for (int i = 0; i < 2; ++i) {
+        const auto &position = change["range"][ends[i]];
+        int line = position.at("line");
+        size_t offset = 0;
+        for (; line > 0 && offset < text.size(); --line) {
+          auto next = text.find('\n', offset);
+          offset = next == std::string::npos ? text.size() : next + 1;
+        }
+        offsets[i] =
+            offset + byte_column(
+                         line_of(std::string_view(text).substr(offset), 0),
+                         position);
+      }
+      text.replace(offsets[0], std::max(offsets[0], offsets[1]) - offsets[0],
+                   change.at("text").get<std::string>());
+    }
+    update(*found->second);
+    return;
+  }
+
+  if (method == "textDocument/hover" || method == "textDocument/definition" ||
+      method == "textDocument/completion") {
+    json result = nullptr;
+    if (found != documents.end()) {
+      // Waits for a typecheck that is running, the answer comes from it
+      std::lock_guard lock(typed);
+      const auto &position = params.at("position");
+      if (method == "textDocument/hover") {
+        result = hover(*found->second, position);
+      } else if (method == "textDocument/definition") {
+        result = definition(*found->second, position);
+      } else {
+        result = completion(*found->second, position);
+      }
+    }
+    respond(message["id"], result);
+    return;
+  }
+
+  if (request) {
+    send({{"jsonrpc", "2.0"},
+          {"id", message["id"]},
+          {"error",
+           {{"code", method_not_found},
+            {"message", "Unsupported method " + method}}}});
+  }
+}
+
+Ref<Declaration> LanguageServer::parse_declaration(const std::string &text,
+                                                   const std::string &path) {
+  auto declaration = std::make_shared<Declaration>();
+  declaration->source = std::make_shared<std::string>(text);
+  declaration->name = fmt::format("{}#{}", path, next_declaration++);
+  logging::CapturedErrors captured;
+  try {
+    declaration->tokens = lex(*declaration->source, declaration->name);
+    auto program = parse(declaration->tokens, declaration->source, modules);
+    declaration->statements = program->body->statements;
+  } catch (const logging::CompileError &error) {
+    declaration->error = problem_at(error.span, error.what());
+  } catch (const std::exception &error) {
+    // Running out of tokens in the middle of a statement
+    int rows = std::count(text.begin(), text.end(), '\n');
+    declaration->error = Problem{rows, 0, rows, 1, error.what()};
+  }
+  return declaration;
+}
+
+void LanguageServer::update(Document &document) {
+  // A declaration whose text is still somewhere in the document keeps its
+  // tokens and AST, wherever it moved
+  std::unordered_multimap<std::string_view, Ref<Declaration>> previous;
+  for (const auto &placed : document.declarations) {
+    previous.emplace(*placed.declaration->source, placed.declaration);
+  }
+  std::vector<Placed> declarations;
+  for (const auto &[line, text] : split_declarations(document.text)) {
+    auto kept = previous.find(text);
+    if (kept != previous.end()) {
+      declarations.push_back({kept->second, line});
+      previous.erase(kept);
+    } else {
+      declarations.push_back({parse_declaration(text, document.path), line});
+    }
+  }
+
+  {
+    std::lock_guard lock(edits);
+    document.declarations = std::move(declarations);
+    document.dirty = true;
+    document.due = Clock::now() + typecheck_delay;
+  }
+  wake.notify_one();
+}
+
+void LanguageServer::check_loop() {
+  std::unique_lock lock(edits);
+  while (!stopping) {
+    Document *next = nullptr;
+    for (auto &[uri, document] : documents) {
+      if (document->dirty && (!next || document->due < next->due)) {
+        next = document.get();
+      }
+    }
+    if (!next) {
+      wake.wait(lock);
+      continue;
+    }
+    if (Clock::now() < next->due) {
+      wake.wait_until(lock, next->due);
+      continue;
+    }
+    next->dirty = false;
+    auto uri = next->uri;
+    auto path = next->path;
+    auto declarations = next->declarations;
+    lock.unlock();
+    check(uri, path, declarations);
+    lock.lock();
+  }
+}
+
+void LanguageServer::check(const std::string &uri, const std::string &path,
+                           const std::vector<Placed> &declarations) {
+  std::lock_guard checking(typed);
+  json diagnostics = json::array();
+  auto report = [&](const Problem &problem, std::string_view text, int line) {
+    diagnostics.push_back(
+        {{"range", range_in(text, line, problem.row, problem.col,
+                            problem.end_row, problem.end_col)},
+         {"severity", 1},
+         {"source", "enki"},
+         {"message", problem.message}});
+  };
+  for (const auto &placed : declarations) {
+    if (placed.declaration->error) {
+      report(*placed.declaration->error, *placed.declaration->source,
+             placed.line);
+    }
+  }
+
+  // Until every declaration parses, what would be missing from the program
+  // would only show up as more errors
+  Ref<Program> program;
+  if (diagnostics.empty()) {
+    std::string where;
+    auto start = Clock::now();
+    auto error = typecheck_declarations(path, declarations, program, where);
+    spdlog::debug("[lsp] Typechecked {} in {}ms", path,
+                  std::chrono::duration_cast<std::chrono::milliseconds>(
+                      Clock::now() - start)
+                      .count());
+    if (error) {
+      auto placed = std::find_if(
+          declarations.begin(), declarations.end(), [&](const Placed &p) {
+            return p.declaration->name == where;
+          });
+      if (placed != declarations.end()) {
+        report(*error, *placed->declaration->source, placed->line);
+      } else {
+        // In an imported module, or not about any place. Errors of modules
+        // that failed to load come as the text printed for them.
+        auto message = error->message.substr(0, error->message.find('\n'));
+        if (!where.empty()) {
+          message = where + ": " + message;
+        }
+        report(Problem{0, 0, 0, 1, message}, "", 0);
+      }
+    }
+  }
+
+  {
+    std::lock_guard lock(edits);
+    auto document = documents.find(uri);
+    if (document == documents.end()) {
+      return;
+    }
+    if (program) {
+      document->second->checked = program;
+    }
+  }
+  send({{"jsonrpc", "2.0"},
+        {"method", "textDocument/publishDiagnostics"},
+        {"params", {{"uri", uri}, {"diagnostics", diagnostics}}}});
+}
+
+void LanguageServer::forget_changed_modules() {
+  std::unordered_set<std::string> changed;
+  for (const auto &[path, program] : modules->modules) {
+    std::error_code error;
+    auto time = std::filesystem::last_write_time(path, error);
+    auto known = module_times.find(path);
+    if (error || (known != module_times.end() && known->second != time)) {
+      changed.insert(path);
+    }
+  }
+  for (const auto &path : modules->forget(changed)) {
+    spdlog::debug("[lsp] Reloading {}", path);
+    module_times.erase(path);
+  }
+}
+
+std::optional<Problem> LanguageServer::typecheck_declarations(
+    const std::string &path, const std::vector<Placed> &declarations,
+    Ref<Program> &program, std::string &where) {
+  forget_changed_modules();
+
+  program = std::make_shared<Program>();
+  program->source_buffer = std::make_shared<std::string>();
+  program->module_context = modules;
+  program->body = std::make_shared<Block>();
+  program->body->scope = program->scope;
+  std::vector<Token> imports;
+  for (const auto &placed : declarations) {
+    const auto &statements = placed.declaration->statements;
+    program->body->statements.insert(program->body->statements.end(),
+                                     statements.begin(), statements.end());
+    if (std::any_of(statements.begin(), statements.end(),
+                    [](const Ref<Statement> &stmt) {
+                      return stmt->get_type() == ASTType::Import;
+                    })) {
+      imports.insert(imports.end(), placed.declaration->tokens.begin(),
+                     placed.declaration->tokens.end());
+    }
+  }
+
+  logging::RecoverableErrors recoverable;
+  logging::CapturedErrors captured;
+  std::optional<Problem> problem;
+  try {
+    modules->load_imports(path, "", imports);
+    perform_injections(program);
+    typecheck(program);
+  } catch (const logging::CompileError &error) {
+    where = std::string(error.span.start.file_name);
+    problem = problem_at(error.span, error.what());
+  } catch (const std::exception &error) {
+    problem = Problem{0, 0, 0, 1, error.what()};
+  }
+
+  for (const auto &[module_path, module] : modules->modules) {
+    std::error_code error;
+    auto time = std::filesystem::last_write_time(module_path, error);
+    if (!error) {
+      module_times.try_emplace(module_path, time);
+    }
+  }
+  return problem;
+}
+
+std::optional<std::pair<Placed, size_t>>
+LanguageServer::locate(const Document &document, const json &position) {
+  int line = position.at("line");
+  auto placed = std::upper_bound(
+      document.declarations.begin(), document.declarations.end(), line,
+      [](int line, const Placed &placed) { return line < placed.line; });
+  if (placed == document.declarations.begin()) {
+    return std::nullopt;
+  }
+  --placed;
+  const auto &source = *placed->declaration->source;
+  size_t offset = 0;
+  for (int row = placed->line; row < line; ++row) {
+    offset = source.find('\n', offset);
+    if (offset == std::string::npos) {
+      return std::nullopt;
+    }
+    ++offset;
+  }
+  return std::pair{*placed,
+                   offset + byte_column(line_of(std::string_view(source)
+                                                    .substr(offset),
+                                                0),
+                                        position)};
+}
+
+std::optional<json> LanguageServer::location_of(const Span &span) {
+  std::string file(span.start.file_name);
+  if (file.empty()) {
+    return std::nullopt;
+  }
+  auto hash = file.rfind('#');
+  if (hash != std::string::npos) {
+    for (const auto &[uri, document] : documents) {
+      if (document->path != file.substr(0, hash)) {
+        continue;
+      }
+      for (const auto &placed : document->declarations) {
+        if (placed.declaration->name == file) {
+          return json{{"uri", uri},
+                      {"range", range_in(*placed.declaration->source,
+                                         placed.line, span.start.row,
+                                         span.start.col, span.end.row,
+                                         span.end.col)}};
+        }
+      }
+      // Edited away since it was typechecked
+      return std::nullopt;
+    }
+  }
+  // A module, whose text is the one it was loaded from
+  std::string_view text;
+  if (auto module = modules->modules.find(file);
+      module != modules->modules.end() && module->second->source_buffer) {
+    text = *module->second->source_buffer;
+  }
+  return json{{"uri", uri_of(file)},
+              {"range", range_in(text, 0, span.start.row, span.start.col,
+                                 span.end.row, span.end.col)}};
+}
+
+// Blocks that were parsed again since the last typecheck know nothing of the
+// program, the global scope is searched after them
+Ref<Scope> LanguageServer::scope_at(const Document &document,
+                                    const Finder &finder) {
+  return finder.scope ? finder.scope
+                      : (document.checked ? document.checked->scope : nullptr);
+}
+
+Ref<Symbol> lookup(Ref<Scope> scope, const Ref<Scope> &global,
+                   std::string_view name) {
+  for (; scope; scope = scope->parent) {
+    auto symbol = scope->symbols.find(name);
+    if (symbol != scope->symbols.end() && symbol->second) {
+      return symbol->second;
+    }
+    if (scope == global) {
+      return nullptr;
+    }
+  }
+  if (global) {
+    auto symbol = global->symbols.find(name);
+    if (symbol != global->symbols.end()) {
+      return symbol->second;
+    }
+  }
+  return nullptr;
+}
+
+json LanguageServer::hover(const Document &document, const json &position) {
+  auto spot = locate(document, position);
+  if (!spot) {
+    return nullptr;
+  }
+  Finder finder(spot->second);
+  for (const auto &stmt : spot->first.declaration->statements) {
+    finder.statement(stmt);
+  }
+  auto global = document.checked ? document.checked->scope : nullptr;
+  std::string text;
+  if (finder.identifier) {
+    if (auto symbol = lookup(scope_at(document, finder), global,
+                             finder.identifier->name)) {
+      text = describe(*symbol);
+    }
+  }
+  if (text.empty() && finder.expression) {
+    text = finder.expression->etype->to_string();
+  }
+  if (text.empty()) {
+    return nullptr;
+  }
+  return {{"contents",
+           {{"kind", "markdown"}, {"value", "```enki\n" + text + "\n```"}}}};
+}
+
+json LanguageServer::definition(const Document &document,
+                                const json &position) {
+  auto spot = locate(document, position);
+  if (!spot) {
+    return nullptr;
+  }
+  Finder finder(spot->second);
+  for (const auto &stmt : spot->first.declaration->statements) {
+    finder.statement(stmt);
+  }
+  if (!finder.identifier) {
+    return nullptr;
+  }
+  auto global = document.checked ? document.checked->scope : nullptr;
+  auto symbol =
+      lookup(scope_at(document, finder), global, finder.identifier->name);
+  if (!symbol) {
+    return nullptr;
+  }
+  auto location = location_of(symbol->span);
+  return location ? *location : json(nullptr);
+}
+
+json LanguageServer::completion(const Document &document,
+                                const json &position) {
+  json items = json::array();
+  auto spot = locate(document, position);
+  Finder finder(spot ? spot->second : 0);
+  if (spot) {
+    for (const auto &stmt : spot->first.declaration->statements) {
+      finder.statement(stmt);
+    }
+  }
+  auto global = document.checked ? document.checked->scope : nullptr;
+  std::unordered_set<std::string_view> seen;
+  auto add = [&](const Ref<Scope> &scope) {
+    for (const auto &[name, symbol] : scope->symbols) {
+      if (symbol && !name.empty() && seen.insert(name).second) {
+        items.push_back({{"label", std::string(name)},
+                         {"kind", completion_kind(symbol->symbol_type)},
+                         {"detail", describe(*symbol)}});
+      }
+    }
+  };
+  bool reached_global = false;
+  for (auto scope = scope_at(document, finder); scope; scope = scope->parent) {
+    add(scope);
+    reached_global |= scope == global;
+  }
+  if (global && !reached_global) {
+    add(global);
+  }
+  return items;
+}
+
+} // namespace
+
+int run_language_server(std::istream &in, std::ostream &out,
+                        Ref<ModuleContext> modules) {
+  return LanguageServer(out, std::move(modules)).run(in);
+}
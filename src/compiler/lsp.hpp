@@ -0,0 +1,23 @@
+#pragma once
+
+#include "modules.hpp"
+#include <istream>
+#include <ostream>
+
+// The language server behind `enki lsp`, speaking LSP over the streams:
+// diagnostics, hover, go to definition and completion.
+//
+// A document is kept as its top level declarations, split apart on the lines
+// that start one: unindented, outside any bracket and not after an
+// annotation. Each declaration is lexed and parsed on its own, so after an
+// edit only the declarations whose text changed are parsed again, the others
+// keep their AST however far they moved. Typechecking the whole document
+// runs on a thread of its own once edits pause, against the declarations as
+// they were then; hover, definitions and completion answer from what it
+// found last. Imports are loaded from the disk into `modules`, and loaded
+// again once their file changes.
+//
+// Positions count UTF-16 code units, or bytes when the client offers `utf-8`
+// among its `general.positionEncodings`. Returns the exit code.
+int run_language_server(std::istream &in, std::ostream &out,
+                        Ref<ModuleContext> modules);
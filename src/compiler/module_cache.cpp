@@ -0,0 +1,233 @@
+#include "module_cache.hpp"
+#include "../definitions/serializations.hpp"
+#include "../utils/hash.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <fmt/format.h>
+#include <fstream>
+#include <iterator>
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+
+namespace {
+
+// Bumped whenever the layout of an entry changes
+constexpr uint64_t format_version = 1;
+
+constexpr size_t fallback_max_entries = 4096;
+
+bool is_entry(const std::filesystem::directory_entry &file) {
+  return file.is_regular_file() && file.path().extension() == ".cbor";
+}
+
+// Entries written by another build of enki may not parse the same
+uint64_t compiler_key() {
+  return hash::fnv1a(hash::executable_key(), format_version);
+}
+
+void link_scopes(const Ref<Statement> &stmt, const Ref<Scope> &parent);
+
+// The parser gives every block but the program's its own scope, as a child
+// of the enclosing one. They are empty until typechecking, so only the tree
+// has to be rebuilt.
+void link_block(const Ref<Block> &block, const Ref<Scope> &parent) {
+  block->scope = std::make_shared<Scope>();
+  block->scope->parent = parent;
+  parent->children.push_back(block->scope);
+  for (const auto &stmt : block->statements) {
+    link_scopes(stmt, block->scope);
+  }
+}
+
+void link_scopes(const Ref<Statement> &stmt, const Ref<Scope> &parent) {
+  if (!stmt) {
+    return;
+  }
+  switch (stmt->get_type()) {
+  case ASTType::Block:
+    link_block(std::static_pointer_cast<Block>(stmt), parent);
+    break;
+  case ASTType::FunctionDefinition:
+    link_block(std::static_pointer_cast<FunctionDefinition>(stmt)->body,
+               parent);
+    break;
+  case ASTType::If: {
+    auto if_stmt = std::static_pointer_cast<If>(stmt);
+    link_scopes(if_stmt->then_branch, parent);
+    link_scopes(if_stmt->else_branch, parent);
+    break;
+  }
+  case ASTType::While:
+    link_scopes(std::static_pointer_cast<While>(stmt)->body, parent);
+    break;
+  default:
+    break;
+  }
+}
+
+} // namespace
+
+ModuleCache::ModuleCache(std::filesystem::path directory, size_t max_entries)
+    : directory(std::move(directory)), max_entries(max_entries) {
+  std::error_code error;
+  std::filesystem::create_directories(interfaces(), error);
+  if (error) {
+    spdlog::warn("[cache] Could not create {}: {}, modules are not cached",
+                 this->directory.string(), error.message());
+    writable = false;
+    return;
+  }
+  for (const auto &file :
+       std::filesystem::directory_iterator(this->directory, error)) {
+    entries += is_entry(file);
+  }
+}
+
+size_t ModuleCache::default_max_entries() {
+  if (const char *text = std::getenv("ENKI_CACHE_ENTRIES")) {
+    char *end;
+    auto value = std::strtoull(text, &end, 10);
+    if (*text && !*end && value > 0) {
+      return value;
+    }
+    spdlog::warn("[cache] Ignoring ENKI_CACHE_ENTRIES={}, expected a positive "
+                 "number",
+                 text);
+  }
+  return fallback_max_entries;
+}
+
+std::optional<std::filesystem::path> ModuleCache::default_directory() {
+  if (const char *dir = std::getenv("ENKI_CACHE_DIR")) {
+    return std::filesystem::path(dir);
+  }
+  if (const char *dir = std::getenv("XDG_CACHE_HOME")) {
+    return std::filesystem::path(dir) / "enki";
+  }
+  if (const char *home = std::getenv("HOME")) {
+    return std::filesystem::path(home) / ".cache" / "enki";
+  }
+  return std::nullopt;
+}
+
+uint64_t ModuleCache::source_key(std::string_view path,
+                                 std::string_view source) {
+  uint64_t key = hash::fnv1a(compiler_key(), path);
+  key = hash::fnv1a(key, static_cast<uint64_t>(source.size()));
+  return hash::fnv1a(key, source);
+}
+
+uint64_t ModuleCache::module_key(uint64_t source_key,
+                                 const std::vector<Import> &imports) {
+  uint64_t key = source_key;
+  for (const auto &import : imports) {
+    key = hash::fnv1a(hash::fnv1a(key, import.name), import.key);
+  }
+  return key;
+}
+
+std::filesystem::path ModuleCache::entry_path(uint64_t source_key) const {
+  return directory / fmt::format("{:016x}.cbor", source_key);
+}
+
+std::optional<ModuleCache::Entry> ModuleCache::load(uint64_t source_key) {
+  std::ifstream file(entry_path(source_key), std::ios::binary);
+  if (!file.is_open()) {
+    return std::nullopt;
+  }
+  std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)),
+                             std::istreambuf_iterator<char>());
+  try {
+    auto j = json::from_cbor(bytes);
+    Entry entry;
+    for (const auto &import : j.at("imports")) {
+      entry.imports.push_back(
+          {import.at(0).get<std::string>(), import.at(1).get<uint64_t>()});
+    }
+    entry.program = std::make_shared<Program>();
+    {
+      std::lock_guard lock(_interning);
+      from_json(j.at("program"), *entry.program);
+    }
+    entry.program->body->scope = entry.program->scope;
+    for (const auto &stmt : entry.program->body->statements) {
+      link_scopes(stmt, entry.program->scope);
+    }
+    // The modification time orders the entries for evict()
+    std::error_code error;
+    std::filesystem::last_write_time(
+        entry_path(source_key), std::filesystem::file_time_type::clock::now(),
+        error);
+    return entry;
+  } catch (const std::exception &error) {
+    spdlog::warn("[cache] Ignoring unreadable entry {}: {}",
+                 entry_path(source_key).string(), error.what());
+    return std::nullopt;
+  }
+}
+
+void ModuleCache::store(uint64_t source_key, const Program &program,
+                        const std::vector<Import> &imports) {
+  if (!writable) {
+    return;
+  }
+  json j;
+  j["program"] = program;
+  j["imports"] = json::array();
+  for (const auto &import : imports) {
+    j["imports"].push_back({import.name, import.key});
+  }
+  auto bytes = json::to_cbor(j);
+
+  // Written next to the entry and renamed over it, so compiles running at
+  // the same time never see half an entry
+  auto path = entry_path(source_key);
+  std::error_code error;
+  bool replaced = std::filesystem::exists(path, error);
+  auto temporary = path;
+  temporary += fmt::format(".{}.tmp", getpid());
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+      spdlog::warn("[cache] Could not write {}", temporary.string());
+      return;
+    }
+    file.write(reinterpret_cast<const char *>(bytes.data()),
+               static_cast<std::streamsize>(bytes.size()));
+  }
+  std::filesystem::rename(temporary, path, error);
+  if (error) {
+    spdlog::warn("[cache] Could not write {}: {}", path.string(),
+                 error.message());
+    std::filesystem::remove(temporary, error);
+    return;
+  }
+  ++stats.stores;
+  if (!replaced && ++entries > max_entries) {
+    evict();
+  }
+}
+
+void ModuleCache::evict() {
+  std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>>
+      files;
+  std::error_code error;
+  for (const auto &file :
+       std::filesystem::directory_iterator(directory, error)) {
+    if (is_entry(file)) {
+      files.emplace_back(file.last_write_time(error), file.path());
+    }
+  }
+  std::sort(files.begin(), files.end());
+  entries = files.size();
+  for (const auto &[time, path] : files) {
+    if (entries <= max_entries) {
+      break;
+    }
+    // Another compile may have removed it first, it is gone either way
+    std::filesystem::remove(path, error);
+    --entries;
+    ++stats.evictions;
+    spdlog::debug("[cache] Evicted {}", path.string());
+  }
+}
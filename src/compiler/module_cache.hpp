@@ -0,0 +1,87 @@
+#pragma once
+
+#include "../definitions/ast.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Parsed modules kept on disk between compiles, so an import whose file has
+// not changed is read back instead of being lexed and parsed again. Entries
+// are the AST in CBOR, through the JSON serialization of the AST, stored under
+// a hash of the compiler, the module's path and its source. An entry also
+// records the key every import of the module had when it was stored, and is
+// only used while all of them still match, so a change to a module reaches
+// everything importing it. The cache holds at most `max_entries` entries, the
+// least recently used go first once it is full.
+class ModuleCache {
+public:
+  // What a cached module was built from
+  struct Import {
+    std::string name;
+    uint64_t key;
+  };
+
+  struct Entry {
+    Ref<Program> program;
+    std::vector<Import> imports;
+  };
+
+  struct Stats {
+    int hits = 0;
+    int misses = 0;
+    int stores = 0;
+    int evictions = 0;
+    int interfaces = 0; // Modules imported from their interface
+  };
+
+  explicit ModuleCache(std::filesystem::path directory,
+                       size_t max_entries = default_max_entries());
+
+  // `ENKI_CACHE_ENTRIES`, or 4096
+  static size_t default_max_entries();
+
+  // Where the interfaces of the modules are kept, see module_interface.hpp.
+  // There is one per module, they are not counted as entries.
+  std::filesystem::path interfaces() const { return directory / "interfaces"; }
+
+  // `ENKI_CACHE_DIR`, or `enki` inside `XDG_CACHE_HOME` or `~/.cache`;
+  // nullopt when none of them is set
+  static std::optional<std::filesystem::path> default_directory();
+
+  // Key of a module's own text, its imports are checked separately
+  static uint64_t source_key(std::string_view path, std::string_view source);
+  // Key of a module together with the keys of what it imports
+  static uint64_t module_key(uint64_t source_key,
+                             const std::vector<Import> &imports);
+
+  // The program is missing its source buffer and module context, which the
+  // caller attaches. Unreadable or corrupt entries are misses. A loaded entry
+  // becomes the most recently used. Safe to call from several threads.
+  std::optional<Entry> load(uint64_t source_key);
+  void store(uint64_t source_key, const Program &program,
+             const std::vector<Import> &imports);
+
+  // Loads that turned out to be stale count as misses, not hits
+  void record_hit() { ++stats.hits; }
+  void record_miss() { ++stats.misses; }
+  void record_interface() { ++stats.interfaces; }
+  const Stats &statistics() const { return stats; }
+  void reset_statistics() { stats = {}; }
+
+private:
+  std::filesystem::path entry_path(uint64_t source_key) const;
+  // Removes the least recently used entries until there are at most
+  // `max_entries`
+  void evict();
+
+  std::filesystem::path directory;
+  bool writable = true;
+  size_t max_entries;
+  // Entries in the directory, counted when the cache is opened and kept up
+  // to date by this process only, other compiles are noticed by evict()
+  size_t entries = 0;
+  Stats stats;
+};
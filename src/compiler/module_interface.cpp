@@ -0,0 +1,143 @@
+#include "module_interface.hpp"
+#include "../definitions/serializations.hpp"
+#include "../utils/hash.hpp"
+#include <array>
+#include <fmt/format.h>
+#include <fstream>
+#include <iterator>
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+
+namespace {
+
+// Bumped whenever the layout of the file changes
+constexpr std::array<char, 8> magic = {'E', 'N', 'K', 'I', 'I', 0, 0, 1};
+
+struct Header {
+  std::array<char, 8> magic;
+  uint64_t source_key;
+};
+
+bool read_header(std::ifstream &file, uint64_t source_key) {
+  Header header;
+  if (!file.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+    return false;
+  }
+  return header.magic == magic && header.source_key == source_key;
+}
+
+// Everything importers can name, functions without their bodies
+Ref<Program> interface_of(const Program &program) {
+  auto interface = std::make_shared<Program>();
+  interface->span = program.span;
+  interface->body = std::make_shared<Block>();
+  interface->body->span = program.body->span;
+  for (const auto &stmt : program.body->statements) {
+    switch (stmt->get_type()) {
+    case ASTType::Import:
+    case ASTType::StructDefinition:
+    case ASTType::EnumDefinition:
+    case ASTType::Extern:
+    case ASTType::VarDecl:
+      interface->body->statements.push_back(stmt);
+      break;
+    case ASTType::FunctionDefinition: {
+      auto func_def = std::static_pointer_cast<FunctionDefinition>(stmt);
+      if (!func_def->body || func_def->identifier->name == "main") {
+        break;
+      }
+      auto signature = std::make_shared<FunctionDefinition>(*func_def);
+      signature->body = nullptr;
+      signature->returns.clear();
+      signature->recursive_calls.clear();
+      interface->body->statements.push_back(signature);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  return interface;
+}
+
+} // namespace
+
+std::filesystem::path interface_path(const std::filesystem::path &directory,
+                                     const std::string &module_path) {
+  std::error_code error;
+  auto absolute = std::filesystem::absolute(module_path, error);
+  auto key = hash::fnv1a(hash::fnv_offset,
+                         (error ? std::filesystem::path(module_path) : absolute)
+                             .lexically_normal()
+                             .string());
+  return directory / fmt::format("{:016x}.enkii", key);
+}
+
+bool interface_is_current(const std::filesystem::path &directory,
+                          const std::string &module_path,
+                          uint64_t source_key) {
+  std::ifstream file(interface_path(directory, module_path), std::ios::binary);
+  return file.is_open() && read_header(file, source_key);
+}
+
+void write_interface(const std::filesystem::path &directory,
+                     const std::string &module_path, uint64_t source_key,
+                     const Program &program) {
+  json j;
+  j["program"] = *interface_of(program);
+  auto bytes = json::to_cbor(j);
+
+  // Another compile may be reading it, it only ever sees a whole file
+  auto path = interface_path(directory, module_path);
+  auto temporary = path;
+  temporary += fmt::format(".{}.tmp", getpid());
+  {
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+      spdlog::debug("[interface] Could not write {}", temporary.string());
+      return;
+    }
+    Header header{magic, source_key};
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(bytes.data()),
+               static_cast<std::streamsize>(bytes.size()));
+  }
+  std::error_code error;
+  std::filesystem::rename(temporary, path, error);
+  if (error) {
+    spdlog::debug("[interface] Could not write {}: {}", path.string(),
+                  error.message());
+    std::filesystem::remove(temporary, error);
+  }
+}
+
+Ref<Program> read_interface(const std::filesystem::path &directory,
+                            const std::string &module_path,
+                            uint64_t source_key) {
+  auto path = interface_path(directory, module_path);
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open() || !read_header(file, source_key)) {
+    return nullptr;
+  }
+  std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)),
+                             std::istreambuf_iterator<char>());
+  try {
+    auto j = json::from_cbor(bytes);
+    auto program = std::make_shared<Program>();
+    {
+      std::lock_guard lock(_interning);
+      from_json(j.at("program"), *program);
+    }
+    program->body->scope = program->scope;
+    for (const auto &stmt : program->body->statements) {
+      if (stmt->get_type() == ASTType::FunctionDefinition) {
+        std::static_pointer_cast<FunctionDefinition>(stmt)->external = true;
+      }
+    }
+    return program;
+  } catch (const std::exception &error) {
+    spdlog::warn("[interface] Ignoring unreadable {}: {}", path.string(),
+                 error.what());
+    return nullptr;
+  }
+}
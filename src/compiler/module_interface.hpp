@@ -0,0 +1,41 @@
+#pragma once
+
+#include "../definitions/ast.hpp"
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+// What importers see of a module: its imports and top level declarations,
+// with the functions reduced to their signatures and without its main.
+// Reading it instead of the module skips parsing the function bodies, so an
+// import costs the size of the interface rather than of the module.
+// Interfaces are kept in a directory of the module cache (see
+// ModuleCache::interfaces), one `.enkii` file per module, named by a hash of
+// the module's absolute path. The file starts with a magic number and the
+// source key of the module it was written from (see
+// ModuleCache::source_key), followed by the declarations in CBOR.
+//
+// A module imported from its interface can be typechecked against, but has
+// no code: its functions are `external`, defined by a unit built from the
+// module itself.
+
+std::filesystem::path interface_path(const std::filesystem::path &directory,
+                                     const std::string &module_path);
+
+// Whether the interface of the module was written for the source with the
+// given key, only its header is read
+bool interface_is_current(const std::filesystem::path &directory,
+                          const std::string &module_path, uint64_t source_key);
+
+// Writes the interface of a parsed module. The file is renamed into place, and
+// failing to write it is not an error.
+void write_interface(const std::filesystem::path &directory,
+                     const std::string &module_path, uint64_t source_key,
+                     const Program &program);
+
+// The interface of the module if it is current, null otherwise. The program
+// is missing its source buffer and module context, which the caller attaches.
+// Safe to call from several threads.
+Ref<Program> read_interface(const std::filesystem::path &directory,
+                            const std::string &module_path,
+                            uint64_t source_key);
@@ -0,0 +1,492 @@
+#include "modules.hpp"
+#include "../utils/logging.hpp"
+#include "module_interface.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+namespace {
+
+// Runs tasks on a fixed number of threads until there are none left, tasks
+// may push more while they run
+class WorkQueue {
+public:
+  void push(std::function<void()> task) {
+    {
+      std::lock_guard lock(mutex);
+      tasks.push_back(std::move(task));
+    }
+    ready.notify_one();
+  }
+
+  void run(unsigned threads) {
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; ++i) {
+      workers.emplace_back([this] { work(); });
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+private:
+  void work() {
+    std::unique_lock lock(mutex);
+    while (true) {
+      ready.wait(lock, [this] { return !tasks.empty() || running == 0; });
+      if (tasks.empty()) {
+        return;
+      }
+      auto task = std::move(tasks.front());
+      tasks.pop_front();
+      ++running;
+      lock.unlock();
+      task();
+      lock.lock();
+      --running;
+      if (tasks.empty() && running == 0) {
+        ready.notify_all();
+      }
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<std::function<void()>> tasks;
+  unsigned running = 0;
+};
+
+// Lexes a module, keeping its errors to be reported later
+bool lex_captured(const std::string &source, const std::string &path,
+                  std::vector<Token> &tokens, std::string &errors) {
+  logging::CapturedErrors captured;
+  try {
+    tokens = lex(source, path);
+    return true;
+  } catch (const logging::CompileError &) {
+    errors = captured.text();
+    return false;
+  }
+}
+
+// The imports of a module read from its interface
+std::vector<ImportReference> imports_in(const Program &program) {
+  std::vector<ImportReference> imports;
+  for (const auto &stmt : program.body->statements) {
+    if (stmt->get_type() == ASTType::Import) {
+      auto import_stmt = std::static_pointer_cast<Import>(stmt);
+      imports.push_back(
+          {std::string(import_stmt->module_path->value), import_stmt->span});
+    }
+  }
+  return imports;
+}
+
+// Parses a module, keeping its errors to be reported later
+void parse_captured(const std::vector<Token> &tokens,
+                    std::shared_ptr<std::string> source,
+                    Ref<ModuleContext> module_context, Ref<Program> &program,
+                    std::string &errors) {
+  logging::CapturedErrors captured;
+  try {
+    program = parse(tokens, source, module_context);
+  } catch (const logging::CompileError &) {
+    errors = captured.text();
+  } catch (const std::exception &error) {
+    // Running out of tokens in the middle of a statement
+    errors = captured.text() + "Error: " + error.what() + "\n";
+  }
+}
+
+} // namespace
+
+// A module on its way from the disk to `modules`
+struct ModuleContext::Load {
+  const std::string *path;
+  std::shared_ptr<std::string> source; // Null when it could not be opened
+  std::vector<Token> tokens;
+  std::vector<ImportReference> imports;
+  uint64_t source_key = 0;
+  std::optional<ModuleCache::Entry> cached;
+  Ref<Program> program;
+  bool from_interface = false;
+  std::string errors;
+};
+
+std::string ModuleContext::resolve(const std::string &name,
+                                   const std::string &importing_file) {
+  std::filesystem::path importee(name);
+  // Only append .enki if not already present
+  if (importee.extension() != ".enki") {
+    importee += ".enki";
+  }
+  auto path = importing_file.empty()
+                  ? importee
+                  : std::filesystem::path(importing_file).parent_path() /
+                        importee;
+  return path.lexically_normal().string();
+}
+
+std::vector<ImportReference>
+ModuleContext::scan_imports(const std::vector<Token> &tokens) {
+  std::vector<ImportReference> imports;
+  for (size_t i = 0; i + 2 < tokens.size(); ++i) {
+    if (tokens[i].type == TokenType::Import &&
+        tokens[i + 1].type == TokenType::LessThan &&
+        tokens[i + 2].type == TokenType::String) {
+      imports.push_back({std::string(tokens[i + 2].value),
+                         Span(tokens[i].span.start, tokens[i + 2].span.end)});
+    }
+  }
+  return imports;
+}
+
+std::vector<ModuleCache::Import>
+ModuleContext::imports_of(const Program &program, const std::string &path) {
+  std::vector<ModuleCache::Import> imports;
+  for (const auto &stmt : program.body->statements) {
+    if (stmt->get_type() != ASTType::Import) {
+      continue;
+    }
+    auto import_stmt = std::static_pointer_cast<Import>(stmt);
+    std::string import_name(import_stmt->module_path->value);
+    auto key = keys.find(resolve(import_name, path));
+    imports.push_back({import_name, key != keys.end() ? key->second : 0});
+  }
+  return imports;
+}
+
+void ModuleContext::load_imports(const std::string &file,
+                                 const std::string &source,
+                                 const std::vector<Token> &tokens) {
+  auto root_imports = scan_imports(tokens);
+  if (root_imports.empty()) {
+    return;
+  }
+  auto self = std::static_pointer_cast<ModuleContext>(shared_from_this());
+  auto root = std::filesystem::path(file).lexically_normal().string();
+
+  // Every module is read, lexed and scanned for its imports, which are
+  // queued right away, before it is parsed or read from the cache
+  std::mutex mutex;
+  std::unordered_map<std::string, std::unique_ptr<Load>> loads;
+  WorkQueue queue;
+  std::function<void(Load &)> load_module;
+  auto schedule = [&](const std::string &path) {
+    std::lock_guard lock(mutex);
+    if (path == root || modules.contains(path) || loads.contains(path)) {
+      return;
+    }
+    auto &entry = loads[path] = std::make_unique<Load>();
+    entry->path = &*paths.insert(path).first;
+    queue.push([&load_module, load = entry.get()] { load_module(*load); });
+  };
+  load_module = [&](Load &load) {
+    std::ifstream input(*load.path);
+    if (!input.is_open()) {
+      return;
+    }
+    std::stringstream buffer;
+    buffer << input.rdbuf();
+    load.source = std::make_shared<std::string>(buffer.str());
+    load.source_key = ModuleCache::source_key(*load.path, *load.source);
+    if (use_interface && cache &&
+        (load.program = read_interface(cache->interfaces(), *load.path,
+                                       load.source_key))) {
+      load.from_interface = true;
+      load.imports = imports_in(*load.program);
+      for (const auto &import : load.imports) {
+        schedule(resolve(import.name, *load.path));
+      }
+      return;
+    }
+
+    if (!lex_captured(*load.source, *load.path, load.tokens, load.errors)) {
+      return;
+    }
+    load.imports = scan_imports(load.tokens);
+    for (const auto &import : load.imports) {
+      schedule(resolve(import.name, *load.path));
+    }
+
+    if (cache && (load.cached = cache->load(load.source_key))) {
+      return;
+    }
+    parse_captured(load.tokens, load.source, self, load.program, load.errors);
+  };
+
+  for (const auto &import : root_imports) {
+    schedule(resolve(import.name, file));
+  }
+  unsigned threads =
+      jobs ? jobs : std::max(1u, std::thread::hardware_concurrency());
+  queue.run(threads);
+
+  // Walking the graph in import order from the root makes the order of the
+  // diagnostics, and of the modules, independent of the threads
+  std::string errors;
+  std::unordered_set<std::string> visited;
+  std::vector<std::string> chain{root};
+  std::vector<Load *> loaded;
+  std::function<void(const std::string &, const std::vector<ImportReference> &,
+                     const std::string &)>
+      visit = [&](const std::string &importer,
+                  const std::vector<ImportReference> &imports,
+                  const std::string &importer_source) {
+        for (const auto &import : imports) {
+          auto path = resolve(import.name, importer);
+          auto cycle = std::find(chain.begin(), chain.end(), path);
+          if (cycle != chain.end()) {
+            std::string route;
+            for (auto it = cycle; it != chain.end(); ++it) {
+              route += *it + " -> ";
+            }
+            logging::CapturedErrors captured;
+            try {
+              LOG_ERROR_EXIT("[modules] Import cycle: " + route + path,
+                             import.span, importer_source);
+            } catch (const logging::CompileError &) {
+              errors += captured.text();
+            }
+            continue;
+          }
+          auto load = loads.find(path);
+          if (load == loads.end() || !visited.insert(path).second) {
+            continue;
+          }
+          if (!load->second->source) {
+            // The importer is linked against the module, it can't do without
+            logging::CapturedErrors captured;
+            try {
+              LOG_ERROR_EXIT("[modules] Could not open module '" + import.name +
+                                 "', looked for " + path,
+                             import.span, importer_source);
+            } catch (const logging::CompileError &) {
+              errors += captured.text();
+            }
+            continue;
+          }
+          errors += load->second->errors;
+          chain.push_back(path);
+          visit(path, load->second->imports, *load->second->source);
+          chain.pop_back();
+          loaded.push_back(load->second.get());
+        }
+      };
+  visit(file, root_imports, source);
+  if (!errors.empty()) {
+    logging::report_errors(errors);
+  }
+
+  // A cached module is only used if everything it imports has the same key
+  // as when it was stored, the imports come first in `loaded`
+  std::vector<Load *> stale;
+  for (auto *load : loaded) {
+    auto &path = *load->path;
+    if (load->from_interface) {
+      keys[path] = ModuleCache::module_key(load->source_key,
+                                           imports_of(*load->program, path));
+      if (use_interface(path, keys[path])) {
+        spdlog::debug("[modules] Imported {} from its interface", path);
+        cache->record_interface();
+        load->program->source_buffer = load->source;
+        load->program->module_context = self;
+        continue;
+      }
+      spdlog::debug("[modules] {} is needed whole", path);
+      load->from_interface = false;
+      load->program = nullptr;
+      stale.push_back(load);
+      if (cache) {
+        cache->record_miss();
+      }
+      continue;
+    }
+    if (load->cached) {
+      bool fresh = std::all_of(
+          load->cached->imports.begin(), load->cached->imports.end(),
+          [&](const ModuleCache::Import &import) {
+            auto key = keys.find(resolve(import.name, path));
+            return (key != keys.end() ? key->second : 0) == import.key;
+          });
+      if (fresh) {
+        cache->record_hit();
+        spdlog::debug("[cache] Loaded {} from the cache", path);
+        load->program = load->cached->program;
+        load->program->source_buffer = load->source;
+        load->program->module_context = self;
+        keys[path] =
+            ModuleCache::module_key(load->source_key, load->cached->imports);
+        continue;
+      }
+      spdlog::debug("[cache] {} is stale, an import changed", path);
+      keys[path] = ModuleCache::module_key(
+          load->source_key, imports_of(*load->cached->program, path));
+      stale.push_back(load);
+    } else {
+      keys[path] = ModuleCache::module_key(load->source_key,
+                                           imports_of(*load->program, path));
+    }
+    if (cache) {
+      cache->record_miss();
+    }
+  }
+
+  for (auto *load : stale) {
+    queue.push([&, load] {
+      // Modules that were going to be imported from their interface
+      if (load->tokens.empty() &&
+          !lex_captured(*load->source, *load->path, load->tokens,
+                        load->errors)) {
+        return;
+      }
+      parse_captured(load->tokens, load->source, self, load->program,
+                     load->errors);
+    });
+  }
+  queue.run(std::min<unsigned>(stale.size(), threads));
+  for (auto *load : stale) {
+    errors += load->errors;
+  }
+  if (!errors.empty()) {
+    logging::report_errors(errors);
+  }
+
+  for (auto *load : loaded) {
+    auto &path = *load->path;
+    bool from_cache = load->cached && load->program == load->cached->program;
+    if (cache && !from_cache && !load->from_interface) {
+      cache->store(load->source_key, *load->program,
+                   imports_of(*load->program, path));
+    }
+    if (write_interfaces && cache && !load->from_interface &&
+        !interface_is_current(cache->interfaces(), path, load->source_key)) {
+      write_interface(cache->interfaces(), path, load->source_key,
+                      *load->program);
+    }
+    modules[path] = load->program;
+    order.push_back(path);
+    utils::ast::print_ast(*load->program, 0, 10);
+  }
+}
+
+bool ModuleContext::preload(const std::string &file) {
+  std::ifstream input(file);
+  if (!input.is_open()) {
+    return false;
+  }
+  std::stringstream buffer;
+  buffer << input.rdbuf();
+  auto source = buffer.str();
+
+  auto level = spdlog::get_level();
+  spdlog::set_level(spdlog::level::off);
+  auto *out = std::cout.rdbuf(nullptr);
+  auto *err = std::cerr.rdbuf(nullptr);
+  {
+    logging::RecoverableErrors recoverable;
+    try {
+      load_imports(file, source, lex(source, file));
+    } catch (const std::exception &) {
+    }
+  }
+  std::cerr.rdbuf(err);
+  std::cout.rdbuf(out);
+  spdlog::set_level(level);
+  return true;
+}
+
+std::vector<std::string> ModuleContext::imported_paths(
+    const std::vector<Ref<Statement>> &statements) {
+  std::vector<std::string> paths;
+  std::unordered_set<std::string> visited;
+  std::function<void(const std::vector<Ref<Statement>> &)> visit =
+      [&](const std::vector<Ref<Statement>> &statements) {
+        for (const auto &stmt : statements) {
+          if (stmt->get_type() != ASTType::Import) {
+            continue;
+          }
+          auto import_stmt = std::static_pointer_cast<Import>(stmt);
+          auto path = resolve(std::string(import_stmt->module_path->value),
+                              std::string(import_stmt->span.start.file_name));
+          auto module = modules.find(path);
+          if (module == modules.end() || !visited.insert(path).second) {
+            continue;
+          }
+          visit(module->second->body->statements);
+          paths.push_back(path);
+        }
+      };
+  visit(statements);
+  return paths;
+}
+
+std::vector<Ref<Statement>>
+ModuleContext::declarations(const std::string &path) {
+  std::vector<Ref<Statement>> declarations;
+  for (const auto &stmt : modules.at(path)->body->statements) {
+    if (stmt->get_type() == ASTType::Import) {
+      continue;
+    }
+    if (stmt->get_type() == ASTType::FunctionDefinition) {
+      auto func_def = std::static_pointer_cast<FunctionDefinition>(stmt);
+      bool builtin = !func_def->body && !func_def->external;
+      if (builtin || func_def->identifier->name == "main") {
+        continue;
+      }
+    }
+    declarations.push_back(stmt);
+  }
+  return declarations;
+}
+
+std::vector<std::string>
+ModuleContext::forget(const std::unordered_set<std::string> &changed) {
+  // A module comes after its imports in `order`, so whether an import was
+  // dropped is known by the time the module is reached
+  std::unordered_set<std::string> dropped;
+  std::vector<std::string> kept;
+  for (const auto &path : order) {
+    bool drop = changed.contains(path);
+    for (const auto &stmt : modules.at(path)->body->statements) {
+      if (drop) {
+        break;
+      }
+      if (stmt->get_type() == ASTType::Import) {
+        auto import_stmt = std::static_pointer_cast<Import>(stmt);
+        drop = dropped.contains(
+            resolve(std::string(import_stmt->module_path->value), path));
+      }
+    }
+    if (drop) {
+      dropped.insert(path);
+      modules.erase(path);
+      keys.erase(path);
+      typechecked.erase(path);
+    } else {
+      kept.push_back(path);
+    }
+  }
+  order = std::move(kept);
+  return {dropped.begin(), dropped.end()};
+}
+
+void link_modules(Ref<Program> program) {
+  auto &statements = program->body->statements;
+  std::vector<Ref<Statement>> linked;
+  for (const auto &path :
+       program->module_context->imported_paths(statements)) {
+    auto declarations = program->module_context->declarations(path);
+    linked.insert(linked.end(), declarations.begin(), declarations.end());
+  }
+  std::erase_if(statements, [](const Ref<Statement> &stmt) {
+    return stmt->get_type() == ASTType::Import;
+  });
+  statements.insert(statements.begin(), linked.begin(), linked.end());
+}
@@ -1,14 +1,19 @@
 #pragma once
 #include "../compiler/lexer.hpp"
+#include "../compiler/module_cache.hpp"
 #include "../compiler/parser.hpp"
 #include "../definitions/ast.hpp"
 #include "../definitions/tokens.hpp"
 #include "../utils/printer.hpp"
 #include <filesystem>
+#include <functional>
 #include <fstream>
 #include <spdlog/spdlog.h>
 #include <sstream>
+#include <string>
 #include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 // Forward declaration for the new parse signature
@@ -16,50 +21,91 @@ Ref<Program> parse(const std::vector<Token> &tokens,
                    std::shared_ptr<std::string> source_buffer,
                    Ref<ModuleContext> module_context);
 
+// An `import <"name">` found by scanning the tokens of a module
+struct ImportReference {
+  std::string name;
+  Span span;
+};
+
+// The modules a program imports, directly or not. They are loaded before the
+// program is parsed: the imports of a module are found by scanning its
+// tokens, so every module can be lexed and parsed on its own, and the whole
+// graph is loaded on a pool of threads. A module imported from its interface
+// is not even lexed, the interface lists its imports. Errors found while
+// loading are reported in the same order however the threads finished.
 struct ModuleContext : std::enable_shared_from_this<ModuleContext> {
+  // Every loaded module by its path, relative to the working directory
   std::unordered_map<std::string, std::shared_ptr<Program>> modules;
+  // The paths of the modules ordered so that every module comes after the
+  // ones it imports, the order they have to be typechecked in
+  std::vector<std::string> order;
+  // Set when parsed modules should be reused across compiles
+  Ref<ModuleCache> cache;
+  // Cache key of every loaded module, including the keys of its imports
+  std::unordered_map<std::string, uint64_t> keys;
+  // The spans of a module's AST point into its path
+  std::unordered_set<std::string> paths;
+  // Threads loading modules, 0 uses one per core
+  unsigned jobs = 0;
+  // Modules that have been typechecked, each is typechecked once, for the
+  // first program importing it
+  std::unordered_set<std::string> typechecked;
+  // Whether modules that are parsed leave an interface in the module cache,
+  // see module_interface.hpp
+  bool write_interfaces = false;
+  // Whether the module at a path, with the given key, may be imported from
+  // its interface when that is current, which is when the compile does not
+  // need the module's code. Unset, every module is imported whole.
+  std::function<bool(const std::string &path, uint64_t key)> use_interface;
 
-  std::shared_ptr<Program> get_module(const std::string &name) {
-    return modules[name];
-  }
-
-  std::shared_ptr<Program> add_module(const std::string &name,
-                                      const std::string &importing_file = "") {
-    // If already loaded, return it
-    if (modules.find(name) != modules.end()) {
-      return modules[name];
-    }
+  // Path of the module `name` imported by the file `importing_file`
+  static std::string resolve(const std::string &name,
+                             const std::string &importing_file);
+  // The imports of a module in source order, without parsing it
+  static std::vector<ImportReference>
+  scan_imports(const std::vector<Token> &tokens);
 
-    std::filesystem::path importee(name);
-    // Only append .enki if not already present
-    if (importee.extension() != ".enki") {
-      importee += ".enki";
-    }
+  // Loads everything imported by the module `file` with the given source and
+  // tokens, which is usually the program being compiled. Modules loaded by
+  // an earlier call are not loaded again. Import cycles, modules that cannot
+  // be opened and errors in the imported modules end the compile.
+  void load_imports(const std::string &file, const std::string &source,
+                    const std::vector<Token> &tokens);
 
-    std::string resolved_path;
-    if (!importing_file.empty()) {
-      std::filesystem::path importer(importing_file);
-      resolved_path = (importer.parent_path() / importee).string();
-    } else {
-      resolved_path = importee.string();
-    }
+  // Loads everything the file imports ahead of compiling it, without
+  // reporting anything: modules that fail to load are left out, and the
+  // compile loads them again and reports why. Returns false when the file
+  // cannot be read.
+  bool preload(const std::string &file);
 
-    std::ifstream file(resolved_path);
-    if (!file.is_open()) {
-      spdlog::error("Failed to open file: {} (resolved from: {} in {})",
-                    resolved_path, name, importing_file);
-      return nullptr;
-    }
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    std::string code = buffer.str();
+  std::shared_ptr<Program> get_module(const std::string &name,
+                                      const std::string &importing_file) {
+    auto module = modules.find(resolve(name, importing_file));
+    return module != modules.end() ? module->second : nullptr;
+  }
 
-    auto tokens = lex(code, resolved_path);
-    auto self = std::static_pointer_cast<ModuleContext>(shared_from_this());
-    auto program = parse(tokens, std::make_shared<std::string>(code), self);
+  // Paths of the modules the statements import, directly or not, each once
+  // and after the modules it imports
+  std::vector<std::string>
+  imported_paths(const std::vector<Ref<Statement>> &statements);
+  // What is emitted for the module at `path`, and what its importers see:
+  // its top level without its imports, the builtins and its main
+  std::vector<Ref<Statement>> declarations(const std::string &path);
+  // Drops the modules at the changed paths and every module importing them,
+  // directly or not, so that the next load_imports reads them again.
+  // Returns the paths that were dropped.
+  std::vector<std::string>
+  forget(const std::unordered_set<std::string> &changed);
 
-    modules[name] = program;
-    utils::ast::print_ast(*program, 0, 10);
-    return program;
-  }
+private:
+  struct Load;
+  // The names imported by the top level of a module, with the keys they
+  // were loaded under. Imports that failed to load have key 0.
+  std::vector<ModuleCache::Import> imports_of(const Program &program,
+                                              const std::string &path);
 };
+
+// Replaces the imports of a typechecked program by the declarations of the
+// modules it imports, so that the backends emit every module once, before
+// the code using it
+void link_modules(Ref<Program> program);
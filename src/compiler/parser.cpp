@@ -1,11 +1,14 @@
 #include "parser.hpp"
 #include "../utils/logging.hpp"
+#include <algorithm>
 #include <format>
 #include <iostream>
 #include <spdlog/spdlog.h>
+#include <utility>
 
 bool is_assignable(Ref<Expression> expr) {
-  return expr->get_type() == ASTType::Identifier;
+  return expr->get_type() == ASTType::Identifier ||
+         expr->get_type() == ASTType::Index;
 }
 
 Ref<Identifier> parse_identifier(ParserContext &ctx);
@@ -122,8 +125,9 @@ Ref<Expression> parse_atom(ParserContext &ctx) {
       ctx.consume();
       auto dot_expr = std::make_shared<Dot>();
       dot_expr->left = ident;
-      dot_expr->right = parse_expression(
-          ctx); // Parse as full expression, not just identifier
+      // Parse an atom rather than a full expression, so `p.x + 1` binds as
+      // (p.x) + 1. Chains like a.b.c still nest through parse_atom.
+      dot_expr->right = parse_atom(ctx);
       if (!dot_expr->right) {
         LOG_ERROR_EXIT(
             "[parser] Expected expression after '.' in dot expression",
@@ -134,6 +138,21 @@ Ref<Expression> parse_atom(ParserContext &ctx) {
       return dot_expr;
     }
 
+    if (ctx.current < ctx.tokens.size() &&
+        ctx.current_token().type == TokenType::LSquare) {
+      ctx.consume();
+      auto index = std::make_shared<Index>();
+      index->base = ident;
+      index->index = parse_expression(ctx);
+      if (!index->index) {
+        LOG_ERROR_EXIT("[parser] Expected expression inside '[]'",
+                       ctx.current_token().span, *ctx.program->source_buffer);
+      }
+      ctx.consume_assert(TokenType::RSquare, "Missing ']' in Index");
+      index->span = Span(ident->span.start, ctx.previous_token_span().end);
+      return index;
+    }
+
     return ident;
   }
   case TokenType::True:
@@ -549,6 +568,46 @@ Ref<Extern> parse_extern(ParserContext &ctx) {
   return extern_stmt;
 }
 
+// One or more `@name` in front of a declaration, checked against the
+// declaration that follows. `@pure` promises that an extern has no side
+// effects and only depends on its arguments, `@tailcall` that every call a
+// function makes to itself can become a jump.
+std::vector<std::string_view> parse_annotations(ParserContext &ctx) {
+  static const std::vector<std::pair<std::string_view, TokenType>> known = {
+      {"pure", TokenType::Extern}, {"tailcall", TokenType::Define}};
+  std::vector<Ref<Identifier>> names;
+  while (ctx.consume_if(TokenType::At))
+    names.push_back(parse_identifier(ctx));
+
+  auto target = ctx.current_token().type;
+  if (target != TokenType::Extern && target != TokenType::Define) {
+    LOG_ERROR_EXIT("[parser] Annotations must be followed by an extern or "
+                   "function declaration",
+                   ctx.current_token().span, *ctx.program->source_buffer);
+  }
+  std::vector<std::string_view> annotations;
+  for (const auto &name : names) {
+    auto found = std::find_if(known.begin(), known.end(), [&](const auto &k) {
+      return k.first == name->name;
+    });
+    if (found == known.end()) {
+      LOG_ERROR_EXIT("[parser] Unknown annotation '@" +
+                         std::string(name->name) + "'",
+                     name->span, *ctx.program->source_buffer);
+    }
+    if (found->second != target) {
+      LOG_ERROR_EXIT("[parser] '@" + std::string(name->name) +
+                         "' only applies to " +
+                         (found->second == TokenType::Extern
+                              ? "extern declarations"
+                              : "function definitions"),
+                     name->span, *ctx.program->source_buffer);
+    }
+    annotations.push_back(name->name);
+  }
+  return annotations;
+}
+
 // @NOTE DOES NOT CONSUME {}
 Ref<Block> parse_block(ParserContext &ctx) {
   spdlog::debug("[parser] Entering parse_block at token {} with value '{}'",
@@ -599,6 +658,7 @@ Ref<Statement> parse_statement(ParserContext &ctx) {
                 ctx.current_token().value);
   const Token &tok = ctx.tokens[ctx.current];
   Span statement_start = tok.span;
+  bool allow_expression = std::exchange(ctx.allow_expression, false);
 
   if (tok.type == TokenType::StructType) {
     auto struct_def = parse_struct(ctx);
@@ -610,6 +670,19 @@ Ref<Statement> parse_statement(ParserContext &ctx) {
     return extern_stmt;
   }
 
+  if (tok.type == TokenType::At) {
+    auto annotations = parse_annotations(ctx);
+    if (ctx.current_token().type == TokenType::Extern) {
+      auto extern_stmt = parse_extern(ctx);
+      extern_stmt->annotations = annotations;
+      return extern_stmt;
+    }
+    auto function_def =
+        std::static_pointer_cast<FunctionDefinition>(parse_statement(ctx));
+    function_def->annotations = annotations;
+    return function_def;
+  }
+
   if (tok.type == TokenType::EnumType) {
     auto enum_def = parse_enum(ctx);
     return enum_def;
@@ -680,10 +753,8 @@ Ref<Statement> parse_statement(ParserContext &ctx) {
     import_stmt->module_path = std::dynamic_pointer_cast<Literal>(module_path);
     spdlog::debug("[parser] Module path: {}", import_stmt->module_path->value);
     import_stmt->span = Span(tok.span.start, module_path->span.end);
-
-    // Use CTX Module Context to add the module to the program
-    ctx.module_context->add_module(std::string(import_stmt->module_path->value),
-                                   ctx.current_file_path);
+    // The module itself was loaded before parsing started, see
+    // ModuleContext::load_imports
 
     ctx.consume_assert(TokenType::GreaterThan,
                        "Missing '>' in Import statement");
@@ -844,6 +915,7 @@ Ref<Statement> parse_statement(ParserContext &ctx) {
           ctx.current_token().span, *ctx.program->source_buffer);
     }
 
+    ctx.consume();
     auto body = parse_block(ctx);
     if (!body) {
       LOG_ERROR_EXIT(
@@ -853,6 +925,8 @@ Ref<Statement> parse_statement(ParserContext &ctx) {
               ")",
           ctx.current_token().span, *ctx.program->source_buffer);
     }
+    ctx.consume_assert(TokenType::RCurly, "Missing '}' in While body");
+    body->span = Span(statement_start.start, ctx.previous_token_span().end);
     while_stmt->body = body;
 
     while_stmt->span =
@@ -875,7 +949,7 @@ Ref<Statement> parse_statement(ParserContext &ctx) {
     }
 
     // Only allow function calls as expression statements
-    if (expr->get_type() == ASTType::Call) {
+    if (expr->get_type() == ASTType::Call || allow_expression) {
       auto expr_stmt = std::make_shared<ExpressionStatement>();
       expr_stmt->expression = expr;
       expr_stmt->span = expr->span;
@@ -907,11 +981,6 @@ Ref<Program> parse(const std::vector<Token> &tokens,
   ParserContext ctx{program, tokens, module_context};
   ctx.current_scope = program->scope;
 
-  // Try to get the file path from the first token, if available
-  if (!tokens.empty()) {
-    ctx.current_file_path = std::string(tokens[0].span.start.file_name);
-  }
-
   // Create a global block to contain all statements
   auto global_block = std::make_shared<Block>();
   global_block->scope = program->scope;
@@ -945,6 +1014,28 @@ Ref<Program> parse(const std::vector<Token> &tokens,
   return program;
 }
 
+std::vector<Ref<Statement>> parse_statements(const std::vector<Token> &tokens,
+                                             Ref<Program> program) {
+  ParserContext ctx{program, tokens, program->module_context};
+  ctx.current_scope = program->scope;
+
+  std::vector<Ref<Statement>> statements;
+  while (!ctx.eof() && ctx.current_token().type != TokenType::Eof) {
+    ctx.allow_expression = true;
+    auto stmt = parse_statement(ctx);
+    if (!stmt) {
+      LOG_ERROR_EXIT(
+          "[parser] Expected EOF but found '" +
+              std::string(ctx.current_token().value) + "' (" +
+              std::string(magic_enum::enum_name(ctx.current_token().type)) +
+              ")",
+          ctx.current_token().span, *ctx.program->source_buffer);
+    }
+    statements.push_back(stmt);
+  }
+  return statements;
+}
+
 void ParserContext::consume_assert(TokenType type, const std::string &message) {
   spdlog::debug("[parser] consume_assert: expecting {}, got {} with value '{}'",
                 magic_enum::enum_name(type),
@@ -12,12 +12,21 @@ Ref<Program> parse(const std::vector<Token> &tokens,
                    std::shared_ptr<std::string> source_buffer,
                    Ref<ModuleContext> module_context);
 
+// Parses more top level statements into the global scope of an existing
+// program and returns them, without adding them to its body. Used by the
+// REPL, which parses every input on its own and also allows expressions on
+// their own at the top level.
+std::vector<Ref<Statement>> parse_statements(const std::vector<Token> &tokens,
+                                             Ref<Program> program);
+
 struct ParserContext {
   Ref<Program> program;
   const std::vector<Token> &tokens;
   Ref<ModuleContext> module_context;
-  std::string current_file_path;
   Ref<Scope> current_scope;
+  // Lets the next statement be any expression, for the top level of REPL
+  // inputs. Cleared by the statement so nested blocks are unaffected.
+  bool allow_expression = false;
 
   size_t current = 0;
 
@@ -0,0 +1,296 @@
+#include "reachability.hpp"
+#include <spdlog/spdlog.h>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+class Reachability {
+public:
+  explicit Reachability(const Ref<Program> &program) {
+    for (const auto &stmt : program->body->statements) {
+      switch (stmt->get_type()) {
+      case ASTType::FunctionDefinition:
+        declare(std::static_pointer_cast<FunctionDefinition>(stmt)
+                    ->identifier->name,
+                stmt);
+        break;
+      case ASTType::StructDefinition:
+        declare(std::static_pointer_cast<StructDefinition>(stmt)
+                    ->identifier->name,
+                stmt);
+        break;
+      case ASTType::EnumDefinition: {
+        auto enum_def = std::static_pointer_cast<EnumDefinition>(stmt);
+        declare(enum_def->identifier->name, stmt);
+        if (enum_def->to_string_function) {
+          declare(enum_def->to_string_function->identifier->name,
+                  enum_def->to_string_function);
+        }
+        break;
+      }
+      default:
+        break;
+      }
+    }
+  }
+
+  bool has_main() const { return declarations.contains("main"); }
+  bool is_reachable(std::string_view name) const {
+    return reachable.contains(name);
+  }
+
+  void mark(std::string_view name) {
+    auto found = declarations.find(name);
+    if (found == declarations.end() || !reachable.insert(name).second)
+      return;
+    spdlog::debug("[reachability] {} is reachable", name);
+    worklist.push_back(found->second);
+  }
+
+  // Visits everything marked so far, and everything that marks in turn
+  void run() {
+    while (!worklist.empty()) {
+      auto stmt = worklist.back();
+      worklist.pop_back();
+      visit_declaration(stmt);
+    }
+  }
+
+  void visit_statement(const Ref<Statement> &stmt) {
+    if (!stmt)
+      return;
+    switch (stmt->get_type()) {
+    case ASTType::VarDecl: {
+      auto var_decl = std::static_pointer_cast<VarDecl>(stmt);
+      visit_type(var_decl->type);
+      visit_expression(var_decl->expression);
+      break;
+    }
+    case ASTType::Assignment: {
+      auto assignment = std::static_pointer_cast<Assignment>(stmt);
+      visit_expression(assignment->assignee);
+      visit_expression(assignment->expression);
+      break;
+    }
+    case ASTType::ExpressionStatement:
+      visit_expression(
+          std::static_pointer_cast<ExpressionStatement>(stmt)->expression);
+      break;
+    case ASTType::If: {
+      auto if_stmt = std::static_pointer_cast<If>(stmt);
+      visit_expression(if_stmt->condition);
+      visit_statement(if_stmt->then_branch);
+      visit_statement(if_stmt->else_branch);
+      break;
+    }
+    case ASTType::While: {
+      auto while_stmt = std::static_pointer_cast<While>(stmt);
+      visit_expression(while_stmt->condition);
+      visit_statement(while_stmt->body);
+      break;
+    }
+    case ASTType::Block:
+      for (const auto &child :
+           std::static_pointer_cast<Block>(stmt)->statements) {
+        visit_statement(child);
+      }
+      break;
+    case ASTType::Return:
+      visit_expression(std::static_pointer_cast<Return>(stmt)->expression);
+      break;
+    case ASTType::FunctionDefinition:
+      // Nested functions are kept with their parent
+      visit_declaration(stmt);
+      break;
+    default:
+      break;
+    }
+  }
+
+private:
+  std::unordered_map<std::string_view, Ref<Statement>> declarations;
+  std::unordered_set<std::string_view> reachable;
+  std::vector<Ref<Statement>> worklist;
+
+  void declare(std::string_view name, Ref<Statement> stmt) {
+    declarations[name] = std::move(stmt);
+  }
+
+  void visit_declaration(const Ref<Statement> &stmt) {
+    switch (stmt->get_type()) {
+    case ASTType::FunctionDefinition: {
+      auto func_def = std::static_pointer_cast<FunctionDefinition>(stmt);
+      for (const auto &param : func_def->parameters)
+        visit_type(param->type);
+      visit_type(func_def->return_type);
+      visit_statement(func_def->body);
+      break;
+    }
+    case ASTType::StructDefinition:
+      for (const auto &field :
+           std::static_pointer_cast<StructDefinition>(stmt)->fields) {
+        visit_type(field->type);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  void visit_type(const Ref<Type> &type) {
+    if (!type)
+      return;
+    switch (type->base_type) {
+    case BaseType::Struct:
+      if (auto structure = std::get_if<Ref<Struct>>(&type->structure);
+          structure && *structure) {
+        mark((*structure)->name);
+      }
+      break;
+    case BaseType::Enum:
+      if (auto structure = std::get_if<Ref<Enum>>(&type->structure);
+          structure && *structure) {
+        mark((*structure)->name);
+      }
+      break;
+    case BaseType::Pointer:
+    case BaseType::Type:
+      if (auto pointee = std::get_if<Ref<Type>>(&type->structure))
+        visit_type(*pointee);
+      break;
+    case BaseType::Function:
+      if (auto function = std::get_if<Ref<Function>>(&type->structure);
+          function && *function) {
+        for (const auto &param : (*function)->parameters)
+          visit_type(param->type);
+        visit_type((*function)->return_type);
+      }
+      break;
+    case BaseType::Unknown:
+    case BaseType::Identifier:
+      // Not resolved by the typechecker, only the name is known
+      mark(type->name);
+      break;
+    default:
+      break;
+    }
+  }
+
+  void visit_expression(const Ref<Expression> &expr) {
+    if (!expr)
+      return;
+    visit_type(expr->etype);
+    switch (expr->get_type()) {
+    case ASTType::Identifier:
+      mark(std::static_pointer_cast<Identifier>(expr)->name);
+      break;
+    case ASTType::Call: {
+      auto call = std::static_pointer_cast<Call>(expr);
+      visit_expression(call->callee);
+      for (const auto &argument : call->arguments)
+        visit_expression(argument);
+      break;
+    }
+    case ASTType::StructInstantiation: {
+      auto instantiation = std::static_pointer_cast<StructInstantiation>(expr);
+      mark(instantiation->identifier->name);
+      for (const auto &argument : instantiation->arguments)
+        visit_expression(argument);
+      break;
+    }
+    case ASTType::BinaryOp: {
+      auto binary_op = std::static_pointer_cast<BinaryOp>(expr);
+      visit_expression(binary_op->left);
+      visit_expression(binary_op->right);
+      break;
+    }
+    case ASTType::Dereference:
+      visit_expression(std::static_pointer_cast<Dereference>(expr)->expression);
+      break;
+    case ASTType::AddressOf:
+      visit_expression(std::static_pointer_cast<AddressOf>(expr)->expression);
+      break;
+    case ASTType::Index: {
+      auto index = std::static_pointer_cast<Index>(expr);
+      visit_expression(index->base);
+      visit_expression(index->index);
+      break;
+    }
+    case ASTType::Dot:
+      // The right hand side names a field or an enum member
+      visit_expression(std::static_pointer_cast<Dot>(expr)->left);
+      break;
+    case ASTType::Literal:
+      visit_type(std::static_pointer_cast<Literal>(expr)->type);
+      break;
+    default:
+      break;
+    }
+  }
+};
+
+bool is_declaration(ASTType type) {
+  return type == ASTType::FunctionDefinition ||
+         type == ASTType::StructDefinition ||
+         type == ASTType::EnumDefinition || type == ASTType::Extern ||
+         type == ASTType::Import;
+}
+
+} // namespace
+
+std::vector<std::string> remove_unreachable_declarations(Ref<Program> program) {
+  std::vector<std::string> removed;
+  Reachability reachability(program);
+  if (!reachability.has_main()) {
+    spdlog::debug("[reachability] No main, keeping every declaration");
+    return removed;
+  }
+
+  reachability.mark("main");
+  for (const auto &stmt : program->body->statements) {
+    if (!is_declaration(stmt->get_type()))
+      reachability.visit_statement(stmt);
+  }
+  reachability.run();
+
+  std::erase_if(program->body->statements, [&](const Ref<Statement> &stmt) {
+    switch (stmt->get_type()) {
+    case ASTType::FunctionDefinition: {
+      auto func_def = std::static_pointer_cast<FunctionDefinition>(stmt);
+      // Builtins have no body, and nothing to remove
+      if (!func_def->body || reachability.is_reachable(func_def->identifier->name))
+        return false;
+      removed.push_back("function '" + std::string(func_def->identifier->name) +
+                        "'");
+      return true;
+    }
+    case ASTType::StructDefinition: {
+      auto name = std::static_pointer_cast<StructDefinition>(stmt)
+                      ->identifier->name;
+      if (reachability.is_reachable(name))
+        return false;
+      removed.push_back("struct '" + std::string(name) + "'");
+      return true;
+    }
+    case ASTType::EnumDefinition: {
+      auto enum_def = std::static_pointer_cast<EnumDefinition>(stmt);
+      auto &helper = enum_def->to_string_function;
+      if (helper && !reachability.is_reachable(helper->identifier->name)) {
+        removed.push_back("function '" +
+                          std::string(helper->identifier->name) + "'");
+        helper = nullptr;
+      }
+      if (reachability.is_reachable(enum_def->identifier->name))
+        return false;
+      removed.push_back("enum '" + std::string(enum_def->identifier->name) +
+                        "'");
+      return true;
+    }
+    default:
+      return false;
+    }
+  });
+  spdlog::debug("[reachability] Removed {} declarations", removed.size());
+  return removed;
+}
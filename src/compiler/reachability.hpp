@@ -0,0 +1,14 @@
+#pragma once
+
+#include "../definitions/ast.hpp"
+#include <string>
+#include <vector>
+
+// Removes top level functions, structs and enums that cannot be reached from
+// `main`, together with the injected `<Enum>_to_string` of enums whose helper
+// is never called. Reachability follows calls and every type reference
+// (annotations, struct fields, expression types, `sizeof` arguments) from
+// `main` and from statements at the top level. Programs without a `main` are
+// libraries whose declarations are all exported, nothing is removed there.
+// Runs after typechecking, returns one description per removed declaration.
+std::vector<std::string> remove_unreachable_declarations(Ref<Program> program);
@@ -0,0 +1,510 @@
+#include "server.hpp"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+#include <iostream>
+#include <poll.h>
+#include <spdlog/spdlog.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+
+// Anything longer is not a compile request
+constexpr uint32_t max_request_size = 1 << 20;
+
+// The server reads every request before going on with the next connection,
+// a client that does not send it in time is dropped
+constexpr timeval request_timeout = {2, 0};
+
+// A request is its size, followed by the working directory and the
+// arguments, each ending in a zero byte. The client's stdout and stderr come
+// along with the first byte.
+struct Request {
+  std::string directory;
+  std::vector<std::string> args;
+  int out = -1;
+  int err = -1;
+
+  ~Request() {
+    if (out >= 0) {
+      close(out);
+    }
+    if (err >= 0) {
+      close(err);
+    }
+  }
+};
+
+// What a module kept in memory was read from
+struct ModuleFile {
+  std::filesystem::file_time_type modified;
+  uintmax_t size;
+  uint64_t source_key;
+};
+
+// The modules kept for a working directory
+struct WarmModules {
+  Ref<ModuleContext> context;
+  std::unordered_map<std::string, ModuleFile> files;
+};
+
+// Signals only write to the pipe, the server loop polls it
+int wake_pipe[2] = {-1, -1};
+volatile sig_atomic_t stopping = 0;
+
+void on_signal(int signal) {
+  if (signal != SIGCHLD) {
+    stopping = 1;
+  }
+  int saved = errno;
+  [[maybe_unused]] auto written = write(wake_pipe[1], "", 1);
+  errno = saved;
+}
+
+bool make_address(const std::string &path, sockaddr_un &address) {
+  address = {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    return false;
+  }
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+// Whether the other end of a connection runs as our user. Only our own
+// compiles are run, and only a server of ours gets our stdout and stderr.
+bool peer_is_us(int connection) {
+  ucred peer{};
+  socklen_t size = sizeof(peer);
+  return getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &size) == 0 &&
+         peer.uid == geteuid();
+}
+
+// A socket connected to the server, -1 when none of ours is listening
+int connect_to(const std::string &path) {
+  sockaddr_un address;
+  if (!make_address(path, address)) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) !=
+          0 ||
+      !peer_is_us(fd)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool read_all(int fd, void *data, size_t size) {
+  auto *bytes = static_cast<char *>(data);
+  while (size > 0) {
+    auto n = read(fd, bytes, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool send_all(int fd, const void *data, size_t size) {
+  auto *bytes = static_cast<const char *>(data);
+  while (size > 0) {
+    auto n = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool receive_request(int connection, Request &request) {
+  uint32_t size = 0;
+  alignas(cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))];
+  iovec data{&size, sizeof(size)};
+  msghdr message{};
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t received;
+  do {
+    received = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+  } while (received < 0 && errno == EINTR);
+  if (received <= 0) {
+    return false;
+  }
+  for (auto *header = CMSG_FIRSTHDR(&message); header;
+       header = CMSG_NXTHDR(&message, header)) {
+    if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS &&
+        header->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+      int fds[2];
+      std::memcpy(fds, CMSG_DATA(header), sizeof(fds));
+      request.out = fds[0];
+      request.err = fds[1];
+    }
+  }
+  if (received < static_cast<ssize_t>(sizeof(size)) &&
+      !read_all(connection, reinterpret_cast<char *>(&size) + received,
+                sizeof(size) - received)) {
+    return false;
+  }
+  if (request.out < 0 || size == 0 || size > max_request_size) {
+    return false;
+  }
+  std::string payload(size, '\0');
+  if (!read_all(connection, payload.data(), size) || payload.back() != '\0') {
+    return false;
+  }
+  std::istringstream fields(payload);
+  std::getline(fields, request.directory, '\0');
+  for (std::string arg; std::getline(fields, arg, '\0');) {
+    request.args.push_back(arg);
+  }
+  return !request.args.empty();
+}
+
+// Whatever was printed so far has to come before the output of a compile
+// writing to the same place
+void flush_output() {
+  std::cout.flush();
+  std::fflush(stdout);
+  std::fflush(stderr);
+}
+
+std::string read_file(const std::string &path) {
+  std::ifstream file(path);
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  return buffer.str();
+}
+
+class Server {
+public:
+  Server(std::string path, const ServerCommands &commands)
+      : path(std::move(path)), commands(commands) {}
+
+  int run();
+
+private:
+  void start_compile(int connection);
+  void reply(int connection, int code);
+  // Replies to the compiles that have finished, waiting for one unless
+  // `flags` is WNOHANG. Returns false once there is nothing to wait for.
+  bool reap(int flags);
+  // Modules for a compile of `input`, with everything it imports loaded
+  Ref<ModuleContext> warm_up(WarmModules &warm, const std::string &input);
+
+  std::string path;
+  const ServerCommands &commands;
+  int listener = -1;
+  std::unordered_map<std::string, WarmModules> warm;
+  // The connection waiting for each running compile
+  std::unordered_map<pid_t, int> running;
+};
+
+int Server::run() {
+  if (int other = connect_to(path); other >= 0) {
+    close(other);
+    spdlog::error("[server] A server is already listening on {}", path);
+    return 1;
+  }
+  sockaddr_un address;
+  if (!make_address(path, address)) {
+    spdlog::error("[server] Socket path too long: {}", path);
+    return 1;
+  }
+  // Left behind by a server that did not stop cleanly
+  unlink(path.c_str());
+  listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  // Whoever can connect can have us compile anywhere, so the socket is ours
+  // alone from the moment it exists
+  mode_t umask_before = umask(0077);
+  bool bound = listener >= 0 &&
+               bind(listener, reinterpret_cast<sockaddr *>(&address),
+                    sizeof(address)) == 0;
+  umask(umask_before);
+  if (!bound || chmod(path.c_str(), 0600) != 0 ||
+      listen(listener, SOMAXCONN) != 0 ||
+      pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+    spdlog::error("[server] Could not listen on {}: {}", path,
+                  std::strerror(errno));
+    return 1;
+  }
+
+  struct sigaction action {};
+  action.sa_handler = on_signal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGCHLD, &action, nullptr);
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+  spdlog::info("[server] Listening on {}", path);
+
+  while (!stopping) {
+    pollfd fds[2] = {{listener, POLLIN, 0}, {wake_pipe[0], POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      spdlog::error("[server] {}", std::strerror(errno));
+      break;
+    }
+    if (fds[1].revents & POLLIN) {
+      char drained[64];
+      while (read(wake_pipe[0], drained, sizeof(drained)) > 0) {
+      }
+    }
+    reap(WNOHANG);
+    if (!stopping && (fds[0].revents & POLLIN)) {
+      int connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (connection >= 0 && !peer_is_us(connection)) {
+        spdlog::warn("[server] Refused a connection from another user");
+        close(connection);
+      } else if (connection >= 0) {
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &request_timeout,
+                   sizeof(request_timeout));
+        start_compile(connection);
+      }
+    }
+  }
+
+  // Compiles that already started still get their answer
+  while (!running.empty() && reap(0)) {
+  }
+  close(listener);
+  unlink(path.c_str());
+  spdlog::info("[server] Stopped");
+  return 0;
+}
+
+void Server::reply(int connection, int code) {
+  int32_t status = code;
+  send_all(connection, &status, sizeof(status));
+  close(connection);
+}
+
+bool Server::reap(int flags) {
+  while (true) {
+    int status;
+    pid_t pid = waitpid(-1, &status, flags);
+    if (pid < 0 && errno == EINTR) {
+      continue;
+    }
+    if (pid <= 0) {
+      return pid == 0;
+    }
+    auto compile = running.find(pid);
+    if (compile != running.end()) {
+      reply(compile->second, WIFEXITED(status) ? WEXITSTATUS(status)
+                                               : 128 + WTERMSIG(status));
+      running.erase(compile);
+    }
+    if (flags != WNOHANG) {
+      return true;
+    }
+  }
+}
+
+void Server::start_compile(int connection) {
+  Request request;
+  if (!receive_request(connection, request)) {
+    close(connection);
+    return;
+  }
+  if (chdir(request.directory.c_str()) != 0) {
+    dprintf(request.err, "[server] Cannot compile in %s: %s\n",
+            request.directory.c_str(), std::strerror(errno));
+    reply(connection, 1);
+    return;
+  }
+
+  Ref<ModuleContext> modules;
+  if (auto input = commands.input(request.args)) {
+    modules = warm_up(warm[request.directory], *input);
+  }
+
+  flush_output();
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(listener);
+    close(connection);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    for (int signal : {SIGCHLD, SIGINT, SIGTERM, SIGPIPE}) {
+      std::signal(signal, SIG_DFL);
+    }
+    int input = open("/dev/null", O_RDONLY);
+    dup2(input, STDIN_FILENO);
+    close(input);
+    dup2(request.out, STDOUT_FILENO);
+    dup2(request.err, STDERR_FILENO);
+    int code = commands.compile(request.args, modules);
+    flush_output();
+    std::exit(code);
+  }
+  if (pid < 0) {
+    dprintf(request.err, "[server] Could not start the compile: %s\n",
+            std::strerror(errno));
+    reply(connection, 1);
+    return;
+  }
+  running[pid] = connection;
+}
+
+Ref<ModuleContext> Server::warm_up(WarmModules &warm,
+                                   const std::string &input) {
+  if (!warm.context) {
+    warm.context = commands.modules();
+  }
+
+  // Only modules whose time or size changed are read to compare their keys
+  std::unordered_set<std::string> changed;
+  for (auto &[module_path, file] : warm.files) {
+    std::error_code error;
+    auto modified = std::filesystem::last_write_time(module_path, error);
+    auto size = error ? 0 : std::filesystem::file_size(module_path, error);
+    if (error) {
+      changed.insert(module_path);
+    } else if (modified != file.modified || size != file.size) {
+      if (ModuleCache::source_key(module_path, read_file(module_path)) ==
+          file.source_key) {
+        file.modified = modified;
+        file.size = size;
+      } else {
+        changed.insert(module_path);
+      }
+    }
+  }
+  for (const auto &module_path : warm.context->forget(changed)) {
+    spdlog::debug("[server] Reloading {}", module_path);
+    warm.files.erase(module_path);
+  }
+  if (warm.context->cache) {
+    warm.context->cache->reset_statistics();
+  }
+
+  // The compile reports the errors of the modules that failed to load
+  warm.context->preload(input);
+
+  for (const auto &[module_path, program] : warm.context->modules) {
+    if (warm.files.contains(module_path)) {
+      continue;
+    }
+    std::error_code error;
+    auto modified = std::filesystem::last_write_time(module_path, error);
+    auto size = error ? 0 : std::filesystem::file_size(module_path, error);
+    if (!error) {
+      warm.files[module_path] = {
+          modified, size,
+          ModuleCache::source_key(module_path, *program->source_buffer)};
+    }
+  }
+  return warm.context;
+}
+
+} // namespace
+
+std::string default_server_socket() {
+  if (const char *socket = std::getenv("ENKI_SERVER_SOCKET")) {
+    return socket;
+  }
+  if (const char *runtime = std::getenv("XDG_RUNTIME_DIR")) {
+    return (std::filesystem::path(runtime) / "enki.sock").string();
+  }
+  return fmt::format("/tmp/enki-{}.sock", getuid());
+}
+
+int serve(const std::string &socket_path, const ServerCommands &commands) {
+  // The server changes into the directory of every compile
+  return Server(std::filesystem::absolute(socket_path).string(), commands)
+      .run();
+}
+
+std::optional<int> compile_on_server(const std::string &socket_path,
+                                     const std::vector<std::string> &args) {
+  std::error_code error;
+  auto directory = std::filesystem::current_path(error);
+  if (error) {
+    return std::nullopt;
+  }
+  // Anyone can create a socket under /tmp, one of another user's would get
+  // our output and compile whatever it likes instead
+  struct stat socket_stat;
+  if (lstat(socket_path.c_str(), &socket_stat) == 0 &&
+      (!S_ISSOCK(socket_stat.st_mode) || socket_stat.st_uid != geteuid())) {
+    spdlog::warn("[server] {} is not a socket of ours, not using it",
+                 socket_path);
+    return std::nullopt;
+  }
+  int connection = connect_to(socket_path);
+  if (connection < 0) {
+    return std::nullopt;
+  }
+
+  std::string payload = directory.string() + '\0';
+  for (const auto &arg : args) {
+    payload += arg + '\0';
+  }
+  auto size = static_cast<uint32_t>(payload.size());
+  payload.insert(0, reinterpret_cast<const char *>(&size), sizeof(size));
+
+  // Anything we printed so far comes before the compile's output
+  flush_output();
+  int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+  iovec data{payload.data(), payload.size()};
+  msghdr message{};
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  auto *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(fds));
+  std::memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+  ssize_t sent;
+  do {
+    sent = sendmsg(connection, &message, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  if (sent < 0) {
+    close(connection);
+    return std::nullopt;
+  }
+  int32_t code;
+  bool answered = send_all(connection, payload.data() + sent,
+                           payload.size() - sent) &&
+                  read_all(connection, &code, sizeof(code));
+  close(connection);
+  if (!answered) {
+    spdlog::error("[server] The server on {} stopped before answering",
+                  socket_path);
+    return 1;
+  }
+  return code;
+}
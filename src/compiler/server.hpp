@@ -0,0 +1,49 @@
+#pragma once
+
+#include "modules.hpp"
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+// `enki serve` compiles on behalf of `enki compile --server` over a Unix
+// domain socket, keeping the imported modules of every working directory it
+// was asked to compile in parsed in memory between requests. A module is read
+// again once its modification time or size changes and its source key (see
+// ModuleCache::source_key) turns out different, and so is everything
+// importing it.
+//
+// A request carries the client's working directory, its arguments, and its
+// stdout and stderr, which the compile writes to directly. Every compile runs
+// in a child forked from the server once the modules of its input are loaded,
+// so it starts with them already parsed, and whatever it changes or however
+// it ends leaves the server untouched. The reply is the exit code.
+//
+// Both ends only talk to processes of their own user: the socket is created
+// with mode 0600, and each side checks the other's credentials.
+
+// How the server runs `enki compile`
+struct ServerCommands {
+  // The file compiled by a compile with the given arguments, when its
+  // imports can come from the modules kept in memory
+  std::function<std::optional<std::string>(std::vector<std::string> &args)>
+      input;
+  // Where modules are kept for a working directory
+  std::function<Ref<ModuleContext>()> modules;
+  // Runs a compile against the given modules, returns its exit code
+  std::function<int(std::vector<std::string> &args, Ref<ModuleContext>)>
+      compile;
+};
+
+// `$ENKI_SERVER_SOCKET`, or else `enki.sock` in `$XDG_RUNTIME_DIR`, or else
+// `enki-<uid>.sock` in /tmp
+std::string default_server_socket();
+
+// Serves compiles on the socket until interrupted, returns the exit code
+int serve(const std::string &socket_path, const ServerCommands &commands);
+
+// Runs `enki compile` with the given arguments on the server, which writes
+// to our stdout and stderr. Returns its exit code, nullopt when no server
+// is listening on the socket.
+std::optional<int> compile_on_server(const std::string &socket_path,
+                                     const std::vector<std::string> &args);
@@ -0,0 +1,93 @@
+#include "tailcalls.hpp"
+#include "../utils/logging.hpp"
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+namespace {
+
+void mark_function(const Ref<Program> &program,
+                   const Ref<FunctionDefinition> &func_def) {
+  const auto &calls = func_def->recursive_calls;
+  size_t tail_calls = 0;
+  for (const auto &ret : func_def->returns) {
+    if (!ret->expression || ret->expression->get_type() != ASTType::Call)
+      continue;
+    auto call = std::static_pointer_cast<Call>(ret->expression);
+    if (std::find(calls.begin(), calls.end(), call) == calls.end())
+      continue;
+    ret->tail_call = true;
+    ++tail_calls;
+  }
+  spdlog::debug("[tailcall] {} makes {} of {} calls to itself in tail position",
+                func_def->identifier->name, tail_calls, calls.size());
+
+  const auto &annotations = func_def->annotations;
+  if (std::find(annotations.begin(), annotations.end(), "tailcall") ==
+      annotations.end())
+    return;
+  if (calls.empty()) {
+    LOG_ERROR_EXIT("[tailcall] '@tailcall' function '" +
+                       std::string(func_def->identifier->name) +
+                       "' never calls itself",
+                   func_def->identifier->span, *program->source_buffer);
+  }
+  for (const auto &call : calls) {
+    bool returned = std::any_of(
+        func_def->returns.begin(), func_def->returns.end(),
+        [&](const Ref<Return> &ret) { return ret->expression == call; });
+    if (!returned) {
+      LOG_ERROR_EXIT("[tailcall] Call to '" +
+                         std::string(func_def->identifier->name) +
+                         "' is not in tail position, '@tailcall' needs it "
+                         "returned directly",
+                     call->span, *program->source_buffer);
+    }
+  }
+}
+
+void visit_statement(const Ref<Program> &program, const Ref<Statement> &stmt) {
+  if (!stmt)
+    return;
+  switch (stmt->get_type()) {
+  case ASTType::FunctionDefinition: {
+    auto func_def = std::static_pointer_cast<FunctionDefinition>(stmt);
+    mark_function(program, func_def);
+    // Nested functions are marked on their own
+    visit_statement(program, func_def->body);
+    break;
+  }
+  case ASTType::Block:
+    for (const auto &child : std::static_pointer_cast<Block>(stmt)->statements)
+      visit_statement(program, child);
+    break;
+  case ASTType::If: {
+    auto if_stmt = std::static_pointer_cast<If>(stmt);
+    visit_statement(program, if_stmt->then_branch);
+    visit_statement(program, if_stmt->else_branch);
+    break;
+  }
+  case ASTType::While:
+    visit_statement(program, std::static_pointer_cast<While>(stmt)->body);
+    break;
+  default:
+    break;
+  }
+}
+
+} // namespace
+
+void mark_tail_calls(Ref<Program> program) {
+  spdlog::debug("[tailcall] Marking self recursive tail calls");
+  visit_statement(program, program->body);
+}
+
+void mark_tail_calls(Ref<Program> program,
+                     const std::vector<Ref<Statement>> &statements) {
+  for (const auto &stmt : statements)
+    visit_statement(program, stmt);
+}
+
+bool has_tail_calls(const Ref<FunctionDefinition> &func_def) {
+  return std::any_of(func_def->returns.begin(), func_def->returns.end(),
+                     [](const Ref<Return> &ret) { return ret->tail_call; });
+}
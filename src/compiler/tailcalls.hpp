@@ -0,0 +1,19 @@
+#pragma once
+
+#include "../definitions/ast.hpp"
+
+// Marks every `return f(...)` inside `f` as a tail call, which the backends
+// lower to reassigning the parameters and jumping back to the top of the
+// function, so self recursion in tail position runs in constant stack space.
+// Functions annotated `@tailcall` must make at least one such call and no
+// other calls to themselves, otherwise compilation stops with an error.
+// Runs after typechecking, which records the calls each function makes to
+// itself.
+void mark_tail_calls(Ref<Program> program);
+// The same for statements typechecked after the rest of the program, like
+// the inputs of the REPL
+void mark_tail_calls(Ref<Program> program,
+                     const std::vector<Ref<Statement>> &statements);
+
+// Whether any return of the function was marked as a tail call
+bool has_tail_calls(const Ref<FunctionDefinition> &func_def);
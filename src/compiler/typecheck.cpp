@@ -3,6 +3,8 @@
 #include "../definitions/types.hpp"
 #include "../utils/logging.hpp"
 #include "injections.hpp"
+#include <algorithm>
+#include <filesystem>
 #include <spdlog/spdlog.h>
 #include <variant>
 
@@ -12,7 +14,8 @@ Ref<Symbol> find_symbol_in_scope_chain(const Ref<Scope> &scope,
 void typecheck_struct_definition(Ref<TypecheckContext> ctx,
                                  Ref<StructDefinition> struct_def);
 void typecheck_statement(Ref<TypecheckContext> ctx, Ref<Statement> stmt);
-Ref<Type> typecheck_expression(Ref<TypecheckContext> ctx, Ref<Expression> expr);
+Ref<Type> typecheck_expression(Ref<TypecheckContext> ctx,
+                               Ref<Expression> &expr);
 void typecheck_function_definition(Ref<TypecheckContext> ctx,
                                    Ref<FunctionDefinition> func_def);
 void register_function_signature(Ref<TypecheckContext> ctx,
@@ -165,6 +168,69 @@ Ref<Symbol> find_symbol_in_scope_chain(const Ref<Scope> &scope,
   return nullptr;
 }
 
+// `mod.name`, where `mod` is the name of an imported module and not of a
+// variable, stands for the `name` the module declares. Dots nest to the
+// right, so `mod.f(x)` and `mod.Color.Red` are `mod` dotted with a call and
+// with another dot. Returns what the expression is replaced by, null for any
+// other dot expression.
+Ref<Expression> resolve_qualified_name(Ref<TypecheckContext> ctx,
+                                       const Ref<Dot> &dot_expr) {
+  if (dot_expr->left->get_type() != ASTType::Identifier) {
+    return nullptr;
+  }
+  auto left = std::static_pointer_cast<Identifier>(dot_expr->left);
+  auto module = ctx->modules.find(std::string(left->name));
+  if (module == ctx->modules.end() ||
+      find_symbol_in_scope_chain(ctx->current_scope(), left->name)) {
+    return nullptr;
+  }
+
+  Ref<Expression> head;
+  switch (dot_expr->right->get_type()) {
+  case ASTType::Identifier:
+    head = dot_expr->right;
+    break;
+  case ASTType::Call:
+    head = std::static_pointer_cast<Call>(dot_expr->right)->callee;
+    break;
+  case ASTType::Dot:
+    head = std::static_pointer_cast<Dot>(dot_expr->right)->left;
+    break;
+  case ASTType::Index:
+    head = std::static_pointer_cast<Index>(dot_expr->right)->base;
+    break;
+  default:
+    break;
+  }
+  if (!head || head->get_type() != ASTType::Identifier) {
+    LOG_ERROR_EXIT("[typechecker] Expected a name after module " +
+                       module->first,
+                   dot_expr->right->span, *ctx->program->source_buffer);
+  }
+
+  auto name = std::static_pointer_cast<Identifier>(head);
+  auto &symbols = module->second->scope->symbols;
+  auto declared = symbols.find(name->name);
+  auto linked = ctx->global_scope->symbols.find(name->name);
+  if (declared == symbols.end() ||
+      linked == ctx->global_scope->symbols.end() ||
+      linked->second != declared->second) {
+    LOG_ERROR_EXIT("[typechecker] Module " + module->first +
+                       " does not declare " + std::string(name->name),
+                   name->span, *ctx->program->source_buffer);
+  }
+  // Every module is emitted into the same namespace, so the name has to
+  // mean the imported declaration where it is used
+  if (find_symbol_in_scope_chain(ctx->current_scope(), name->name) !=
+      declared->second) {
+    LOG_ERROR_EXIT("[typechecker] " + std::string(name->name) +
+                       " from module " + module->first +
+                       " is shadowed by a local declaration",
+                   dot_expr->span, *ctx->program->source_buffer);
+  }
+  return dot_expr->right;
+}
+
 Ref<Type> typecheck_identifier(Ref<TypecheckContext> ctx, Ref<Identifier> id) {
   spdlog::debug("[typechecker] typecheck_identifier: id = {}", id->name);
   auto symbol = find_symbol_in_scope_chain(ctx->current_scope(), id->name);
@@ -191,6 +257,26 @@ Ref<Type> typecheck_dereference(Ref<TypecheckContext> ctx,
   return std::get<Ref<Type>>(expr_type->structure);
 }
 
+Ref<Type> typecheck_index(Ref<TypecheckContext> ctx, Ref<Index> index) {
+  spdlog::debug("[typechecker] typecheck_index: index expression");
+
+  auto base_type = typecheck_expression(ctx, index->base);
+  if (base_type->base_type != BaseType::Pointer) {
+    LOG_ERROR_EXIT("[typechecker] Only pointers can be indexed, got: " +
+                       base_type->to_string(),
+                   index->span, *ctx->program->source_buffer);
+  }
+  auto index_type = typecheck_expression(ctx, index->index);
+  if (index_type->base_type != BaseType::Int) {
+    LOG_ERROR_EXIT("[typechecker] Index must be an int, got: " +
+                       index_type->to_string(),
+                   index->index->span, *ctx->program->source_buffer);
+  }
+
+  // Indexing a pointer returns the type it points to, like dereferencing
+  return std::get<Ref<Type>>(base_type->structure);
+}
+
 Ref<Type> typecheck_address_of(Ref<TypecheckContext> ctx,
                                Ref<AddressOf> addr_of) {
   spdlog::debug("[typechecker] typecheck_address_of: addr_of expression");
@@ -270,6 +356,14 @@ Ref<Type> typecheck_function_call(Ref<TypecheckContext> ctx, Ref<Call> call) {
       }
     }
 
+    // Self calls are what mark_tail_calls turns into jumps
+    auto current_func = ctx->current_function();
+    if (current_func == func_type && current_func->definition) {
+      auto &calls = current_func->definition->recursive_calls;
+      if (std::find(calls.begin(), calls.end(), call) == calls.end())
+        calls.push_back(call);
+    }
+
     spdlog::debug("[typecheck] Function return type: {}",
                   func_type->return_type->to_string());
     return func_type->return_type;
@@ -345,15 +439,23 @@ Ref<Type> typecheck_type(Ref<TypecheckContext> ctx, Ref<Type> typ) {
   spdlog::debug("[typechecker] typecheck_type: base = {}",
                 magic_enum::enum_name(typ->base_type));
 
-  // If the parameter type is Unknown, try to resolve it as an enum type
+  // Pointers resolve their pointee, e.g. &Point
+  if (typ->base_type == BaseType::Pointer) {
+    auto &pointee = std::get<Ref<Type>>(typ->structure);
+    pointee = typecheck_type(ctx, pointee);
+    return typ;
+  }
+
+  // If the parameter type is Unknown, try to resolve it as an enum or struct
   if (typ->base_type == BaseType::Unknown) {
     // Look up the type name in the scope chain
     auto type_symbol =
         find_symbol_in_scope_chain(ctx->current_scope(), typ->name);
-    if (type_symbol && type_symbol->symbol_type == SymbolType::Enum) {
+    if (type_symbol && (type_symbol->symbol_type == SymbolType::Enum ||
+                        type_symbol->symbol_type == SymbolType::Struct)) {
       spdlog::debug(
-          "[typechecker] Resolved unknown parameter type '{}' to enum",
-          typ->to_string());
+          "[typechecker] Resolved unknown parameter type '{}' to {}",
+          typ->to_string(), magic_enum::enum_name(type_symbol->symbol_type));
       return type_symbol->type;
     } else {
       spdlog::error(
@@ -452,7 +554,7 @@ Ref<Type> typecheck_struct_instantiation(Ref<TypecheckContext> ctx,
 
   // We want to make sure the arguments are valid
   for (size_t i = 0; i < struct_inst->arguments.size(); ++i) {
-    auto arg = struct_inst->arguments[i];
+    auto &arg = struct_inst->arguments[i];
     auto arg_type = typecheck_expression(ctx, arg);
     if (!can_assign_type(struct_inst->struct_type->fields[i]->type, arg_type)) {
       LOG_ERROR_EXIT(
@@ -485,6 +587,8 @@ Ref<Type> _typecheck_expression(Ref<TypecheckContext> ctx,
                                  std::static_pointer_cast<Dereference>(expr));
   case ASTType::AddressOf:
     return typecheck_address_of(ctx, std::static_pointer_cast<AddressOf>(expr));
+  case ASTType::Index:
+    return typecheck_index(ctx, std::static_pointer_cast<Index>(expr));
   case ASTType::Dot:
     return typecheck_dot_expression(ctx, std::static_pointer_cast<Dot>(expr));
   case ASTType::StructInstantiation:
@@ -500,7 +604,15 @@ Ref<Type> _typecheck_expression(Ref<TypecheckContext> ctx,
 }
 
 Ref<Type> typecheck_expression(Ref<TypecheckContext> ctx,
-                               Ref<Expression> expr) {
+                               Ref<Expression> &expr) {
+  // A qualified name is replaced by the plain one, which is what the
+  // backends know how to emit
+  if (expr->get_type() == ASTType::Dot) {
+    if (auto resolved =
+            resolve_qualified_name(ctx, std::static_pointer_cast<Dot>(expr))) {
+      return typecheck_expression(ctx, expr = resolved);
+    }
+  }
   auto type = _typecheck_expression(ctx, expr);
   expr->etype = type; // Set the type on the expression for later use
   return type;
@@ -539,6 +651,13 @@ void typecheck_return(Ref<TypecheckContext> ctx, Ref<Return> ret) {
     LOG_ERROR_EXIT("[typechecker] Return statement outside of function",
                    ret->span, *ctx->program->source_buffer);
   }
+  // Every exit of a function is recorded on its definition, the IR lowering
+  // and the inliner use it to decide whether a shared exit block is needed
+  if (current_func->definition) {
+    auto &returns = current_func->definition->returns;
+    if (std::find(returns.begin(), returns.end(), ret) == returns.end())
+      returns.push_back(ret);
+  }
   // If function returns void, return must not have an expression
   if (current_func->return_type->base_type == BaseType::Void) {
     if (ret->expression != nullptr) {
@@ -590,7 +709,10 @@ void typecheck_assignment(Ref<TypecheckContext> ctx,
                    assignment->span, *ctx->program->source_buffer);
   }
 
-  //@TODO : This wont work the second we have arr indexes etc
+  // Storing through an index leaves the pointer variable as it is
+  if (assignment->assignee->get_type() == ASTType::Index)
+    return;
+
   auto assignee_symbol = find_symbol_in_scope_chain(
       ctx->current_scope(),
       std::static_pointer_cast<Identifier>(assignment->assignee)->name);
@@ -656,12 +778,69 @@ void typecheck_import(Ref<TypecheckContext> ctx, Ref<Import> import_stmt) {
   spdlog::debug("[typechecker] typecheck_import: import_stmt type = {}",
                 magic_enum::enum_name(import_stmt ? import_stmt->get_type()
                                                   : ASTType::Unknown));
-  // For now, just validate the module path is a string literal
   if (import_stmt->module_path->type->base_type != BaseType::String) {
     LOG_ERROR_EXIT("[typechecker] Import module path must be a string literal",
                    import_stmt->span, *ctx->program->source_buffer);
   }
-  // TODO: Actually resolve and import the module
+  if (ctx->current_scope() != ctx->global_scope) {
+    LOG_ERROR_EXIT("[typechecker] Imports must be in the global scope",
+                   import_stmt->span, *ctx->program->source_buffer);
+  }
+
+  auto module_context = ctx->program->module_context;
+  std::string name(import_stmt->module_path->value);
+  auto path = ModuleContext::resolve(
+      name, std::string(import_stmt->span.start.file_name));
+  auto module = module_context->modules.find(path);
+  if (module == module_context->modules.end()) {
+    return; // Reported when the module failed to load
+  }
+  // The modules it imports are typechecked first, by its own imports
+  if (module_context->typechecked.insert(path).second) {
+    spdlog::debug("[typechecker] Typechecking module {}", path);
+    perform_injections(module->second);
+    typecheck(module->second);
+  }
+  ctx->modules[std::filesystem::path(name).stem().string()] = module->second;
+
+  // The program's own top level declarations are registered after its
+  // imports, and must not replace them
+  std::unordered_set<std::string_view> declared;
+  if (ctx->current_block) {
+    for (const auto &stmt : ctx->current_block->statements) {
+      declared.insert(declared_name(stmt));
+    }
+  }
+  auto &symbols = module->second->scope->symbols;
+  auto link = [&](std::string_view name) {
+    auto symbol = symbols.find(name);
+    if (symbol == symbols.end()) {
+      return;
+    }
+    auto &linked = ctx->global_scope->symbols[name];
+    if (declared.contains(name) || (linked && linked != symbol->second)) {
+      LOG_ERROR_EXIT("[typechecker] " + std::string(name) + " from " + path +
+                         " is already declared",
+                     import_stmt->span, *ctx->program->source_buffer);
+    }
+    linked = symbol->second;
+  };
+  for (const auto &stmt : module_context->declarations(path)) {
+    auto stmt_name = declared_name(stmt);
+    if (!stmt_name.empty()) {
+      link(stmt_name);
+    }
+    if (stmt->get_type() == ASTType::EnumDefinition) {
+      auto enum_def = std::static_pointer_cast<EnumDefinition>(stmt);
+      link(enum_def->to_string_function->identifier->name);
+      // Members are names of their own in the scope the enum is declared in
+      for (const auto &member : enum_def->members) {
+        if (auto symbol = symbols.find(member->name); symbol != symbols.end()) {
+          ctx->global_scope->symbols[member->name] = symbol->second;
+        }
+      }
+    }
+  }
 }
 
 void typecheck_extern(Ref<TypecheckContext> ctx, Ref<Extern> extern_stmt) {
@@ -783,7 +962,7 @@ void typecheck_statement(Ref<TypecheckContext> ctx, Ref<Statement> stmt) {
     typecheck_while(ctx, std::static_pointer_cast<While>(stmt));
     break;
   case ASTType::Import:
-    typecheck_import(ctx, std::static_pointer_cast<Import>(stmt));
+    // Linked in the first pass, before any declaration can name an import
     break;
   default:
     LOG_ERROR_EXIT("[typechecker] Unknown statement type: " +
@@ -800,9 +979,13 @@ void typecheck_struct_definition(Ref<TypecheckContext> ctx,
       magic_enum::enum_name(struct_def ? struct_def->get_type()
                                        : ASTType::Unknown));
 
-  // The struct was already registered in the first pass, for now there isn't
-  // actually anything to do in here. At some point when we change the fields to
-  // be able to have default values, we'll need to do something here.
+  // The struct was already registered in the first pass, all that is left is
+  // resolving field types that name other structs or enums. At some point when
+  // we change the fields to be able to have default values, we'll need to do
+  // more here.
+  for (auto &field : struct_def->fields) {
+    field->type = typecheck_type(ctx, field->type);
+  }
 }
 void typecheck_function_definition(Ref<TypecheckContext> ctx,
                                    Ref<FunctionDefinition> func_def) {
@@ -885,7 +1068,9 @@ void typecheck_function_definition(Ref<TypecheckContext> ctx,
 
   // Use typecheck_block to process the function body (handles nested functions
   // automatically)
-  if (func_def->body) {
+  bool reused = ctx->function_stack.size() == 1 &&
+                ctx->reused_bodies.contains(func_name);
+  if (func_def->body && !reused) {
     typecheck_block(ctx, func_def->body);
   }
 
@@ -940,15 +1125,17 @@ void register_function_signature(Ref<TypecheckContext> ctx,
   func_type->name = func_name;
 
   // Resolve return type if it's an identifier (e.g., "Color" -> Color enum
-  // type)
+  // type, "Point" -> Point struct type)
   if (func_def->return_type->base_type == BaseType::Unknown) {
     auto return_type_symbol = find_symbol_in_scope_chain(
         ctx->current_scope(), func_def->return_type->name);
     if (return_type_symbol &&
-        return_type_symbol->symbol_type == SymbolType::Enum) {
+        (return_type_symbol->symbol_type == SymbolType::Enum ||
+         return_type_symbol->symbol_type == SymbolType::Struct)) {
       func_type->return_type = return_type_symbol->type;
-      spdlog::debug("[typechecker] Resolved unknown return type '{}' to enum",
-                    func_def->return_type->name);
+      spdlog::debug("[typechecker] Resolved unknown return type '{}' to {}",
+                    func_def->return_type->name,
+                    magic_enum::enum_name(return_type_symbol->symbol_type));
     } else {
       func_type->return_type = func_def->return_type;
       spdlog::error("[typechecker] Could not resolve unknown return type '{}'",
@@ -960,11 +1147,12 @@ void register_function_signature(Ref<TypecheckContext> ctx,
 
   func_type->span = func_def->span;
 
-  // Add parameters to function type
+  // Add parameters to function type, resolved so that calls which appear
+  // before the definition is typechecked see the real parameter types
   for (auto &param : func_def->parameters) {
     auto param_var = std::make_shared<Variable>();
     param_var->name = param->identifier->name;
-    param_var->type = param->type;
+    param_var->type = typecheck_type(ctx, param->type);
     func_type->parameters.push_back(param_var);
   }
 
@@ -1010,6 +1198,15 @@ void register_enum_signature(Ref<TypecheckContext> ctx,
 // a scope
 void perform_first_pass_registration(
     Ref<TypecheckContext> ctx, const std::vector<Ref<Statement>> &statements) {
+  // First pass: Link imported modules, their declarations can be used in the
+  // signatures of this scope's
+  spdlog::debug("[typechecker] First pass: Linking imports");
+  for (auto &stmt : statements) {
+    if (stmt->get_type() == ASTType::Import) {
+      typecheck_import(ctx, std::static_pointer_cast<Import>(stmt));
+    }
+  }
+
   // First pass: Register all enum definitions first
   spdlog::debug("[typechecker] First pass: Registering enums");
   for (auto &stmt : statements) {
@@ -1067,4 +1264,11 @@ void typecheck(Ref<Program> program) {
   spdlog::debug("[typechecker] Typechecking program body with {} statements",
                 program->body->statements.size());
   typecheck_block(ctx, program->body);
+}
+
+void typecheck(Ref<Program> program,
+               const std::unordered_set<std::string_view> &reused_bodies) {
+  auto ctx = std::make_shared<TypecheckContext>(program);
+  ctx->reused_bodies = reused_bodies;
+  typecheck_block(ctx, program->body);
 }
\ No newline at end of file
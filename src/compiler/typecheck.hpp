@@ -6,6 +6,8 @@
 #include <iostream>
 #include <spdlog/spdlog.h>
 #include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 struct TypecheckContext {
@@ -14,6 +16,13 @@ struct TypecheckContext {
   std::vector<Ref<Scope>> scope_stack;
   Ref<Scope> global_scope;
   Ref<Block> current_block; // Track the current block being processed
+  // Top level functions whose bodies are not typechecked, only their
+  // signatures, incremental builds reuse the code compiled from them before
+  std::unordered_set<std::string_view> reused_bodies;
+  // Imported modules by the name their declarations can be qualified with,
+  // the last component of the imported path: `math.square` for `square`
+  // from `import <"lib/math">`
+  std::unordered_map<std::string, Ref<Program>> modules;
 
   size_t current = 0;
 
@@ -52,6 +61,10 @@ struct TypecheckContext {
 };
 
 void typecheck(Ref<Program> program);
+// Leaves the bodies of the named top level functions unchecked, see
+// TypecheckContext::reused_bodies
+void typecheck(Ref<Program> program,
+               const std::unordered_set<std::string_view> &reused_bodies);
 
 // Function declarations for typechecking
 void typecheck_if(Ref<TypecheckContext> ctx, Ref<If> if_stmt);
@@ -32,6 +32,8 @@ std::optional<BinaryOpType> token_to_binop(TokenType type) {
     return BinaryOpType::Multiply;
   case TokenType::Slash:
     return BinaryOpType::Divide;
+  case TokenType::Percent:
+    return BinaryOpType::Modulo;
   case TokenType::LessThan:
     return BinaryOpType::LessThan;
   case TokenType::GreaterThan:
@@ -47,4 +49,20 @@ std::optional<BinaryOpType> token_to_binop(TokenType type) {
   default:
     return {}; // No matching binary operator
   }
-}
\ No newline at end of file
+}
+std::string_view declared_name(const Ref<Statement> &stmt) {
+  switch (stmt->get_type()) {
+  case ASTType::FunctionDefinition:
+    return std::static_pointer_cast<FunctionDefinition>(stmt)->identifier->name;
+  case ASTType::StructDefinition:
+    return std::static_pointer_cast<StructDefinition>(stmt)->identifier->name;
+  case ASTType::EnumDefinition:
+    return std::static_pointer_cast<EnumDefinition>(stmt)->identifier->name;
+  case ASTType::Extern:
+    return std::static_pointer_cast<Extern>(stmt)->identifier->name;
+  case ASTType::VarDecl:
+    return std::static_pointer_cast<VarDecl>(stmt)->identifier->name;
+  default:
+    return {};
+  }
+}
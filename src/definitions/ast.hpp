@@ -39,6 +39,7 @@ enum class ASTType {
   Dot,
   Dereference,
   AddressOf,
+  Index,
   Unknown
 };
 
@@ -79,6 +80,7 @@ struct Extern : Statement {
   std::vector<Ref<Type>> args;
   Ref<Type> return_type;
   std::string_view module_path;
+  std::vector<std::string_view> annotations; // e.g. `pure` for `@pure extern`
   ASTType get_type() const override { return ASTType::Extern; }
 };
 
@@ -135,6 +137,13 @@ struct AddressOf : Expression {
   ASTType get_type() const override { return ASTType::AddressOf; }
 };
 
+// `base[index]`, the element `index` places after the one `base` points to
+struct Index : Expression {
+  Ref<Expression> base;
+  Ref<Expression> index;
+  ASTType get_type() const override { return ASTType::Index; }
+};
+
 struct VarDecl : Statement {
   Ref<Identifier> identifier;
   Ref<Type> type;
@@ -172,6 +181,7 @@ struct Return : Statement {
   Span span;
   Ref<Type> type;
   Ref<Function> function;
+  bool tail_call = false; // `return f(...)` inside f, see mark_tail_calls
   ASTType get_type() const override { return ASTType::Return; }
 };
 
@@ -206,8 +216,13 @@ struct FunctionDefinition : Statement {
   Ref<Type> return_type;
   std::vector<Ref<Parameter>> parameters;
   std::vector<Ref<Return>> returns;
+  std::vector<Ref<Call>> recursive_calls; // Calls to itself, in any position
   Ref<Block> body;
   Ref<Function> function;
+  std::vector<std::string_view> annotations; // e.g. `tailcall` for @tailcall
+  // Has no body because it is defined in another unit, like the functions of
+  // a module imported from its interface. Builtins have no body either.
+  bool external = false;
 
   ASTType get_type() const override { return ASTType::FunctionDefinition; }
 };
@@ -245,4 +260,8 @@ inline BaseType token_to_literal_type(TokenType type) {
 struct ExpressionStatement : Statement {
   Ref<Expression> expression;
   ASTType get_type() const override { return ASTType::ExpressionStatement; }
-};
\ No newline at end of file
+};
+
+// Name a top level statement declares, empty for statements that declare
+// nothing
+std::string_view declared_name(const Ref<Statement> &stmt);
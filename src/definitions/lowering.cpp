@@ -0,0 +1,184 @@
+#include "lowering.hpp"
+#include <algorithm>
+
+Layout type_layout(const Ref<Type> &type, Layout string_layout) {
+  switch (type->base_type) {
+  case BaseType::Bool:
+  case BaseType::Char:
+    return {1, 1};
+  case BaseType::Int:
+  case BaseType::Float:
+  case BaseType::Enum:
+    return {4, 4};
+  case BaseType::Pointer:
+    return {8, 8};
+  case BaseType::String:
+    return string_layout;
+  case BaseType::Struct: {
+    int size = 0, align = 1;
+    for (const auto &field : std::get<Ref<Struct>>(type->structure)->fields) {
+      auto field_layout = type_layout(field->type, string_layout);
+      size = (size + field_layout.align - 1) / field_layout.align *
+                 field_layout.align +
+             field_layout.size;
+      align = std::max(align, field_layout.align);
+    }
+    return {(size + align - 1) / align * align, align};
+  }
+  default:
+    return {0, 1};
+  }
+}
+
+int type_size(const Ref<Type> &type) { return type_layout(type).size; }
+
+int type_align(const Ref<Type> &type) { return type_layout(type).align; }
+
+std::pair<int, Ref<Type>> field_offset(const Ref<Struct> &struct_type,
+                                       std::string_view name) {
+  int offset = 0;
+  for (const auto &field : struct_type->fields) {
+    auto layout = type_layout(field->type);
+    offset = (offset + layout.align - 1) / layout.align * layout.align;
+    if (field->name == name) {
+      return {offset, field->type};
+    }
+    offset += layout.size;
+  }
+  return {-1, nullptr};
+}
+
+Ref<Struct> resolved_struct(const Ref<Program> &program,
+                            const Ref<StructDefinition> &struct_def) {
+  auto symbol = program->scope->symbols.find(struct_def->identifier->name);
+  if (symbol == program->scope->symbols.end()) {
+    return nullptr;
+  }
+  return std::get<Ref<Struct>>(symbol->second->type->structure);
+}
+
+std::string unescape(std::string_view value) {
+  std::string result;
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (value[i] != '\\' || i + 1 == value.size()) {
+      result += value[i];
+      continue;
+    }
+    switch (value[++i]) {
+    case 'n':
+      result += '\n';
+      break;
+    case 't':
+      result += '\t';
+      break;
+    case 'r':
+      result += '\r';
+      break;
+    case '0':
+      result += '\0';
+      break;
+    default:
+      result += value[i];
+      break;
+    }
+  }
+  return result;
+}
+
+namespace {
+
+// The local a chain of field accesses like `a.b.c` starts from
+void insert_base(const Ref<Expression> &expr,
+                 std::unordered_set<std::string_view> &names) {
+  auto base = expr;
+  while (base->get_type() == ASTType::Dot)
+    base = std::static_pointer_cast<Dot>(base)->left;
+  if (base->get_type() == ASTType::Identifier)
+    names.insert(std::static_pointer_cast<Identifier>(base)->name);
+}
+
+void collect_address_taken(const std::vector<Ref<Expression>> &expressions,
+                           std::unordered_set<std::string_view> &names) {
+  for (const auto &expr : expressions)
+    collect_address_taken(expr, names);
+}
+
+} // namespace
+
+void collect_address_taken(const Ref<ASTNode> &node,
+                           std::unordered_set<std::string_view> &names) {
+  if (!node)
+    return;
+  switch (node->get_type()) {
+  case ASTType::AddressOf: {
+    auto expr = std::static_pointer_cast<AddressOf>(node)->expression;
+    insert_base(expr, names);
+    collect_address_taken(expr, names);
+    break;
+  }
+  case ASTType::Block:
+    for (const auto &stmt : std::static_pointer_cast<Block>(node)->statements)
+      collect_address_taken(stmt, names);
+    break;
+  case ASTType::VarDecl:
+    collect_address_taken(std::static_pointer_cast<VarDecl>(node)->expression,
+                          names);
+    break;
+  case ASTType::Assignment: {
+    auto assignment = std::static_pointer_cast<Assignment>(node);
+    // Assigning to a field writes through the struct's address
+    if (assignment->assignee->get_type() == ASTType::Dot)
+      insert_base(assignment->assignee, names);
+    collect_address_taken(assignment->assignee, names);
+    collect_address_taken(assignment->expression, names);
+    break;
+  }
+  case ASTType::ExpressionStatement:
+    collect_address_taken(
+        std::static_pointer_cast<ExpressionStatement>(node)->expression, names);
+    break;
+  case ASTType::Return:
+    collect_address_taken(std::static_pointer_cast<Return>(node)->expression,
+                          names);
+    break;
+  case ASTType::If: {
+    auto if_stmt = std::static_pointer_cast<If>(node);
+    collect_address_taken(if_stmt->condition, names);
+    collect_address_taken(if_stmt->then_branch, names);
+    collect_address_taken(if_stmt->else_branch, names);
+    break;
+  }
+  case ASTType::While:
+    collect_address_taken(std::static_pointer_cast<While>(node)->condition,
+                          names);
+    collect_address_taken(std::static_pointer_cast<While>(node)->body, names);
+    break;
+  case ASTType::BinaryOp:
+    collect_address_taken(std::static_pointer_cast<BinaryOp>(node)->left,
+                          names);
+    collect_address_taken(std::static_pointer_cast<BinaryOp>(node)->right,
+                          names);
+    break;
+  case ASTType::Call:
+    collect_address_taken(std::static_pointer_cast<Call>(node)->arguments,
+                          names);
+    break;
+  case ASTType::StructInstantiation:
+    collect_address_taken(
+        std::static_pointer_cast<StructInstantiation>(node)->arguments, names);
+    break;
+  case ASTType::Dereference:
+    collect_address_taken(
+        std::static_pointer_cast<Dereference>(node)->expression, names);
+    break;
+  case ASTType::Index:
+    collect_address_taken(std::static_pointer_cast<Index>(node)->base, names);
+    collect_address_taken(std::static_pointer_cast<Index>(node)->index, names);
+    break;
+  case ASTType::Dot:
+    collect_address_taken(std::static_pointer_cast<Dot>(node)->left, names);
+    break;
+  default:
+    break;
+  }
+}
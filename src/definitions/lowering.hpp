@@ -0,0 +1,49 @@
+#pragma once
+
+#include "ast.hpp"
+#include "types.hpp"
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+
+// What every backend needs to know about the typed AST before lowering it:
+// how values are laid out in memory, what literals contain and which locals
+// have to live in memory. The native and LLVM backends, the C++ backend, the
+// IR lowering and the VM all go through these, so they agree on them.
+
+// Size and alignment of a value in bytes
+struct Layout {
+  int size;
+  int align;
+};
+
+// An Enki string in the runtime, enki_str {data, len}
+constexpr Layout enki_string_layout = {16, 8};
+
+// Layout of a type in the C layout, so pointers to structs can be handed to C
+// code. Strings take `string_layout`, the C++ backend passes std::string's.
+Layout type_layout(const Ref<Type> &type,
+                   Layout string_layout = enki_string_layout);
+int type_size(const Ref<Type> &type);
+int type_align(const Ref<Type> &type);
+
+// Offset and type of the field called `name`, -1 and null when there is none
+std::pair<int, Ref<Type>> field_offset(const Ref<Struct> &struct_type,
+                                       std::string_view name);
+
+// The resolved Struct of a struct definition, which lives on its symbol in
+// the program's scope rather than on the definition. Null when it was never
+// resolved.
+Ref<Struct> resolved_struct(const Ref<Program> &program,
+                            const Ref<StructDefinition> &struct_def);
+
+// The bytes of a string or char literal with its escapes (\n, \t, \r, \0)
+// replaced, any other escaped character stands for itself
+std::string unescape(std::string_view value);
+
+// Adds the locals of `node` that have their address taken, directly with `&x`
+// or through a field with `&x.f` or `x.f = ...`, to `names`. They cannot be
+// kept in a register and live in memory.
+void collect_address_taken(const Ref<ASTNode> &node,
+                           std::unordered_set<std::string_view> &names);
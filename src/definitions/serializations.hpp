@@ -6,8 +6,10 @@ using json = nlohmann::json;
 // removed symbols.hpp
 #include <magic_enum/magic_enum.hpp>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
+#include <unordered_set>
 #include <vector>
 // ... include other relevant headers as needed ...
 
@@ -15,13 +17,23 @@ using json = nlohmann::json;
 extern bool g_visualization_mode;
 
 // --- String view helpers ---
-inline std::vector<std::string> _interned_strings;
+// Nodes of the set never move, so the views stay valid, and repeated names
+// (e.g. the file name of every span) are only stored once
+inline std::unordered_set<std::string> _interned_strings;
+// Held by threads reading ASTs, which all intern into the one table
+inline std::mutex _interning;
 inline void to_json(json &j, const std::string_view &sv) {
   j = std::string(sv);
 }
+// get_to would leave views into the json instead, these are called directly
 inline void from_json(const json &j, std::string_view &sv) {
-  _interned_strings.emplace_back(j.get<std::string>());
-  sv = _interned_strings.back();
+  sv = *_interned_strings.insert(j.get<std::string>()).first;
+}
+inline void from_json(const json &j, std::vector<std::string_view> &svs) {
+  svs.clear();
+  for (const auto &element : j) {
+    from_json(element, svs.emplace_back());
+  }
 }
 
 // --- shared_ptr helpers for concrete types ---
@@ -52,7 +64,7 @@ inline void from_json(const json &j, Location &loc) {
   j.at("row").get_to(loc.row);
   j.at("col").get_to(loc.col);
   j.at("pos").get_to(loc.pos);
-  j.at("file_name").get_to(loc.file_name);
+  from_json(j.at("file_name"), loc.file_name);
 }
 
 // --- Span ---
@@ -76,7 +88,7 @@ inline void to_json(json &j, const Identifier &id) {
   }
 }
 inline void from_json(const json &j, Identifier &id) {
-  j.at("name").get_to(id.name);
+  from_json(j.at("name"), id.name);
   j.at("span").get_to(id.span);
 }
 
@@ -124,6 +136,20 @@ inline void from_json(const json &j, Dereference &id) {
   j.at("span").get_to(id.span);
 }
 
+// --- Index ---
+inline void to_json(json &j, const Index &index) {
+  j["base"] = index.base;
+  j["index"] = index.index;
+  j["type"] = "Index";
+  if (!g_visualization_mode) {
+    j["span"] = index.span;
+  }
+}
+inline void from_json(const json &j, Index &index) {
+  j.at("base").get_to(index.base);
+  j.at("index").get_to(index.index);
+  j.at("span").get_to(index.span);
+}
 
 // --- Dot ---
 inline void to_json(json &j, const Dot &dot) {
@@ -142,6 +168,7 @@ inline void from_json(const json &j, Dot &dot) {
 
 // --- StructInstantiation ---
 inline void to_json(json &j, const StructInstantiation &struct_inst) {
+  j["identifier"] = struct_inst.identifier;
   j["struct_type"] = struct_inst.struct_type;
   j["arguments"] = struct_inst.arguments;
   j["type"] = "StructInstantiation";
@@ -150,6 +177,9 @@ inline void to_json(json &j, const StructInstantiation &struct_inst) {
   }
 }
 inline void from_json(const json &j, StructInstantiation &struct_inst) {
+  if (j.contains("identifier")) {
+    j.at("identifier").get_to(struct_inst.identifier);
+  }
   j.at("struct_type").get_to(struct_inst.struct_type);
   j.at("arguments").get_to(struct_inst.arguments);
   j.at("span").get_to(struct_inst.span);
@@ -165,9 +195,9 @@ inline void to_json(json &j, const Literal &lit) {
   }
 }
 inline void from_json(const json &j, Literal &lit) {
-  j.at("value").get_to(lit.value);
+  from_json(j.at("value"), lit.value);
   j.at("span").get_to(lit.span);
-  lit.type->base_type = j.at("base_type").get<BaseType>();
+  lit.type = std::make_shared<Type>(Type{j.at("base_type").get<BaseType>()});
 }
 
 // --- BaseType (enum) ---
@@ -187,19 +217,41 @@ inline void to_json(json &j, const Variable &v) {
   }
 }
 inline void from_json(const json &j, Variable &v) {
-  j.at("name").get_to(v.name);
+  from_json(j.at("name"), v.name);
   j.at("span").get_to(v.span);
   j.at("type").get_to(v.type);
 }
 
 // --- Type (new, from types.hpp) ---
+// Written as the parser leaves it: the name of a struct or enum that is
+// still Unknown and the type a pointer points to. The structures of resolved
+// types belong to the typechecker, which recreates them.
 inline void to_json(json &j, const Type &t) {
   j["base_type"] = t.base_type;
-  // TODO: serialize more fields if added
+  if (!g_visualization_mode) {
+    if (!t.name.empty()) {
+      j["name"] = t.name;
+    }
+    if (t.base_type == BaseType::Pointer &&
+        std::holds_alternative<Ref<Type>>(t.structure)) {
+      j["pointee"] = std::get<Ref<Type>>(t.structure);
+    }
+    j["span"] = t.span;
+  }
 }
 inline void from_json(const json &j, Type &t) {
   j.at("base_type").get_to(t.base_type);
-  // TODO: deserialize more fields if added
+  if (j.contains("name")) {
+    from_json(j.at("name"), t.name);
+  }
+  if (j.contains("pointee")) {
+    Ref<Type> pointee;
+    j.at("pointee").get_to(pointee);
+    t.structure = pointee;
+  }
+  if (j.contains("span")) {
+    j.at("span").get_to(t.span);
+  }
 }
 
 // --- VarDecl ---
@@ -208,12 +260,16 @@ inline void to_json(json &j, const VarDecl &l) {
   j["identifier"] = l.identifier;
   j["expression"] = l.expression;
   if (!g_visualization_mode) {
+    j["var_type"] = l.type;
     j["span"] = l.span;
   }
 }
 inline void from_json(const json &j, VarDecl &l) {
   j.at("identifier").get_to(l.identifier);
   j.at("expression").get_to(l.expression);
+  if (j.contains("var_type")) {
+    j.at("var_type").get_to(l.type);
+  }
   j.at("span").get_to(l.span);
 }
 
@@ -315,6 +371,7 @@ inline void to_json(json &j, const Extern &e) {
   }
   j["return_type"] = *e.return_type;
   j["module_path"] = e.module_path;
+  j["annotations"] = e.annotations;
   if (!g_visualization_mode) {
     j["span"] = e.span;
   }
@@ -326,7 +383,10 @@ inline void from_json(const json &j, Extern &e) {
     e.args.push_back(std::make_shared<Type>(arg.get<Type>()));
   }
   e.return_type = std::make_shared<Type>(j.at("return_type").get<Type>());
-  j.at("module_path").get_to(e.module_path);
+  from_json(j.at("module_path"), e.module_path);
+  if (j.contains("annotations")) {
+    from_json(j.at("annotations"), e.annotations);
+  }
   j.at("span").get_to(e.span);
 }
 
@@ -367,6 +427,9 @@ inline void to_json(json &j, const Ref<Expression> &expr) {
   } else if (auto addr_of = std::dynamic_pointer_cast<AddressOf>(expr)) {
     to_json(j, *addr_of);
     j["type"] = "AddressOf";
+  } else if (auto index = std::dynamic_pointer_cast<Index>(expr)) {
+    to_json(j, *index);
+    j["type"] = "Index";
   } else if (auto dot_expr = std::dynamic_pointer_cast<Dot>(expr)) {
     to_json(j, *dot_expr);
     j["type"] = "Dot";
@@ -407,6 +470,10 @@ inline void from_json(const json &j, Ref<Expression> &expr) {
     auto addr_of = std::make_shared<AddressOf>();
     from_json(j, *addr_of);
     expr = addr_of;
+  } else if (type == "Index") {
+    auto index = std::make_shared<Index>();
+    from_json(j, *index);
+    expr = index;
   } else if (type == "Dot") {
     auto dot_expr = std::make_shared<Dot>();
     from_json(j, *dot_expr);
@@ -428,6 +495,7 @@ inline void to_json(json &j, const FunctionDefinition &f) {
   j["parameters"] = f.parameters;
   j["returns"] = f.returns;
   j["body"] = f.body;
+  j["annotations"] = f.annotations;
   if (!g_visualization_mode) {
     j["span"] = f.span;
   }
@@ -438,8 +506,12 @@ inline void from_json(const json &j, FunctionDefinition &f) {
   j.at("parameters").get_to(f.parameters);
   j.at("returns").get_to(f.returns);
   j.at("body").get_to(f.body);
+  if (j.contains("annotations")) {
+    from_json(j.at("annotations"), f.annotations);
+  }
   j.at("span").get_to(f.span);
-  // Optionally: check type tag
+  // The parser gives every definition its Function up front
+  f.function = std::make_shared<Function>();
 }
 
 // --- EnumDefinition ---
@@ -457,6 +529,18 @@ inline void from_json(const json &j, EnumDefinition &e) {
   j.at("members").get_to(e.members);
   j.at("enum_type").get_to(e.enum_type);
   j.at("span").get_to(e.span);
+  // The members share the enum's type, which holds them by name, like the
+  // parser builds them
+  if (e.enum_type && e.enum_type->base_type == BaseType::Enum) {
+    auto enum_struct = std::make_shared<Enum>();
+    enum_struct->name = e.identifier->name;
+    enum_struct->span = e.span;
+    for (const auto &member : e.members) {
+      member->type = e.enum_type;
+      enum_struct->members[member->name] = member;
+    }
+    e.enum_type->structure = enum_struct;
+  }
 }
 
 // --- StructDefinition ---
@@ -495,12 +579,16 @@ inline void from_json(const json &j, Assignment &a) {
 inline void to_json(json &j, const Return &r) {
   j = json{{"type", "Return"}};
   j["expression"] = r.expression;
+  j["tail_call"] = r.tail_call;
   if (!g_visualization_mode) {
     j["span"] = r.span;
   }
 }
 inline void from_json(const json &j, Return &r) {
   j.at("expression").get_to(r.expression);
+  if (j.contains("tail_call")) {
+    j.at("tail_call").get_to(r.tail_call);
+  }
   j.at("span").get_to(r.span);
 }
 // --- Polymorphic pointer serialization for Statement ---
@@ -588,6 +676,7 @@ inline void from_json(const json &j, Ref<Statement> &stmt) {
   } else if (type == "FunctionDefinition") {
     auto func_def = std::make_shared<FunctionDefinition>();
     from_json(j, *func_def);
+    func_def->function->definition = func_def;
     stmt = func_def;
   } else if (type == "Assignment") {
     auto assign = std::make_shared<Assignment>();
@@ -622,7 +711,7 @@ inline void to_json(json &j, const Enum &e) {
   }
 }
 inline void from_json(const json &j, Enum &e) {
-  j.at("name").get_to(e.name);
+  from_json(j.at("name"), e.name);
   j.at("span").get_to(e.span);
   e.members.clear();
   for (const auto &[name, member] : j.at("members").items()) {
@@ -642,7 +731,7 @@ inline void to_json(json &j, const Struct &s) {
   }
 }
 inline void from_json(const json &j, Struct &s) {
-  j.at("name").get_to(s.name);
+  from_json(j.at("name"), s.name);
   j.at("span").get_to(s.span);
   s.fields.clear();
   for (const auto &field : j.at("fields")) {
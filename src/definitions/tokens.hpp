@@ -50,6 +50,7 @@ enum class TokenType {
   Minus,
   Asterisk,
   Slash,
+  Percent,
   LessThan,
   LessThanEquals,
   GreaterThan,
@@ -58,6 +59,7 @@ enum class TokenType {
   NotEquals,
   Exclamation,
   Ampersand,
+  At,
 
   // Literal types
   Identifier,
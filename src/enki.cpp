@@ -1,21 +1,47 @@
 
+#include <algorithm>
 #include <cctype>
+#include <cstdlib>
 #include <fstream>
+#include <getopt.h>
 #include <iomanip>
 #include <iostream>
 #include <nlohmann/json.hpp>
+#include <optional>
+#include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/spdlog.h>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
+#include "compiler/batch.hpp"
 #include "compiler/codegen.hpp"
+#include "compiler/codegen_c.hpp"
+#include "compiler/codegen_llvm.hpp"
+#include "compiler/codegen_native.hpp"
+#include "compiler/incremental.hpp"
 #include "compiler/injections.hpp"
 #include "compiler/lexer.hpp"
+#include "compiler/lsp.hpp"
+#include "compiler/modules.hpp"
 #include "compiler/parser.hpp"
+#include "compiler/reachability.hpp"
+#include "compiler/server.hpp"
+#include "compiler/tailcalls.hpp"
 #include "compiler/typecheck.hpp"
 #include "definitions/serializations.hpp"
+#include "interpreter/compiler.hpp"
+#include "interpreter/jit.hpp"
+#include "interpreter/repl.hpp"
+#include "interpreter/vm.hpp"
+#include "ir/emit_cpp.hpp"
+#include "ir/lower.hpp"
+#include "ir/passes.hpp"
+#include "ir/printer.hpp"
+#include "ir/verify.hpp"
 #include "utils/logging.hpp"
 
 // External declaration of the global visualization flag
@@ -76,9 +102,12 @@ Ref<Program> compile(const std::string &source, const std::string &filename,
                      Ref<ModuleContext> module_context) {
   auto buffer_ptr = std::make_shared<std::string>(source);
   std::vector<Token> tokens = lex(*buffer_ptr, filename);
+  module_context->load_imports(filename, *buffer_ptr, tokens);
   auto program = parse(tokens, buffer_ptr, module_context);
   perform_injections(program); // New injection pass
   typecheck(program);
+  link_modules(program);
+  mark_tail_calls(program);
   return program;
 }
 
@@ -86,6 +115,13 @@ void print_global_usage(const char *prog_name) {
   fmt::println("Usage: {} <command> [options] [arguments]", prog_name);
   fmt::println("Commands:");
   fmt::println("  compile: Compile a enki source file to AST JSON");
+  fmt::println("  run: Run a enki source file in the bytecode VM");
+  fmt::println("  jit: Run a enki source file in the VM, compiling hot "
+               "functions to machine code");
+  fmt::println("  repl: Evaluate enki interactively, one input at a time");
+  fmt::println("  serve: Compile for 'compile --server', keeping imported "
+               "modules in memory");
+  fmt::println("  lsp: Run a language server for editors on stdin and stdout");
   fmt::println("  serde: Test AST serialization/deserialization");
   fmt::println("");
   fmt::println(
@@ -94,13 +130,96 @@ void print_global_usage(const char *prog_name) {
 }
 
 void print_compile_usage(const char *prog_name) {
-  fmt::println("Usage: {} compile [options] <input-file>", prog_name);
+  fmt::println("Usage: {} compile [options] <input-file>...", prog_name);
+  fmt::println("Several inputs, or @<file> listing one per line, are "
+               "compiled side by side, sharing the modules they import");
   fmt::println("Options:");
-  fmt::println("  -o <file>: Output file for compiled AST");
+  fmt::println("  -o <file>: Output file for compiled AST, only with a "
+               "single input");
+  fmt::println("  -j <n>: Inputs compiled at the same time (default: one "
+               "per core)");
   fmt::println("  -a: Output AST as JSON");
   fmt::println("  -t: Stop after type checking, do not generate C++ code");
   fmt::println(
       "  --vis: Output minimal AST for visualization (no spans/locations)");
+  fmt::println(
+      "  --backend=<cpp|cpp-ir|c|native|llvm>: Code generator to use "
+      "(default: cpp)");
+  fmt::println("  --emit-ir: Write the SSA IR of the program to <output>.ir");
+  fmt::println("  -O <0-3>: Optimization level for the c, llvm and IR based "
+               "backends (default: 2)");
+  fmt::println("  --passes=<pipeline>: LLVM pass pipeline, overrides -O "
+               "(e.g. 'default<O3>')");
+  fmt::println("  --inline-threshold=<n>: Largest function, in IR "
+               "instructions, the inliner copies into callers (default: 25)");
+  fmt::println("  --unroll=<n>: Copies of the body in unrolled counted loops, "
+               "1 to 16, 1 disables unrolling (default: 4)");
+  fmt::println("  --no-vectorize: Keep counted loops over buffers scalar in "
+               "the IR");
+  fmt::println("  --remarks=<pass,...>: Report the decisions of the IR "
+               "passes on stderr (inline, escape, peephole, cse, licm, "
+               "vectorize, unroll, all), vectorize also reports LLVM's loop "
+               "vectorizer with --backend=llvm");
+  fmt::println("  --print-removed: List the functions and types dropped because "
+               "they are unreachable from main");
+  fmt::println("  --cache-stats: Report how many imported modules were loaded "
+               "from the module cache on stderr");
+  fmt::println("  --no-cache: Parse every imported module again instead of "
+               "using the module cache");
+  fmt::println("  --incremental: Build with the c backend one function at a "
+               "time, rebuilding only what changed since the last build "
+               "(no AST output)");
+  fmt::println("  --explain-rebuild: List what an incremental build "
+               "recompiled and why on stderr, implies --incremental");
+  fmt::println("  --server[=<socket>]: Compile on the server started by "
+               "'enki serve', or in-process when none is running");
+  fmt::println("  -h: Show this help message");
+}
+
+void print_run_usage(const char *prog_name) {
+  fmt::println("Usage: {} run [options] <input-file>", prog_name);
+  fmt::println("Options:");
+  fmt::println("  --dump-bytecode: Print the compiled bytecode to stderr "
+               "before running it");
+  fmt::println("  -h: Show this help message");
+}
+
+void print_jit_usage(const char *prog_name) {
+  fmt::println("Usage: {} jit [options] <input-file>", prog_name);
+  fmt::println("Options:");
+  fmt::println("  --threshold=<n>: Calls after which a function runs as "
+               "machine code, 0 compiles main right away (default: 1000)");
+  fmt::println("  --print-tier-up: Report every function moved to machine "
+               "code on stderr");
+  fmt::println("  --dump-bytecode: Print the compiled bytecode to stderr "
+               "before running it");
+  fmt::println("  -h: Show this help message");
+}
+
+void print_repl_usage(const char *prog_name) {
+  fmt::println("Usage: {} repl [options]", prog_name);
+  fmt::println("Reads statements from stdin and runs each as soon as it is "
+               "complete, ':quit' or end of input stops");
+  fmt::println("Options:");
+  fmt::println("  -h: Show this help message");
+}
+
+void print_serve_usage(const char *prog_name) {
+  fmt::println("Usage: {} serve [options]", prog_name);
+  fmt::println("Runs the compiles of 'enki compile --server' until "
+               "interrupted");
+  fmt::println("Options:");
+  fmt::println("  --socket=<path>: Unix socket to listen on (default: "
+               "$ENKI_SERVER_SOCKET, $XDG_RUNTIME_DIR/enki.sock or "
+               "/tmp/enki-<uid>.sock)");
+  fmt::println("  -h: Show this help message");
+}
+
+void print_lsp_usage(const char *prog_name) {
+  fmt::println("Usage: {} lsp [options]", prog_name);
+  fmt::println("Speaks the Language Server Protocol on stdin and stdout, "
+               "logging to stderr");
+  fmt::println("Options:");
   fmt::println("  -h: Show this help message");
 }
 
@@ -124,32 +243,237 @@ std::string default_output_path(const std::string &input_filename) {
   return build_dir.data() + output_filename;
 }
 
-int compile_command(int argc, char *argv[]) {
+enum class Backend { Cpp, CppIR, C, Native, LLVM };
+
+// Long-only options start above the range of any short option character
+enum LongOption {
+  OPT_VIS = 256,
+  OPT_BACKEND,
+  OPT_PASSES,
+  OPT_EMIT_IR,
+  OPT_INLINE_THRESHOLD,
+  OPT_UNROLL,
+  OPT_NO_VECTORIZE,
+  OPT_REMARKS,
+  OPT_PRINT_REMOVED,
+  OPT_DUMP_BYTECODE,
+  OPT_THRESHOLD,
+  OPT_PRINT_TIER_UP,
+  OPT_CACHE_STATS,
+  OPT_NO_CACHE,
+  OPT_INCREMENTAL,
+  OPT_EXPLAIN_REBUILD,
+  OPT_SOCKET,
+};
+
+// Directory holding the runtime (enki_io.hpp, enki_rt.h/.c), the environment takes precedence over the
+// location baked in at build time
+static std::string runtime_dir() {
+  if (const char *dir = std::getenv("ENKI_RUNTIME_DIR")) {
+    return dir;
+  }
+  return ENKI_RUNTIME_DIR;
+}
+
+// The native backend links against a prebuilt runtime object, falling back to
+// compiling the runtime source when it isn't there (e.g. after `make clean`)
+static std::string runtime_object() {
+  if (const char *object = std::getenv("ENKI_RUNTIME_OBJECT")) {
+    return object;
+  }
+  if (std::filesystem::exists(ENKI_RUNTIME_OBJECT)) {
+    return ENKI_RUNTIME_OBJECT;
+  }
+  return runtime_dir() + "/enki_rt.c";
+}
+
+// Imported modules are parsed once and then read back from the module cache
+// while their source stays the same, see ModuleCache. They also leave their
+// interface next to them, see module_interface.hpp.
+static Ref<ModuleContext> make_module_context(bool use_cache) {
+  auto module_context = std::make_shared<ModuleContext>();
+  module_context->write_interfaces = use_cache;
+  if (use_cache) {
+    if (auto directory = ModuleCache::default_directory()) {
+      module_context->cache = std::make_shared<ModuleCache>(*directory);
+    }
+  }
+  return module_context;
+}
+
+// A verifier failure is a compiler bug rather than an error in the program
+static void verify_ir(const ir::Module &module, const char *stage) {
+  auto errors = ir::verify(module);
+  if (errors.empty()) {
+    return;
+  }
+  for (const auto &error : errors) {
+    spdlog::error("[ir] Verifier ({}): {}", stage, error);
+  }
+  spdlog::error("[ir] Invalid IR:\n{}", ir::print_module(module));
+  std::exit(1);
+}
+
+// Lowers the program to IR and optimizes it, verifying the IR before and
+// after the passes
+static ir::Module build_ir(Ref<Program> program,
+                           const ir::PassOptions &pass_options) {
+  auto module = ir::lower_program(program);
+  verify_ir(module, "after lowering");
+  ir::optimize(module, pass_options);
+  verify_ir(module, "after optimization");
+  return module;
+}
+
+// LLVM tools are often only installed with a version suffix (opt-14), so
+// their names can be overridden from the environment
+static std::string llvm_tool(const char *env, const char *fallback) {
+  if (const char *tool = std::getenv(env)) {
+    return tool;
+  }
+  return fallback;
+}
+
+// Writes the module as textual IR, runs the pass pipeline over it with `opt`
+// and lowers the result to an object with `llc`, which is then linked against
+// the runtime like the native backend's output. With `vectorize_remarks` opt
+// reports which loops its vectorizer transformed on stderr.
+static int build_with_llvm(Ref<Program> program,
+                           const std::string &output_filename,
+                           int opt_level, const std::string &passes,
+                           bool vectorize_remarks) {
+  auto ir_file = output_filename + ".ll";
+  std::ofstream ir_output(ir_file);
+  if (!ir_output.is_open()) {
+    spdlog::error("Could not open LLVM IR output file: {}", ir_file);
+    return 1;
+  }
+  ir_output << codegen_llvm(program);
+  ir_output.close();
+  spdlog::info("Wrote LLVM IR to {}", ir_file);
+
+  auto pipeline = passes.empty()
+                      ? "default<O" + std::to_string(opt_level) + ">"
+                      : passes;
+  auto optimized_file = output_filename + ".opt.bc";
+  std::string opt_cmd = llvm_tool("ENKI_OPT", "opt") + " -passes='" +
+                        pipeline + "' -o " + optimized_file + " " + ir_file;
+  if (vectorize_remarks) {
+    opt_cmd += " -pass-remarks=loop-vectorize";
+  }
+  spdlog::info("Optimizing with command: {}", opt_cmd);
+  if (system(opt_cmd.c_str()) != 0) {
+    spdlog::error("Failed to optimize {}", ir_file);
+    return 1;
+  }
+
+  auto object_file = output_filename + ".o";
+  std::string llc_cmd = llvm_tool("ENKI_LLC", "llc") + " -O" +
+                        std::to_string(opt_level) +
+                        " -filetype=obj -relocation-model=pic -o " +
+                        object_file + " " + optimized_file;
+  spdlog::info("Generating object file with command: {}", llc_cmd);
+  if (system(llc_cmd.c_str()) != 0) {
+    spdlog::error("Failed to generate object file from {}", optimized_file);
+    return 1;
+  }
+
+  std::string link_cmd =
+      "cc -o " + output_filename + " " + object_file + " " + runtime_object();
+  spdlog::info("Linking with command: {}", link_cmd);
+  if (system(link_cmd.c_str()) != 0) {
+    spdlog::error("Failed to link {}", object_file);
+    return 1;
+  }
+  return 0;
+}
+
+// Options of `enki compile`
+static const char *compile_short_options = "o:hatO:j:";
+static const struct option compile_options[] = {
+    {"vis", no_argument, nullptr, OPT_VIS},
+    {"backend", required_argument, nullptr, OPT_BACKEND},
+    {"passes", required_argument, nullptr, OPT_PASSES},
+    {"emit-ir", no_argument, nullptr, OPT_EMIT_IR},
+    {"inline-threshold", required_argument, nullptr, OPT_INLINE_THRESHOLD},
+    {"unroll", required_argument, nullptr, OPT_UNROLL},
+    {"no-vectorize", no_argument, nullptr, OPT_NO_VECTORIZE},
+    {"remarks", required_argument, nullptr, OPT_REMARKS},
+    {"print-removed", no_argument, nullptr, OPT_PRINT_REMOVED},
+    {"cache-stats", no_argument, nullptr, OPT_CACHE_STATS},
+    {"no-cache", no_argument, nullptr, OPT_NO_CACHE},
+    {"incremental", no_argument, nullptr, OPT_INCREMENTAL},
+    {"explain-rebuild", no_argument, nullptr, OPT_EXPLAIN_REBUILD},
+    {nullptr, 0, nullptr, 0},
+};
+
+// The file a compile with these arguments reads, when it uses the module
+// cache. Nothing is reported, the compile does that itself.
+static std::optional<std::string> compile_input(int argc, char *argv[]) {
   optind = 1; // Reset getopt
-  std::string output_filename;
-  bool visualization_mode = false;
+  opterr = 0;
+  bool use_cache = true;
+  bool usage = false;
   int opt;
+  while ((opt = getopt_long(argc, argv, compile_short_options, compile_options,
+                            nullptr)) != -1) {
+    if (opt == OPT_NO_CACHE) {
+      use_cache = false;
+    } else if (opt == 'h' || opt == '?') {
+      usage = true;
+    }
+  }
+  opterr = 1;
+  if (!use_cache || usage || optind >= argc) {
+    return std::nullopt;
+  }
+  return argv[optind];
+}
 
-  // Handle --vis flag first
-  for (int i = 1; i < argc; i++) {
-    if (std::string(argv[i]) == "--vis") {
-      visualization_mode = true;
-      // Remove the flag from argv
-      for (int j = i; j < argc - 1; j++) {
-        argv[j] = argv[j + 1];
-      }
-      argc--;
-      i--; // Adjust index since we removed an element
-      break;
+// `modules` are the modules shared with other compiles, those kept by
+// `enki serve` or those of a batch
+int compile_command(int argc, char *argv[],
+                    Ref<ModuleContext> modules = nullptr) {
+  // `--server` hands the whole compile to `enki serve`
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg != "--server" && !arg.starts_with("--server=")) {
+      continue;
     }
+    auto socket = arg == "--server" ? default_server_socket()
+                                    : std::string(arg.substr(9));
+    std::copy(argv + i + 1, argv + argc, argv + i);
+    argv[--argc] = nullptr;
+    if (auto code = compile_on_server(
+            socket, std::vector<std::string>(argv, argv + argc))) {
+      return *code;
+    }
+    spdlog::info("[server] No server on {}, compiling in-process", socket);
+    break;
   }
 
-  // Reset optind after modifying argc/argv
-  optind = 1;
+  optind = 1; // Reset getopt
+  std::string output_filename;
+  bool visualization_mode = false;
   bool output_ast_json = false;
   bool typecheck_only = false;
+  bool emit_ir = false;
+  bool print_removed = false;
+  bool cache_stats = false;
+  bool use_cache = true;
+  bool incremental = false;
+  bool explain_rebuild = false;
+  Backend backend = Backend::Cpp;
+  bool backend_given = false;
+  int opt_level = 2;
+  unsigned jobs = 0;
+  std::string passes;
+  ir::PassOptions pass_options;
+  int opt;
 
-  while ((opt = getopt(argc, argv, "o:hat")) != -1) {
+
+  while ((opt = getopt_long(argc, argv, compile_short_options, compile_options,
+                            nullptr)) != -1) {
     switch (opt) {
     case 'o':
       output_filename = optarg;
@@ -163,15 +487,175 @@ int compile_command(int argc, char *argv[]) {
     case 't':
       typecheck_only = true;
       break;
+    case OPT_VIS:
+      visualization_mode = true;
+      break;
+    case OPT_BACKEND:
+      backend_given = true;
+      if (std::string_view(optarg) == "cpp") {
+        backend = Backend::Cpp;
+      } else if (std::string_view(optarg) == "cpp-ir") {
+        backend = Backend::CppIR;
+      } else if (std::string_view(optarg) == "c") {
+        backend = Backend::C;
+      } else if (std::string_view(optarg) == "native") {
+        backend = Backend::Native;
+      } else if (std::string_view(optarg) == "llvm") {
+        backend = Backend::LLVM;
+      } else {
+        spdlog::error("Unknown backend: {}", optarg);
+        print_compile_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'O':
+      if (std::string_view(optarg).size() != 1 || optarg[0] < '0' ||
+          optarg[0] > '3') {
+        spdlog::error("Invalid optimization level: {}", optarg);
+        print_compile_usage(argv[0]);
+        return 1;
+      }
+      opt_level = optarg[0] - '0';
+      break;
+    case 'j': {
+      auto text = std::string_view(optarg);
+      if (text.empty() || !std::all_of(text.begin(), text.end(), ::isdigit) ||
+          std::stoul(optarg) == 0) {
+        spdlog::error("Invalid job count: {}", optarg);
+        print_compile_usage(argv[0]);
+        return 1;
+      }
+      jobs = std::stoul(optarg);
+      break;
+    }
+    case OPT_PASSES:
+      passes = optarg;
+      break;
+    case OPT_EMIT_IR:
+      emit_ir = true;
+      break;
+    case OPT_INLINE_THRESHOLD: {
+      auto text = std::string_view(optarg);
+      if (text.empty() ||
+          !std::all_of(text.begin(), text.end(), ::isdigit)) {
+        spdlog::error("Invalid inline threshold: {}", optarg);
+        print_compile_usage(argv[0]);
+        return 1;
+      }
+      pass_options.inline_threshold = std::stoul(optarg);
+      break;
+    }
+    case OPT_UNROLL: {
+      auto text = std::string_view(optarg);
+      if (text.empty() || text.size() > 2 ||
+          !std::all_of(text.begin(), text.end(), ::isdigit) ||
+          std::stoul(optarg) < 1 || std::stoul(optarg) > 16) {
+        spdlog::error("Invalid unroll factor: {}, expected 1 to 16", optarg);
+        print_compile_usage(argv[0]);
+        return 1;
+      }
+      pass_options.unroll_factor = std::stoul(optarg);
+      break;
+    }
+    case OPT_NO_VECTORIZE:
+      pass_options.vectorize = false;
+      break;
+    case OPT_REMARKS: {
+      std::stringstream list(optarg);
+      std::string pass;
+      while (std::getline(list, pass, ',')) {
+        if (pass != "all" && !ir::is_remark_pass(pass)) {
+          spdlog::error("Unknown remarks pass: {}", pass);
+          print_compile_usage(argv[0]);
+          return 1;
+        }
+        pass_options.remarks.insert(pass);
+      }
+      break;
+    }
+    case OPT_PRINT_REMOVED:
+      print_removed = true;
+      break;
+    case OPT_CACHE_STATS:
+      cache_stats = true;
+      break;
+    case OPT_NO_CACHE:
+      use_cache = false;
+      break;
+    case OPT_INCREMENTAL:
+      incremental = true;
+      break;
+    case OPT_EXPLAIN_REBUILD:
+      incremental = true;
+      explain_rebuild = true;
+      break;
     default: /* '?' */
       print_compile_usage(argv[0]);
       return 1;
     }
   }
 
+  pass_options.opt_level = opt_level;
+
+  std::vector<std::string> inputs;
+  if (!expand_inputs(std::vector<std::string>(argv + optind, argv + argc),
+                     inputs)) {
+    return 1;
+  }
+
+  Ref<ModuleContext> module_context =
+      modules ? modules : make_module_context(use_cache);
+  // Typechecking only needs the declarations of the modules, the server
+  // already has all of them
+  if (typecheck_only && use_cache && !modules) {
+    module_context->use_interface = [](const std::string &, uint64_t) {
+      return true;
+    };
+  }
+
+  // Every input is compiled with the options given for all of them, which
+  // getopt has moved in front of the inputs
+  if (inputs.size() > 1) {
+    if (!output_filename.empty()) {
+      spdlog::error("-o takes a single input, {} were given", inputs.size());
+      return 1;
+    }
+    // Outputs are named after the input alone, and the compiles run side by
+    // side, so two inputs of the same name would write the same files
+    if (!typecheck_only) {
+      std::unordered_map<std::string, std::string> outputs;
+      for (const auto &input : inputs) {
+        auto [other, added] =
+            outputs.emplace(default_output_path(input), input);
+        if (!added) {
+          spdlog::error("{} and {} would both be written to {}, compile them "
+                        "separately",
+                        other->second, input, other->first);
+          return 1;
+        }
+      }
+    }
+    std::vector<std::string> options(argv, argv + optind);
+    if (jobs == 0) {
+      jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return compile_batch(
+        inputs, jobs, module_context,
+        [&](const std::string &input, Ref<ModuleContext> shared) {
+          auto args = options;
+          args.push_back(input);
+          std::vector<char *> input_argv;
+          for (auto &arg : args) {
+            input_argv.push_back(arg.data());
+          }
+          input_argv.push_back(nullptr);
+          return compile_command(args.size(), input_argv.data(), shared);
+        });
+  }
+
   std::string input_filename;
-  if (optind < argc) {
-    input_filename = argv[optind];
+  if (!inputs.empty()) {
+    input_filename = inputs[0];
   }
 
   if (input_filename.empty()) {
@@ -187,7 +671,6 @@ int compile_command(int argc, char *argv[]) {
   }
 
   Ref<Program> program;
-  Ref<ModuleContext> module_context = std::make_shared<ModuleContext>();
 
   // If input file, lex, parse, and print to output file
   std::ifstream file(input_filename);
@@ -198,8 +681,36 @@ int compile_command(int argc, char *argv[]) {
   std::stringstream buffer;
   buffer << file.rdbuf();
   std::string source = buffer.str();
+
+  // Goes through the front end itself, it only typechecks what it rebuilds
+  if (incremental && !typecheck_only) {
+    if (backend_given && backend != Backend::C) {
+      spdlog::error("--incremental builds with the c backend, it cannot be "
+                    "combined with another --backend");
+      return 1;
+    }
+    if (output_filename.empty()) {
+      output_filename = default_output_path(input_filename);
+    }
+    return build_incremental(source, input_filename, module_context,
+                             {output_filename, opt_level, runtime_dir(),
+                              runtime_object(), explain_rebuild});
+  }
+
   program = compile(source, input_filename, module_context);
 
+  if (cache_stats) {
+    ModuleCache::Stats stats;
+    if (module_context->cache) {
+      stats = module_context->cache->statistics();
+    }
+    fmt::print(stderr,
+               "[cache] {} hits, {} misses, {} stored, {} evicted, {} "
+               "interfaces read\n",
+               stats.hits, stats.misses, stats.stores, stats.evictions,
+               stats.interfaces);
+  }
+
   if (output_filename.empty()) {
     output_filename =
         default_output_path(input_filename);
@@ -231,6 +742,83 @@ int compile_command(int argc, char *argv[]) {
     return 0;
   }
 
+  // Every backend only sees what main can reach
+  for (const auto &removed : remove_unreachable_declarations(program)) {
+    if (print_removed) {
+      fmt::print(stderr, "removed {}\n", removed);
+    }
+  }
+
+  if (backend == Backend::Native) {
+    auto object_file = output_filename + ".o";
+    if (!write_elf_object(codegen_native(program), object_file)) {
+      return 1;
+    }
+    spdlog::info("Wrote object file to {}", object_file);
+
+    std::string link_cmd =
+        "cc -o " + output_filename + " " + object_file + " " + runtime_object();
+    spdlog::info("Linking with command: {}", link_cmd);
+    if (system(link_cmd.c_str()) != 0) {
+      spdlog::error("Failed to link {}", object_file);
+      return 1;
+    }
+    return 0;
+  }
+
+  // Built at most once, the passes report their remarks while it is built
+  std::optional<ir::Module> ir_module;
+  auto optimized_ir = [&]() -> const ir::Module & {
+    if (!ir_module) {
+      ir_module = build_ir(program, pass_options);
+    }
+    return *ir_module;
+  };
+
+  if (emit_ir) {
+    auto ir_path = output_filename + ".ir";
+    std::ofstream output(ir_path);
+    if (!output.is_open()) {
+      spdlog::error("Could not open output file: {}", ir_path);
+      return 1;
+    }
+    output << ir::print_module(optimized_ir());
+    spdlog::info("Wrote IR to {}", ir_path);
+  }
+
+  if (backend == Backend::LLVM) {
+    bool vectorize_remarks = pass_options.remarks.contains("vectorize") ||
+                             pass_options.remarks.contains("all");
+    return build_with_llvm(program, output_filename, opt_level, passes,
+                           vectorize_remarks);
+  }
+
+  if (backend == Backend::C) {
+    auto temp_c_file = output_filename + ".c";
+    std::ofstream c_output(temp_c_file);
+    if (!c_output.is_open()) {
+      spdlog::error("Could not open temporary C output file: {}", temp_c_file);
+      return 1;
+    }
+    c_output << codegen_c(program);
+    c_output.close();
+    spdlog::info("Wrote C code to {}", temp_c_file);
+
+    // compile the generated C code together with the runtime
+    auto rt_dir = runtime_dir();
+    std::string compile_cmd = "cc -std=c11 -O" + std::to_string(opt_level) +
+                              " -I" + rt_dir + " -o " +
+                              output_filename + " " + temp_c_file + " " +
+                              rt_dir + "/enki_rt.c";
+    spdlog::info("Compiling generated C code with command: {}", compile_cmd);
+    int compile_result = system(compile_cmd.c_str());
+    if (compile_result != 0) {
+      spdlog::error("Failed to compile generated C code");
+      return 1;
+    }
+    return 0;
+  }
+
   auto temp_cpp_file = output_filename + ".cpp";
   std::ofstream cpp_output(temp_cpp_file);
   if (!cpp_output.is_open()) {
@@ -238,12 +826,13 @@ int compile_command(int argc, char *argv[]) {
                   temp_cpp_file);
     return 1;
   }
-  cpp_output << codegen(program);
+  cpp_output << (backend == Backend::CppIR ? ir::emit_cpp(optimized_ir())
+                                           : codegen(program));
   cpp_output.close();
   spdlog::info("Wrote CPP code to {}", temp_cpp_file);
 
   // compile the generated C++ code
-  std::string compile_cmd = "g++ -std=c++17 -o " +
+  std::string compile_cmd = "g++ -std=c++17 -I" + runtime_dir() + " -o " +
                             output_filename + " " + temp_cpp_file;
   spdlog::info("Compiling generated C++ code with command: {}", compile_cmd);
   int compile_result = system(compile_cmd.c_str());
@@ -255,6 +844,263 @@ int compile_command(int argc, char *argv[]) {
   return 0;
 }
 
+// Compiles a source file to bytecode for `run` and `jit`, returns false if
+// there is nothing to run
+bool compile_for_vm(const std::string &input_filename, bool dump_bytecode,
+                    Ref<Program> &program, vm::Module &module) {
+  // The log shares stdout with the program, keep it to problems unless a
+  // level was asked for. The parser and typechecker also dump some nodes to
+  // std::cout, which is muted while compiling for the same reason.
+  bool quiet = !std::getenv("LOG");
+  if (quiet) {
+    spdlog::set_level(spdlog::level::warn);
+  }
+
+  std::ifstream file(input_filename);
+  if (!file.is_open()) {
+    spdlog::error("Could not open file: {}", input_filename);
+    return false;
+  }
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  auto *cout_buffer = quiet ? std::cout.rdbuf(nullptr) : nullptr;
+  program = compile(buffer.str(), input_filename, make_module_context(true));
+  remove_unreachable_declarations(program);
+  module = vm::compile_program(program);
+  if (quiet) {
+    std::cout.rdbuf(cout_buffer);
+    std::cout.clear();
+  }
+
+  if (dump_bytecode) {
+    fmt::print(stderr, "{}", vm::disassemble(module));
+  }
+  if (module.main == -1) {
+    spdlog::error("{} has no main function to run", input_filename);
+    return false;
+  }
+  return true;
+}
+
+int run_command(int argc, char *argv[]) {
+  optind = 1; // Reset getopt
+  bool dump_bytecode = false;
+  int opt;
+
+  static const struct option long_options[] = {
+      {"dump-bytecode", no_argument, nullptr, OPT_DUMP_BYTECODE},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  while ((opt = getopt_long(argc, argv, "h", long_options, nullptr)) != -1) {
+    switch (opt) {
+    case 'h':
+      print_run_usage(argv[0]);
+      return 0;
+    case OPT_DUMP_BYTECODE:
+      dump_bytecode = true;
+      break;
+    default: /* '?' */
+      print_run_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::string input_filename;
+  if (optind < argc) {
+    input_filename = argv[optind];
+  }
+
+  if (input_filename.empty()) {
+    spdlog::error("An input file is required.");
+    print_run_usage(argv[0]);
+    return 1;
+  }
+
+  Ref<Program> program;
+  vm::Module module;
+  if (!compile_for_vm(input_filename, dump_bytecode, program, module)) {
+    return 1;
+  }
+  return vm::run(module);
+}
+
+int jit_command(int argc, char *argv[]) {
+  optind = 1; // Reset getopt
+  bool dump_bytecode = false;
+  bool print_tier_up = false;
+  vm::TierUp tier_up;
+  int opt;
+
+  static const struct option long_options[] = {
+      {"threshold", required_argument, nullptr, OPT_THRESHOLD},
+      {"print-tier-up", no_argument, nullptr, OPT_PRINT_TIER_UP},
+      {"dump-bytecode", no_argument, nullptr, OPT_DUMP_BYTECODE},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  while ((opt = getopt_long(argc, argv, "h", long_options, nullptr)) != -1) {
+    switch (opt) {
+    case 'h':
+      print_jit_usage(argv[0]);
+      return 0;
+    case OPT_THRESHOLD: {
+      auto text = std::string_view(optarg);
+      if (text.empty() || text.size() > 9 ||
+          !std::all_of(text.begin(), text.end(), ::isdigit)) {
+        spdlog::error("Invalid threshold: {}", optarg);
+        print_jit_usage(argv[0]);
+        return 1;
+      }
+      tier_up.threshold = std::stoul(optarg);
+      break;
+    }
+    case OPT_PRINT_TIER_UP:
+      print_tier_up = true;
+      break;
+    case OPT_DUMP_BYTECODE:
+      dump_bytecode = true;
+      break;
+    default: /* '?' */
+      print_jit_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::string input_filename;
+  if (optind < argc) {
+    input_filename = argv[optind];
+  }
+
+  if (input_filename.empty()) {
+    spdlog::error("An input file is required.");
+    print_jit_usage(argv[0]);
+    return 1;
+  }
+
+  Ref<Program> program;
+  vm::Module module;
+  if (!compile_for_vm(input_filename, dump_bytecode, program, module)) {
+    return 1;
+  }
+  if (!vm::jit_available()) {
+    spdlog::warn("[jit] Machine code is only generated on x86-64, "
+                 "interpreting instead");
+    return vm::run(module);
+  }
+
+  // The whole program goes through the native backend once, the first time
+  // anything gets hot. Hot functions are then entered there, and whatever
+  // they call runs as machine code too. A program the native backend can't
+  // lower stops there with its error, like --backend=native would.
+  std::unique_ptr<vm::JitCode> code;
+  tier_up.compile = [&](const vm::Function &fn) {
+    if (!code) {
+      code = std::make_unique<vm::JitCode>(codegen_native(program), module);
+    }
+    if (print_tier_up) {
+      fmt::print(stderr, "[jit] '{}' is hot, running it as machine code\n",
+                 fn.name);
+    }
+    return code->function(fn.name);
+  };
+  return vm::run(module, &tier_up);
+}
+
+int repl_command(int argc, char *argv[]) {
+  optind = 1; // Reset getopt
+  int opt;
+  while ((opt = getopt(argc, argv, "h")) != -1) {
+    switch (opt) {
+    case 'h':
+      print_repl_usage(argv[0]);
+      return 0;
+    default: /* '?' */
+      print_repl_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // Like `run`, the log and the AST dumps of the parser would end up between
+  // the results
+  if (!std::getenv("LOG")) {
+    spdlog::set_level(spdlog::level::warn);
+    std::cout.rdbuf(nullptr);
+  }
+  return vm::run_repl(std::cin, isatty(STDIN_FILENO));
+}
+
+int serve_command(int argc, char *argv[]) {
+  optind = 1; // Reset getopt
+  std::string socket = default_server_socket();
+  static const struct option long_options[] = {
+      {"socket", required_argument, nullptr, OPT_SOCKET},
+      {nullptr, 0, nullptr, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h", long_options, nullptr)) != -1) {
+    switch (opt) {
+    case 'h':
+      print_serve_usage(argv[0]);
+      return 0;
+    case OPT_SOCKET:
+      socket = optarg;
+      break;
+    default: /* '?' */
+      print_serve_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // Every compile starts out from the modules its input imports, which the
+  // server loads beforehand
+  auto arguments = [](std::vector<std::string> &args) {
+    std::vector<char *> argv;
+    for (auto &arg : args) {
+      argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+    return argv;
+  };
+  return serve(socket,
+               {[&](std::vector<std::string> &args) {
+                  auto argv = arguments(args);
+                  return compile_input(args.size(), argv.data());
+                },
+                [] { return make_module_context(true); },
+                [&](std::vector<std::string> &args,
+                    Ref<ModuleContext> modules) {
+                  auto argv = arguments(args);
+                  return compile_command(args.size(), argv.data(), modules);
+                }});
+}
+
+int lsp_command(int argc, char *argv[]) {
+  optind = 1; // Reset getopt
+  int opt;
+  while ((opt = getopt(argc, argv, "h")) != -1) {
+    switch (opt) {
+    case 'h':
+      print_lsp_usage(argv[0]);
+      return 0;
+    default: /* '?' */
+      print_lsp_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // stdout carries the protocol, anything else printed there would corrupt
+  // it: logs go to stderr, and only warnings unless LOG asks for more
+  std::ostream protocol(std::cout.rdbuf());
+  std::cout.rdbuf(nullptr);
+  auto console = spdlog::stderr_color_mt("lsp");
+  spdlog::set_default_logger(console);
+  spdlog::set_level(std::getenv("LOG")
+                        ? spdlog::level::from_str(std::getenv("LOG"))
+                        : spdlog::level::warn);
+  return run_language_server(std::cin, protocol, make_module_context(true));
+}
+
 int serde_command(int argc, char *argv[]) {
   optind = 1; // Reset getopt
   int opt;
@@ -352,6 +1198,16 @@ int main(int argc, char *argv[]) {
 
   if (command == "compile") {
     return compile_command(argc, argv);
+  } else if (command == "run") {
+    return run_command(argc, argv);
+  } else if (command == "jit") {
+    return jit_command(argc, argv);
+  } else if (command == "repl") {
+    return repl_command(argc, argv);
+  } else if (command == "serve") {
+    return serve_command(argc, argv);
+  } else if (command == "lsp") {
+    return lsp_command(argc, argv);
   } else if (command == "serde") {
     return serde_command(argc, argv);
   } else if (command == "-h" || command == "--help") {
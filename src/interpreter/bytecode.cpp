@@ -0,0 +1,112 @@
+#include "bytecode.hpp"
+#include <format>
+#include <magic_enum/magic_enum.hpp>
+
+namespace vm {
+
+namespace {
+
+void disassemble_inst(std::string &out, const Module &module, const Inst &inst) {
+  auto r = [](uint16_t reg) { return "r" + std::to_string(reg); };
+  out += std::format("{:<12}", magic_enum::enum_name(inst.op));
+  switch (inst.op) {
+  case Op::Mov:
+  case Op::Not:
+    out += std::format("{}, {}", r(inst.a), r(inst.b));
+    break;
+  case Op::LoadInt:
+    out += std::format("{}, {}", r(inst.a), inst.imm);
+    break;
+  case Op::LoadFloat: {
+    Value value;
+    value.i = inst.imm;
+    out += std::format("{}, {}", r(inst.a), value.f);
+    break;
+  }
+  case Op::LoadConst:
+    out += std::format("{}, k{}", r(inst.a), inst.imm);
+    break;
+  case Op::AddIntImm:
+  case Op::AddOffset:
+  case Op::Load1:
+  case Op::Load4:
+  case Op::Load8:
+    out += std::format("{}, {}, {}", r(inst.a), r(inst.b), inst.imm);
+    break;
+  case Op::Store1:
+  case Op::Store4:
+  case Op::Store8:
+    out += std::format("[{} + {}], {}", r(inst.a), inst.imm, r(inst.b));
+    break;
+  case Op::FrameAddr:
+    out += std::format("{}, {}", r(inst.a), inst.imm);
+    break;
+  case Op::AddIndex:
+    out += std::format("{}, {}, {} * {}", r(inst.a), r(inst.b), r(inst.c),
+                       inst.imm);
+    break;
+  case Op::Copy:
+    out += std::format("[{}], [{}], {}", r(inst.a), r(inst.b), inst.imm);
+    break;
+  case Op::Jump:
+    out += std::format("@{}", inst.imm);
+    break;
+  case Op::JumpIfZero:
+    out += std::format("{}, @{}", r(inst.a), inst.imm);
+    break;
+  case Op::JumpIfEq:
+  case Op::JumpIfNe:
+  case Op::JumpIfLt:
+  case Op::JumpIfGt:
+  case Op::JumpIfLe:
+  case Op::JumpIfGe:
+    out += std::format("{}, {}, @{}", r(inst.a), r(inst.b), inst.imm);
+    break;
+  case Op::Call:
+    out += std::format("{}, {}, {}", r(inst.a),
+                       module.functions[inst.b].name, r(inst.c));
+    break;
+  case Op::CallExtern:
+    out += std::format("{}, {}, {}", r(inst.a), module.externs[inst.b].name,
+                       r(inst.c));
+    break;
+  case Op::Return:
+  case Op::WriteInt:
+  case Op::WriteFloat:
+  case Op::WriteBool:
+  case Op::WriteChar:
+  case Op::WritePtr:
+  case Op::WriteStr:
+    out += r(inst.a);
+    break;
+  case Op::WriteNewline:
+  case Op::EprintBegin:
+  case Op::EprintEnd:
+  case Op::Flush:
+    break;
+  default:
+    out += std::format("{}, {}, {}", r(inst.a), r(inst.b), r(inst.c));
+    break;
+  }
+  out += "\n";
+}
+
+} // namespace
+
+std::string disassemble(const Module &module) {
+  std::string out;
+  for (size_t i = 0; i < module.constants.size(); ++i) {
+    out += std::format("k{} = {}\n", i, module.constants[i].p);
+  }
+  for (const auto &fn : module.functions) {
+    out += std::format("\n{}: {} params, {} registers, {} bytes of frame\n",
+                       fn.name, fn.params, fn.registers, fn.frame_size);
+    for (size_t pc = 0; pc < fn.code.size(); ++pc) {
+      out += std::format("  {:>4}  ", pc);
+      disassemble_inst(out, module, fn.code[pc]);
+    }
+  }
+  return out;
+}
+
+} // namespace vm
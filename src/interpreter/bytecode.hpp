@@ -0,0 +1,149 @@
+#pragma once
+
+/* Register based bytecode run by the VM behind `enki run`. Every function
+gets a window of 64-bit registers and a block of frame memory, registers hold
+ints, floats and pointers, everything that lives in memory (structs, strings
+and locals whose address is taken) uses the C layout, like the native
+backend. Instructions are typed, there are no tags on values at run time. */
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace vm {
+
+// Ints (int, bool, char and enums) are 32 bit, floats single precision. Both
+// use the low four bytes, so a four byte load or store moves either
+union Value {
+  int32_t i;
+  float f;
+  void *p;
+  uint64_t bits;
+};
+
+// Operands are register numbers unless noted, `a` is the destination of
+// every instruction that produces a value
+enum class Op : uint8_t {
+  Mov,        // a = b
+  LoadInt,    // a = imm
+  LoadFloat,  // a = imm as float bits
+  LoadConst,  // a = constants[imm]
+  AddInt,     // a = b + c, wrapping
+  SubInt,     // a = b - c, wrapping
+  MulInt,     // a = b * c, wrapping
+  DivInt,     // a = b / c
+  ModInt,     // a = b % c
+  AddIntImm,  // a = b + imm, wrapping
+  AddFloat,   // a = b + c
+  SubFloat,   // a = b - c
+  MulFloat,   // a = b * c
+  DivFloat,   // a = b / c
+  EqInt,      // a = b == c
+  NeInt,      // a = b != c
+  LtInt,      // a = b < c
+  GtInt,      // a = b > c
+  LeInt,      // a = b <= c
+  GeInt,      // a = b >= c
+  EqFloat,    // a = b == c
+  NeFloat,    // a = b != c
+  LtFloat,    // a = b < c
+  GtFloat,    // a = b > c
+  LeFloat,    // a = b <= c
+  GeFloat,    // a = b >= c
+  EqPtr,      // a = b == c
+  NePtr,      // a = b != c
+  Not,        // a = !b
+  StrEq,      // a = the strings at b and c are equal
+  FrameAddr,  // a = frame memory + imm
+  AddOffset,  // a = b + imm
+  AddIndex,   // a = b + c * imm, c sign extended
+  Load1,      // a = [b + imm], zero extended
+  Load4,      // a = [b + imm]
+  Load8,      // a = [b + imm]
+  Store1,     // [a + imm] = b
+  Store4,     // [a + imm] = b
+  Store8,     // [a + imm] = b
+  Copy,       // [a] = [b], imm bytes
+  Jump,       // goto imm
+  JumpIfZero, // if a == 0 goto imm
+  JumpIfEq,   // if a == b goto imm, ints
+  JumpIfNe,   // if a != b goto imm, ints
+  JumpIfLt,   // if a < b goto imm, ints
+  JumpIfGt,   // if a > b goto imm, ints
+  JumpIfLe,   // if a <= b goto imm, ints
+  JumpIfGe,   // if a >= b goto imm, ints
+  Call,       // a = functions[b](registers c...), the callee's window starts at c
+  CallExtern, // a = externs[b](registers c...)
+  Return,     // return a
+  WriteInt,   // print the int in a
+  WriteFloat, // print the float in a
+  WriteBool,  // print the bool in a
+  WriteChar,  // print the char in a
+  WritePtr,   // print the pointer in a
+  WriteStr,   // print the string at a
+  WriteNewline,
+  EprintBegin, // output goes to stderr until EprintEnd
+  EprintEnd,
+  Flush,
+};
+
+struct Inst {
+  Op op;
+  uint16_t a = 0;
+  uint16_t b = 0;
+  uint16_t c = 0;
+  int32_t imm = 0;
+};
+
+// 16 bit register numbers, a function is limited to this many registers
+constexpr uint32_t max_registers = UINT16_MAX;
+
+// Ints are sign extended, floats go in the floating point registers
+enum class ValueClass : uint8_t { Int, Ptr, Float };
+
+// Only the low byte of a bool or char result is defined
+enum class ResultKind : uint8_t { Void, Int, Byte, Ptr, Float };
+
+// How machine code following the C calling convention is called with
+// arguments from registers. Structs and strings are passed by address.
+struct Signature {
+  std::vector<ValueClass> args;
+  ResultKind result = ResultKind::Void;
+};
+
+struct Function {
+  std::string name;
+  std::vector<Inst> code;
+  uint32_t params = 0;    // In the first registers on entry, incl. the result pointer
+  uint32_t registers = 0; // Size of the register window
+  uint32_t frame_size = 0; // Bytes of frame memory, for slots
+  Signature signature;     // Of its machine code, see TierUp
+};
+
+struct Extern {
+  std::string name;
+  void *address = nullptr;
+  Signature signature;
+};
+
+// Layout of an Enki string in memory, matches enki_str from the runtime
+struct Str {
+  const char *data;
+  int64_t len;
+};
+
+struct Module {
+  std::vector<Function> functions;
+  std::vector<Extern> externs;
+  std::vector<Value> constants;
+  std::deque<std::string> texts; // Backing storage of the string literals
+  std::deque<Str> strings;       // The literals, constants point at these
+  std::deque<std::vector<uint64_t>> globals; // Top level `let`s of the REPL
+  int main = -1;                 // Index of main in functions
+};
+
+// Human readable listing of every function, for --dump-bytecode
+std::string disassemble(const Module &module);
+
+} // namespace vm
@@ -0,0 +1,1114 @@
+/* Compiles the typed AST to register bytecode. Like the native backend each
+function is lowered straight from the AST, scalars that never have their
+address taken get a register and everything else a slot in frame memory.
+Registers are handed out like a stack: locals keep theirs until the end of
+their block, temporaries only until the end of the statement, and the
+arguments of a call go in the registers above everything that is live, where
+the callee's window starts. */
+
+#include "compiler.hpp"
+#include "../compiler/tailcalls.hpp"
+#include "../definitions/lowering.hpp"
+#include "../utils/logging.hpp"
+#include <algorithm>
+#include <cstring>
+#include <dlfcn.h>
+#include <optional>
+#include <spdlog/spdlog.h>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace vm {
+
+namespace {
+
+// ---------------------------------------------------------------------------
+// Types and layout
+// ---------------------------------------------------------------------------
+
+// Frame memory holds strings as the runtime's enki_str, the layout assumes
+static_assert(sizeof(Str) == enki_string_layout.size &&
+              alignof(Str) == enki_string_layout.align);
+
+bool is_aggregate(const Ref<Type> &type) {
+  return type->base_type == BaseType::String ||
+         type->base_type == BaseType::Struct;
+}
+
+bool is_float(const Ref<Type> &type) {
+  return type->base_type == BaseType::Float;
+}
+
+bool is_pointer(const Ref<Type> &type) {
+  return type->base_type == BaseType::Pointer;
+}
+
+ValueClass value_class(const Ref<Type> &type) {
+  if (is_float(type))
+    return ValueClass::Float;
+  return is_pointer(type) || is_aggregate(type) ? ValueClass::Ptr
+                                                : ValueClass::Int;
+}
+
+// Structs and strings are passed by address and returned through a hidden
+// pointer, which comes first
+Signature signature_of(const std::vector<Ref<Type>> &params,
+                       const Ref<Type> &return_type) {
+  Signature signature;
+  if (is_aggregate(return_type))
+    signature.args.push_back(ValueClass::Ptr);
+  for (const auto &param : params)
+    signature.args.push_back(value_class(param));
+  switch (return_type->base_type) {
+  case BaseType::Void:
+  case BaseType::String:
+  case BaseType::Struct:
+    signature.result = ResultKind::Void;
+    break;
+  case BaseType::Bool:
+  case BaseType::Char:
+    signature.result = ResultKind::Byte;
+    break;
+  case BaseType::Pointer:
+    signature.result = ResultKind::Ptr;
+    break;
+  case BaseType::Float:
+    signature.result = ResultKind::Float;
+    break;
+  default:
+    signature.result = ResultKind::Int;
+    break;
+  }
+  return signature;
+}
+
+// Whether the instruction writes its `a` register
+bool writes_register(Op op) {
+  switch (op) {
+  case Op::Store1:
+  case Op::Store4:
+  case Op::Store8:
+  case Op::Copy:
+  case Op::Jump:
+  case Op::JumpIfZero:
+  case Op::JumpIfEq:
+  case Op::JumpIfNe:
+  case Op::JumpIfLt:
+  case Op::JumpIfGt:
+  case Op::JumpIfLe:
+  case Op::JumpIfGe:
+  case Op::Return:
+  case Op::WriteInt:
+  case Op::WriteFloat:
+  case Op::WriteBool:
+  case Op::WriteChar:
+  case Op::WritePtr:
+  case Op::WriteStr:
+  case Op::WriteNewline:
+  case Op::EprintBegin:
+  case Op::EprintEnd:
+  case Op::Flush:
+    return false;
+  default:
+    return true;
+  }
+}
+
+bool is_jump(Op op) {
+  switch (op) {
+  case Op::Jump:
+  case Op::JumpIfZero:
+  case Op::JumpIfEq:
+  case Op::JumpIfNe:
+  case Op::JumpIfLt:
+  case Op::JumpIfGt:
+  case Op::JumpIfLe:
+  case Op::JumpIfGe:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Compiling from the AST
+// ---------------------------------------------------------------------------
+
+// A top level `let` of the REPL, which lives in Module::globals
+struct Global {
+  Ref<Type> type;
+  int constant; // Holds its address
+};
+
+struct ProgramInfo {
+  Module &module;
+  std::unordered_map<std::string_view, int> functions; // Index in module
+  std::unordered_map<std::string_view, Ref<FunctionDefinition>> definitions;
+  std::unordered_map<std::string_view, Ref<::Extern>> externs;
+  std::unordered_map<std::string_view, int> resolved_externs;
+  std::unordered_map<std::string_view, std::vector<std::string_view>> enums;
+  std::unordered_map<std::string_view, Ref<Struct>> structs;
+  std::unordered_map<std::string, int> strings; // Interned constants
+  std::unordered_map<std::string_view, Global> globals;
+  const std::string *source;
+};
+
+struct Local {
+  Ref<Type> type;
+  int reg = -1; // Scalars that never have their address taken
+  int slot = 0; // Frame memory offset for everything else
+};
+
+class FunctionCompiler {
+public:
+  FunctionCompiler(ProgramInfo &program, Function &fn)
+      : program(program), fn(fn) {}
+
+  void compile_function(const Ref<FunctionDefinition> &func_def);
+  // Top level statements of a REPL input, as a function without parameters.
+  // Their `let`s become globals.
+  void compile_input(const std::vector<Ref<Statement>> &statements);
+
+private:
+  ProgramInfo &program;
+  Function &fn;
+  std::vector<std::unordered_map<std::string_view, Local>> scopes;
+  std::unordered_set<std::string_view> address_taken;
+  int result_address = -1; // Hidden pointer for struct/string results
+  // Self tail calls rebind the parameters and jump back to this label
+  std::vector<Ref<Parameter>> parameters;
+  int tail_label = -1;
+  std::vector<int> labels; // Code position of each label
+  // Registers below locals_end hold locals, temporaries start there and are
+  // released after every statement
+  int locals_end = 0;
+  int next_register = 0;
+
+  [[noreturn]] void unsupported(const std::string &what, const Span &span) {
+    LOG_ERROR_EXIT("[vm] " + what + " is not supported by the VM", span,
+                   *program.source);
+    std::exit(1);
+  }
+
+  int new_register(const Span &span = Span{}) {
+    if (static_cast<uint32_t>(next_register) >= max_registers)
+      unsupported("A function needing more than 65535 registers", span);
+    fn.registers = std::max<uint32_t>(fn.registers, next_register + 1);
+    return next_register++;
+  }
+  int new_label() {
+    labels.push_back(-1);
+    return static_cast<int>(labels.size() - 1);
+  }
+  void place_label(int label) { labels[label] = static_cast<int>(fn.code.size()); }
+  void emit(Inst inst) { fn.code.push_back(inst); }
+  Inst make(Op op, int a = 0, int b = 0, int c = 0, int32_t imm = 0) {
+    return Inst{op, static_cast<uint16_t>(a), static_cast<uint16_t>(b),
+                static_cast<uint16_t>(c), imm};
+  }
+
+  int alloc_slot(int size, int align) {
+    int offset = (static_cast<int>(fn.frame_size) + align - 1) / align * align;
+    fn.frame_size = offset + size;
+    return offset;
+  }
+
+  int load_int(int32_t value) {
+    int dst = new_register();
+    emit(make(Op::LoadInt, dst, 0, 0, value));
+    return dst;
+  }
+  int frame_address(int slot) {
+    int dst = new_register();
+    emit(make(Op::FrameAddr, dst, 0, 0, slot));
+    return dst;
+  }
+  int load(int address, int offset, const Ref<Type> &type) {
+    int dst = new_register();
+    auto size = type_size(type);
+    auto op = size == 1 ? Op::Load1 : size == 4 ? Op::Load4 : Op::Load8;
+    emit(make(op, dst, address, 0, offset));
+    return dst;
+  }
+  void store(int address, int offset, int value, const Ref<Type> &type) {
+    auto size = type_size(type);
+    auto op = size == 1 ? Op::Store1 : size == 4 ? Op::Store4 : Op::Store8;
+    emit(make(op, address, value, 0, offset));
+  }
+  void copy(int dst_address, int src_address, const Ref<Type> &type) {
+    emit(make(Op::Copy, dst_address, src_address, 0, type_size(type)));
+  }
+
+  // Sets a register local. A temporary computed by the last instruction is
+  // written to the local directly instead of being moved there.
+  void move_into(int local, int value, int first_temporary) {
+    if (local == value)
+      return;
+    if (value >= first_temporary && !fn.code.empty() &&
+        writes_register(fn.code.back().op) && fn.code.back().a == value) {
+      fn.code.back().a = static_cast<uint16_t>(local);
+      return;
+    }
+    emit(make(Op::Mov, local, value));
+  }
+
+  Local *find_local(std::string_view name) {
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+      auto found = it->find(name);
+      if (found != it->end())
+        return &found->second;
+    }
+    return nullptr;
+  }
+
+  int global_address(const Global &global) {
+    int dst = new_register();
+    emit(make(Op::LoadConst, dst, 0, 0, global.constant));
+    return dst;
+  }
+
+  const Global *find_global(std::string_view name) {
+    auto found = program.globals.find(name);
+    return found != program.globals.end() ? &found->second : nullptr;
+  }
+
+  // Gives a top level `let` of the REPL storage that outlives the input
+  void declare_global(std::string_view name, const Ref<Type> &type,
+                      int value) {
+    auto &module = program.module;
+    auto &storage =
+        module.globals.emplace_back((type_size(type) + 7) / 8, uint64_t{0});
+    Value address;
+    address.p = storage.data();
+    module.constants.push_back(address);
+    Global global{type, static_cast<int>(module.constants.size() - 1)};
+    if (is_aggregate(type)) {
+      copy(global_address(global), value, type);
+    } else {
+      store(global_address(global), 0, value, type);
+    }
+    program.globals[name] = global;
+  }
+
+  // Binds a new local to an initial value (a register for scalars, an address
+  // for aggregates)
+  void declare_local(std::string_view name, const Ref<Type> &type, int value) {
+    Local local{type};
+    if (is_aggregate(type)) {
+      local.slot = alloc_slot(type_size(type), type_align(type));
+      copy(frame_address(local.slot), value, type);
+    } else if (address_taken.contains(name)) {
+      local.slot = alloc_slot(8, 8);
+      store(frame_address(local.slot), 0, value, type);
+    } else {
+      int first_temporary = locals_end;
+      local.reg = locals_end++;
+      next_register = std::max(next_register, locals_end);
+      fn.registers = std::max<uint32_t>(fn.registers, locals_end);
+      move_into(local.reg, value, first_temporary);
+    }
+    scopes.back()[name] = local;
+  }
+
+  int string_constant(const std::string &text) {
+    auto found = program.strings.find(text);
+    if (found != program.strings.end())
+      return found->second;
+    auto &module = program.module;
+    const auto &stored = module.texts.emplace_back(text);
+    auto &str = module.strings.emplace_back(
+        Str{stored.data(), static_cast<int64_t>(stored.size())});
+    Value value;
+    value.p = &str;
+    module.constants.push_back(value);
+    int index = static_cast<int>(module.constants.size() - 1);
+    program.strings[text] = index;
+    return index;
+  }
+
+  int compile_literal(const Ref<Literal> &literal) {
+    switch (literal->type->base_type) {
+    case BaseType::Int:
+      return load_int(
+          static_cast<int32_t>(std::stoll(std::string(literal->value))));
+    case BaseType::Bool:
+      return load_int(literal->value == "true" ? 1 : 0);
+    case BaseType::Char:
+      return load_int(static_cast<unsigned char>(unescape(literal->value)[0]));
+    case BaseType::Float: {
+      Value value;
+      value.f = std::stof(std::string(literal->value));
+      int dst = new_register();
+      emit(make(Op::LoadFloat, dst, 0, 0, value.i));
+      return dst;
+    }
+    case BaseType::String: {
+      int dst = new_register();
+      emit(make(Op::LoadConst, dst, 0, 0,
+                string_constant(unescape(literal->value))));
+      return dst;
+    }
+    default:
+      unsupported("Literal of type " + literal->type->to_string(),
+                  literal->span);
+    }
+  }
+
+  // Address of an lvalue expression
+  int address_of(const Ref<Expression> &expr) {
+    switch (expr->get_type()) {
+    case ASTType::Identifier: {
+      auto ident = std::static_pointer_cast<Identifier>(expr);
+      auto local = find_local(ident->name);
+      if (auto global = local ? nullptr : find_global(ident->name))
+        return global_address(*global);
+      if (!local || local->reg != -1) {
+        unsupported("Taking the address of '" + std::string(ident->name) + "'",
+                    expr->span);
+      }
+      return frame_address(local->slot);
+    }
+    case ASTType::Dot: {
+      auto dot = std::static_pointer_cast<Dot>(expr);
+      auto base = address_of(dot->left);
+      auto [offset, type] = dot_field(dot);
+      if (offset == 0)
+        return base;
+      int dst = new_register();
+      emit(make(Op::AddOffset, dst, base, 0, offset));
+      return dst;
+    }
+    case ASTType::Dereference:
+      return compile_expression(
+          std::static_pointer_cast<Dereference>(expr)->expression);
+    case ASTType::Index: {
+      auto index = std::static_pointer_cast<Index>(expr);
+      int base = compile_expression(index->base);
+      int offset = compile_expression(index->index);
+      int dst = new_register();
+      emit(make(Op::AddIndex, dst, base, offset, type_size(expr->etype)));
+      return dst;
+    }
+    default:
+      unsupported("Taking the address of this expression", expr->span);
+    }
+  }
+
+  std::pair<int, Ref<Type>> dot_field(const Ref<Dot> &dot) {
+    if (dot->left->etype->base_type != BaseType::Struct ||
+        dot->right->get_type() != ASTType::Identifier) {
+      unsupported("This member access", dot->span);
+    }
+    auto field = std::static_pointer_cast<Identifier>(dot->right);
+    return field_offset(std::get<Ref<Struct>>(dot->left->etype->structure),
+                        field->name);
+  }
+
+  int compile_dot(const Ref<Dot> &dot) {
+    if (dot->left->etype->base_type == BaseType::Enum) {
+      auto enum_type = std::get<Ref<Enum>>(dot->left->etype->structure);
+      auto member = std::static_pointer_cast<Identifier>(dot->right)->name;
+      const auto &members = program.enums[enum_type->name];
+      auto it = std::find(members.begin(), members.end(), member);
+      return load_int(static_cast<int32_t>(it - members.begin()));
+    }
+    auto address = address_of(dot);
+    auto [offset, type] = dot_field(dot);
+    return is_aggregate(type) ? address : load(address, 0, type);
+  }
+
+  int compile_binary_op(const Ref<BinaryOp> &binop) {
+    auto operand_type = binop->left->etype;
+    int left = compile_expression(binop->left);
+    if (operand_type->base_type == BaseType::String) {
+      if (binop->op != BinaryOpType::Equals &&
+          binop->op != BinaryOpType::NotEquals) {
+        unsupported("This string operator", binop->span);
+      }
+      int right = compile_expression(binop->right);
+      int equal = new_register();
+      emit(make(Op::StrEq, equal, left, right));
+      if (binop->op == BinaryOpType::Equals)
+        return equal;
+      int dst = new_register();
+      emit(make(Op::Not, dst, equal));
+      return dst;
+    }
+
+    // `x + 1` and friends, common in loops, skip the constant's register
+    if (binop->op == BinaryOpType::Add &&
+        operand_type->base_type == BaseType::Int &&
+        binop->right->get_type() == ASTType::Literal) {
+      auto literal = std::static_pointer_cast<Literal>(binop->right);
+      int dst = new_register();
+      emit(make(Op::AddIntImm, dst, left, 0,
+                static_cast<int32_t>(std::stoll(std::string(literal->value)))));
+      return dst;
+    }
+
+    int right = compile_expression(binop->right);
+    auto binary = [&](Op op) {
+      int dst = new_register();
+      emit(make(op, dst, left, right));
+      return dst;
+    };
+    bool floats = is_float(operand_type);
+    if (is_pointer(operand_type)) {
+      if (binop->op == BinaryOpType::Equals)
+        return binary(Op::EqPtr);
+      if (binop->op == BinaryOpType::NotEquals)
+        return binary(Op::NePtr);
+      unsupported("This pointer operator", binop->span);
+    }
+    switch (binop->op) {
+    case BinaryOpType::Add:
+      return binary(floats ? Op::AddFloat : Op::AddInt);
+    case BinaryOpType::Subtract:
+      return binary(floats ? Op::SubFloat : Op::SubInt);
+    case BinaryOpType::Multiply:
+      return binary(floats ? Op::MulFloat : Op::MulInt);
+    case BinaryOpType::Divide:
+      return binary(floats ? Op::DivFloat : Op::DivInt);
+    case BinaryOpType::Modulo:
+      if (floats)
+        unsupported("Float modulo", binop->span);
+      return binary(Op::ModInt);
+    case BinaryOpType::Equals:
+      return binary(floats ? Op::EqFloat : Op::EqInt);
+    case BinaryOpType::NotEquals:
+      return binary(floats ? Op::NeFloat : Op::NeInt);
+    case BinaryOpType::LessThan:
+      return binary(floats ? Op::LtFloat : Op::LtInt);
+    case BinaryOpType::GreaterThan:
+      return binary(floats ? Op::GtFloat : Op::GtInt);
+    case BinaryOpType::LessThanOrEqual:
+      return binary(floats ? Op::LeFloat : Op::LeInt);
+    case BinaryOpType::GreaterThanOrEqual:
+      return binary(floats ? Op::GeFloat : Op::GeInt);
+    }
+    return -1;
+  }
+
+  // Jumps to `label` when the condition is false. Comparisons of ints become
+  // a single compare and branch on the opposite condition.
+  void jump_unless(const Ref<Expression> &condition, int label) {
+    if (condition->get_type() == ASTType::BinaryOp) {
+      auto binop = std::static_pointer_cast<BinaryOp>(condition);
+      auto base_type = binop->left->etype->base_type;
+      bool ints = base_type == BaseType::Int || base_type == BaseType::Bool ||
+                  base_type == BaseType::Char || base_type == BaseType::Enum;
+      std::optional<Op> op;
+      switch (binop->op) {
+      case BinaryOpType::Equals:
+        op = Op::JumpIfNe;
+        break;
+      case BinaryOpType::NotEquals:
+        op = Op::JumpIfEq;
+        break;
+      case BinaryOpType::LessThan:
+        op = Op::JumpIfGe;
+        break;
+      case BinaryOpType::GreaterThan:
+        op = Op::JumpIfLe;
+        break;
+      case BinaryOpType::LessThanOrEqual:
+        op = Op::JumpIfGt;
+        break;
+      case BinaryOpType::GreaterThanOrEqual:
+        op = Op::JumpIfLt;
+        break;
+      default:
+        break;
+      }
+      if (ints && op) {
+        int left = compile_expression(binop->left);
+        int right = compile_expression(binop->right);
+        emit(make(*op, left, right, 0, label));
+        return;
+      }
+    }
+    emit(make(Op::JumpIfZero, compile_expression(condition), 0, 0, label));
+  }
+
+  void compile_print(const Ref<Call> &call_expr, bool to_stderr) {
+    if (to_stderr)
+      emit(make(Op::EprintBegin));
+    for (const auto &arg : call_expr->arguments) {
+      int value = compile_expression(arg);
+      Op op;
+      switch (arg->etype->base_type) {
+      case BaseType::Int:
+      case BaseType::Enum:
+        op = Op::WriteInt;
+        break;
+      case BaseType::Float:
+        op = Op::WriteFloat;
+        break;
+      case BaseType::Bool:
+        op = Op::WriteBool;
+        break;
+      case BaseType::Char:
+        op = Op::WriteChar;
+        break;
+      case BaseType::Pointer:
+        op = Op::WritePtr;
+        break;
+      case BaseType::String:
+        op = Op::WriteStr;
+        break;
+      default:
+        unsupported("Printing a " + arg->etype->to_string(), arg->span);
+      }
+      emit(make(op, value));
+    }
+    emit(make(Op::WriteNewline));
+    if (to_stderr)
+      emit(make(Op::EprintEnd));
+  }
+
+  // Finds the symbol of an extern in the running process, or in the library
+  // it names, and records how its arguments and result are passed
+  int resolve_extern(const Ref<::Extern> &ext, const Span &span) {
+    auto name = ext->identifier->name;
+    if (auto found = program.resolved_externs.find(name);
+        found != program.resolved_externs.end()) {
+      return found->second;
+    }
+    std::string symbol(name);
+    void *address = dlsym(RTLD_DEFAULT, symbol.c_str());
+    std::string library(ext->module_path);
+    if (!address && !library.empty() && library != "libc") {
+      for (const auto &candidate : {library, "lib" + library + ".so"}) {
+        if (void *handle = dlopen(candidate.c_str(), RTLD_NOW | RTLD_GLOBAL)) {
+          address = dlsym(handle, symbol.c_str());
+          break;
+        }
+      }
+    }
+    if (!address) {
+      LOG_ERROR_EXIT("[vm] Could not find extern '" + symbol + "'", span,
+                     *program.source);
+    }
+
+    std::vector<Ref<Type>> args = ext->args;
+    args.push_back(ext->return_type);
+    if (std::any_of(args.begin(), args.end(), is_aggregate)) {
+      unsupported("Passing or returning a struct or string from an extern",
+                  span);
+    }
+    vm::Extern resolved{symbol, address,
+                        signature_of(ext->args, ext->return_type)};
+    auto floats = std::count(resolved.signature.args.begin(),
+                             resolved.signature.args.end(), ValueClass::Float);
+    if (floats > 8 || resolved.signature.args.size() - floats > 6) {
+      unsupported("Externs with more than 6 integer or 8 float arguments",
+                  span);
+    }
+    spdlog::debug("[vm] Resolved extern {} to {}", symbol, address);
+    program.module.externs.push_back(std::move(resolved));
+    int index = static_cast<int>(program.module.externs.size() - 1);
+    program.resolved_externs[name] = index;
+    return index;
+  }
+
+  // Evaluates the arguments into consecutive registers above everything
+  // that is live, returns the first one
+  int compile_arguments(const std::vector<Ref<Expression>> &arguments,
+                        int result_slot) {
+    int base = next_register;
+    int count = static_cast<int>(arguments.size()) + (result_slot != -1);
+    for (int i = 0; i < count; ++i)
+      new_register();
+    int first_temporary = next_register;
+    int arg = base;
+    if (result_slot != -1) {
+      move_into(arg++, frame_address(result_slot), first_temporary);
+    }
+    for (const auto &argument : arguments) {
+      move_into(arg++, compile_expression(argument), first_temporary);
+    }
+    return base;
+  }
+
+  int compile_call(const Ref<Call> &call_expr) {
+    auto name = std::static_pointer_cast<Identifier>(call_expr->callee)->name;
+    if (name == "print" || name == "eprint") {
+      compile_print(call_expr, name == "eprint");
+      return -1;
+    }
+    if (name == "flush") {
+      emit(make(Op::Flush));
+      return -1;
+    }
+
+    if (auto ext = program.externs.find(name); ext != program.externs.end()) {
+      // sizeof(T) is folded, everything else is a call through dlsym
+      if (!ext->second->args.empty() &&
+          ext->second->args[0]->base_type == BaseType::Type) {
+        auto type_name =
+            std::static_pointer_cast<Identifier>(call_expr->arguments[0])->name;
+        return load_int(sizeof_named_type(type_name, call_expr));
+      }
+      int index = resolve_extern(ext->second, call_expr->span);
+      int dst = new_register();
+      int base = compile_arguments(call_expr->arguments, -1);
+      emit(make(Op::CallExtern, dst, index, base));
+      return dst;
+    }
+
+    auto func = program.functions.find(name);
+    if (func == program.functions.end()) {
+      unsupported("Calling '" + std::string(name) + "'", call_expr->span);
+    }
+    auto return_type = program.definitions[name]->return_type;
+    int result_slot = -1;
+    if (is_aggregate(return_type)) {
+      result_slot =
+          alloc_slot(type_size(return_type), type_align(return_type));
+    }
+    // Structs and strings go into the callee's window as frame addresses,
+    // see signature_of
+    int dst = new_register();
+    int base = compile_arguments(call_expr->arguments, result_slot);
+    emit(make(Op::Call, dst, func->second, base));
+    return result_slot != -1 ? frame_address(result_slot) : dst;
+  }
+
+  int32_t sizeof_named_type(std::string_view name, const Ref<Call> &call_expr) {
+    auto type = std::make_shared<Type>();
+    if (name == "int") {
+      type->base_type = BaseType::Int;
+    } else if (name == "float") {
+      type->base_type = BaseType::Float;
+    } else if (name == "bool") {
+      type->base_type = BaseType::Bool;
+    } else if (name == "char") {
+      type->base_type = BaseType::Char;
+    } else if (name == "string") {
+      type->base_type = BaseType::String;
+    } else if (auto found = program.structs.find(name);
+               found != program.structs.end()) {
+      type->base_type = BaseType::Struct;
+      type->structure = found->second;
+    } else if (program.enums.contains(name)) {
+      type->base_type = BaseType::Enum;
+    } else {
+      unsupported("sizeof(" + std::string(name) + ")", call_expr->span);
+    }
+    return type_size(type);
+  }
+
+  int compile_expression(const Ref<Expression> &expr) {
+    switch (expr->get_type()) {
+    case ASTType::Literal:
+      return compile_literal(std::static_pointer_cast<Literal>(expr));
+    case ASTType::Identifier: {
+      auto ident = std::static_pointer_cast<Identifier>(expr);
+      auto local = find_local(ident->name);
+      if (auto global = local ? nullptr : find_global(ident->name)) {
+        int address = global_address(*global);
+        return is_aggregate(global->type) ? address
+                                          : load(address, 0, global->type);
+      }
+      if (!local)
+        unsupported("Global '" + std::string(ident->name) + "'", expr->span);
+      if (local->reg != -1)
+        return local->reg;
+      if (is_aggregate(local->type))
+        return frame_address(local->slot);
+      return load(frame_address(local->slot), 0, local->type);
+    }
+    case ASTType::BinaryOp:
+      return compile_binary_op(std::static_pointer_cast<BinaryOp>(expr));
+    case ASTType::Call:
+      return compile_call(std::static_pointer_cast<Call>(expr));
+    case ASTType::Dot:
+      return compile_dot(std::static_pointer_cast<Dot>(expr));
+    case ASTType::AddressOf:
+      return address_of(std::static_pointer_cast<AddressOf>(expr)->expression);
+    case ASTType::Dereference: {
+      int pointer = compile_expression(
+          std::static_pointer_cast<Dereference>(expr)->expression);
+      return is_aggregate(expr->etype) ? pointer
+                                       : load(pointer, 0, expr->etype);
+    }
+    case ASTType::Index: {
+      int address = address_of(expr);
+      return is_aggregate(expr->etype) ? address
+                                       : load(address, 0, expr->etype);
+    }
+    case ASTType::StructInstantiation: {
+      auto inst = std::static_pointer_cast<StructInstantiation>(expr);
+      auto type = std::make_shared<Type>(Type{BaseType::Struct});
+      type->structure = inst->struct_type;
+      int address = frame_address(alloc_slot(type_size(type), type_align(type)));
+      for (size_t i = 0; i < inst->arguments.size(); ++i) {
+        auto field = inst->struct_type->fields[i];
+        auto [offset, field_type] =
+            field_offset(inst->struct_type, field->name);
+        int value = compile_expression(inst->arguments[i]);
+        if (is_aggregate(field_type)) {
+          int field_address = new_register();
+          emit(make(Op::AddOffset, field_address, address, 0, offset));
+          copy(field_address, value, field_type);
+        } else {
+          store(address, offset, value, field_type);
+        }
+      }
+      return address;
+    }
+    default:
+      unsupported(std::string(magic_enum::enum_name(expr->get_type())),
+                  expr->span);
+    }
+  }
+
+  void compile_assignment(const Ref<Assignment> &assignment) {
+    auto type = assignment->assignee->etype;
+    int value = compile_expression(assignment->expression);
+    if (assignment->assignee->get_type() == ASTType::Identifier) {
+      auto name =
+          std::static_pointer_cast<Identifier>(assignment->assignee)->name;
+      auto local = find_local(name);
+      auto global = local ? nullptr : find_global(name);
+      if (!local && !global)
+        unsupported("Assigning to a global", assignment->span);
+      if (local && local->reg != -1) {
+        move_into(local->reg, value, locals_end);
+        return;
+      }
+      type = local ? local->type : global->type;
+    }
+    if (!type)
+      unsupported("This assignment", assignment->span);
+    int address = address_of(assignment->assignee);
+    if (is_aggregate(type)) {
+      copy(address, value, type);
+    } else {
+      store(address, 0, value, type);
+    }
+  }
+
+  // The arguments are copied out before any parameter changes, they may read
+  // the parameters being replaced
+  void compile_tail_call(const Ref<Call> &call) {
+    std::vector<int> values;
+    for (size_t i = 0; i < parameters.size(); ++i) {
+      const auto &type = parameters[i]->type;
+      int value = compile_expression(call->arguments[i]);
+      int copy_of = -1;
+      if (is_aggregate(type)) {
+        copy_of =
+            frame_address(alloc_slot(type_size(type), type_align(type)));
+        copy(copy_of, value, type);
+      } else {
+        copy_of = new_register();
+        emit(make(Op::Mov, copy_of, value));
+      }
+      values.push_back(copy_of);
+    }
+    for (size_t i = 0; i < parameters.size(); ++i) {
+      const auto &type = parameters[i]->type;
+      const auto &local = scopes.front().at(parameters[i]->identifier->name);
+      if (local.reg != -1) {
+        emit(make(Op::Mov, local.reg, values[i]));
+      } else if (is_aggregate(type)) {
+        copy(frame_address(local.slot), values[i], type);
+      } else {
+        store(frame_address(local.slot), 0, values[i], type);
+      }
+    }
+    emit(make(Op::Jump, 0, 0, 0, tail_label));
+  }
+
+  // Resolves the labels and rounds up the frame, once all code is emitted
+  void finish() {
+    for (auto &inst : fn.code) {
+      if (is_jump(inst.op))
+        inst.imm = labels[inst.imm];
+    }
+    // The callee's frame memory starts right after this one's
+    fn.frame_size = (fn.frame_size + 15) / 16 * 16;
+  }
+
+  void compile_statement(const Ref<Statement> &stmt) {
+    switch (stmt->get_type()) {
+    case ASTType::Block: {
+      int block_locals = locals_end;
+      scopes.emplace_back();
+      for (const auto &child :
+           std::static_pointer_cast<Block>(stmt)->statements) {
+        next_register = locals_end;
+        compile_statement(child);
+      }
+      scopes.pop_back();
+      locals_end = next_register = block_locals;
+      break;
+    }
+    case ASTType::VarDecl: {
+      auto var_decl = std::static_pointer_cast<VarDecl>(stmt);
+      if (!var_decl->expression)
+        unsupported("A declaration without initializer", var_decl->span);
+      declare_local(var_decl->identifier->name, var_decl->type,
+                    compile_expression(var_decl->expression));
+      break;
+    }
+    case ASTType::Assignment:
+      compile_assignment(std::static_pointer_cast<Assignment>(stmt));
+      break;
+    case ASTType::ExpressionStatement:
+      compile_expression(
+          std::static_pointer_cast<ExpressionStatement>(stmt)->expression);
+      break;
+    case ASTType::If: {
+      auto if_stmt = std::static_pointer_cast<If>(stmt);
+      int else_label = new_label();
+      int end_label = new_label();
+      jump_unless(if_stmt->condition, else_label);
+      compile_statement(if_stmt->then_branch);
+      emit(make(Op::Jump, 0, 0, 0, end_label));
+      place_label(else_label);
+      if (if_stmt->else_branch)
+        compile_statement(if_stmt->else_branch);
+      place_label(end_label);
+      break;
+    }
+    case ASTType::While: {
+      auto while_stmt = std::static_pointer_cast<While>(stmt);
+      int head_label = new_label();
+      int end_label = new_label();
+      place_label(head_label);
+      jump_unless(while_stmt->condition, end_label);
+      compile_statement(while_stmt->body);
+      emit(make(Op::Jump, 0, 0, 0, head_label));
+      place_label(end_label);
+      break;
+    }
+    case ASTType::Return: {
+      auto ret = std::static_pointer_cast<Return>(stmt);
+      if (ret->tail_call) {
+        compile_tail_call(std::static_pointer_cast<Call>(ret->expression));
+      } else if (!ret->expression) {
+        emit(make(Op::Return, load_int(0)));
+      } else if (result_address != -1) {
+        copy(result_address, compile_expression(ret->expression),
+             ret->expression->etype);
+        emit(make(Op::Return, result_address));
+      } else {
+        emit(make(Op::Return, compile_expression(ret->expression)));
+      }
+      break;
+    }
+    default:
+      unsupported(std::string(magic_enum::enum_name(stmt->get_type())),
+                  stmt->span);
+    }
+  }
+};
+
+void FunctionCompiler::compile_function(
+    const Ref<FunctionDefinition> &func_def) {
+  fn.name = func_def->identifier->name;
+  std::vector<Ref<Type>> param_types;
+  for (const auto &param : func_def->parameters)
+    param_types.push_back(param->type);
+  fn.signature = signature_of(param_types, func_def->return_type);
+  collect_address_taken(func_def->body, address_taken);
+  scopes.emplace_back();
+
+  // The caller puts the arguments in the first registers of the window
+  if (is_aggregate(func_def->return_type))
+    result_address = new_register();
+  std::vector<std::pair<Ref<Parameter>, int>> incoming;
+  for (const auto &param : func_def->parameters)
+    incoming.emplace_back(param, new_register(func_def->span));
+  fn.params = next_register;
+  locals_end = next_register;
+  for (const auto &[param, reg] : incoming) {
+    if (!is_aggregate(param->type) &&
+        !address_taken.contains(param->identifier->name)) {
+      scopes.back()[param->identifier->name] = Local{param->type, reg};
+    } else {
+      declare_local(param->identifier->name, param->type, reg);
+    }
+  }
+  if (has_tail_calls(func_def)) {
+    parameters = func_def->parameters;
+    tail_label = new_label();
+    place_label(tail_label);
+  }
+
+  next_register = locals_end;
+  compile_statement(func_def->body);
+  scopes.pop_back();
+
+  // A body without a final return still hands main its exit code of 0
+  next_register = locals_end;
+  emit(make(Op::Return, load_int(0)));
+  finish();
+}
+
+void FunctionCompiler::compile_input(
+    const std::vector<Ref<Statement>> &statements) {
+  fn.name = "<input>";
+  fn.signature = Signature{{}, ResultKind::Int};
+  for (const auto &stmt : statements)
+    collect_address_taken(stmt, address_taken);
+  scopes.emplace_back();
+  for (const auto &stmt : statements) {
+    next_register = locals_end;
+    if (stmt->get_type() != ASTType::VarDecl) {
+      compile_statement(stmt);
+      continue;
+    }
+    // The initializer still sees an earlier global of the same name
+    auto var_decl = std::static_pointer_cast<VarDecl>(stmt);
+    declare_global(var_decl->identifier->name, var_decl->type,
+                   compile_expression(var_decl->expression));
+  }
+  scopes.pop_back();
+  next_register = locals_end;
+  emit(make(Op::Return, load_int(0)));
+  finish();
+}
+
+// Records a top level declaration, returns the function it brings if any.
+// Anything else is a statement, which only the REPL compiles.
+std::optional<Ref<FunctionDefinition>>
+declare(ProgramInfo &info, const Ref<Program> &program,
+        const Ref<Statement> &stmt) {
+  switch (stmt->get_type()) {
+  case ASTType::FunctionDefinition: {
+    auto func_def = std::static_pointer_cast<FunctionDefinition>(stmt);
+    return func_def->body ? func_def : nullptr;
+  }
+  case ASTType::EnumDefinition: {
+    auto enum_def = std::static_pointer_cast<EnumDefinition>(stmt);
+    auto &members = info.enums[enum_def->identifier->name];
+    members.clear();
+    for (const auto &member : enum_def->members)
+      members.push_back(member->name);
+    return enum_def->to_string_function;
+  }
+  case ASTType::StructDefinition: {
+    auto struct_def = std::static_pointer_cast<StructDefinition>(stmt);
+    if (auto struct_type = resolved_struct(program, struct_def))
+      info.structs[struct_def->identifier->name] = struct_type;
+    return nullptr;
+  }
+  case ASTType::Extern: {
+    auto ext = std::static_pointer_cast<::Extern>(stmt);
+    info.externs[ext->identifier->name] = ext;
+    return nullptr;
+  }
+  case ASTType::Import:
+    return nullptr;
+  default:
+    return std::nullopt;
+  }
+}
+
+} // namespace
+
+Module compile_program(Ref<Program> program) {
+  spdlog::debug("[vm] Compiling program to bytecode");
+  Module module;
+  ProgramInfo info{module};
+  info.source = program->source_buffer.get();
+
+  std::vector<Ref<FunctionDefinition>> functions;
+  for (const auto &stmt : program->body->statements) {
+    auto function = declare(info, program, stmt);
+    if (!function) {
+      LOG_ERROR_EXIT("[vm] Top level statements are not supported by the VM",
+                     stmt->span, *program->source_buffer);
+    }
+    if (*function)
+      functions.push_back(*function);
+  }
+
+  module.functions.resize(functions.size());
+  for (size_t i = 0; i < functions.size(); ++i) {
+    module.functions[i].name = functions[i]->identifier->name;
+    info.functions[functions[i]->identifier->name] = static_cast<int>(i);
+    info.definitions[functions[i]->identifier->name] = functions[i];
+  }
+  for (size_t i = 0; i < functions.size(); ++i) {
+    FunctionCompiler compiler(info, module.functions[i]);
+    compiler.compile_function(functions[i]);
+    spdlog::debug("[vm] {}: {} instructions, {} registers",
+                  module.functions[i].name, module.functions[i].code.size(),
+                  module.functions[i].registers);
+  }
+  if (auto main = info.functions.find("main"); main != info.functions.end())
+    module.main = main->second;
+  return module;
+}
+
+struct IncrementalCompiler::State {
+  Module module;
+  std::unique_ptr<ProgramInfo> info = std::make_unique<ProgramInfo>(module);
+  int input = -1; // Index of the function running the current input
+};
+
+IncrementalCompiler::IncrementalCompiler() : state(std::make_unique<State>()) {
+  state->module.functions.emplace_back();
+  state->input = 0;
+}
+
+IncrementalCompiler::~IncrementalCompiler() = default;
+
+const Module &IncrementalCompiler::module() const { return state->module; }
+
+int IncrementalCompiler::compile(Ref<Program> program,
+                                 const std::vector<Ref<Statement>> &statements) {
+  auto &module = state->module;
+  // Everything is compiled off to the side and only put in place once all of
+  // it succeeded, the tables are restored if anything throws
+  ProgramInfo saved = *state->info;
+  auto &info = *state->info;
+  info.source = program->source_buffer.get();
+  try {
+    std::vector<Ref<Statement>> inputs;
+    std::vector<std::pair<int, Ref<FunctionDefinition>>> functions;
+    int next_index = static_cast<int>(module.functions.size());
+    for (const auto &stmt : statements) {
+      auto function = declare(info, program, stmt);
+      if (!function) {
+        inputs.push_back(stmt);
+        continue;
+      }
+      if (!*function)
+        continue;
+      auto name = (*function)->identifier->name;
+      auto [index, added] = info.functions.try_emplace(name, next_index);
+      if (added)
+        ++next_index;
+      info.definitions[name] = *function;
+      functions.emplace_back(index->second, *function);
+    }
+
+    std::vector<std::pair<int, Function>> compiled;
+    for (const auto &[index, func_def] : functions) {
+      Function fn;
+      FunctionCompiler(info, fn).compile_function(func_def);
+      compiled.emplace_back(index, std::move(fn));
+    }
+    Function input;
+    FunctionCompiler(info, input).compile_input(inputs);
+
+    module.functions.resize(next_index);
+    for (auto &[index, fn] : compiled) {
+      spdlog::debug("[vm] {}: {} instructions, {} registers", fn.name,
+                    fn.code.size(), fn.registers);
+      module.functions[index] = std::move(fn);
+    }
+    module.functions[state->input] = std::move(input);
+    return state->input;
+  } catch (...) {
+    state->info = std::make_unique<ProgramInfo>(saved);
+    throw;
+  }
+}
+
+} // namespace vm
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "../definitions/ast.hpp"
+#include "bytecode.hpp"
+#include <memory>
+
+namespace vm {
+
+// Compiles the typechecked program to bytecode for the VM. Externs are looked
+// up with dlsym when a call to them is compiled, in the running process first
+// (which has libc loaded) and then in the library named by `from "..."`.
+Module compile_program(Ref<Program> program);
+
+// Bytecode for a program that grows one input at a time, behind `enki repl`.
+// A redefined function keeps its index, so code compiled earlier calls the
+// new definition from then on.
+class IncrementalCompiler {
+public:
+  IncrementalCompiler();
+  ~IncrementalCompiler();
+
+  // Adds the typechecked top level statements of an input to the module and
+  // returns the function that runs it. Declarations are compiled on their
+  // own, everything else goes into that function, where `let`s declare
+  // globals that later inputs see. Nothing changes if an error is thrown
+  // (see logging::RecoverableErrors).
+  int compile(Ref<Program> program,
+              const std::vector<Ref<Statement>> &statements);
+
+  const Module &module() const;
+
+private:
+  struct State;
+  std::unique_ptr<State> state;
+};
+
+} // namespace vm
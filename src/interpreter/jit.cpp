@@ -0,0 +1,157 @@
+/* Loads the relocatable object of the native backend straight into memory,
+doing the little a linker would: text and rodata are copied into one mapping,
+every undefined symbol gets a 16 byte stub after the text that jumps through
+an absolute address, so the 32 bit PC-relative calls can reach code anywhere
+in the process, and the relocations are patched against those. Text and stubs
+are then made executable and rodata read only. */
+
+#include "jit.hpp"
+#include "../utils/logging.hpp"
+#include <algorithm>
+#include <cstring>
+#include <dlfcn.h>
+#include <spdlog/spdlog.h>
+#include <string_view>
+#include <sys/mman.h>
+#include <unistd.h>
+
+extern "C" {
+#include "../runtime/enki_rt.h"
+}
+
+namespace vm {
+
+namespace {
+
+constexpr size_t stub_size = 16;
+
+size_t align_to(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// The runtime is linked into enki but not exported, so dlsym can't see it
+void *runtime_symbol(std::string_view name) {
+  static const std::unordered_map<std::string_view, void *> symbols = {
+      {"enki_write_int", reinterpret_cast<void *>(&enki_write_int)},
+      {"enki_write_float", reinterpret_cast<void *>(&enki_write_float)},
+      {"enki_write_bool", reinterpret_cast<void *>(&enki_write_bool)},
+      {"enki_write_char", reinterpret_cast<void *>(&enki_write_char)},
+      {"enki_write_str", reinterpret_cast<void *>(&enki_write_str)},
+      {"enki_write_ptr", reinterpret_cast<void *>(&enki_write_ptr)},
+      {"enki_write_newline", reinterpret_cast<void *>(&enki_write_newline)},
+      {"enki_flush", reinterpret_cast<void *>(&enki_flush)},
+      {"enki_eprint_begin", reinterpret_cast<void *>(&enki_eprint_begin)},
+      {"enki_eprint_end", reinterpret_cast<void *>(&enki_eprint_end)},
+      {"enki_str_eq", reinterpret_cast<void *>(&enki_str_eq)},
+      {"enki_alloc", reinterpret_cast<void *>(&enki_alloc)},
+      {"enki_realloc", reinterpret_cast<void *>(&enki_realloc)},
+      {"enki_free", reinterpret_cast<void *>(&enki_free)},
+  };
+  auto found = symbols.find(name);
+  return found != symbols.end() ? found->second : nullptr;
+}
+
+void *resolve_symbol(const std::string &name, const Module &module) {
+  if (void *address = runtime_symbol(name))
+    return address;
+  for (const auto &ext : module.externs) {
+    if (ext.name == name)
+      return ext.address;
+  }
+  if (void *address = dlsym(RTLD_DEFAULT, name.c_str()))
+    return address;
+  LOG_ERROR_EXIT("[jit] Could not find symbol '" + name + "'");
+  std::exit(1);
+}
+
+void write_stub(uint8_t *at, void *target) {
+  static const uint8_t jump[] = {0xFF, 0x25, 0, 0, 0, 0}; // jmp [rip]
+  std::memcpy(at, jump, sizeof(jump));
+  std::memcpy(at + sizeof(jump), &target, sizeof(target));
+  std::memset(at + sizeof(jump) + sizeof(target), 0xCC,
+              stub_size - sizeof(jump) - sizeof(target));
+}
+
+} // namespace
+
+bool jit_available() {
+#if defined(__x86_64__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+JitCode::JitCode(const ElfObject &object, const Module &module) {
+  // One stub per undefined symbol that is actually called
+  std::unordered_map<uint32_t, size_t> stubs;
+  size_t stubs_start = align_to(object.text.size(), stub_size);
+  for (const auto &relocation : object.relocations) {
+    if (object.symbols[relocation.symbol].section == ElfSection::Undefined)
+      stubs.try_emplace(relocation.symbol,
+                        stubs_start + stub_size * stubs.size());
+  }
+
+  size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  size_t code_size = align_to(stubs_start + stub_size * stubs.size(), page);
+  size = code_size + align_to(std::max<size_t>(object.rodata.size(), 1), page);
+  void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    LOG_ERROR_EXIT("[jit] Could not map " + std::to_string(size) +
+                   " bytes for machine code");
+  }
+  memory = static_cast<uint8_t *>(mapping);
+  uint8_t *rodata = memory + code_size;
+  std::memcpy(memory, object.text.data(), object.text.size());
+  std::memcpy(rodata, object.rodata.data(), object.rodata.size());
+
+  for (const auto &[symbol, offset] : stubs) {
+    write_stub(memory + offset,
+               resolve_symbol(object.symbols[symbol].name, module));
+  }
+
+  // Both relocation types are S + A - P into a 32 bit field
+  for (const auto &relocation : object.relocations) {
+    const auto &symbol = object.symbols[relocation.symbol];
+    uint8_t *target = nullptr;
+    switch (symbol.section) {
+    case ElfSection::Undefined:
+      target = memory + stubs.at(relocation.symbol);
+      break;
+    case ElfSection::Text:
+      target = memory + symbol.value;
+      break;
+    case ElfSection::Rodata:
+      target = rodata + symbol.value;
+      break;
+    }
+    uint8_t *place = memory + relocation.offset;
+    auto value = static_cast<int32_t>(target + relocation.addend - place);
+    std::memcpy(place, &value, sizeof(value));
+  }
+
+  for (const auto &symbol : object.symbols) {
+    if (symbol.function && symbol.section == ElfSection::Text)
+      functions[symbol.name] = memory + symbol.value;
+  }
+
+  if (mprotect(memory, code_size, PROT_READ | PROT_EXEC) != 0 ||
+      mprotect(rodata, size - code_size, PROT_READ) != 0) {
+    LOG_ERROR_EXIT("[jit] Could not make the machine code executable");
+  }
+  spdlog::debug("[jit] Loaded {} bytes of code, {} of rodata and {} stubs",
+                object.text.size(), object.rodata.size(), stubs.size());
+}
+
+JitCode::~JitCode() {
+  if (memory)
+    munmap(memory, size);
+}
+
+void *JitCode::function(const std::string &name) const {
+  auto found = functions.find(name);
+  return found != functions.end() ? found->second : nullptr;
+}
+
+} // namespace vm
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "../compiler/elf_writer.hpp"
+#include "bytecode.hpp"
+#include <string>
+#include <unordered_map>
+
+namespace vm {
+
+// Whether machine code from the native backend can run in this process,
+// which needs an x86-64 host
+bool jit_available();
+
+// The object emitted by the native backend, linked and loaded into
+// executable memory of the running process. Calls to the runtime go to the
+// copy linked into enki, externs to the address the bytecode compiler
+// resolved for them or else whatever dlsym finds.
+class JitCode {
+public:
+  JitCode(const ElfObject &object, const Module &module);
+  ~JitCode();
+  JitCode(const JitCode &) = delete;
+  JitCode &operator=(const JitCode &) = delete;
+
+  // Entry point of the function with the given name, nullptr if the object
+  // doesn't define it
+  void *function(const std::string &name) const;
+
+private:
+  uint8_t *memory = nullptr;
+  size_t size = 0;
+  std::unordered_map<std::string, void *> functions;
+};
+
+} // namespace vm
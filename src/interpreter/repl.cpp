@@ -0,0 +1,351 @@
+/* The REPL keeps one Program whose global scope grows with every input, and
+a TypecheckContext sitting at that scope, so an input is typechecked with the
+same two passes as a block without touching what came before. The bytecode
+grows alongside in an IncrementalCompiler. A failing input is rolled back by
+restoring the symbols of the global scope, the compiler rolls back its own
+tables. */
+
+#include "repl.hpp"
+#include "../compiler/injections.hpp"
+#include "../compiler/lexer.hpp"
+#include "../compiler/parser.hpp"
+#include "../compiler/tailcalls.hpp"
+#include "../compiler/typecheck.hpp"
+#include "../utils/logging.hpp"
+#include "compiler.hpp"
+#include "vm.hpp"
+#include <cstdio>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+
+extern "C" {
+#include "../runtime/enki_rt.h"
+}
+
+namespace vm {
+
+namespace {
+
+// Where the current definition of a function came from
+struct Definition {
+  Ref<FunctionDefinition> definition;
+  std::shared_ptr<std::string> source;
+};
+
+bool same_signature(const Ref<Symbol> &left, const Ref<Symbol> &right) {
+  if (left->type->base_type != BaseType::Function ||
+      right->type->base_type != BaseType::Function) {
+    return false;
+  }
+  auto a = std::get<Ref<::Function>>(left->type->structure);
+  auto b = std::get<Ref<::Function>>(right->type->structure);
+  if (a->parameters.size() != b->parameters.size() ||
+      !types_are_equal(a->return_type, b->return_type)) {
+    return false;
+  }
+  for (size_t i = 0; i < a->parameters.size(); ++i) {
+    if (!types_are_equal(a->parameters[i]->type, b->parameters[i]->type))
+      return false;
+  }
+  return true;
+}
+
+bool is_printable(const Ref<Type> &type) {
+  switch (type ? type->base_type : BaseType::Void) {
+  case BaseType::Int:
+  case BaseType::Float:
+  case BaseType::String:
+  case BaseType::Bool:
+  case BaseType::Char:
+  case BaseType::Enum:
+  case BaseType::Pointer:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// An expression on its own prints its value, `1 + 2` works like `print(1 + 2)`
+void print_expressions(const std::vector<Ref<Statement>> &statements) {
+  for (const auto &stmt : statements) {
+    if (stmt->get_type() != ASTType::ExpressionStatement)
+      continue;
+    auto expr_stmt = std::static_pointer_cast<ExpressionStatement>(stmt);
+    if (!is_printable(expr_stmt->expression->etype))
+      continue;
+    auto print = std::make_shared<Call>();
+    auto callee = std::make_shared<Identifier>();
+    callee->name = "print";
+    callee->span = expr_stmt->expression->span;
+    print->callee = callee;
+    print->arguments.push_back(expr_stmt->expression);
+    print->span = expr_stmt->expression->span;
+    print->etype = std::make_shared<Type>(Type{BaseType::Void});
+    expr_stmt->expression = print;
+  }
+}
+
+// How many brackets the line leaves open, ignoring literals and comments
+int open_brackets(const std::string &line) {
+  int depth = 0;
+  char quote = 0;
+  for (size_t i = 0; i < line.size(); ++i) {
+    char c = line[i];
+    if (quote) {
+      if (c == '\\')
+        ++i;
+      else if (c == quote)
+        quote = 0;
+      continue;
+    }
+    if (c == '/' && i + 1 < line.size() && line[i + 1] == '/')
+      break;
+    if (c == '"' || c == '\'')
+      quote = c;
+    else if (c == '{' || c == '(' || c == '[')
+      ++depth;
+    else if (c == '}' || c == ')' || c == ']')
+      --depth;
+  }
+  return depth;
+}
+
+} // namespace
+
+struct Repl::State {
+  Ref<Program> program = std::make_shared<Program>();
+  Ref<TypecheckContext> typecheck;
+  IncrementalCompiler compiler;
+  // The AST points into the text and tokens of every input
+  std::deque<std::shared_ptr<std::string>> sources;
+  std::deque<std::vector<Token>> tokens;
+  std::unordered_map<std::string_view, Definition> functions;
+  std::unordered_set<std::string_view> types_and_externs;
+  // Imported modules whose declarations have been compiled
+  std::unordered_set<std::string> linked_modules;
+
+  void check_redeclarations(const std::vector<Ref<Statement>> &statements);
+  std::vector<Ref<Statement>>
+  retypecheck_callers(const std::vector<Ref<Statement>> &statements,
+                      const decltype(Scope::symbols) &previous);
+  void commit(const std::vector<Ref<Statement>> &statements);
+};
+
+Repl::Repl() : state(std::make_unique<State>()) {
+  auto &program = state->program;
+  program->source_buffer = std::make_shared<std::string>();
+  program->module_context = std::make_shared<ModuleContext>();
+  program->body = std::make_shared<Block>();
+  program->body->scope = program->scope;
+  perform_injections(program);
+
+  state->typecheck = std::make_shared<TypecheckContext>(program);
+  state->typecheck->current_block = program->body;
+  perform_first_pass_registration(state->typecheck, program->body->statements);
+  perform_second_pass_typechecking(state->typecheck,
+                                   program->body->statements);
+}
+
+Repl::~Repl() = default;
+
+// Functions may be redefined, anything else other code was compiled against
+// the layout of may not
+void Repl::State::check_redeclarations(
+    const std::vector<Ref<Statement>> &statements) {
+  for (const auto &stmt : statements) {
+    Ref<Identifier> identifier;
+    switch (stmt->get_type()) {
+    case ASTType::StructDefinition:
+      identifier = std::static_pointer_cast<StructDefinition>(stmt)->identifier;
+      break;
+    case ASTType::EnumDefinition:
+      identifier = std::static_pointer_cast<EnumDefinition>(stmt)->identifier;
+      break;
+    case ASTType::Extern:
+      identifier = std::static_pointer_cast<::Extern>(stmt)->identifier;
+      break;
+    case ASTType::FunctionDefinition:
+      identifier =
+          std::static_pointer_cast<FunctionDefinition>(stmt)->identifier;
+      if (!types_and_externs.contains(identifier->name))
+        continue;
+      break;
+    default:
+      continue;
+    }
+    if (types_and_externs.contains(identifier->name) ||
+        functions.contains(identifier->name)) {
+      LOG_ERROR_EXIT("[repl] '" + std::string(identifier->name) +
+                         "' is already defined, only functions can be "
+                         "redefined",
+                     stmt->span, *program->source_buffer);
+    }
+  }
+}
+
+// A function redefined with another signature has every earlier function
+// typechecked again, the ones calling it were compiled against the old one.
+// Returns them to be compiled again.
+std::vector<Ref<Statement>> Repl::State::retypecheck_callers(
+    const std::vector<Ref<Statement>> &statements,
+    const decltype(Scope::symbols) &previous) {
+  std::unordered_set<std::string_view> redefined;
+  std::vector<std::string_view> changed;
+  for (const auto &stmt : statements) {
+    if (stmt->get_type() != ASTType::FunctionDefinition)
+      continue;
+    auto name =
+        std::static_pointer_cast<FunctionDefinition>(stmt)->identifier->name;
+    auto before = previous.find(name);
+    if (!functions.contains(name) || before == previous.end())
+      continue;
+    redefined.insert(name);
+    if (!same_signature(before->second, program->scope->symbols.at(name)))
+      changed.push_back(name);
+  }
+  if (changed.empty())
+    return {};
+
+  auto current_source = program->source_buffer;
+  std::vector<Ref<Statement>> callers;
+  for (const auto &[name, function] : functions) {
+    if (redefined.contains(name))
+      continue;
+    program->source_buffer = function.source;
+    try {
+      perform_second_pass_typechecking(typecheck, {function.definition});
+    } catch (const logging::CompileError &) {
+      program->source_buffer = current_source;
+      LOG_ERROR_EXIT("[repl] The new signature of '" +
+                     std::string(changed.front()) + "' breaks '" +
+                     std::string(name) + "', define them together instead");
+    }
+    callers.push_back(function.definition);
+  }
+  program->source_buffer = current_source;
+  return callers;
+}
+
+void Repl::State::commit(const std::vector<Ref<Statement>> &statements) {
+  for (const auto &stmt : statements) {
+    switch (stmt->get_type()) {
+    case ASTType::FunctionDefinition: {
+      auto func_def = std::static_pointer_cast<FunctionDefinition>(stmt);
+      functions[func_def->identifier->name] = {func_def,
+                                               program->source_buffer};
+      break;
+    }
+    case ASTType::StructDefinition:
+      types_and_externs.insert(
+          std::static_pointer_cast<StructDefinition>(stmt)->identifier->name);
+      break;
+    case ASTType::EnumDefinition:
+      types_and_externs.insert(
+          std::static_pointer_cast<EnumDefinition>(stmt)->identifier->name);
+      break;
+    case ASTType::Extern:
+      types_and_externs.insert(
+          std::static_pointer_cast<::Extern>(stmt)->identifier->name);
+      break;
+    default:
+      break;
+    }
+    program->body->statements.push_back(stmt);
+  }
+}
+
+bool Repl::evaluate(const std::string &text) {
+  auto &program = state->program;
+  auto &typecheck = state->typecheck;
+  auto source = state->sources.emplace_back(std::make_shared<std::string>(text));
+  program->source_buffer = source;
+  auto previous = program->scope->symbols;
+
+  logging::RecoverableErrors recoverable;
+  int input = -1;
+  try {
+    const auto &tokens = state->tokens.emplace_back(lex(*source, "<repl>"));
+    program->module_context->load_imports("<repl>", *source, tokens);
+    auto statements = parse_statements(tokens, program);
+    if (statements.empty())
+      return true;
+    state->check_redeclarations(statements);
+
+    perform_first_pass_registration(typecheck, statements);
+    perform_second_pass_typechecking(typecheck, statements);
+    // The modules an input imports for the first time are compiled with it
+    std::vector<Ref<Statement>> compiled;
+    for (const auto &path :
+         program->module_context->imported_paths(statements)) {
+      if (state->linked_modules.contains(path))
+        continue;
+      auto declarations = program->module_context->declarations(path);
+      compiled.insert(compiled.end(), declarations.begin(), declarations.end());
+    }
+    mark_tail_calls(program, compiled);
+    mark_tail_calls(program, statements);
+    auto callers = state->retypecheck_callers(statements, previous);
+    print_expressions(statements);
+
+    compiled.insert(compiled.end(), statements.begin(), statements.end());
+    compiled.insert(compiled.end(), callers.begin(), callers.end());
+    input = state->compiler.compile(program, compiled);
+    state->commit(statements);
+    for (const auto &path :
+         program->module_context->imported_paths(statements)) {
+      state->linked_modules.insert(path);
+    }
+  } catch (const std::exception &error) {
+    // Parse errors at the end of the input are plain exceptions
+    if (!dynamic_cast<const logging::CompileError *>(&error))
+      std::fprintf(stderr, "Error: %s\n", error.what());
+    program->scope->symbols = previous;
+    typecheck->scope_stack = {typecheck->global_scope};
+    typecheck->function_stack.clear();
+    typecheck->current_block = program->body;
+    return false;
+  }
+
+  run_function(state->compiler.module(), input);
+  enki_flush();
+  return true;
+}
+
+int run_repl(std::istream &in, bool interactive) {
+  auto prompt = [&](const char *text) {
+    if (interactive) {
+      std::fputs(text, stdout);
+      std::fflush(stdout);
+    }
+  };
+
+  Repl repl;
+  std::string input;
+  std::string line;
+  int depth = 0;
+  prompt(">>> ");
+  while (std::getline(in, line)) {
+    if (input.empty() && (line == ":quit" || line == ":q"))
+      return 0;
+    input += line;
+    input += '\n';
+    depth += open_brackets(line);
+    if (depth > 0) {
+      prompt("... ");
+      continue;
+    }
+    bool ok = repl.evaluate(input);
+    input.clear();
+    depth = 0;
+    if (!ok && !interactive)
+      return 1;
+    prompt(">>> ");
+  }
+  if (!input.empty() && !repl.evaluate(input) && !interactive)
+    return 1;
+  prompt("\n");
+  return 0;
+}
+
+} // namespace vm
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <istream>
+#include <memory>
+#include <string>
+
+namespace vm {
+
+// An interactive session behind `enki repl`. The global scope, the
+// typechecked declarations and the bytecode live as long as the session,
+// every input is lexed, parsed, typechecked and compiled on its own against
+// them and then run in the VM. Top level `let`s become globals, expressions
+// print their value and functions can be redefined; structs, enums and
+// externs cannot.
+class Repl {
+public:
+  Repl();
+  ~Repl();
+
+  // Runs one input, which holds whole statements. Returns false after
+  // printing the error if any step fails, the session is left as it was
+  // before the input then.
+  bool evaluate(const std::string &text);
+
+private:
+  struct State;
+  std::unique_ptr<State> state;
+};
+
+// Reads inputs from `in` until it ends or `:quit`, a statement continues over
+// the following lines as long as it has unclosed brackets. Interactive
+// sessions show prompts and carry on after errors, otherwise the first error
+// ends the session with exit code 1.
+int run_repl(std::istream &in, bool interactive);
+
+} // namespace vm
@@ -0,0 +1,424 @@
+/* The bytecode interpreter. Dispatch is threaded through a table of label
+addresses (GCC's computed goto), every handler jumps straight to the next
+one instead of going back through a switch. The register windows, frame
+memory and call frames live in three stacks allocated once up front, the
+pages are only touched as deep as the program actually recurses. */
+
+#include "vm.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+extern "C" {
+#include "../runtime/enki_rt.h"
+}
+
+namespace vm {
+
+namespace {
+
+constexpr size_t register_stack_size = size_t{1} << 22; // Values
+constexpr size_t memory_stack_size = size_t{1} << 26;   // Bytes
+constexpr size_t max_frames = size_t{1} << 20;
+
+struct Frame {
+  const Function *fn;
+  const Inst *return_pc; // The Call, its `a` receives the result
+  Value *registers;
+  uint8_t *memory;
+};
+
+int32_t add(int32_t left, int32_t right) {
+  return static_cast<int32_t>(static_cast<uint32_t>(left) +
+                              static_cast<uint32_t>(right));
+}
+int32_t sub(int32_t left, int32_t right) {
+  return static_cast<int32_t>(static_cast<uint32_t>(left) -
+                              static_cast<uint32_t>(right));
+}
+int32_t mul(int32_t left, int32_t right) {
+  return static_cast<int32_t>(static_cast<uint32_t>(left) *
+                              static_cast<uint32_t>(right));
+}
+
+uint8_t *address(const Value &base, int32_t offset) {
+  return static_cast<uint8_t *>(base.p) + offset;
+}
+
+[[noreturn]] void stack_overflow(const Function &fn) {
+  enki_flush();
+  std::fprintf(stderr, "enki: stack overflow calling '%s'\n", fn.name.c_str());
+  std::exit(1);
+}
+
+// Integer class arguments go in the integer argument registers in order,
+// floats in the floating point ones, independently of each other. Calling
+// through a prototype with six of the one and eight of the other fills both
+// the same way for any mix, unused registers are ignored by the callee.
+using IntFunction = uint64_t (*)(uint64_t, uint64_t, uint64_t, uint64_t,
+                                 uint64_t, uint64_t, float, float, float,
+                                 float, float, float, float, float);
+using FloatFunction = float (*)(uint64_t, uint64_t, uint64_t, uint64_t,
+                                uint64_t, uint64_t, float, float, float, float,
+                                float, float, float, float);
+
+Value call_native(void *address, const Signature &signature,
+                  const Value *args) {
+  uint64_t ints[6] = {};
+  float floats[8] = {};
+  int next_int = 0;
+  int next_float = 0;
+  for (size_t i = 0; i < signature.args.size(); ++i) {
+    switch (signature.args[i]) {
+    case ValueClass::Int:
+      ints[next_int++] = static_cast<uint64_t>(static_cast<int64_t>(args[i].i));
+      break;
+    case ValueClass::Ptr:
+      ints[next_int++] = args[i].bits;
+      break;
+    case ValueClass::Float:
+      floats[next_float++] = args[i].f;
+      break;
+    }
+  }
+
+  Value result;
+  result.bits = 0;
+  if (signature.result == ResultKind::Float) {
+    result.f = reinterpret_cast<FloatFunction>(address)(
+        ints[0], ints[1], ints[2], ints[3], ints[4], ints[5], floats[0],
+        floats[1], floats[2], floats[3], floats[4], floats[5], floats[6],
+        floats[7]);
+    return result;
+  }
+  uint64_t raw = reinterpret_cast<IntFunction>(address)(
+      ints[0], ints[1], ints[2], ints[3], ints[4], ints[5], floats[0],
+      floats[1], floats[2], floats[3], floats[4], floats[5], floats[6],
+      floats[7]);
+  switch (signature.result) {
+  case ResultKind::Int:
+    result.i = static_cast<int32_t>(raw);
+    break;
+  case ResultKind::Byte:
+    result.i = static_cast<uint8_t>(raw);
+    break;
+  case ResultKind::Ptr:
+    result.bits = raw;
+    break;
+  default:
+    break;
+  }
+  return result;
+}
+
+// Counts the calls the VM makes to each function and hands out the machine
+// code of the ones that got hot
+class Tiering {
+public:
+  Tiering(const Module &module, const TierUp *tier_up)
+      : module(module), tier_up(tier_up), calls(module.functions.size(), 0),
+        entries(module.functions.size(), nullptr) {}
+
+  // Machine code to call instead of interpreting, if any
+  void *entry(uint16_t index) {
+    if (!tier_up)
+      return nullptr;
+    if (!entries[index] && calls[index]++ >= tier_up->threshold)
+      entries[index] = tier_up->compile(module.functions[index]);
+    return entries[index];
+  }
+
+private:
+  const Module &module;
+  const TierUp *tier_up;
+  std::vector<uint32_t> calls;
+  std::vector<void *> entries;
+};
+
+} // namespace
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+int run(const Module &module, const TierUp *tier_up) {
+  return run_function(module, module.main, tier_up);
+}
+
+int run_function(const Module &module, int function, const TierUp *tier_up) {
+  Tiering tiering(module, tier_up);
+  if (void *entry = tiering.entry(function)) {
+    return call_native(entry, module.functions[function].signature, nullptr)
+        .i;
+  }
+
+  // Uninitialized on purpose, a value-initialized stack would be zeroed page
+  // by page before the first instruction runs
+  std::unique_ptr<Value[]> register_stack(new Value[register_stack_size]);
+  std::unique_ptr<uint8_t[]> memory_stack(new uint8_t[memory_stack_size]);
+  std::unique_ptr<Frame[]> frame_stack(new Frame[max_frames]);
+  const Value *registers_end = register_stack.get() + register_stack_size;
+  const uint8_t *memory_end = memory_stack.get() + memory_stack_size;
+  Frame *frames_end = frame_stack.get() + max_frames;
+
+  const Function *fn = &module.functions[function];
+  if (fn->registers > register_stack_size ||
+      fn->frame_size > memory_stack_size) {
+    stack_overflow(*fn);
+  }
+  Value *r = register_stack.get();
+  uint8_t *memory = memory_stack.get();
+  Frame *frame = frame_stack.get();
+  const Inst *code = fn->code.data();
+  const Inst *pc = code;
+
+  // In the order of Op, Flush is the last one
+  static const void *const handlers[] = {
+      &&Mov,        &&LoadInt,    &&LoadFloat,  &&LoadConst,   &&AddInt,
+      &&SubInt,     &&MulInt,     &&DivInt,     &&ModInt,      &&AddIntImm,
+      &&AddFloat,   &&SubFloat,   &&MulFloat,   &&DivFloat,    &&EqInt,
+      &&NeInt,      &&LtInt,      &&GtInt,      &&LeInt,       &&GeInt,
+      &&EqFloat,    &&NeFloat,    &&LtFloat,    &&GtFloat,     &&LeFloat,
+      &&GeFloat,    &&EqPtr,      &&NePtr,      &&Not,         &&StrEq,
+      &&FrameAddr,  &&AddOffset,  &&AddIndex,   &&Load1,       &&Load4,
+      &&Load8,      &&Store1,     &&Store4,     &&Store8,      &&Copy,
+      &&Jump,       &&JumpIfZero, &&JumpIfEq,   &&JumpIfNe,    &&JumpIfLt,
+      &&JumpIfGt,   &&JumpIfLe,   &&JumpIfGe,   &&Call,        &&CallExtern,
+      &&Return,     &&WriteInt,   &&WriteFloat, &&WriteBool,   &&WriteChar,
+      &&WritePtr,   &&WriteStr,   &&WriteNewline, &&EprintBegin, &&EprintEnd,
+      &&Flush,
+  };
+  static_assert(std::size(handlers) == static_cast<size_t>(Op::Flush) + 1);
+
+#define DISPATCH() goto *handlers[static_cast<size_t>(pc->op)]
+#define NEXT()                                                                 \
+  do {                                                                         \
+    ++pc;                                                                      \
+    DISPATCH();                                                                \
+  } while (0)
+#define JUMP_IF(condition)                                                     \
+  do {                                                                         \
+    pc = (condition) ? code + pc->imm : pc + 1;                                \
+    DISPATCH();                                                                \
+  } while (0)
+
+  DISPATCH();
+
+Mov:
+  r[pc->a] = r[pc->b];
+  NEXT();
+LoadInt:
+LoadFloat:
+  r[pc->a].i = pc->imm;
+  NEXT();
+LoadConst:
+  r[pc->a] = module.constants[pc->imm];
+  NEXT();
+AddInt:
+  r[pc->a].i = add(r[pc->b].i, r[pc->c].i);
+  NEXT();
+SubInt:
+  r[pc->a].i = sub(r[pc->b].i, r[pc->c].i);
+  NEXT();
+MulInt:
+  r[pc->a].i = mul(r[pc->b].i, r[pc->c].i);
+  NEXT();
+DivInt:
+  r[pc->a].i = r[pc->b].i / r[pc->c].i;
+  NEXT();
+ModInt:
+  r[pc->a].i = r[pc->b].i % r[pc->c].i;
+  NEXT();
+AddIntImm:
+  r[pc->a].i = add(r[pc->b].i, pc->imm);
+  NEXT();
+AddFloat:
+  r[pc->a].f = r[pc->b].f + r[pc->c].f;
+  NEXT();
+SubFloat:
+  r[pc->a].f = r[pc->b].f - r[pc->c].f;
+  NEXT();
+MulFloat:
+  r[pc->a].f = r[pc->b].f * r[pc->c].f;
+  NEXT();
+DivFloat:
+  r[pc->a].f = r[pc->b].f / r[pc->c].f;
+  NEXT();
+EqInt:
+  r[pc->a].i = r[pc->b].i == r[pc->c].i;
+  NEXT();
+NeInt:
+  r[pc->a].i = r[pc->b].i != r[pc->c].i;
+  NEXT();
+LtInt:
+  r[pc->a].i = r[pc->b].i < r[pc->c].i;
+  NEXT();
+GtInt:
+  r[pc->a].i = r[pc->b].i > r[pc->c].i;
+  NEXT();
+LeInt:
+  r[pc->a].i = r[pc->b].i <= r[pc->c].i;
+  NEXT();
+GeInt:
+  r[pc->a].i = r[pc->b].i >= r[pc->c].i;
+  NEXT();
+EqFloat:
+  r[pc->a].i = r[pc->b].f == r[pc->c].f;
+  NEXT();
+NeFloat:
+  r[pc->a].i = r[pc->b].f != r[pc->c].f;
+  NEXT();
+LtFloat:
+  r[pc->a].i = r[pc->b].f < r[pc->c].f;
+  NEXT();
+GtFloat:
+  r[pc->a].i = r[pc->b].f > r[pc->c].f;
+  NEXT();
+LeFloat:
+  r[pc->a].i = r[pc->b].f <= r[pc->c].f;
+  NEXT();
+GeFloat:
+  r[pc->a].i = r[pc->b].f >= r[pc->c].f;
+  NEXT();
+EqPtr:
+  r[pc->a].i = r[pc->b].p == r[pc->c].p;
+  NEXT();
+NePtr:
+  r[pc->a].i = r[pc->b].p != r[pc->c].p;
+  NEXT();
+Not:
+  r[pc->a].i = !r[pc->b].i;
+  NEXT();
+StrEq: {
+  auto *left = static_cast<const Str *>(r[pc->b].p);
+  auto *right = static_cast<const Str *>(r[pc->c].p);
+  r[pc->a].i = enki_str_eq({left->data, left->len}, {right->data, right->len});
+  NEXT();
+}
+FrameAddr:
+  r[pc->a].p = memory + pc->imm;
+  NEXT();
+AddOffset:
+  r[pc->a].p = address(r[pc->b], pc->imm);
+  NEXT();
+AddIndex:
+  r[pc->a].p = static_cast<uint8_t *>(r[pc->b].p) +
+               static_cast<int64_t>(r[pc->c].i) * pc->imm;
+  NEXT();
+Load1:
+  r[pc->a].i = *address(r[pc->b], pc->imm);
+  NEXT();
+Load4:
+  std::memcpy(&r[pc->a].i, address(r[pc->b], pc->imm), 4);
+  NEXT();
+Load8:
+  std::memcpy(&r[pc->a].p, address(r[pc->b], pc->imm), 8);
+  NEXT();
+Store1:
+  *address(r[pc->a], pc->imm) = static_cast<uint8_t>(r[pc->b].i);
+  NEXT();
+Store4:
+  std::memcpy(address(r[pc->a], pc->imm), &r[pc->b].i, 4);
+  NEXT();
+Store8:
+  std::memcpy(address(r[pc->a], pc->imm), &r[pc->b].p, 8);
+  NEXT();
+Copy:
+  std::memmove(r[pc->a].p, r[pc->b].p, pc->imm);
+  NEXT();
+Jump:
+  pc = code + pc->imm;
+  DISPATCH();
+JumpIfZero:
+  JUMP_IF(r[pc->a].i == 0);
+JumpIfEq:
+  JUMP_IF(r[pc->a].i == r[pc->b].i);
+JumpIfNe:
+  JUMP_IF(r[pc->a].i != r[pc->b].i);
+JumpIfLt:
+  JUMP_IF(r[pc->a].i < r[pc->b].i);
+JumpIfGt:
+  JUMP_IF(r[pc->a].i > r[pc->b].i);
+JumpIfLe:
+  JUMP_IF(r[pc->a].i <= r[pc->b].i);
+JumpIfGe:
+  JUMP_IF(r[pc->a].i >= r[pc->b].i);
+Call: {
+  const Function &callee = module.functions[pc->b];
+  if (void *entry = tiering.entry(pc->b)) {
+    r[pc->a] = call_native(entry, callee.signature, r + pc->c);
+    NEXT();
+  }
+  Value *window = r + pc->c;
+  uint8_t *callee_memory = memory + fn->frame_size;
+  if (window + callee.registers > registers_end ||
+      callee_memory + callee.frame_size > memory_end || frame == frames_end) {
+    stack_overflow(callee);
+  }
+  *frame++ = Frame{fn, pc, r, memory};
+  fn = &callee;
+  r = window;
+  memory = callee_memory;
+  code = pc = callee.code.data();
+  DISPATCH();
+}
+CallExtern:
+  r[pc->a] = call_native(module.externs[pc->b].address,
+                         module.externs[pc->b].signature, r + pc->c);
+  NEXT();
+Return: {
+  Value result = r[pc->a];
+  if (frame == frame_stack.get())
+    return result.i;
+  --frame;
+  fn = frame->fn;
+  r = frame->registers;
+  memory = frame->memory;
+  code = fn->code.data();
+  pc = frame->return_pc;
+  r[pc->a] = result;
+  NEXT();
+}
+WriteInt:
+  enki_write_int(r[pc->a].i);
+  NEXT();
+WriteFloat:
+  enki_write_float(r[pc->a].f);
+  NEXT();
+WriteBool:
+  enki_write_bool(r[pc->a].i != 0);
+  NEXT();
+WriteChar:
+  enki_write_char(static_cast<char>(r[pc->a].i));
+  NEXT();
+WritePtr:
+  enki_write_ptr(r[pc->a].p);
+  NEXT();
+WriteStr: {
+  auto *str = static_cast<const Str *>(r[pc->a].p);
+  enki_write_str({str->data, str->len});
+  NEXT();
+}
+WriteNewline:
+  enki_write_newline();
+  NEXT();
+EprintBegin:
+  enki_eprint_begin();
+  NEXT();
+EprintEnd:
+  enki_eprint_end();
+  NEXT();
+Flush:
+  enki_flush();
+  NEXT();
+
+#undef JUMP_IF
+#undef NEXT
+#undef DISPATCH
+}
+
+#pragma GCC diagnostic pop
+
+} // namespace vm
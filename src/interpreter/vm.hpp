@@ -0,0 +1,27 @@
+#pragma once
+
+#include "bytecode.hpp"
+#include <functional>
+
+namespace vm {
+
+// Moves hot functions to machine code, see `enki jit`. Once a function has
+// been called `threshold` times by the VM, `compile` is asked for its
+// machine code and every later call from the VM goes there instead. The
+// code follows the function's Signature, and whatever it calls runs as
+// machine code too.
+struct TierUp {
+  uint32_t threshold = 1000; // 0 runs main as machine code straight away
+  std::function<void *(const Function &fn)> compile;
+};
+
+// Runs main and returns its result. Output goes through the C runtime
+// (src/runtime/enki_rt.c), so it is formatted and buffered exactly like the
+// output of a compiled program.
+int run(const Module &module, const TierUp *tier_up = nullptr);
+// The same for any function without parameters, the REPL runs its inputs
+// like this
+int run_function(const Module &module, int function,
+                 const TierUp *tier_up = nullptr);
+
+} // namespace vm
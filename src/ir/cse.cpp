@@ -0,0 +1,180 @@
+#include "cse.hpp"
+#include <algorithm>
+#include <bit>
+#include <format>
+#include <map>
+#include <optional>
+#include <spdlog/spdlog.h>
+#include <tuple>
+
+namespace ir {
+
+namespace {
+
+bool is_commutative(Opcode op) {
+  return op == Opcode::Add || op == Opcode::Mul || op == Opcode::And ||
+         op == Opcode::Or || op == Opcode::MulHigh || op == Opcode::Eq || op == Opcode::Ne;
+}
+
+// Every literal in the source gets its own entry in Module::constants, so
+// constants are compared by value through the first entry holding it
+std::vector<uint32_t> canonical_constants(const Module &module) {
+  std::map<std::tuple<TypeId, int64_t, uint64_t, std::string>, uint32_t> first;
+  std::vector<uint32_t> canonical(module.constants.size());
+  for (uint32_t i = 0; i < module.constants.size(); ++i) {
+    const auto &constant = module.constants[i];
+    auto key = std::make_tuple(constant.type, constant.integer,
+                               std::bit_cast<uint64_t>(constant.real),
+                               constant.text);
+    canonical[i] = first.emplace(key, i).first->second;
+  }
+  return canonical;
+}
+
+// Opcode, type, immediates, memory state and operands of an instruction
+using Key = std::tuple<Opcode, TypeId, uint32_t, uint32_t, uint64_t,
+                       std::vector<ValueId>>;
+
+class FunctionCSE {
+public:
+  FunctionCSE(const Module &module, Function &fn,
+              const std::vector<uint32_t> &constants)
+      : module(module), fn(fn), constants(constants),
+        replacement(fn.insts.size(), NONE), children(fn.blocks.size()) {}
+
+  // Returns the number of removed instructions per opcode
+  std::map<std::string, uint32_t> run();
+
+private:
+  const Module &module;
+  Function &fn;
+  const std::vector<uint32_t> &constants;
+  std::map<Key, ValueId> available;
+  std::vector<ValueId> replacement;
+  std::vector<std::vector<BlockId>> children; // Dominator tree
+  std::map<std::string, uint32_t> removed;
+
+  ValueId resolve(ValueId value) const {
+    while (replacement[value] != NONE)
+      value = replacement[value];
+    return value;
+  }
+
+  std::optional<Key> key_of(ValueId id, uint64_t memory) const;
+  void visit(BlockId block);
+};
+
+std::optional<Key> FunctionCSE::key_of(ValueId id, uint64_t memory) const {
+  const auto &inst = fn.insts[id];
+  auto imm = inst.imm;
+  uint64_t state = 0;
+  switch (inst.op) {
+  case Opcode::Const:
+    imm = constants[inst.imm];
+    break;
+  case Opcode::Load:
+    state = memory;
+    break;
+  case Opcode::Call:
+    if (!module.functions[inst.imm].pure)
+      return std::nullopt;
+    break;
+  case Opcode::Zero:
+  case Opcode::FieldAddr:
+  case Opcode::ElementAddr:
+  case Opcode::Field:
+  case Opcode::MakeStruct:
+  case Opcode::Bitcast:
+  case Opcode::SizeOf:
+    break;
+  default:
+    if (!is_binary(inst.op))
+      return std::nullopt;
+    break;
+  }
+
+  std::vector<ValueId> operands;
+  for (uint32_t i = 0; i < inst.count; ++i)
+    operands.push_back(resolve(fn.operand(id, i)));
+  if (is_commutative(inst.op))
+    std::sort(operands.begin(), operands.end());
+  return Key{inst.op, inst.type, imm, inst.imm2, state, std::move(operands)};
+}
+
+// Values of a block are available in every block it dominates. Loads are
+// tagged with the block and the number of writes before them, so they only
+// match within one stretch of a block without writes.
+void FunctionCSE::visit(BlockId block) {
+  std::vector<Key> added;
+  uint64_t writes = 0;
+  for (auto id : fn.blocks[block].insts) {
+    const auto &inst = fn.insts[id];
+    if (inst.op == Opcode::Store ||
+        (inst.op == Opcode::Call && !module.functions[inst.imm].pure)) {
+      ++writes;
+      continue;
+    }
+    auto key = key_of(id, (static_cast<uint64_t>(block) << 32) | writes);
+    if (!key)
+      continue;
+    auto [existing, inserted] = available.emplace(*key, id);
+    if (inserted) {
+      added.push_back(std::move(*key));
+    } else {
+      replacement[id] = existing->second;
+      ++removed[opcode_name(inst.op)];
+    }
+  }
+  for (auto child : children[block])
+    visit(child);
+  for (const auto &key : added)
+    available.erase(key);
+}
+
+std::map<std::string, uint32_t> FunctionCSE::run() {
+  auto idom = compute_dominators(fn);
+  for (BlockId b = 0; b < fn.blocks.size(); ++b) {
+    if (idom[b] != NONE)
+      children[idom[b]].push_back(b);
+  }
+  visit(0);
+
+  for (auto &operand : fn.operands)
+    operand = resolve(operand);
+  for (auto &block : fn.blocks) {
+    std::erase_if(block.insts,
+                  [&](ValueId id) { return replacement[id] != NONE; });
+  }
+  for (ValueId id = 0; id < fn.insts.size(); ++id) {
+    if (replacement[id] != NONE)
+      fn.insts[id].block = NONE;
+  }
+  return removed;
+}
+
+} // namespace
+
+void eliminate_common_subexpressions(Module &module,
+                                     const PassOptions &options) {
+  spdlog::debug("[ir] Eliminating common subexpressions");
+  auto constants = canonical_constants(module);
+  for (auto &fn : module.functions) {
+    if (fn.kind != FunctionKind::Defined)
+      continue;
+    auto removed = FunctionCSE(module, fn, constants).run();
+    if (removed.empty())
+      continue;
+    uint32_t total = 0;
+    std::string details;
+    for (const auto &[name, count] : removed) {
+      total += count;
+      details += std::format("{}{} {}", details.empty() ? "" : ", ", count,
+                             name);
+    }
+    remark(options, "cse", fn,
+           std::format("removed {} redundant instruction{} ({})", total,
+                       total == 1 ? "" : "s", details));
+  }
+}
+
+} // namespace ir
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "ir.hpp"
+#include "passes.hpp"
+
+namespace ir {
+
+// Replaces instructions that recompute a value already available in a
+// dominating block. Loads are only reused within one block and only while no
+// store or impure call sits in between. Calls are reused when the callee is
+// pure, so compute_purity() has to run first.
+void eliminate_common_subexpressions(Module &module,
+                                     const PassOptions &options);
+
+} // namespace ir
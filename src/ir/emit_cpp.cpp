@@ -0,0 +1,434 @@
+#include "emit_cpp.hpp"
+#include <cmath>
+#include <cstdio>
+#include <format>
+#include <functional>
+#include <spdlog/spdlog.h>
+
+namespace ir {
+
+namespace {
+
+std::string cpp_type(const Module &module, TypeId id) {
+  const auto &type = module.types[id];
+  switch (type.kind) {
+  case TypeKind::Void:
+    return "void";
+  case TypeKind::Bool:
+    return "bool";
+  case TypeKind::Char:
+    return "char";
+  case TypeKind::Int:
+    return "int";
+  case TypeKind::Float:
+    return "float";
+  case TypeKind::String:
+    return "std::string";
+  case TypeKind::Pointer:
+    return cpp_type(module, type.pointee) + "*";
+  case TypeKind::Struct:
+  case TypeKind::Enum:
+    return type.name;
+  case TypeKind::Vector:
+    return std::format("enki_{}x{}", cpp_type(module, type.pointee),
+                       vector_lanes);
+  }
+  return "void";
+}
+
+// GCC vector extensions, the `_unaligned` variant reads and writes vectors
+// anywhere in a buffer
+void emit_vector_types(const Module &module, std::string &out) {
+  for (TypeId id = 0; id < module.types.types.size(); ++id) {
+    if (module.types[id].kind != TypeKind::Vector)
+      continue;
+    auto lane = cpp_type(module, module.types[id].pointee);
+    auto name = cpp_type(module, id);
+    out += std::format("typedef {0} {1} __attribute__((vector_size({2} * "
+                       "sizeof({0}))));\n",
+                       lane, name, vector_lanes);
+    out += std::format("typedef {0} {1}_unaligned __attribute__((vector_size("
+                       "{2} * sizeof({0})), aligned(alignof({0}))));\n",
+                       lane, name, vector_lanes);
+  }
+}
+
+std::string float_literal(const Constant &constant) {
+  if (!constant.text.empty())
+    return constant.text + "f";
+  // Constants made up by passes have no source text. Folding can overflow
+  // to infinity or make a NaN, which %g would spell as no literal does.
+  auto value = static_cast<float>(constant.real);
+  if (std::isinf(value) || std::isnan(value)) {
+    return std::string(std::signbit(value) ? "-" : "") +
+           (std::isinf(value) ? "std::numeric_limits<float>::infinity()"
+                              : "std::numeric_limits<float>::quiet_NaN()");
+  }
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+  std::string text = buffer;
+  if (text.find_first_of(".en") == std::string::npos)
+    text += ".0";
+  return text + "f";
+}
+
+std::string constant_literal(const Module &module, const Constant &constant) {
+  const auto &type = module.types[constant.type];
+  switch (type.kind) {
+  case TypeKind::String:
+    return "\"" + constant.text + "\"";
+  case TypeKind::Char:
+    return "'" + constant.text + "'";
+  case TypeKind::Bool:
+    return constant.integer ? "true" : "false";
+  case TypeKind::Float:
+    return float_literal(constant);
+  case TypeKind::Enum:
+    return type.name + "::" + type.names[constant.integer];
+  default:
+    return std::to_string(constant.integer);
+  }
+}
+
+const char *binary_operator(Opcode op) {
+  switch (op) {
+  case Opcode::Add:
+    return "+";
+  case Opcode::Sub:
+    return "-";
+  case Opcode::Mul:
+    return "*";
+  case Opcode::Div:
+    return "/";
+  case Opcode::Mod:
+    return "%";
+  case Opcode::Shr:
+    return ">>";
+  case Opcode::And:
+    return "&";
+  case Opcode::Or:
+    return "|";
+  case Opcode::Eq:
+    return "==";
+  case Opcode::Ne:
+    return "!=";
+  case Opcode::Lt:
+    return "<";
+  case Opcode::Gt:
+    return ">";
+  case Opcode::Le:
+    return "<=";
+  case Opcode::Ge:
+    return ">=";
+  default:
+    return "?";
+  }
+}
+
+class FunctionEmitter {
+public:
+  FunctionEmitter(const Module &module, const Function &fn, std::string &out)
+      : module(module), fn(fn), out(out) {}
+
+  void emit();
+
+private:
+  const Module &module;
+  const Function &fn;
+  std::string &out;
+  bool void_main = false;
+
+  static std::string value(ValueId id) { return "_" + std::to_string(id); }
+  std::string type(TypeId id) const { return cpp_type(module, id); }
+
+  // Integer constants are written in place, which lets g++ see constant
+  // shift amounts and multipliers without optimizing
+  std::string operand(ValueId id, uint32_t index) const {
+    auto operand = fn.operand(id, index);
+    const auto &inst = fn.insts[operand];
+    if (inst.op == Opcode::Const && inst.type == TypeTable::Int)
+      return "(" + constant_literal(module, module.constants[inst.imm]) + ")";
+    return value(operand);
+  }
+
+  // Phis are resolved by copying into a per-phi temporary at the end of each
+  // predecessor, and from there into the phi at the top of its block, which
+  // keeps parallel-copy semantics without ordering the copies
+  void emit_phi_copies(BlockId block) {
+    for (auto succ : fn.successors(block)) {
+      const auto &target = fn.blocks[succ];
+      for (size_t i = 0; i < target.preds.size(); ++i) {
+        if (target.preds[i] != block)
+          continue;
+        for (auto id : target.insts) {
+          if (fn.insts[id].op != Opcode::Phi)
+            break;
+          out += "  " + value(id) + "_in = " +
+                 value(fn.operand(id, static_cast<uint32_t>(i))) + ";\n";
+        }
+      }
+    }
+  }
+
+  void emit_inst(ValueId id);
+};
+
+void FunctionEmitter::emit_inst(ValueId id) {
+  const auto &inst = fn.insts[id];
+  auto assign = [&](const std::string &expression) {
+    out += "  " + value(id) + " = " + expression + ";\n";
+  };
+
+  if (is_binary(inst.op)) {
+    auto operand_type = fn.insts[fn.operand(id, 0)].type;
+    if (inst.op == Opcode::Mod && operand_type == TypeTable::Float) {
+      assign("std::fmod(" + operand(id, 0) + ", " + operand(id, 1) + ")");
+      return;
+    }
+    // Shifting into the sign bit is undefined for int, unsigned wraps
+    if (inst.op == Opcode::Shl) {
+      assign("static_cast<int>(static_cast<unsigned>(" + operand(id, 0) +
+             ") << " + operand(id, 1) + ")");
+      return;
+    }
+    if (inst.op == Opcode::MulHigh) {
+      assign("static_cast<int>((static_cast<long long>(" + operand(id, 0) +
+             ") * " + operand(id, 1) + ") >> 32)");
+      return;
+    }
+    assign(operand(id, 0) + " " + binary_operator(inst.op) + " " +
+           operand(id, 1));
+    return;
+  }
+
+  switch (inst.op) {
+  case Opcode::Const:
+    assign(constant_literal(module, module.constants[inst.imm]));
+    break;
+  case Opcode::Zero:
+    assign(type(inst.type) + "{}");
+    break;
+  case Opcode::Param:
+    assign(fn.param_names[inst.imm]);
+    break;
+  case Opcode::Alloca:
+    assign("&" + value(id) + "_slot");
+    break;
+  case Opcode::Load:
+    assign("*" + operand(id, 0));
+    break;
+  case Opcode::Store:
+    out += "  *" + operand(id, 0) + " = " + operand(id, 1) + ";\n";
+    break;
+  case Opcode::FieldAddr: {
+    auto base = module.types[fn.insts[fn.operand(id, 0)].type].pointee;
+    assign("&" + operand(id, 0) + "->" + module.types[base].names[inst.imm]);
+    break;
+  }
+  case Opcode::Field: {
+    auto base = fn.insts[fn.operand(id, 0)].type;
+    assign(operand(id, 0) + "." + module.types[base].names[inst.imm]);
+    break;
+  }
+  case Opcode::MakeStruct: {
+    std::string fields;
+    for (uint32_t i = 0; i < inst.count; ++i)
+      fields += (i > 0 ? ", " : "") + operand(id, i);
+    assign(type(inst.type) + "{" + fields + "}");
+    break;
+  }
+  case Opcode::Bitcast:
+    assign("reinterpret_cast<" + type(inst.type) + ">(" + operand(id, 0) +
+           ")");
+    break;
+  case Opcode::SizeOf:
+    assign("static_cast<int>(sizeof(" + type(inst.imm) + "))");
+    break;
+  case Opcode::ElementAddr:
+    assign(operand(id, 0) + " + " + operand(id, 1));
+    break;
+  case Opcode::VecLoad:
+    assign("*reinterpret_cast<" + type(inst.type) + "_unaligned *>(" +
+           operand(id, 0) + ")");
+    break;
+  case Opcode::VecStore:
+    out += "  *reinterpret_cast<" + type(fn.insts[fn.operand(id, 1)].type) +
+           "_unaligned *>(" + operand(id, 0) + ") = " + operand(id, 1) +
+           ";\n";
+    break;
+  case Opcode::Splat: {
+    std::string lanes;
+    for (uint32_t i = 0; i < vector_lanes; ++i)
+      lanes += (i > 0 ? ", " : "") + operand(id, 0);
+    assign(type(inst.type) + "{" + lanes + "}");
+    break;
+  }
+  case Opcode::ReduceAdd: {
+    std::string sum;
+    for (uint32_t i = 0; i < vector_lanes; ++i)
+      sum += std::format("{}{}[{}]", i > 0 ? " + " : "", operand(id, 0), i);
+    assign(sum);
+    break;
+  }
+  case Opcode::Call: {
+    const auto &callee = module.functions[inst.imm];
+    std::string args;
+    for (uint32_t i = 0; i < inst.count; ++i)
+      args += (i > 0 ? ", " : "") + operand(id, i);
+    // Output builtins live in the enki::io runtime (src/runtime/enki_io.hpp)
+    auto name = callee.kind == FunctionKind::Builtin ? "enki::io::" + callee.name
+                                                     : callee.name;
+    if (inst.type == TypeTable::Void) {
+      out += "  " + name + "(" + args + ");\n";
+    } else if (callee.kind == FunctionKind::Extern &&
+               module.types[inst.type].kind == TypeKind::Pointer) {
+      // libc allocators return void *, whatever pointer the extern declares
+      assign("static_cast<" + type(inst.type) + ">(" + name + "(" + args +
+             "))");
+    } else {
+      assign(name + "(" + args + ")");
+    }
+    break;
+  }
+  case Opcode::Phi:
+    assign(value(id) + "_in");
+    break;
+  case Opcode::Br:
+    emit_phi_copies(inst.block);
+    out += std::format("  goto bb{};\n", inst.imm);
+    break;
+  case Opcode::CondBr:
+    emit_phi_copies(inst.block);
+    // A counted loop usually runs another trip
+    if (fn.blocks[inst.block].counted_loop) {
+      out += std::format("  if (__builtin_expect({}, 1)) goto bb{};\n  goto "
+                         "bb{};\n",
+                         operand(id, 0), inst.imm, inst.imm2);
+      break;
+    }
+    out += std::format("  if ({}) goto bb{};\n  goto bb{};\n", operand(id, 0),
+                       inst.imm, inst.imm2);
+    break;
+  case Opcode::Ret:
+    if (inst.count == 1) {
+      out += "  return " + operand(id, 0) + ";\n";
+    } else {
+      out += void_main ? "  return 0;\n" : "  return;\n";
+    }
+    break;
+  default:
+    spdlog::error("[ir] Cannot emit C++ for {}", opcode_name(inst.op));
+    std::exit(1);
+  }
+}
+
+void FunctionEmitter::emit() {
+  void_main = fn.name == "main" && fn.return_type == TypeTable::Void;
+  out += (void_main ? std::string("int") : type(fn.return_type)) + " " +
+         fn.name + "(";
+  for (size_t i = 0; i < fn.params.size(); ++i) {
+    out += (i > 0 ? ", " : "") + type(fn.params[i]) + " " + fn.param_names[i];
+  }
+  out += ") {\n";
+
+  // Everything is declared up front, jumping over an initialization is an
+  // error in C++
+  for (const auto &block : fn.blocks) {
+    for (auto id : block.insts) {
+      const auto &inst = fn.insts[id];
+      if (inst.type == TypeTable::Void)
+        continue;
+      out += "  " + type(inst.type) + " " + value(id) + "{};\n";
+      if (inst.op == Opcode::Phi)
+        out += "  " + type(inst.type) + " " + value(id) + "_in{};\n";
+      if (inst.op == Opcode::Alloca && inst.imm > 0) {
+        out += std::format("  alignas(16) unsigned char {}_slot[{}]{{}};\n",
+                           value(id), inst.imm);
+      } else if (inst.op == Opcode::Alloca) {
+        out += "  " + type(module.types[inst.type].pointee) + " " + value(id) +
+               "_slot{};\n";
+      }
+    }
+  }
+
+  for (BlockId b = 0; b < fn.blocks.size(); ++b) {
+    if (!fn.blocks[b].preds.empty())
+      out += std::format("bb{}:;\n", b);
+    for (auto id : fn.blocks[b].insts)
+      emit_inst(id);
+  }
+  out += "}\n";
+}
+
+std::string prototype(const Module &module, const Function &fn) {
+  std::string params;
+  for (size_t i = 0; i < fn.params.size(); ++i)
+    params += (i > 0 ? ", " : "") + cpp_type(module, fn.params[i]);
+  return cpp_type(module, fn.return_type) + " " + fn.name + "(" + params + ")";
+}
+
+// Structs are defined after the structs they contain by value
+void emit_structs(const Module &module, std::string &out) {
+  std::vector<bool> emitted(module.types.types.size(), false);
+  std::function<void(TypeId)> emit_struct = [&](TypeId id) {
+    const auto &type = module.types[id];
+    if (emitted[id] || type.kind != TypeKind::Struct)
+      return;
+    emitted[id] = true;
+    for (auto field : type.fields)
+      emit_struct(field);
+    out += "struct " + type.name + " {\n";
+    for (size_t i = 0; i < type.fields.size(); ++i)
+      out += "  " + cpp_type(module, type.fields[i]) + " " + type.names[i] +
+             ";\n";
+    out += "};\n";
+  };
+  for (const auto &type : module.types.types) {
+    if (type.kind == TypeKind::Struct)
+      out += "struct " + type.name + ";\n";
+  }
+  for (TypeId id = 0; id < module.types.types.size(); ++id)
+    emit_struct(id);
+}
+
+} // namespace
+
+std::string emit_cpp(const Module &module) {
+  spdlog::debug("[ir] Emitting C++ from IR");
+  std::string out;
+  out += "#include \"enki_io.hpp\"\n";
+  out += "#include <cmath>\n";
+  out += "#include <limits>\n";
+  out += "#include <string>\n";
+  out += "#include <stdlib.h>\n";
+
+  for (const auto &type : module.types.types) {
+    if (type.kind != TypeKind::Enum)
+      continue;
+    out += "enum class " + type.name + " {\n";
+    for (const auto &member : type.names)
+      out += "  " + member + ",\n";
+    out += "};\n";
+  }
+  emit_vector_types(module, out);
+  emit_structs(module, out);
+
+  // libc functions are declared by the headers above
+  for (const auto &fn : module.functions) {
+    if (fn.kind == FunctionKind::Extern && !fn.module_path.empty() &&
+        fn.module_path != "libc") {
+      out += "extern \"C\" " + prototype(module, fn) + ";\n";
+    }
+  }
+  for (const auto &fn : module.functions) {
+    if (fn.kind == FunctionKind::Defined && fn.name != "main")
+      out += prototype(module, fn) + ";\n";
+  }
+  for (const auto &fn : module.functions) {
+    if (fn.kind == FunctionKind::Defined)
+      FunctionEmitter(module, fn, out).emit();
+  }
+  return out;
+}
+
+} // namespace ir
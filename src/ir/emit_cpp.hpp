@@ -0,0 +1,14 @@
+#pragma once
+
+#include "ir.hpp"
+#include <string>
+
+namespace ir {
+
+// Generates C++ from the IR, the counterpart of the AST based codegen() used
+// by `--backend=cpp-ir`. Every SSA value becomes a local declared at the top
+// of its function and blocks become labels, so the output is not meant to be
+// read, only to be compiled.
+std::string emit_cpp(const Module &module);
+
+} // namespace ir
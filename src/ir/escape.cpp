@@ -0,0 +1,451 @@
+#include "escape.hpp"
+#include <algorithm>
+#include <format>
+#include <map>
+#include <optional>
+#include <set>
+#include <spdlog/spdlog.h>
+
+namespace ir {
+
+namespace {
+
+// Larger allocations stay on the heap, a deep recursion with big frames
+// would otherwise overflow the stack
+constexpr int64_t MAX_STACK_BYTES = 4096;
+
+struct Use {
+  ValueId user;
+  uint32_t index; // Operand index within the user
+};
+
+std::vector<std::vector<Use>> find_uses(const Function &fn) {
+  std::vector<std::vector<Use>> uses(fn.insts.size());
+  for (const auto &block : fn.blocks) {
+    for (auto id : block.insts) {
+      for (uint32_t i = 0; i < fn.insts[id].count; ++i)
+        uses[fn.operand(id, i)].push_back(Use{id, i});
+    }
+  }
+  return uses;
+}
+
+bool is_extern_named(const Function &fn, const char *name) {
+  return fn.kind == FunctionKind::Extern && fn.name == name;
+}
+
+void insert_after_params(Function &fn, ValueId id) {
+  auto &entry = fn.blocks[0].insts;
+  auto after_params = std::find_if(entry.begin(), entry.end(), [&](ValueId id) {
+    return fn.insts[id].op != Opcode::Param;
+  });
+  entry.insert(after_params, id);
+  fn.insts[id].block = 0;
+}
+
+void remove_inst(Function &fn, ValueId id) {
+  auto &list = fn.blocks[fn.insts[id].block].insts;
+  list.erase(std::find(list.begin(), list.end(), id));
+  fn.insts[id].block = NONE;
+}
+
+class EscapeAnalysis {
+public:
+  explicit EscapeAnalysis(const Module &module);
+
+  // Why `pointer` or a pointer derived from it outlives the function, empty
+  // when nothing does. Calls to `free` are collected in `frees` when it is
+  // given and count as an escape otherwise.
+  std::string escape_reason(const Function &fn,
+                            const std::vector<std::vector<Use>> &uses,
+                            ValueId pointer,
+                            std::vector<ValueId> *frees) const;
+
+private:
+  const Module &module;
+  // Parameters of defined functions that may outlive the call
+  std::vector<std::vector<bool>> captures;
+};
+
+// Starts from no parameter escaping and marks parameters until nothing
+// changes, so recursive functions that only pass a pointer along keep it
+EscapeAnalysis::EscapeAnalysis(const Module &module) : module(module) {
+  for (const auto &fn : module.functions)
+    captures.emplace_back(fn.params.size(), fn.kind != FunctionKind::Defined);
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (FunctionId f = 0; f < module.functions.size(); ++f) {
+      const auto &fn = module.functions[f];
+      if (fn.kind != FunctionKind::Defined)
+        continue;
+      auto uses = find_uses(fn);
+      for (auto id : fn.blocks[0].insts) {
+        const auto &inst = fn.insts[id];
+        if (inst.op != Opcode::Param || captures[f][inst.imm] ||
+            module.types[inst.type].kind != TypeKind::Pointer)
+          continue;
+        if (!escape_reason(fn, uses, id, nullptr).empty()) {
+          captures[f][inst.imm] = true;
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+std::string
+EscapeAnalysis::escape_reason(const Function &fn,
+                              const std::vector<std::vector<Use>> &uses,
+                              ValueId pointer,
+                              std::vector<ValueId> *frees) const {
+  std::vector<ValueId> pending = {pointer};
+  std::set<ValueId> seen = {pointer};
+  while (!pending.empty()) {
+    auto value = pending.back();
+    pending.pop_back();
+    for (auto [user, index] : uses[value]) {
+      const auto &inst = fn.insts[user];
+      switch (inst.op) {
+      case Opcode::Load:
+        break;
+      case Opcode::Store:
+        if (index != 0)
+          return "stored to memory";
+        break;
+      case Opcode::FieldAddr:
+      case Opcode::ElementAddr:
+      case Opcode::Bitcast:
+        if (seen.insert(user).second)
+          pending.push_back(user);
+        break;
+      case Opcode::Call: {
+        const auto &callee = module.functions[inst.imm];
+        if (frees && is_extern_named(callee, "free") &&
+            inst.type == TypeTable::Void) {
+          frees->push_back(user);
+          break;
+        }
+        if (callee.kind == FunctionKind::Defined &&
+            !captures[inst.imm][index])
+          break;
+        return "passed to '" + callee.name + "'";
+      }
+      case Opcode::Phi:
+        return "merged at a phi";
+      case Opcode::Ret:
+        return "returned";
+      default:
+        if (is_comparison(inst.op))
+          break;
+        return std::string("used by ") + opcode_name(inst.op);
+      }
+    }
+  }
+  return "";
+}
+
+// Byte count of a malloc argument built from integer constants
+std::optional<int64_t> constant_size(const Module &module, const Function &fn,
+                                     ValueId value) {
+  const auto &inst = fn.insts[value];
+  switch (inst.op) {
+  case Opcode::Const:
+    if (inst.type != TypeTable::Int)
+      return std::nullopt;
+    return module.constants[inst.imm].integer;
+  case Opcode::Add:
+  case Opcode::Mul: {
+    auto a = constant_size(module, fn, fn.operand(value, 0));
+    auto b = constant_size(module, fn, fn.operand(value, 1));
+    if (!a || !b || *a > MAX_STACK_BYTES || *b > MAX_STACK_BYTES)
+      return std::nullopt;
+    return inst.op == Opcode::Add ? *a + *b : *a * *b;
+  }
+  default:
+    return std::nullopt;
+  }
+}
+
+class FunctionEscapes {
+public:
+  FunctionEscapes(Module &module, const EscapeAnalysis &analysis,
+                  Function &fn, const PassOptions &options)
+      : module(module), analysis(analysis), fn(fn), options(options) {}
+
+  void move_allocations_to_stack();
+  // Returns the number of promoted slots
+  uint32_t promote_slots();
+
+private:
+  Module &module;
+  const EscapeAnalysis &analysis;
+  Function &fn;
+  const PassOptions &options;
+
+  // Phi placement and renaming state, rebuilt for every promoted slot
+  std::vector<BlockId> idom;
+  std::vector<std::vector<BlockId>> children;
+  std::vector<std::set<BlockId>> frontier;
+  std::vector<bool> reachable;
+  std::map<ValueId, ValueId> replacement;
+  std::map<BlockId, ValueId> phis;
+
+  ValueId resolve(ValueId value) const {
+    for (auto found = replacement.find(value); found != replacement.end();
+         found = replacement.find(value))
+      value = found->second;
+    return value;
+  }
+
+  void compute_frontiers();
+  void rename(ValueId slot, BlockId block, ValueId current);
+  void promote(ValueId slot, const std::vector<Use> &slot_uses);
+  void remove_unused(std::vector<ValueId> candidates);
+};
+
+void FunctionEscapes::move_allocations_to_stack() {
+  auto uses = find_uses(fn);
+  std::vector<ValueId> calls;
+  for (const auto &block : fn.blocks) {
+    for (auto id : block.insts) {
+      const auto &inst = fn.insts[id];
+      if (inst.op == Opcode::Call && inst.count == 1 &&
+          is_extern_named(module.functions[inst.imm], "malloc") &&
+          module.types[inst.type].kind == TypeKind::Pointer)
+        calls.push_back(id);
+    }
+  }
+
+  for (auto call : calls) {
+    auto site = std::format("malloc at %{}", call);
+    auto size = fn.operand(call, 0);
+    auto bytes = constant_size(module, fn, size);
+    auto sized_type = fn.insts[size].op == Opcode::SizeOf
+                          ? std::optional<TypeId>(fn.insts[size].imm)
+                          : std::nullopt;
+    if (!bytes && !sized_type) {
+      remark(options, "escape", fn,
+             site + " stays on the heap: the size is not a constant");
+      continue;
+    }
+    if (bytes && (*bytes <= 0 || *bytes > MAX_STACK_BYTES)) {
+      remark(options, "escape", fn,
+             std::format("{} stays on the heap: {} bytes is too large", site,
+                         *bytes));
+      continue;
+    }
+    std::vector<ValueId> frees;
+    auto reason = analysis.escape_reason(fn, uses, call, &frees);
+    if (!reason.empty()) {
+      remark(options, "escape", fn,
+             site + " stays on the heap: the pointer is " + reason);
+      continue;
+    }
+
+    // A sizeof(T) allocation becomes a slot for a T, anything else a
+    // buffer of raw bytes
+    auto slot_type = module.types.pointer_to(sized_type ? *sized_type
+                                                        : TypeTable::Void);
+    auto slot = fn.add(Inst{Opcode::Alloca, slot_type, NONE, 0, 0,
+                            bytes && !sized_type
+                                ? static_cast<uint32_t>(*bytes)
+                                : 0});
+    insert_after_params(fn, slot);
+    auto &inst = fn.insts[call];
+    if (slot_type == inst.type) {
+      for (auto &operand : fn.operands) {
+        if (operand == call)
+          operand = slot;
+      }
+      remove_inst(fn, call);
+    } else {
+      // The call already has exactly one operand slot to reuse
+      inst.op = Opcode::Bitcast;
+      inst.imm = 0;
+      fn.operand(call, 0) = slot;
+    }
+    for (auto free : frees)
+      remove_inst(fn, free);
+    remark(options, "escape", fn,
+           sized_type ? std::format("{} moved to the stack ({})", site,
+                                    module.types.to_string(*sized_type))
+                      : std::format("{} moved to the stack ({} bytes)", site,
+                                    *bytes));
+  }
+}
+
+// Dominance frontiers as in Cooper, Harvey and Kennedy, "A Simple, Fast
+// Dominance Algorithm"
+void FunctionEscapes::compute_frontiers() {
+  idom = compute_dominators(fn);
+  children.assign(fn.blocks.size(), {});
+  frontier.assign(fn.blocks.size(), {});
+  reachable.assign(fn.blocks.size(), false);
+  for (auto block : reverse_postorder(fn))
+    reachable[block] = true;
+  for (BlockId b = 0; b < fn.blocks.size(); ++b) {
+    if (idom[b] != NONE)
+      children[idom[b]].push_back(b);
+    const auto &preds = fn.blocks[b].preds;
+    if (!reachable[b] || preds.size() < 2)
+      continue;
+    for (auto pred : preds) {
+      if (!reachable[pred])
+        continue;
+      for (auto runner = pred; runner != NONE && runner != idom[b];
+           runner = idom[runner])
+        frontier[runner].insert(b);
+    }
+  }
+}
+
+// Walks the dominator tree carrying the value the slot holds on entry to
+// each block, loads read it and stores replace it
+void FunctionEscapes::rename(ValueId slot, BlockId block, ValueId current) {
+  if (auto phi = phis.find(block); phi != phis.end())
+    current = phi->second;
+  for (auto id : fn.blocks[block].insts) {
+    const auto &inst = fn.insts[id];
+    if (inst.op == Opcode::Load && fn.operand(id, 0) == slot)
+      replacement[id] = current;
+    else if (inst.op == Opcode::Store && fn.operand(id, 0) == slot)
+      current = resolve(fn.operand(id, 1));
+  }
+  for (auto succ : fn.successors(block)) {
+    auto phi = phis.find(succ);
+    if (phi == phis.end())
+      continue;
+    const auto &preds = fn.blocks[succ].preds;
+    for (uint32_t i = 0; i < preds.size(); ++i) {
+      if (preds[i] == block)
+        fn.operand(phi->second, i) = current;
+    }
+  }
+  for (auto child : children[block])
+    rename(slot, child, current);
+}
+
+// Removes phis and zero values without uses, phis can keep each other alive
+void FunctionEscapes::remove_unused(std::vector<ValueId> candidates) {
+  auto uses = find_uses(fn);
+  std::vector<uint32_t> count(fn.insts.size());
+  for (ValueId id = 0; id < fn.insts.size(); ++id) {
+    count[id] = static_cast<uint32_t>(std::count_if(
+        uses[id].begin(), uses[id].end(),
+        [&](const Use &use) { return use.user != id; }));
+  }
+  while (!candidates.empty()) {
+    auto id = candidates.back();
+    candidates.pop_back();
+    if (fn.insts[id].block == NONE || count[id] > 0)
+      continue;
+    for (uint32_t i = 0; i < fn.insts[id].count; ++i) {
+      auto operand = fn.operand(id, i);
+      if (operand != id && --count[operand] == 0)
+        candidates.push_back(operand);
+    }
+    remove_inst(fn, id);
+  }
+}
+
+void FunctionEscapes::promote(ValueId slot,
+                              const std::vector<Use> &slot_uses) {
+  auto type = module.types[fn.insts[slot].type].pointee;
+  // Slots start out zeroed, which is what a load before any store reads
+  auto zero = fn.add(Inst{Opcode::Zero, type});
+  insert_after_params(fn, zero);
+
+  // Phis go to the iterated dominance frontier of the stores
+  phis.clear();
+  replacement.clear();
+  std::vector<BlockId> pending;
+  for (auto [user, index] : slot_uses) {
+    if (fn.insts[user].op == Opcode::Store)
+      pending.push_back(fn.insts[user].block);
+  }
+  while (!pending.empty()) {
+    auto block = pending.back();
+    pending.pop_back();
+    for (auto join : frontier[block]) {
+      if (phis.contains(join))
+        continue;
+      std::vector<ValueId> operands(fn.blocks[join].preds.size(), zero);
+      auto phi = fn.add(Inst{Opcode::Phi, type, join}, operands);
+      auto &list = fn.blocks[join].insts;
+      list.insert(list.begin(), phi);
+      phis[join] = phi;
+      pending.push_back(join);
+    }
+  }
+
+  rename(slot, 0, zero);
+  // Unreachable blocks never run, their loads just have to stay well formed
+  for (auto [user, index] : slot_uses) {
+    if (fn.insts[user].op == Opcode::Load && !reachable[fn.insts[user].block])
+      replacement[user] = zero;
+  }
+
+  for (auto &operand : fn.operands)
+    operand = resolve(operand);
+  for (auto [user, index] : slot_uses)
+    remove_inst(fn, user);
+  remove_inst(fn, slot);
+
+  std::vector<ValueId> created = {zero};
+  for (auto [block, phi] : phis)
+    created.push_back(phi);
+  remove_unused(created);
+}
+
+uint32_t FunctionEscapes::promote_slots() {
+  auto uses = find_uses(fn);
+  std::vector<ValueId> slots;
+  for (const auto &block : fn.blocks) {
+    for (auto id : block.insts) {
+      const auto &inst = fn.insts[id];
+      if (inst.op != Opcode::Alloca ||
+          module.types[inst.type].pointee == TypeTable::Void)
+        continue;
+      bool direct = std::all_of(
+          uses[id].begin(), uses[id].end(), [&](const Use &use) {
+            auto op = fn.insts[use.user].op;
+            return (op == Opcode::Load || op == Opcode::Store) &&
+                   use.index == 0;
+          });
+      if (direct)
+        slots.push_back(id);
+    }
+  }
+  if (slots.empty())
+    return 0;
+
+  // Promotion only adds phis and zero values, which leaves the CFG and with
+  // it the frontiers unchanged
+  compute_frontiers();
+  for (auto slot : slots)
+    promote(slot, find_uses(fn)[slot]);
+  return static_cast<uint32_t>(slots.size());
+}
+
+} // namespace
+
+void stack_allocate(Module &module, const PassOptions &options) {
+  spdlog::debug("[ir] Moving non-escaping memory to the stack");
+  EscapeAnalysis analysis(module);
+  for (auto &fn : module.functions) {
+    if (fn.kind != FunctionKind::Defined)
+      continue;
+    FunctionEscapes escapes(module, analysis, fn, options);
+    escapes.move_allocations_to_stack();
+    auto promoted = escapes.promote_slots();
+    if (promoted > 0) {
+      remark(options, "escape", fn,
+             std::format("promoted {} stack slot{} to registers", promoted,
+                         promoted == 1 ? "" : "s"));
+    }
+  }
+}
+
+} // namespace ir
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "ir.hpp"
+#include "passes.hpp"
+
+namespace ir {
+
+// Finds memory whose address never leaves the function that created it.
+// Calls to `malloc` with a small constant size whose result does not escape
+// become stack slots, and their `free` calls are dropped. Stack slots that
+// are only ever loaded from and stored to directly are promoted to SSA
+// values. A pointer escapes when it is stored to memory, returned, merged
+// by a phi or passed to a function that may keep it; defined functions are
+// summarized per parameter, externs are assumed to keep every pointer.
+void stack_allocate(Module &module, const PassOptions &options);
+
+} // namespace ir
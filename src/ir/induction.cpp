@@ -0,0 +1,165 @@
+#include "induction.hpp"
+#include <algorithm>
+
+namespace ir {
+
+namespace {
+
+std::optional<int64_t> int_constant(const Module &module, const Function &fn,
+                                    ValueId value) {
+  const auto &inst = fn.insts[value];
+  if (inst.op != Opcode::Const || inst.type != TypeTable::Int)
+    return std::nullopt;
+  return module.constants[inst.imm].integer;
+}
+
+// The relation with its operands swapped, `a < b` is `b > a`
+Opcode mirrored(Opcode op) {
+  switch (op) {
+  case Opcode::Lt:
+    return Opcode::Gt;
+  case Opcode::Gt:
+    return Opcode::Lt;
+  case Opcode::Le:
+    return Opcode::Ge;
+  default:
+    return Opcode::Le;
+  }
+}
+
+size_t position(const std::vector<BlockId> &blocks, BlockId block) {
+  return static_cast<size_t>(
+      std::find(blocks.begin(), blocks.end(), block) - blocks.begin());
+}
+
+} // namespace
+
+std::optional<CountedLoop> find_counted_loop(const Module &module,
+                                             const Function &fn,
+                                             const Loop &loop,
+                                             std::string &reason) {
+  if (loop.preheader == NONE) {
+    reason = "it has no preheader";
+    return std::nullopt;
+  }
+  if (loop.latches.size() != 1) {
+    reason = "it has more than one latch";
+    return std::nullopt;
+  }
+  auto exiting = loop.exiting_blocks(fn);
+  if (exiting.size() != 1 || exiting[0] != loop.header) {
+    reason = "it is left from a block other than the header";
+    return std::nullopt;
+  }
+
+  if (loop.blocks.size() < 2) {
+    reason = "it has no body";
+    return std::nullopt;
+  }
+  const auto &header = fn.blocks[loop.header];
+  auto branch = header.insts.back();
+  if (fn.insts[branch].op != Opcode::CondBr ||
+      !loop.contains[fn.insts[branch].imm]) {
+    reason = "the header does not enter the loop when its condition holds";
+    return std::nullopt;
+  }
+  auto condition = fn.operand(branch, 0);
+  bool only_phis = header.insts.size() >= 2 &&
+                   header.insts[header.insts.size() - 2] == condition;
+  for (size_t i = 0; only_phis && i + 2 < header.insts.size(); ++i)
+    only_phis = fn.insts[header.insts[i]].op == Opcode::Phi;
+  if (!only_phis) {
+    reason = "the header computes more than the loop condition";
+    return std::nullopt;
+  }
+
+  auto relation = fn.insts[condition].op;
+  if (relation != Opcode::Lt && relation != Opcode::Le &&
+      relation != Opcode::Gt && relation != Opcode::Ge) {
+    reason = "the condition is not an ordered comparison";
+    return std::nullopt;
+  }
+  auto is_header_phi = [&](ValueId value) {
+    return fn.insts[value].op == Opcode::Phi &&
+           fn.insts[value].block == loop.header &&
+           fn.insts[value].type == TypeTable::Int;
+  };
+  auto induction = fn.operand(condition, 0);
+  auto bound = fn.operand(condition, 1);
+  if (!is_header_phi(induction)) {
+    std::swap(induction, bound);
+    relation = mirrored(relation);
+  }
+  if (!is_header_phi(induction)) {
+    reason = "the condition does not test an int phi of the header";
+    return std::nullopt;
+  }
+  if (loop.contains[fn.insts[bound].block]) {
+    reason = "the bound changes inside the loop";
+    return std::nullopt;
+  }
+
+  // Unrolled copies of the body run without the header, they cannot read the
+  // condition it computed
+  for (auto block : loop.blocks) {
+    for (auto id : fn.blocks[block].insts) {
+      const auto &inst = fn.insts[id];
+      for (uint32_t i = 0; id != branch && i < inst.count; ++i) {
+        if (fn.operand(id, i) == condition) {
+          reason = "the loop condition is used inside the loop";
+          return std::nullopt;
+        }
+      }
+    }
+  }
+
+  auto latch = loop.latches[0];
+  auto next = fn.operand(
+      induction, static_cast<uint32_t>(position(header.preds, latch)));
+  const auto &update = fn.insts[next];
+  std::optional<int64_t> step;
+  if (update.op == Opcode::Add && fn.operand(next, 0) == induction)
+    step = int_constant(module, fn, fn.operand(next, 1));
+  else if (update.op == Opcode::Add && fn.operand(next, 1) == induction)
+    step = int_constant(module, fn, fn.operand(next, 0));
+  else if (update.op == Opcode::Sub && fn.operand(next, 0) == induction) {
+    if (auto amount = int_constant(module, fn, fn.operand(next, 1)))
+      step = -*amount;
+  }
+  if (!step || *step == 0 || *step > (1 << 20) || *step < -(1 << 20)) {
+    reason = "the induction variable is not stepped by a small constant";
+    return std::nullopt;
+  }
+  bool counts_up = relation == Opcode::Lt || relation == Opcode::Le;
+  if (counts_up != (*step > 0)) {
+    reason = "the induction variable steps away from the bound";
+    return std::nullopt;
+  }
+
+  auto start = fn.operand(
+      induction, static_cast<uint32_t>(position(header.preds, loop.preheader)));
+  return CountedLoop{induction,
+                     start,
+                     static_cast<int32_t>(*step),
+                     bound,
+                     relation,
+                     condition,
+                     fn.insts[branch].imm,
+                     latch};
+}
+
+std::optional<int64_t> trip_count(const Module &module, const Function &fn,
+                                  const CountedLoop &counted) {
+  auto start = int_constant(module, fn, counted.start);
+  auto bound = int_constant(module, fn, counted.bound);
+  if (!start || !bound)
+    return std::nullopt;
+  // Distance left to cover and the size of one step, both positive
+  int64_t distance = counted.step > 0 ? *bound - *start : *start - *bound;
+  int64_t step = counted.step > 0 ? counted.step : -int64_t{counted.step};
+  if (counted.relation == Opcode::Le || counted.relation == Opcode::Ge)
+    return distance < 0 ? 0 : distance / step + 1;
+  return distance <= 0 ? 0 : (distance + step - 1) / step;
+}
+
+} // namespace ir
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "ir.hpp"
+#include "loops.hpp"
+#include <optional>
+#include <string>
+
+namespace ir {
+
+// A loop shaped like `while i < n { ...; i = i + 1 }`: a header holding only
+// phis, one comparison and the branch on it, an induction variable stepped by
+// a constant on every trip, and a bound that does not change inside the loop.
+// The header is the only block leaving the loop.
+struct CountedLoop {
+  ValueId induction; // Phi in the header
+  ValueId start;     // Value of the induction variable on entry
+  int32_t step;
+  ValueId bound;
+  // The loop runs while `induction <relation> bound`, one of Lt, Le, Gt, Ge
+  Opcode relation;
+  ValueId condition; // The comparison in the header
+  BlockId body;      // Successor of the header inside the loop
+  BlockId latch;
+};
+
+// Recognizes a counted loop, `reason` says why not when it returns nullopt
+std::optional<CountedLoop> find_counted_loop(const Module &module,
+                                             const Function &fn,
+                                             const Loop &loop,
+                                             std::string &reason);
+
+// Number of trips when the start and the bound are constants
+std::optional<int64_t> trip_count(const Module &module, const Function &fn,
+                                  const CountedLoop &counted);
+
+} // namespace ir
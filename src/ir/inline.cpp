@@ -0,0 +1,291 @@
+#include "inline.hpp"
+#include <algorithm>
+#include <format>
+#include <spdlog/spdlog.h>
+
+namespace ir {
+
+namespace {
+
+// Defined functions called by each function, builtins and externs are leaves
+std::vector<std::vector<FunctionId>> call_graph(const Module &module) {
+  std::vector<std::vector<FunctionId>> callees(module.functions.size());
+  for (FunctionId f = 0; f < module.functions.size(); ++f) {
+    const auto &fn = module.functions[f];
+    for (const auto &block : fn.blocks) {
+      for (auto id : block.insts) {
+        const auto &inst = fn.insts[id];
+        if (inst.op == Opcode::Call &&
+            module.functions[inst.imm].kind == FunctionKind::Defined) {
+          callees[f].push_back(inst.imm);
+        }
+      }
+    }
+  }
+  return callees;
+}
+
+// Tarjan's algorithm, components are found callees first
+class ComponentFinder {
+public:
+  explicit ComponentFinder(const std::vector<std::vector<FunctionId>> &graph)
+      : graph(graph), index(graph.size(), NONE), low(graph.size(), 0),
+        on_stack(graph.size(), false) {}
+
+  std::vector<std::vector<FunctionId>> run() {
+    for (FunctionId f = 0; f < graph.size(); ++f) {
+      if (index[f] == NONE)
+        visit(f);
+    }
+    return components;
+  }
+
+private:
+  const std::vector<std::vector<FunctionId>> &graph;
+  std::vector<uint32_t> index;
+  std::vector<uint32_t> low;
+  std::vector<bool> on_stack;
+  std::vector<FunctionId> stack;
+  std::vector<std::vector<FunctionId>> components;
+  uint32_t counter = 0;
+
+  void visit(FunctionId f) {
+    index[f] = low[f] = counter++;
+    stack.push_back(f);
+    on_stack[f] = true;
+    for (auto callee : graph[f]) {
+      if (index[callee] == NONE) {
+        visit(callee);
+        low[f] = std::min(low[f], low[callee]);
+      } else if (on_stack[callee]) {
+        low[f] = std::min(low[f], index[callee]);
+      }
+    }
+    if (low[f] != index[f])
+      return;
+    auto &component = components.emplace_back();
+    FunctionId member;
+    do {
+      member = stack.back();
+      stack.pop_back();
+      on_stack[member] = false;
+      component.push_back(member);
+    } while (member != f);
+  }
+};
+
+// Size estimate of a function body. Parameters and phis are free, they become
+// the call arguments and the copies that already exist at the call site.
+uint32_t inline_cost(const Function &fn) {
+  uint32_t cost = 0;
+  for (const auto &block : fn.blocks) {
+    for (auto id : block.insts) {
+      auto op = fn.insts[id].op;
+      if (op != Opcode::Param && op != Opcode::Phi)
+        ++cost;
+    }
+  }
+  return cost;
+}
+
+class Inliner {
+public:
+  Inliner(Module &module, const PassOptions &options)
+      : module(module), options(options) {}
+
+  void run();
+
+private:
+  Module &module;
+  const PassOptions &options;
+  std::vector<bool> recursive;
+
+  bool should_inline(const Function &caller, FunctionId target);
+  void inline_call(Function &caller, const Function &callee, ValueId call);
+};
+
+bool Inliner::should_inline(const Function &caller, FunctionId target) {
+  const auto &callee = module.functions[target];
+  if (recursive[target]) {
+    remark(options, "inline", caller,
+           std::format("not inlining '{}': it is recursive", callee.name));
+    return false;
+  }
+  if (!callee.blocks[0].preds.empty()) {
+    remark(options, "inline", caller,
+           std::format("not inlining '{}': its entry block is a loop header",
+                       callee.name));
+    return false;
+  }
+  auto cost = inline_cost(callee);
+  if (cost > options.inline_threshold) {
+    remark(options, "inline", caller,
+           std::format("not inlining '{}': cost {} exceeds threshold {}",
+                       callee.name, cost, options.inline_threshold));
+    return false;
+  }
+  remark(options, "inline", caller,
+         std::format("inlined '{}' (cost {}, threshold {})", callee.name, cost,
+                     options.inline_threshold));
+  return true;
+}
+
+// Splits the block at the call, copies the callee's blocks in between the two
+// halves and turns its returns into branches to the second half
+void Inliner::inline_call(Function &caller, const Function &callee,
+                          ValueId call) {
+  auto block = caller.insts[call].block;
+  std::vector<ValueId> args(
+      caller.operands.begin() + caller.insts[call].first,
+      caller.operands.begin() + caller.insts[call].first +
+          caller.insts[call].count);
+
+  // Everything after the call moves to a continuation block, which takes over
+  // the block's place as predecessor of its successors
+  auto continuation = caller.add_block();
+  auto &insts = caller.blocks[block].insts;
+  auto position = std::find(insts.begin(), insts.end(), call);
+  caller.blocks[continuation].insts.assign(position + 1, insts.end());
+  insts.erase(position, insts.end());
+  caller.insts[call].block = NONE;
+  for (auto id : caller.blocks[continuation].insts)
+    caller.insts[id].block = continuation;
+  for (auto succ : caller.successors(continuation)) {
+    for (auto &pred : caller.blocks[succ].preds) {
+      if (pred == block)
+        pred = continuation;
+    }
+  }
+
+  std::vector<BlockId> block_map(callee.blocks.size());
+  for (auto &target : block_map)
+    target = caller.add_block();
+
+  // Values are numbered before they are copied, phis can refer to values
+  // defined further down
+  std::vector<ValueId> value_map(callee.insts.size(), NONE);
+  auto next = static_cast<ValueId>(caller.insts.size());
+  for (const auto &callee_block : callee.blocks) {
+    for (auto id : callee_block.insts) {
+      const auto &inst = callee.insts[id];
+      value_map[id] = inst.op == Opcode::Param ? args[inst.imm] : next++;
+    }
+  }
+
+  std::vector<BlockId> return_blocks;
+  std::vector<ValueId> return_values;
+  std::vector<ValueId> allocas;
+  for (BlockId b = 0; b < callee.blocks.size(); ++b) {
+    for (auto id : callee.blocks[b].insts) {
+      auto inst = callee.insts[id];
+      if (inst.op == Opcode::Param)
+        continue;
+      std::vector<ValueId> operands;
+      for (uint32_t i = 0; i < inst.count; ++i)
+        operands.push_back(value_map[callee.operand(id, i)]);
+      inst.block = block_map[b];
+      if (inst.op == Opcode::Br) {
+        inst.imm = block_map[inst.imm];
+      } else if (inst.op == Opcode::CondBr) {
+        inst.imm = block_map[inst.imm];
+        inst.imm2 = block_map[inst.imm2];
+      } else if (inst.op == Opcode::Ret) {
+        return_blocks.push_back(inst.block);
+        if (!operands.empty())
+          return_values.push_back(operands[0]);
+        inst = Inst{Opcode::Br, TypeTable::Void, inst.block, 0, 0,
+                    continuation};
+        operands.clear();
+      } else if (inst.op == Opcode::Alloca) {
+        // Stack slots go to the caller's entry block so that inlining into a
+        // loop does not allocate once per iteration
+        inst.block = 0;
+      }
+      auto copy = caller.add(inst, operands);
+      if (inst.op == Opcode::Alloca) {
+        allocas.push_back(copy);
+      } else {
+        caller.blocks[inst.block].insts.push_back(copy);
+      }
+    }
+    for (auto pred : callee.blocks[b].preds)
+      caller.blocks[block_map[b]].preds.push_back(block_map[pred]);
+  }
+
+  auto &entry = caller.blocks[0].insts;
+  auto after_params = std::find_if(entry.begin(), entry.end(), [&](ValueId id) {
+    return caller.insts[id].op != Opcode::Param;
+  });
+  entry.insert(after_params, allocas.begin(), allocas.end());
+
+  caller.append(block, Inst{Opcode::Br, TypeTable::Void, NONE, 0, 0,
+                            block_map[0]});
+  caller.blocks[block_map[0]].preds.push_back(block);
+  caller.blocks[continuation].preds = return_blocks;
+
+  auto type = caller.insts[call].type;
+  if (type == TypeTable::Void)
+    return;
+  ValueId result;
+  if (return_values.size() == 1) {
+    result = return_values[0];
+  } else {
+    // No returns at all leaves the continuation unreachable, the zero value
+    // only keeps the uses of the call well formed
+    auto op = return_values.empty() ? Opcode::Zero : Opcode::Phi;
+    result = caller.add(Inst{op, type, continuation}, return_values);
+    auto &list = caller.blocks[continuation].insts;
+    list.insert(list.begin(), result);
+  }
+  for (auto &operand : caller.operands) {
+    if (operand == call)
+      operand = result;
+  }
+}
+
+void Inliner::run() {
+  auto graph = call_graph(module);
+  auto components = ComponentFinder(graph).run();
+
+  recursive.assign(module.functions.size(), false);
+  for (const auto &component : components) {
+    for (auto f : component) {
+      recursive[f] =
+          component.size() > 1 ||
+          std::find(graph[f].begin(), graph[f].end(), f) != graph[f].end();
+    }
+  }
+
+  for (const auto &component : components) {
+    for (auto f : component) {
+      auto &caller = module.functions[f];
+      if (caller.kind != FunctionKind::Defined)
+        continue;
+      // Blocks added by inlining are visited too, they hold the rest of the
+      // split block and the copied body
+      for (BlockId b = 0; b < caller.blocks.size(); ++b) {
+        for (size_t i = 0; i < caller.blocks[b].insts.size(); ++i) {
+          auto id = caller.blocks[b].insts[i];
+          const auto &inst = caller.insts[id];
+          if (inst.op != Opcode::Call ||
+              module.functions[inst.imm].kind != FunctionKind::Defined) {
+            continue;
+          }
+          if (should_inline(caller, inst.imm)) {
+            inline_call(caller, module.functions[inst.imm], id);
+            break;
+          }
+        }
+      }
+    }
+  }
+}
+
+} // namespace
+
+void inline_functions(Module &module, const PassOptions &options) {
+  spdlog::debug("[ir] Inlining with threshold {}", options.inline_threshold);
+  Inliner(module, options).run();
+}
+
+} // namespace ir
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "ir.hpp"
+#include "passes.hpp"
+
+namespace ir {
+
+// Copies the bodies of small non-recursive functions into their callers.
+// Functions are visited callees first, so a caller sees its callees after
+// their own calls were inlined and their size already accounts for that.
+// Functions that are part of a cycle in the call graph are never inlined.
+void inline_functions(Module &module, const PassOptions &options);
+
+} // namespace ir
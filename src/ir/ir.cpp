@@ -0,0 +1,301 @@
+#include "ir.hpp"
+#include <algorithm>
+#include <format>
+#include <functional>
+
+namespace ir {
+
+TypeTable::TypeTable() {
+  // Order matches the constants in the header
+  for (auto kind : {TypeKind::Void, TypeKind::Bool, TypeKind::Char,
+                    TypeKind::Int, TypeKind::Float, TypeKind::String}) {
+    types.push_back(IRType{kind});
+  }
+}
+
+TypeId TypeTable::pointer_to(TypeId pointee) {
+  for (TypeId id = 0; id < types.size(); ++id) {
+    if (types[id].kind == TypeKind::Pointer && types[id].pointee == pointee)
+      return id;
+  }
+  types.push_back(IRType{TypeKind::Pointer, pointee});
+  return static_cast<TypeId>(types.size() - 1);
+}
+
+TypeId TypeTable::vector_of(TypeId lane) {
+  for (TypeId id = 0; id < types.size(); ++id) {
+    if (types[id].kind == TypeKind::Vector && types[id].pointee == lane)
+      return id;
+  }
+  types.push_back(IRType{TypeKind::Vector, lane});
+  return static_cast<TypeId>(types.size() - 1);
+}
+
+TypeId TypeTable::named(TypeKind kind, const std::string &name) {
+  for (TypeId id = 0; id < types.size(); ++id) {
+    if (types[id].kind == kind && types[id].name == name)
+      return id;
+  }
+  types.push_back(IRType{kind, NONE, name});
+  return static_cast<TypeId>(types.size() - 1);
+}
+
+std::string TypeTable::to_string(TypeId id) const {
+  const auto &type = types[id];
+  switch (type.kind) {
+  case TypeKind::Void:
+    return "void";
+  case TypeKind::Bool:
+    return "bool";
+  case TypeKind::Char:
+    return "char";
+  case TypeKind::Int:
+    return "int";
+  case TypeKind::Float:
+    return "float";
+  case TypeKind::String:
+    return "string";
+  case TypeKind::Pointer:
+    return "&" + to_string(type.pointee);
+  case TypeKind::Struct:
+  case TypeKind::Enum:
+    return type.name;
+  case TypeKind::Vector:
+    return std::format("<{} x {}>", vector_lanes, to_string(type.pointee));
+  }
+  return "?";
+}
+
+bool is_terminator(Opcode op) {
+  return op == Opcode::Br || op == Opcode::CondBr || op == Opcode::Ret;
+}
+
+bool is_binary(Opcode op) {
+  return op >= Opcode::Add && op <= Opcode::Ge;
+}
+
+bool is_comparison(Opcode op) {
+  return op >= Opcode::Eq && op <= Opcode::Ge;
+}
+
+bool has_side_effects(Opcode op) {
+  switch (op) {
+  case Opcode::Store:
+  case Opcode::VecStore:
+  case Opcode::Call:
+  case Opcode::Br:
+  case Opcode::CondBr:
+  case Opcode::Ret:
+    return true;
+  default:
+    return false;
+  }
+}
+
+const char *opcode_name(Opcode op) {
+  switch (op) {
+  case Opcode::Const:
+    return "const";
+  case Opcode::Zero:
+    return "zero";
+  case Opcode::Param:
+    return "param";
+  case Opcode::Add:
+    return "add";
+  case Opcode::Sub:
+    return "sub";
+  case Opcode::Mul:
+    return "mul";
+  case Opcode::Div:
+    return "div";
+  case Opcode::Mod:
+    return "mod";
+  case Opcode::Shl:
+    return "shl";
+  case Opcode::Shr:
+    return "shr";
+  case Opcode::And:
+    return "and";
+  case Opcode::Or:
+    return "or";
+  case Opcode::MulHigh:
+    return "mulhigh";
+  case Opcode::Eq:
+    return "eq";
+  case Opcode::Ne:
+    return "ne";
+  case Opcode::Lt:
+    return "lt";
+  case Opcode::Gt:
+    return "gt";
+  case Opcode::Le:
+    return "le";
+  case Opcode::Ge:
+    return "ge";
+  case Opcode::Alloca:
+    return "alloca";
+  case Opcode::Load:
+    return "load";
+  case Opcode::Store:
+    return "store";
+  case Opcode::FieldAddr:
+    return "fieldaddr";
+  case Opcode::ElementAddr:
+    return "elementaddr";
+  case Opcode::Field:
+    return "field";
+  case Opcode::MakeStruct:
+    return "struct";
+  case Opcode::Bitcast:
+    return "bitcast";
+  case Opcode::SizeOf:
+    return "sizeof";
+  case Opcode::VecLoad:
+    return "vecload";
+  case Opcode::VecStore:
+    return "vecstore";
+  case Opcode::Splat:
+    return "splat";
+  case Opcode::ReduceAdd:
+    return "reduceadd";
+  case Opcode::Call:
+    return "call";
+  case Opcode::Phi:
+    return "phi";
+  case Opcode::Br:
+    return "br";
+  case Opcode::CondBr:
+    return "condbr";
+  case Opcode::Ret:
+    return "ret";
+  }
+  return "?";
+}
+
+ValueId Function::add(Inst inst, const std::vector<ValueId> &args) {
+  inst.first = static_cast<uint32_t>(operands.size());
+  inst.count = static_cast<uint32_t>(args.size());
+  operands.insert(operands.end(), args.begin(), args.end());
+  insts.push_back(inst);
+  return static_cast<ValueId>(insts.size() - 1);
+}
+
+ValueId Function::append(BlockId block, Inst inst,
+                         const std::vector<ValueId> &args) {
+  inst.block = block;
+  auto id = add(inst, args);
+  blocks[block].insts.push_back(id);
+  return id;
+}
+
+BlockId Function::add_block() {
+  blocks.emplace_back();
+  return static_cast<BlockId>(blocks.size() - 1);
+}
+
+std::vector<BlockId> Function::successors(BlockId block) const {
+  const auto &list = blocks[block].insts;
+  if (list.empty())
+    return {};
+  const auto &last = insts[list.back()];
+  switch (last.op) {
+  case Opcode::Br:
+    return {last.imm};
+  case Opcode::CondBr:
+    return {last.imm, last.imm2};
+  default:
+    return {};
+  }
+}
+
+FunctionId Module::find_function(const std::string &name) const {
+  for (FunctionId id = 0; id < functions.size(); ++id) {
+    if (functions[id].name == name)
+      return id;
+  }
+  return NONE;
+}
+
+uint32_t Module::add_constant(Constant constant) {
+  constants.push_back(std::move(constant));
+  return static_cast<uint32_t>(constants.size() - 1);
+}
+
+std::vector<BlockId> reverse_postorder(const Function &fn) {
+  std::vector<BlockId> order;
+  if (fn.blocks.empty())
+    return order;
+  std::vector<bool> visited(fn.blocks.size(), false);
+  // Iterative DFS, the stack holds a block and its next successor to visit
+  std::vector<std::pair<BlockId, size_t>> stack{{0, 0}};
+  visited[0] = true;
+  while (!stack.empty()) {
+    auto &[block, next] = stack.back();
+    auto succs = fn.successors(block);
+    if (next < succs.size()) {
+      auto succ = succs[next++];
+      if (!visited[succ]) {
+        visited[succ] = true;
+        stack.push_back({succ, 0});
+      }
+      continue;
+    }
+    order.push_back(block);
+    stack.pop_back();
+  }
+  std::reverse(order.begin(), order.end());
+  return order;
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+std::vector<BlockId> compute_dominators(const Function &fn) {
+  std::vector<BlockId> idom(fn.blocks.size(), NONE);
+  auto order = reverse_postorder(fn);
+  if (order.empty())
+    return idom;
+  std::vector<uint32_t> position(fn.blocks.size(), NONE);
+  for (uint32_t i = 0; i < order.size(); ++i)
+    position[order[i]] = i;
+
+  auto intersect = [&](BlockId a, BlockId b) {
+    while (a != b) {
+      while (position[a] > position[b])
+        a = idom[a];
+      while (position[b] > position[a])
+        b = idom[b];
+    }
+    return a;
+  };
+
+  idom[0] = 0;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 1; i < order.size(); ++i) {
+      auto block = order[i];
+      BlockId new_idom = NONE;
+      for (auto pred : fn.blocks[block].preds) {
+        if (idom[pred] == NONE)
+          continue;
+        new_idom = new_idom == NONE ? pred : intersect(pred, new_idom);
+      }
+      if (new_idom != idom[block]) {
+        idom[block] = new_idom;
+        changed = true;
+      }
+    }
+  }
+  idom[0] = NONE;
+  return idom;
+}
+
+bool dominates(const std::vector<BlockId> &idom, BlockId a, BlockId b) {
+  while (b != NONE) {
+    if (a == b)
+      return true;
+    b = idom[b];
+  }
+  return false;
+}
+
+} // namespace ir
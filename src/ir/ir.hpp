@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Mid-level SSA IR sitting between the typechecker and the backends. A
+// Function owns flat vectors of instructions, operands and blocks, and
+// everything refers to everything else through 32 bit indices into those
+// vectors rather than through pointers, so the IR is cheap to build, copy and
+// walk. Instructions only become part of the program when a block lists them,
+// passes drop an instruction by removing it from its block.
+
+namespace ir {
+
+using TypeId = uint32_t;
+using ValueId = uint32_t;
+using BlockId = uint32_t;
+using FunctionId = uint32_t;
+
+constexpr uint32_t NONE = UINT32_MAX;
+
+enum class TypeKind : uint8_t {
+  Void,
+  Bool,
+  Char,
+  Int,
+  Float,
+  String,
+  Pointer,
+  Struct,
+  Enum,
+  Vector, // `vector_lanes` ints or floats, made by the vectorizer
+};
+
+// Lanes in every vector type, four 32 bit lanes fill a 128 bit register
+constexpr uint32_t vector_lanes = 4;
+
+struct IRType {
+  TypeKind kind;
+  TypeId pointee = NONE;          // Pointer, and the lane type of a Vector
+  std::string name;               // Struct and Enum
+  std::vector<TypeId> fields;     // Struct
+  std::vector<std::string> names; // Struct field or Enum member names
+};
+
+// Types are interned, so two TypeIds are equal exactly when the types are
+struct TypeTable {
+  // The primitive types always sit at these indices
+  static constexpr TypeId Void = 0;
+  static constexpr TypeId Bool = 1;
+  static constexpr TypeId Char = 2;
+  static constexpr TypeId Int = 3;
+  static constexpr TypeId Float = 4;
+  static constexpr TypeId String = 5;
+
+  std::vector<IRType> types;
+
+  TypeTable();
+  TypeId pointer_to(TypeId pointee);
+  TypeId vector_of(TypeId lane);
+  // Structs and enums are identified by name. A struct is declared first and
+  // its fields filled in afterwards, so it can point to itself.
+  TypeId named(TypeKind kind, const std::string &name);
+  const IRType &operator[](TypeId id) const { return types[id]; }
+  IRType &operator[](TypeId id) { return types[id]; }
+  std::string to_string(TypeId id) const;
+};
+
+enum class Opcode : uint8_t {
+  Const,      // imm: index into Module::constants
+  Zero,       // The zero value of the result type
+  Param,      // imm: parameter index
+  Add,        // a + b, also used for the other arithmetic ops below
+  Sub,
+  Mul,
+  Div,
+  Mod,
+  Shl,        // a << b, wrapping
+  Shr,        // a >> b, filling with the sign bit
+  And,        // a & b
+  Or,         // a | b
+  MulHigh,    // High 32 bits of the 64 bit product a * b
+  Eq,         // Comparisons produce a Bool
+  Ne,
+  Lt,
+  Gt,
+  Le,
+  Ge,
+  Alloca,     // A stack slot for the pointee of the result type, or of imm
+              // bytes when the result is a void pointer
+  Load,       // *a
+  Store,      // *a = b
+  FieldAddr,  // &a->field[imm]
+  ElementAddr, // &a[b], the element b places after the one a points to
+  Field,      // a.field[imm] of a struct value
+  MakeStruct, // Struct value from one operand per field
+  Bitcast,    // Pointer a reinterpreted as the result pointer type
+  SizeOf,     // imm: TypeId, result is Int
+  // Vector instructions, binary ops on vectors work lane by lane
+  VecLoad,    // The vector of the elements starting at a, unaligned
+  VecStore,   // Stores the lanes of vector b to the elements starting at a
+  Splat,      // A vector with a in every lane
+  ReduceAdd,  // Sum of the lanes of vector a
+  Call,       // imm: FunctionId of the callee, operands are the arguments
+  Phi,        // One operand per predecessor, in the order of BasicBlock::preds
+  // Terminators
+  Br,         // imm: target block
+  CondBr,     // a ? imm : imm2
+  Ret,        // Optional operand
+};
+
+bool is_terminator(Opcode op);
+bool is_binary(Opcode op);
+bool is_comparison(Opcode op);
+// Whether an instruction can be removed when its result is unused
+bool has_side_effects(Opcode op);
+const char *opcode_name(Opcode op);
+
+struct Inst {
+  Opcode op;
+  TypeId type = TypeTable::Void; // Result type, Void if there is no result
+  BlockId block = NONE;          // The block listing the instruction
+  uint32_t first = 0;            // First operand in Function::operands
+  uint32_t count = 0;            // Number of operands
+  uint32_t imm = 0;
+  uint32_t imm2 = 0;
+};
+
+struct BasicBlock {
+  std::vector<ValueId> insts; // Phis first, a terminator last
+  std::vector<BlockId> preds;
+  // Header of a loop that steps an induction variable towards a fixed bound,
+  // see induction.hpp. Backends may assume the loop usually continues.
+  bool counted_loop = false;
+};
+
+// Literal value of a Const instruction. Integers, bools, chars and enum
+// members use `integer`, floats `real` and strings `text`, which holds the
+// literal as written in the source (escapes included).
+struct Constant {
+  TypeId type;
+  int64_t integer = 0;
+  double real = 0;
+  std::string text;
+};
+
+enum class FunctionKind : uint8_t {
+  Defined,
+  Extern,  // Resolved by the linker, e.g. malloc from libc
+  Builtin, // print, eprint and flush, provided by the runtime
+};
+
+struct Function {
+  std::string name;
+  FunctionKind kind = FunctionKind::Defined;
+  TypeId return_type = TypeTable::Void;
+  std::vector<TypeId> params;
+  std::vector<std::string> param_names;
+  bool variadic = false;     // Builtins accept any arguments
+  std::string module_path;   // Externs: the `from "..."` part
+  // No side effects and no memory reads, so calls with equal arguments give
+  // equal results. Set by `@pure` on externs and by compute_purity().
+  bool pure = false;
+
+  std::vector<Inst> insts;
+  std::vector<ValueId> operands;
+  std::vector<BasicBlock> blocks; // blocks[0] is the entry
+
+  ValueId operand(ValueId inst, uint32_t index) const {
+    return operands[insts[inst].first + index];
+  }
+  ValueId &operand(ValueId inst, uint32_t index) {
+    return operands[insts[inst].first + index];
+  }
+  // Appends an instruction that is not yet part of any block
+  ValueId add(Inst inst, const std::vector<ValueId> &args = {});
+  // Appends an instruction to the end of a block
+  ValueId append(BlockId block, Inst inst,
+                 const std::vector<ValueId> &args = {});
+  BlockId add_block();
+  std::vector<BlockId> successors(BlockId block) const;
+};
+
+struct Module {
+  TypeTable types;
+  std::vector<Constant> constants;
+  std::vector<Function> functions;
+
+  FunctionId find_function(const std::string &name) const;
+  uint32_t add_constant(Constant constant);
+};
+
+// Immediate dominator of every block, NONE for the entry and for blocks that
+// are unreachable from it
+std::vector<BlockId> compute_dominators(const Function &fn);
+bool dominates(const std::vector<BlockId> &idom, BlockId a, BlockId b);
+// Blocks reachable from the entry in reverse postorder
+std::vector<BlockId> reverse_postorder(const Function &fn);
+
+} // namespace ir
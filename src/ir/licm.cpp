@@ -0,0 +1,175 @@
+#include "licm.hpp"
+#include "loops.hpp"
+#include <algorithm>
+#include <format>
+#include <map>
+#include <spdlog/spdlog.h>
+
+namespace ir {
+
+namespace {
+
+// Instructions that can run even when the original program would not have
+// run them, they neither trap nor have effects
+bool is_speculatable(Opcode op) {
+  switch (op) {
+  case Opcode::Const:
+  case Opcode::Zero:
+  case Opcode::Add:
+  case Opcode::Sub:
+  case Opcode::Mul:
+  case Opcode::Shl:
+  case Opcode::Shr:
+  case Opcode::And:
+  case Opcode::Or:
+  case Opcode::MulHigh:
+  case Opcode::FieldAddr:
+  case Opcode::ElementAddr:
+  case Opcode::Field:
+  case Opcode::MakeStruct:
+  case Opcode::Bitcast:
+  case Opcode::SizeOf:
+    return true;
+  default:
+    return is_comparison(op);
+  }
+}
+
+class LoopHoister {
+public:
+  LoopHoister(const Module &module, Function &fn,
+              const std::vector<BlockId> &idom, const Loop &loop)
+      : module(module), fn(fn), idom(idom), loop(loop) {}
+
+  // Returns the number of hoisted instructions per opcode
+  std::map<std::string, uint32_t> run();
+
+private:
+  const Module &module;
+  Function &fn;
+  const std::vector<BlockId> &idom;
+  const Loop &loop;
+  bool writes_memory = false;
+  std::vector<BlockId> exits;
+
+  bool is_impure_call(const Inst &inst) const {
+    return inst.op == Opcode::Call && !module.functions[inst.imm].pure;
+  }
+  bool runs_when_entered(BlockId block) const {
+    return std::all_of(exits.begin(), exits.end(), [&](BlockId exit) {
+      return dominates(idom, block, exit);
+    });
+  }
+  // Stack slots and their fields can always be read, a load from them cannot
+  // fault wherever it runs
+  bool is_stack_address(ValueId address) const {
+    while (fn.insts[address].op == Opcode::FieldAddr)
+      address = fn.operand(address, 0);
+    return fn.insts[address].op == Opcode::Alloca;
+  }
+  bool is_invariant(ValueId id) const;
+  void hoist(ValueId id);
+};
+
+bool LoopHoister::is_invariant(ValueId id) const {
+  const auto &inst = fn.insts[id];
+  switch (inst.op) {
+  case Opcode::Param:
+  case Opcode::Phi:
+  case Opcode::Alloca:
+  case Opcode::Store:
+    return false;
+  case Opcode::Load:
+    if (writes_memory)
+      return false;
+    break;
+  case Opcode::Call:
+    if (is_impure_call(inst))
+      return false;
+    break;
+  default:
+    if (is_terminator(inst.op))
+      return false;
+    break;
+  }
+  for (uint32_t i = 0; i < inst.count; ++i) {
+    if (loop.contains[fn.insts[fn.operand(id, i)].block])
+      return false;
+  }
+  if (inst.op == Opcode::Load && is_stack_address(fn.operand(id, 0)))
+    return true;
+  return is_speculatable(inst.op) || runs_when_entered(inst.block);
+}
+
+// Moves the instruction in front of the preheader's branch to the header
+void LoopHoister::hoist(ValueId id) {
+  auto &source = fn.blocks[fn.insts[id].block].insts;
+  source.erase(std::find(source.begin(), source.end(), id));
+  auto &target = fn.blocks[loop.preheader].insts;
+  target.insert(target.end() - 1, id);
+  fn.insts[id].block = loop.preheader;
+}
+
+std::map<std::string, uint32_t> LoopHoister::run() {
+  for (auto block : loop.blocks) {
+    for (auto id : fn.blocks[block].insts) {
+      const auto &inst = fn.insts[id];
+      if (inst.op == Opcode::Store || is_impure_call(inst))
+        writes_memory = true;
+    }
+  }
+  exits = loop.exiting_blocks(fn);
+
+  std::map<std::string, uint32_t> hoisted;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto block : loop.blocks) {
+      // Copied, hoisting removes from the block's list
+      auto insts = fn.blocks[block].insts;
+      for (auto id : insts) {
+        if (!is_invariant(id))
+          continue;
+        hoist(id);
+        ++hoisted[opcode_name(fn.insts[id].op)];
+        changed = true;
+      }
+    }
+  }
+  return hoisted;
+}
+
+} // namespace
+
+void hoist_loop_invariants(Module &module, const PassOptions &options) {
+  spdlog::debug("[ir] Hoisting loop invariant code");
+  for (auto &fn : module.functions) {
+    if (fn.kind != FunctionKind::Defined)
+      continue;
+    auto idom = compute_dominators(fn);
+    for (const auto &loop : find_loops(fn, idom)) {
+      if (loop.preheader == NONE) {
+        remark(options, "licm", fn,
+               std::format("loop at bb{} has no preheader, nothing hoisted",
+                           loop.header));
+        continue;
+      }
+      auto hoisted = LoopHoister(module, fn, idom, loop).run();
+      if (hoisted.empty())
+        continue;
+      uint32_t total = 0;
+      std::string details;
+      for (const auto &[name, count] : hoisted) {
+        total += count;
+        details += std::format("{}{} {}", details.empty() ? "" : ", ", count,
+                               name);
+      }
+      remark(options, "licm", fn,
+             std::format("hoisted {} instruction{} out of the loop at bb{} "
+                         "({})",
+                         total, total == 1 ? "" : "s", loop.header, details));
+    }
+  }
+}
+
+} // namespace ir
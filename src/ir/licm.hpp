@@ -0,0 +1,16 @@
+#pragma once
+
+#include "ir.hpp"
+#include "passes.hpp"
+
+namespace ir {
+
+// Moves instructions whose operands do not change inside a loop to the loop's
+// preheader, inner loops first so values can move out of a whole nest.
+// Instructions that may trap or never return (division, loads and calls) are
+// only moved from blocks that dominate every exit of the loop, which run
+// whenever the loop is entered, except loads from stack slots. Loads move
+// only out of loops that do not write memory at all.
+void hoist_loop_invariants(Module &module, const PassOptions &options);
+
+} // namespace ir
@@ -0,0 +1,71 @@
+#include "loops.hpp"
+#include <algorithm>
+
+namespace ir {
+
+std::vector<BlockId> Loop::exiting_blocks(const Function &fn) const {
+  std::vector<BlockId> exiting;
+  for (auto block : blocks) {
+    for (auto succ : fn.successors(block)) {
+      if (!contains[succ]) {
+        exiting.push_back(block);
+        break;
+      }
+    }
+  }
+  return exiting;
+}
+
+std::vector<Loop> find_loops(const Function &fn,
+                             const std::vector<BlockId> &idom) {
+  std::vector<Loop> loops;
+  for (auto block : reverse_postorder(fn)) {
+    for (auto succ : fn.successors(block)) {
+      if (!dominates(idom, succ, block))
+        continue;
+      // A back edge, loops sharing a header are merged into one
+      auto loop = std::find_if(loops.begin(), loops.end(),
+                               [&](const Loop &l) { return l.header == succ; });
+      if (loop == loops.end()) {
+        loop = loops.insert(loops.end(), Loop{succ});
+        loop->contains.assign(fn.blocks.size(), false);
+        loop->contains[succ] = true;
+        loop->blocks.push_back(succ);
+      }
+      loop->latches.push_back(block);
+      // Everything that reaches the latch without passing the header
+      std::vector<BlockId> worklist{block};
+      while (!worklist.empty()) {
+        auto current = worklist.back();
+        worklist.pop_back();
+        if (loop->contains[current])
+          continue;
+        loop->contains[current] = true;
+        loop->blocks.push_back(current);
+        for (auto pred : fn.blocks[current].preds)
+          worklist.push_back(pred);
+      }
+    }
+  }
+
+  for (auto &loop : loops) {
+    BlockId outside = NONE;
+    size_t outside_count = 0;
+    for (auto pred : fn.blocks[loop.header].preds) {
+      if (!loop.contains[pred]) {
+        outside = pred;
+        ++outside_count;
+      }
+    }
+    if (outside_count == 1 && fn.successors(outside).size() == 1)
+      loop.preheader = outside;
+  }
+
+  std::stable_sort(loops.begin(), loops.end(),
+                   [](const Loop &a, const Loop &b) {
+                     return a.blocks.size() < b.blocks.size();
+                   });
+  return loops;
+}
+
+} // namespace ir
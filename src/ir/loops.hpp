@@ -0,0 +1,27 @@
+#pragma once
+
+#include "ir.hpp"
+#include <vector>
+
+namespace ir {
+
+// A natural loop: the header dominates every block of the loop, and each
+// latch branches back to the header
+struct Loop {
+  BlockId header;
+  // The single block outside the loop that branches to the header and
+  // nowhere else, NONE when the loop has no such block
+  BlockId preheader = NONE;
+  std::vector<BlockId> blocks; // Header first
+  std::vector<BlockId> latches;
+  std::vector<bool> contains;  // Indexed by BlockId
+
+  // Blocks of the loop with a successor outside of it
+  std::vector<BlockId> exiting_blocks(const Function &fn) const;
+};
+
+// Loops of a function, inner loops before the loops that contain them
+std::vector<Loop> find_loops(const Function &fn,
+                             const std::vector<BlockId> &idom);
+
+} // namespace ir
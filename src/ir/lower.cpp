@@ -0,0 +1,870 @@
+#include "lower.hpp"
+#include "../compiler/tailcalls.hpp"
+#include "../definitions/lowering.hpp"
+#include "../utils/logging.hpp"
+#include <algorithm>
+#include <spdlog/spdlog.h>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace ir {
+
+namespace {
+
+struct ProgramInfo {
+  Module &module;
+  std::unordered_map<std::string_view, FunctionId> functions;
+  std::unordered_set<std::string_view> type_externs; // sizeof and friends
+  const std::string *source;
+};
+
+[[noreturn]] void unsupported(const ProgramInfo &program,
+                              const std::string &what, const Span &span) {
+  LOG_ERROR_EXIT("[ir] " + what + " is not supported when lowering to IR",
+                 span, *program.source);
+  std::exit(1);
+}
+
+TypeId lower_type(Module &module, const Ref<Type> &type) {
+  switch (type->base_type) {
+  case BaseType::Void:
+    return TypeTable::Void;
+  case BaseType::Bool:
+    return TypeTable::Bool;
+  case BaseType::Char:
+    return TypeTable::Char;
+  case BaseType::Int:
+    return TypeTable::Int;
+  case BaseType::Float:
+    return TypeTable::Float;
+  case BaseType::String:
+    return TypeTable::String;
+  case BaseType::Pointer: {
+    auto pointee = std::get<Ref<Type>>(type->structure);
+    return module.types.pointer_to(pointee ? lower_type(module, pointee)
+                                           : TypeTable::Void);
+  }
+  case BaseType::Enum:
+    return module.types.named(
+        TypeKind::Enum,
+        std::string(std::get<Ref<Enum>>(type->structure)->name));
+  case BaseType::Struct:
+    return module.types.named(
+        TypeKind::Struct,
+        std::string(std::get<Ref<Struct>>(type->structure)->name));
+  default:
+    spdlog::error("[ir] Unhandled type when lowering to IR: {}",
+                  type->to_string());
+    std::exit(1);
+  }
+}
+
+struct Variable {
+  TypeId type;
+  ValueId slot = NONE; // The Alloca, for locals that live in memory
+};
+
+class FunctionLowering {
+public:
+  FunctionLowering(ProgramInfo &program, Function &fn)
+      : program(program), module(program.module), fn(fn) {}
+
+  void lower(const Ref<FunctionDefinition> &func_def);
+
+private:
+  ProgramInfo &program;
+  Module &module;
+  Function &fn;
+  BlockId current = NONE; // NONE after a return, nothing is reachable there
+  std::vector<std::unordered_map<std::string_view, uint32_t>> scopes;
+  std::vector<Variable> variables;
+  std::unordered_set<std::string_view> address_taken;
+  // Functions with several returns branch to one shared exit block, and the
+  // returned value is an SSA variable of its own so it ends up in a phi
+  BlockId exit_block = NONE;
+  uint32_t return_variable = NONE;
+  // Self tail calls write the parameters, the first variables, and branch
+  // back to this block right after the entry
+  BlockId tail_block = NONE;
+
+  // SSA construction state, per block
+  std::vector<std::unordered_map<uint32_t, ValueId>> definitions;
+  std::vector<bool> sealed;
+  std::vector<std::vector<std::pair<uint32_t, ValueId>>> incomplete_phis;
+
+  [[noreturn]] void unsupported(const std::string &what, const Span &span) {
+    ir::unsupported(program, what, span);
+  }
+
+  BlockId new_block() {
+    auto block = fn.add_block();
+    definitions.emplace_back();
+    sealed.push_back(false);
+    incomplete_phis.emplace_back();
+    return block;
+  }
+
+  void add_edge(BlockId from, BlockId to) { fn.blocks[to].preds.push_back(from); }
+
+  ValueId emit(Inst inst, const std::vector<ValueId> &args = {}) {
+    return fn.append(current, inst, args);
+  }
+  ValueId emit(Opcode op, TypeId type, const std::vector<ValueId> &args = {},
+               uint32_t imm = 0) {
+    return emit(Inst{op, type, NONE, 0, 0, imm}, args);
+  }
+  void branch(BlockId target) {
+    emit(Inst{Opcode::Br, TypeTable::Void, NONE, 0, 0, target});
+    add_edge(current, target);
+    current = NONE;
+  }
+  void cond_branch(ValueId condition, BlockId then_block, BlockId else_block) {
+    emit(Inst{Opcode::CondBr, TypeTable::Void, NONE, 0, 0, then_block,
+              else_block},
+         {condition});
+    add_edge(current, then_block);
+    add_edge(current, else_block);
+    current = NONE;
+  }
+
+  // `value` is NONE for functions returning void
+  void lower_return(ValueId value) {
+    if (exit_block == NONE) {
+      if (value == NONE) {
+        emit(Opcode::Ret, TypeTable::Void);
+      } else {
+        emit(Opcode::Ret, TypeTable::Void, {value});
+      }
+      current = NONE;
+      return;
+    }
+    if (value != NONE)
+      write_variable(return_variable, current, value);
+    branch(exit_block);
+  }
+
+  ValueId constant(Constant value) {
+    auto type = value.type;
+    return emit(Opcode::Const, type, {},
+                module.add_constant(std::move(value)));
+  }
+
+  // --- SSA construction -----------------------------------------------------
+
+  void write_variable(uint32_t variable, BlockId block, ValueId value) {
+    definitions[block][variable] = value;
+  }
+
+  ValueId read_variable(uint32_t variable, BlockId block) {
+    auto found = definitions[block].find(variable);
+    if (found != definitions[block].end())
+      return found->second;
+    return read_variable_recursive(variable, block);
+  }
+
+  ValueId new_phi(BlockId block, TypeId type) {
+    auto phi = fn.add(Inst{Opcode::Phi, type, block});
+    auto &insts = fn.blocks[block].insts;
+    auto position = insts.begin();
+    while (position != insts.end() && fn.insts[*position].op == Opcode::Phi)
+      ++position;
+    insts.insert(position, phi);
+    return phi;
+  }
+
+  ValueId read_variable_recursive(uint32_t variable, BlockId block) {
+    ValueId value;
+    const auto &preds = fn.blocks[block].preds;
+    if (!sealed[block]) {
+      // Not all predecessors are known yet, the operands are filled in when
+      // the block is sealed
+      value = new_phi(block, variables[variable].type);
+      incomplete_phis[block].emplace_back(variable, value);
+    } else if (preds.size() == 1) {
+      value = read_variable(variable, preds[0]);
+    } else {
+      // Breaks cycles through loops: the phi is the definition while its
+      // operands are looked up
+      value = new_phi(block, variables[variable].type);
+      write_variable(variable, block, value);
+      add_phi_operands(variable, value);
+    }
+    write_variable(variable, block, value);
+    return value;
+  }
+
+  void add_phi_operands(uint32_t variable, ValueId phi) {
+    std::vector<ValueId> values;
+    auto block = fn.insts[phi].block;
+    for (auto pred : fn.blocks[block].preds)
+      values.push_back(read_variable(variable, pred));
+    // Operands of one instruction are contiguous, so they are only appended
+    // once all of them are known
+    fn.insts[phi].first = static_cast<uint32_t>(fn.operands.size());
+    fn.insts[phi].count = static_cast<uint32_t>(values.size());
+    fn.operands.insert(fn.operands.end(), values.begin(), values.end());
+  }
+
+  void seal(BlockId block) {
+    sealed[block] = true;
+    for (auto [variable, phi] : incomplete_phis[block])
+      add_phi_operands(variable, phi);
+    incomplete_phis[block].clear();
+  }
+
+  // --- Variables ------------------------------------------------------------
+
+  Variable *find_variable(std::string_view name, uint32_t *index = nullptr) {
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+      auto found = it->find(name);
+      if (found != it->end()) {
+        if (index)
+          *index = found->second;
+        return &variables[found->second];
+      }
+    }
+    return nullptr;
+  }
+
+  void declare_variable(std::string_view name, TypeId type, ValueId value) {
+    auto index = static_cast<uint32_t>(variables.size());
+    variables.push_back(Variable{type});
+    scopes.back()[name] = index;
+    value = coerce(value, type);
+    if (address_taken.contains(name)) {
+      auto slot = emit(Opcode::Alloca, module.types.pointer_to(type));
+      variables[index].slot = slot;
+      emit(Opcode::Store, TypeTable::Void, {slot, value});
+    } else {
+      write_variable(index, current, value);
+    }
+  }
+
+  // Pointers to void convert implicitly to and from other pointers
+  ValueId coerce(ValueId value, TypeId type) {
+    auto from = fn.insts[value].type;
+    if (from == type || module.types[from].kind != TypeKind::Pointer ||
+        module.types[type].kind != TypeKind::Pointer) {
+      return value;
+    }
+    return emit(Opcode::Bitcast, type, {value});
+  }
+
+  // --- Expressions ----------------------------------------------------------
+
+  ValueId lower_literal(const Ref<Literal> &literal) {
+    auto text = std::string(literal->value);
+    switch (literal->type->base_type) {
+    case BaseType::Int:
+      return constant({TypeTable::Int, std::stoll(text), 0, text});
+    case BaseType::Bool:
+      return constant({TypeTable::Bool, text == "true" ? 1 : 0, 0, text});
+    case BaseType::Char:
+      return constant({TypeTable::Char,
+                       static_cast<unsigned char>(unescape(text)[0]), 0, text});
+    case BaseType::Float:
+      return constant({TypeTable::Float, 0, std::stof(text), text});
+    case BaseType::String:
+      return constant({TypeTable::String, 0, 0, text});
+    default:
+      unsupported("Literal of type " + literal->type->to_string(),
+                  literal->span);
+    }
+  }
+
+  ValueId enum_member(TypeId type, std::string_view member, const Span &span) {
+    const auto &names = module.types[type].names;
+    for (size_t i = 0; i < names.size(); ++i) {
+      if (names[i] == member) {
+        return constant({type, static_cast<int64_t>(i), 0,
+                         std::string(member)});
+      }
+    }
+    unsupported("Unknown enum member '" + std::string(member) + "'", span);
+  }
+
+  uint32_t field_index(const Ref<Dot> &dot, TypeId &field_type) {
+    auto struct_type = lower_type(module, dot->left->etype);
+    if (module.types[struct_type].kind != TypeKind::Struct ||
+        dot->right->get_type() != ASTType::Identifier) {
+      unsupported("This member access", dot->span);
+    }
+    auto name = std::static_pointer_cast<Identifier>(dot->right)->name;
+    const auto &type = module.types[struct_type];
+    for (uint32_t i = 0; i < type.names.size(); ++i) {
+      if (type.names[i] == name) {
+        field_type = type.fields[i];
+        return i;
+      }
+    }
+    unsupported("Unknown field '" + std::string(name) + "'", dot->span);
+  }
+
+  bool in_memory(const Ref<Expression> &expr) {
+    switch (expr->get_type()) {
+    case ASTType::Identifier: {
+      auto variable =
+          find_variable(std::static_pointer_cast<Identifier>(expr)->name);
+      return variable && variable->slot != NONE;
+    }
+    case ASTType::Dot:
+      return in_memory(std::static_pointer_cast<Dot>(expr)->left);
+    case ASTType::Dereference:
+    case ASTType::Index:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  ValueId address_of(const Ref<Expression> &expr) {
+    switch (expr->get_type()) {
+    case ASTType::Identifier: {
+      auto ident = std::static_pointer_cast<Identifier>(expr);
+      auto variable = find_variable(ident->name);
+      if (!variable || variable->slot == NONE) {
+        unsupported("Taking the address of '" + std::string(ident->name) + "'",
+                    expr->span);
+      }
+      return variable->slot;
+    }
+    case ASTType::Dot: {
+      auto dot = std::static_pointer_cast<Dot>(expr);
+      TypeId field_type;
+      auto index = field_index(dot, field_type);
+      return emit(Opcode::FieldAddr, module.types.pointer_to(field_type),
+                  {address_of(dot->left)}, index);
+    }
+    case ASTType::Dereference: {
+      auto pointer =
+          lower_expression(std::static_pointer_cast<Dereference>(expr)->expression);
+      return coerce(pointer, module.types.pointer_to(
+                                 lower_type(module, expr->etype)));
+    }
+    case ASTType::Index: {
+      auto index = std::static_pointer_cast<Index>(expr);
+      auto type = module.types.pointer_to(lower_type(module, expr->etype));
+      auto base = coerce(lower_expression(index->base), type);
+      return emit(Opcode::ElementAddr, type,
+                  {base, lower_expression(index->index)});
+    }
+    default:
+      unsupported("Taking the address of this expression", expr->span);
+    }
+  }
+
+  ValueId lower_dot(const Ref<Dot> &dot) {
+    if (dot->left->etype->base_type == BaseType::Enum) {
+      return enum_member(lower_type(module, dot->left->etype),
+                         std::static_pointer_cast<Identifier>(dot->right)->name,
+                         dot->span);
+    }
+    TypeId field_type;
+    auto index = field_index(dot, field_type);
+    if (in_memory(dot))
+      return emit(Opcode::Load, field_type, {address_of(dot)});
+    return emit(Opcode::Field, field_type, {lower_expression(dot->left)},
+                index);
+  }
+
+  ValueId lower_binary_op(const Ref<BinaryOp> &binop) {
+    auto left = lower_expression(binop->left);
+    auto right = coerce(lower_expression(binop->right), fn.insts[left].type);
+    Opcode op;
+    switch (binop->op) {
+    case BinaryOpType::Add:
+      op = Opcode::Add;
+      break;
+    case BinaryOpType::Subtract:
+      op = Opcode::Sub;
+      break;
+    case BinaryOpType::Multiply:
+      op = Opcode::Mul;
+      break;
+    case BinaryOpType::Divide:
+      op = Opcode::Div;
+      break;
+    case BinaryOpType::Modulo:
+      op = Opcode::Mod;
+      break;
+    case BinaryOpType::Equals:
+      op = Opcode::Eq;
+      break;
+    case BinaryOpType::NotEquals:
+      op = Opcode::Ne;
+      break;
+    case BinaryOpType::LessThan:
+      op = Opcode::Lt;
+      break;
+    case BinaryOpType::GreaterThan:
+      op = Opcode::Gt;
+      break;
+    case BinaryOpType::LessThanOrEqual:
+      op = Opcode::Le;
+      break;
+    case BinaryOpType::GreaterThanOrEqual:
+      op = Opcode::Ge;
+      break;
+    default:
+      unsupported("This operator", binop->span);
+    }
+    auto type = is_comparison(op) ? TypeTable::Bool : fn.insts[left].type;
+    return emit(op, type, {left, right});
+  }
+
+  TypeId named_type(std::string_view name, const Span &span) {
+    if (name == "int")
+      return TypeTable::Int;
+    if (name == "float")
+      return TypeTable::Float;
+    if (name == "bool")
+      return TypeTable::Bool;
+    if (name == "char")
+      return TypeTable::Char;
+    if (name == "string")
+      return TypeTable::String;
+    for (TypeId id = 0; id < module.types.types.size(); ++id) {
+      const auto &type = module.types[id];
+      if ((type.kind == TypeKind::Struct || type.kind == TypeKind::Enum) &&
+          type.name == name) {
+        return id;
+      }
+    }
+    unsupported("The type '" + std::string(name) + "'", span);
+  }
+
+  ValueId lower_call(const Ref<Call> &call) {
+    if (call->callee->get_type() != ASTType::Identifier)
+      unsupported("Calling this expression", call->span);
+    auto name = std::static_pointer_cast<Identifier>(call->callee)->name;
+    if (program.type_externs.contains(name)) {
+      auto type_name =
+          std::static_pointer_cast<Identifier>(call->arguments[0])->name;
+      return emit(Opcode::SizeOf, TypeTable::Int, {},
+                  named_type(type_name, call->span));
+    }
+    auto found = program.functions.find(name);
+    if (found == program.functions.end())
+      unsupported("Calling '" + std::string(name) + "'", call->span);
+    auto callee = found->second;
+
+    std::vector<ValueId> args;
+    for (size_t i = 0; i < call->arguments.size(); ++i) {
+      auto value = lower_expression(call->arguments[i]);
+      const auto &target = module.functions[callee];
+      if (!target.variadic && i < target.params.size())
+        value = coerce(value, target.params[i]);
+      args.push_back(value);
+    }
+    return emit(Opcode::Call, module.functions[callee].return_type, args,
+                callee);
+  }
+
+  ValueId lower_expression(const Ref<Expression> &expr) {
+    switch (expr->get_type()) {
+    case ASTType::Literal:
+      return lower_literal(std::static_pointer_cast<Literal>(expr));
+    case ASTType::Identifier: {
+      auto ident = std::static_pointer_cast<Identifier>(expr);
+      uint32_t index;
+      auto variable = find_variable(ident->name, &index);
+      if (!variable) {
+        // Bare enum members are visible in the global scope
+        if (expr->etype && expr->etype->base_type == BaseType::Enum) {
+          return enum_member(lower_type(module, expr->etype), ident->name,
+                             expr->span);
+        }
+        unsupported("Global '" + std::string(ident->name) + "'", expr->span);
+      }
+      if (variable->slot != NONE)
+        return emit(Opcode::Load, variable->type, {variable->slot});
+      return read_variable(index, current);
+    }
+    case ASTType::BinaryOp:
+      return lower_binary_op(std::static_pointer_cast<BinaryOp>(expr));
+    case ASTType::Call:
+      return lower_call(std::static_pointer_cast<Call>(expr));
+    case ASTType::Dot:
+      return lower_dot(std::static_pointer_cast<Dot>(expr));
+    case ASTType::AddressOf:
+      return address_of(std::static_pointer_cast<AddressOf>(expr)->expression);
+    case ASTType::Dereference:
+    case ASTType::Index:
+      return emit(Opcode::Load, lower_type(module, expr->etype),
+                  {address_of(expr)});
+    case ASTType::StructInstantiation: {
+      auto inst = std::static_pointer_cast<StructInstantiation>(expr);
+      auto type = module.types.named(TypeKind::Struct,
+                                     std::string(inst->struct_type->name));
+      std::vector<ValueId> fields;
+      for (size_t i = 0; i < inst->arguments.size(); ++i) {
+        fields.push_back(coerce(lower_expression(inst->arguments[i]),
+                                module.types[type].fields[i]));
+      }
+      return emit(Opcode::MakeStruct, type, fields);
+    }
+    default:
+      unsupported(std::string(magic_enum::enum_name(expr->get_type())),
+                  expr->span);
+    }
+  }
+
+  // --- Statements -----------------------------------------------------------
+
+  void lower_assignment(const Ref<Assignment> &assignment) {
+    auto value = lower_expression(assignment->expression);
+    if (assignment->assignee->get_type() == ASTType::Identifier) {
+      auto ident = std::static_pointer_cast<Identifier>(assignment->assignee);
+      uint32_t index;
+      auto variable = find_variable(ident->name, &index);
+      if (!variable)
+        unsupported("Assigning to a global", assignment->span);
+      value = coerce(value, variable->type);
+      if (variable->slot == NONE) {
+        write_variable(index, current, value);
+        return;
+      }
+      emit(Opcode::Store, TypeTable::Void, {variable->slot, value});
+      return;
+    }
+    auto address = address_of(assignment->assignee);
+    value = coerce(value, module.types[fn.insts[address].type].pointee);
+    emit(Opcode::Store, TypeTable::Void, {address, value});
+  }
+
+  void lower_tail_call(const Ref<Call> &call) {
+    std::vector<ValueId> values;
+    for (uint32_t i = 0; i < call->arguments.size(); ++i)
+      values.push_back(coerce(lower_expression(call->arguments[i]),
+                              fn.params[i]));
+    for (uint32_t i = 0; i < values.size(); ++i) {
+      if (variables[i].slot == NONE) {
+        write_variable(i, current, values[i]);
+      } else {
+        emit(Opcode::Store, TypeTable::Void, {variables[i].slot, values[i]});
+      }
+    }
+    branch(tail_block);
+  }
+
+  void lower_if(const Ref<If> &if_stmt) {
+    auto condition = lower_expression(if_stmt->condition);
+    auto then_block = new_block();
+    auto else_block = new_block();
+    cond_branch(condition, then_block, else_block);
+    seal(then_block);
+    seal(else_block);
+
+    BlockId end_block = NONE;
+    auto fall_through = [&]() {
+      if (current == NONE)
+        return;
+      if (end_block == NONE)
+        end_block = new_block();
+      branch(end_block);
+    };
+    current = then_block;
+    lower_statement(if_stmt->then_branch);
+    fall_through();
+    current = else_block;
+    if (if_stmt->else_branch)
+      lower_statement(if_stmt->else_branch);
+    fall_through();
+
+    // Both branches returned, the rest of the block is unreachable
+    if (end_block != NONE) {
+      seal(end_block);
+      current = end_block;
+    }
+  }
+
+  void lower_while(const Ref<While> &while_stmt) {
+    auto header = new_block();
+    branch(header);
+    current = header;
+    auto condition = lower_expression(while_stmt->condition);
+    auto body = new_block();
+    auto exit = new_block();
+    cond_branch(condition, body, exit);
+    seal(body);
+    seal(exit);
+
+    current = body;
+    lower_statement(while_stmt->body);
+    if (current != NONE)
+      branch(header);
+    // The back edge is known now
+    seal(header);
+    current = exit;
+  }
+
+  void lower_statement(const Ref<Statement> &stmt) {
+    if (current == NONE)
+      return; // Dead code after a return
+    switch (stmt->get_type()) {
+    case ASTType::Block:
+      scopes.emplace_back();
+      for (const auto &child : std::static_pointer_cast<Block>(stmt)->statements)
+        lower_statement(child);
+      scopes.pop_back();
+      break;
+    case ASTType::VarDecl: {
+      auto var_decl = std::static_pointer_cast<VarDecl>(stmt);
+      auto type = lower_type(module, var_decl->type);
+      auto value = var_decl->expression ? lower_expression(var_decl->expression)
+                                        : emit(Opcode::Zero, type);
+      declare_variable(var_decl->identifier->name, type, value);
+      break;
+    }
+    case ASTType::Assignment:
+      lower_assignment(std::static_pointer_cast<Assignment>(stmt));
+      break;
+    case ASTType::ExpressionStatement:
+      lower_expression(
+          std::static_pointer_cast<ExpressionStatement>(stmt)->expression);
+      break;
+    case ASTType::If:
+      lower_if(std::static_pointer_cast<If>(stmt));
+      break;
+    case ASTType::While:
+      lower_while(std::static_pointer_cast<While>(stmt));
+      break;
+    case ASTType::Return: {
+      auto ret = std::static_pointer_cast<Return>(stmt);
+      if (ret->tail_call) {
+        lower_tail_call(std::static_pointer_cast<Call>(ret->expression));
+        break;
+      }
+      ValueId value = NONE;
+      if (ret->expression)
+        value = coerce(lower_expression(ret->expression), fn.return_type);
+      lower_return(value);
+      break;
+    }
+    default:
+      unsupported(std::string(magic_enum::enum_name(stmt->get_type())),
+                  stmt->span);
+    }
+  }
+};
+
+// Phis whose operands are all the same value (or the phi itself) are left
+// behind by SSA construction, e.g. for variables that are only read in a
+// loop. Removing one can make others trivial, so this runs to a fixed point.
+void remove_trivial_phis(Function &fn) {
+  std::vector<ValueId> replacement(fn.insts.size(), NONE);
+  auto resolve = [&](ValueId value) {
+    while (replacement[value] != NONE)
+      value = replacement[value];
+    return value;
+  };
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (const auto &block : fn.blocks) {
+      for (auto id : block.insts) {
+        const auto &inst = fn.insts[id];
+        if (inst.op != Opcode::Phi)
+          break;
+        if (replacement[id] != NONE)
+          continue;
+        ValueId same = NONE;
+        bool trivial = true;
+        for (uint32_t i = 0; i < inst.count; ++i) {
+          auto operand = resolve(fn.operand(id, i));
+          if (operand == id || operand == same)
+            continue;
+          if (same != NONE) {
+            trivial = false;
+            break;
+          }
+          same = operand;
+        }
+        if (trivial && same != NONE) {
+          replacement[id] = same;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  for (auto &operand : fn.operands)
+    operand = resolve(operand);
+  for (auto &block : fn.blocks) {
+    std::erase_if(block.insts,
+                  [&](ValueId id) { return replacement[id] != NONE; });
+  }
+  for (ValueId id = 0; id < fn.insts.size(); ++id) {
+    if (replacement[id] != NONE)
+      fn.insts[id].block = NONE;
+  }
+}
+
+void FunctionLowering::lower(const Ref<FunctionDefinition> &func_def) {
+  collect_address_taken(func_def->body, address_taken);
+  scopes.emplace_back();
+  current = new_block();
+  seal(current);
+
+  for (uint32_t i = 0; i < func_def->parameters.size(); ++i) {
+    const auto &param = func_def->parameters[i];
+    auto value = emit(Opcode::Param, fn.params[i], {}, i);
+    declare_variable(param->identifier->name, fn.params[i], value);
+  }
+  if (has_tail_calls(func_def)) {
+    tail_block = new_block();
+    branch(tail_block);
+    current = tail_block;
+  }
+  if (func_def->returns.size() > 1) {
+    exit_block = new_block();
+    return_variable = static_cast<uint32_t>(variables.size());
+    variables.push_back(Variable{fn.return_type});
+  }
+
+  lower_statement(func_def->body);
+  // Falling off the end returns the zero value, e.g. exit code 0 for main
+  if (current != NONE) {
+    lower_return(fn.return_type == TypeTable::Void
+                     ? NONE
+                     : emit(Opcode::Zero, fn.return_type));
+  }
+  if (tail_block != NONE)
+    seal(tail_block);
+  if (exit_block != NONE) {
+    seal(exit_block);
+    current = exit_block;
+    if (fn.return_type == TypeTable::Void) {
+      emit(Opcode::Ret, TypeTable::Void);
+    } else if (fn.blocks[exit_block].preds.empty()) {
+      // Only reached when every return is unreachable, e.g. after a loop
+      // that never exits
+      emit(Opcode::Ret, TypeTable::Void,
+           {emit(Opcode::Zero, fn.return_type)});
+    } else {
+      emit(Opcode::Ret, TypeTable::Void,
+           {read_variable(return_variable, exit_block)});
+    }
+  }
+  scopes.pop_back();
+  remove_trivial_phis(fn);
+}
+
+} // namespace
+
+Module lower_program(Ref<Program> program) {
+  spdlog::debug("[ir] Lowering program to IR");
+  Module module;
+  ProgramInfo info{module};
+  info.source = program->source_buffer.get();
+
+  for (auto name : {"print", "eprint", "flush"}) {
+    Function builtin;
+    builtin.name = name;
+    builtin.kind = FunctionKind::Builtin;
+    builtin.variadic = true;
+    module.functions.push_back(std::move(builtin));
+    info.functions[name] = static_cast<FunctionId>(module.functions.size() - 1);
+  }
+
+  // Types first, so signatures and bodies can refer to any of them
+  for (const auto &stmt : program->body->statements) {
+    if (stmt->get_type() == ASTType::EnumDefinition) {
+      auto enum_def = std::static_pointer_cast<EnumDefinition>(stmt);
+      auto type = module.types.named(TypeKind::Enum,
+                                     std::string(enum_def->identifier->name));
+      for (const auto &member : enum_def->members)
+        module.types[type].names.emplace_back(member->name);
+    } else if (stmt->get_type() == ASTType::StructDefinition) {
+      module.types.named(TypeKind::Struct,
+                         std::string(std::static_pointer_cast<StructDefinition>(
+                                         stmt)->identifier->name));
+    }
+  }
+  for (const auto &stmt : program->body->statements) {
+    if (stmt->get_type() != ASTType::StructDefinition)
+      continue;
+    auto struct_def = std::static_pointer_cast<StructDefinition>(stmt);
+    auto struct_type = resolved_struct(program, struct_def);
+    if (!struct_type)
+      continue;
+    auto name = struct_def->identifier->name;
+    std::vector<TypeId> fields;
+    std::vector<std::string> names;
+    for (const auto &field : struct_type->fields) {
+      fields.push_back(lower_type(module, field->type));
+      names.emplace_back(field->name);
+    }
+    auto type = module.types.named(TypeKind::Struct, std::string(name));
+    module.types[type].fields = std::move(fields);
+    module.types[type].names = std::move(names);
+  }
+
+  // Signatures of everything that can be called
+  std::vector<std::pair<FunctionId, Ref<FunctionDefinition>>> bodies;
+  auto declare = [&](const Ref<FunctionDefinition> &func_def) {
+    Function fn;
+    fn.name = func_def->identifier->name;
+    fn.return_type = lower_type(module, func_def->return_type);
+    for (const auto &param : func_def->parameters) {
+      fn.params.push_back(lower_type(module, param->type));
+      fn.param_names.emplace_back(param->identifier->name);
+    }
+    module.functions.push_back(std::move(fn));
+    auto id = static_cast<FunctionId>(module.functions.size() - 1);
+    info.functions[func_def->identifier->name] = id;
+    bodies.emplace_back(id, func_def);
+  };
+  for (const auto &stmt : program->body->statements) {
+    switch (stmt->get_type()) {
+    case ASTType::FunctionDefinition: {
+      auto func_def = std::static_pointer_cast<FunctionDefinition>(stmt);
+      if (func_def->body)
+        declare(func_def);
+      break;
+    }
+    case ASTType::EnumDefinition: {
+      auto enum_def = std::static_pointer_cast<EnumDefinition>(stmt);
+      if (enum_def->to_string_function)
+        declare(enum_def->to_string_function);
+      break;
+    }
+    case ASTType::Extern: {
+      auto ext = std::static_pointer_cast<Extern>(stmt);
+      if (!ext->args.empty() && ext->args[0]->base_type == BaseType::Type) {
+        info.type_externs.insert(ext->identifier->name);
+        break;
+      }
+      Function fn;
+      fn.name = ext->identifier->name;
+      fn.kind = FunctionKind::Extern;
+      fn.module_path = ext->module_path;
+      fn.pure = std::find(ext->annotations.begin(), ext->annotations.end(),
+                          "pure") != ext->annotations.end();
+      fn.return_type = lower_type(module, ext->return_type);
+      for (const auto &arg : ext->args)
+        fn.params.push_back(lower_type(module, arg));
+      module.functions.push_back(std::move(fn));
+      info.functions[ext->identifier->name] =
+          static_cast<FunctionId>(module.functions.size() - 1);
+      break;
+    }
+    case ASTType::StructDefinition:
+    case ASTType::Import:
+      break;
+    default:
+      ir::unsupported(info, "Top level statements", stmt->span);
+    }
+  }
+
+  for (const auto &[id, func_def] : bodies) {
+    FunctionLowering lowering(info, module.functions[id]);
+    lowering.lower(func_def);
+  }
+
+  spdlog::debug("[ir] Lowered {} functions", bodies.size());
+  return module;
+}
+
+} // namespace ir
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "../definitions/ast.hpp"
+#include "ir.hpp"
+
+namespace ir {
+
+// Lowers a typechecked program to SSA form. Locals become SSA values directly
+// (Braun et al., "Simple and Efficient Construction of Static Single
+// Assignment Form"), only locals whose address is taken live in an Alloca.
+Module lower_program(Ref<Program> program);
+
+} // namespace ir
@@ -0,0 +1,50 @@
+#include "passes.hpp"
+#include "cse.hpp"
+#include "escape.hpp"
+#include "inline.hpp"
+#include "licm.hpp"
+#include "peephole.hpp"
+#include "purity.hpp"
+#include "unroll.hpp"
+#include "vectorize.hpp"
+#include <cstdio>
+#include <spdlog/spdlog.h>
+
+namespace ir {
+
+bool is_remark_pass(const std::string &name) {
+  static const std::set<std::string> passes = {"inline", "escape", "peephole",
+                                                "cse", "licm", "vectorize",
+                                                "unroll"};
+  return passes.contains(name);
+}
+
+void remark(const PassOptions &options, const std::string &pass,
+            const Function &fn, const std::string &message) {
+  if (!options.remarks.contains(pass) && !options.remarks.contains("all"))
+    return;
+  std::fprintf(stderr, "remark: %s: [%s] %s\n", fn.name.c_str(), pass.c_str(),
+               message.c_str());
+}
+
+void optimize(Module &module, const PassOptions &options) {
+  spdlog::debug("[ir] Optimizing at -O{}", options.opt_level);
+  if (options.opt_level == 0)
+    return;
+  inline_functions(module, options);
+  // Promoting stack slots removes loads and stores, which can make more
+  // functions pure
+  stack_allocate(module, options);
+  compute_purity(module);
+  // Before CSE, so the constants and shifts it creates are shared
+  simplify_arithmetic(module, options);
+  eliminate_common_subexpressions(module, options);
+  hoist_loop_invariants(module, options);
+  // After LICM, so invariants are splatted once in front of the vector loop
+  if (options.vectorize)
+    vectorize_loops(module, options);
+  // Last, so hoisted invariants and simplified steps are not copied
+  unroll_loops(module, options);
+}
+
+} // namespace ir
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "ir.hpp"
+#include <set>
+#include <string>
+
+namespace ir {
+
+// Settings shared by the optimization passes, filled in from the command line
+struct PassOptions {
+  int opt_level = 2;
+  // Largest callee, in instructions, that the inliner copies into its callers
+  uint32_t inline_threshold = 25;
+  // Copies of the body in an unrolled counted loop, 1 turns unrolling off
+  uint32_t unroll_factor = 4;
+  // Whether counted loops over buffers are rewritten to use vectors
+  bool vectorize = true;
+  // Passes whose decisions are reported, `--remarks=inline,cse` or `all`
+  std::set<std::string> remarks;
+};
+
+// Whether `name` is a pass that reports remarks
+bool is_remark_pass(const std::string &name);
+
+// Reports a decision taken by `pass` while optimizing `fn` on stderr, when
+// remarks were requested for that pass
+void remark(const PassOptions &options, const std::string &pass,
+            const Function &fn, const std::string &message);
+
+// Runs the optimization pipeline selected by the options over the module
+void optimize(Module &module, const PassOptions &options);
+
+} // namespace ir
@@ -0,0 +1,327 @@
+#include "peephole.hpp"
+#include <bit>
+#include <climits>
+#include <format>
+#include <map>
+#include <optional>
+#include <set>
+#include <spdlog/spdlog.h>
+
+namespace ir {
+
+namespace {
+
+int32_t wrap(int64_t value) {
+  return static_cast<int32_t>(static_cast<uint32_t>(value));
+}
+
+bool is_power_of_two(int32_t value) {
+  return value > 0 && std::has_single_bit(static_cast<uint32_t>(value));
+}
+
+uint32_t log2(int32_t value) {
+  return static_cast<uint32_t>(std::countr_zero(static_cast<uint32_t>(value)));
+}
+
+// Multiplier and shift that replace a signed division by d >= 2 with the
+// high half of a multiplication, Hacker's Delight section 10-4
+struct Magic {
+  int32_t multiplier;
+  uint32_t shift;
+};
+
+Magic signed_magic(int32_t d) {
+  constexpr uint32_t two31 = 0x80000000u;
+  auto ad = static_cast<uint32_t>(d);
+  uint32_t anc = two31 - 1 - two31 % ad;
+  uint32_t p = 31;
+  uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+  uint32_t q2 = two31 / ad, r2 = two31 - q2 * ad;
+  uint32_t delta;
+  do {
+    ++p;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      ++q1;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      ++q2;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+  return {static_cast<int32_t>(q2 + 1), p - 32};
+}
+
+class FunctionSimplifier {
+public:
+  FunctionSimplifier(Module &module, Function &fn) : module(module), fn(fn) {}
+
+  // Returns the number of rewrites per kind
+  std::map<std::string, uint32_t> run();
+
+private:
+  Module &module;
+  Function &fn;
+  BlockId block = NONE;
+  std::vector<ValueId> output; // The new instruction list of the block
+  std::map<ValueId, ValueId> replacement;
+  std::map<std::string, uint32_t> rewrites;
+
+  ValueId resolve(ValueId value) const {
+    for (auto found = replacement.find(value); found != replacement.end();
+         found = replacement.find(value))
+      value = found->second;
+    return value;
+  }
+
+  std::optional<int32_t> constant_of(ValueId value) const {
+    const auto &inst = fn.insts[value];
+    if (inst.op != Opcode::Const || inst.type != TypeTable::Int)
+      return std::nullopt;
+    return wrap(module.constants[inst.imm].integer);
+  }
+
+  // New instructions go in front of the one being replaced
+  ValueId emit(Opcode op, const std::vector<ValueId> &args,
+               uint32_t imm = 0) {
+    auto id = fn.add(Inst{op, TypeTable::Int, block, 0, 0, imm}, args);
+    output.push_back(id);
+    return id;
+  }
+  ValueId constant(int32_t value) {
+    return emit(Opcode::Const, {},
+                module.add_constant(Constant{TypeTable::Int, value}));
+  }
+
+  bool is_non_negative(ValueId value, std::set<ValueId> &phis,
+                       int depth) const;
+  bool is_non_negative(ValueId value) const {
+    std::set<ValueId> phis;
+    return is_non_negative(value, phis, 0);
+  }
+  ValueId divide(ValueId x, int32_t d, bool non_negative);
+  ValueId simplify(ValueId id);
+};
+
+// Only operations that cannot wrap keep a value non-negative: integer
+// arithmetic wraps around, so a sum or product of non-negative values can
+// still come out negative. Phis are assumed non-negative while their
+// operands are checked, which is sound as every operation that gets back to
+// them keeps non-negative values non-negative.
+bool FunctionSimplifier::is_non_negative(ValueId value, std::set<ValueId> &phis,
+                                         int depth) const {
+  value = resolve(value);
+  const auto &inst = fn.insts[value];
+  if (inst.type != TypeTable::Int || depth > 16)
+    return false;
+  auto operand = [&](uint32_t index) {
+    return is_non_negative(fn.operand(value, index), phis, depth + 1);
+  };
+  switch (inst.op) {
+  case Opcode::Const:
+    return *constant_of(value) >= 0;
+  case Opcode::SizeOf:
+    return true;
+  case Opcode::And:
+    return operand(0) || operand(1);
+  case Opcode::Shr:
+  case Opcode::Mod:
+    return operand(0);
+  case Opcode::Div:
+    return operand(0) && operand(1);
+  case Opcode::Phi:
+    if (!phis.insert(value).second)
+      return true;
+    for (uint32_t i = 0; i < inst.count; ++i) {
+      if (!operand(i))
+        return false;
+    }
+    return true;
+  default:
+    return false;
+  }
+}
+
+// x / d for a constant d >= 2, rounding towards zero like the division
+ValueId FunctionSimplifier::divide(ValueId x, int32_t d, bool non_negative) {
+  if (is_power_of_two(d)) {
+    auto shift = constant(static_cast<int32_t>(log2(d)));
+    if (non_negative)
+      return emit(Opcode::Shr, {x, shift});
+    // Negative dividends are biased by d - 1 so the shift rounds up
+    auto sign = emit(Opcode::Shr, {x, constant(31)});
+    auto bias = emit(Opcode::And, {sign, constant(d - 1)});
+    return emit(Opcode::Shr, {emit(Opcode::Add, {x, bias}), shift});
+  }
+  auto magic = signed_magic(d);
+  auto q = emit(Opcode::MulHigh, {x, constant(magic.multiplier)});
+  if (magic.multiplier < 0)
+    q = emit(Opcode::Add, {q, x});
+  if (magic.shift > 0)
+    q = emit(Opcode::Shr, {q, constant(static_cast<int32_t>(magic.shift))});
+  if (non_negative)
+    return q;
+  // The multiply rounds down, negative dividends need one added
+  return emit(Opcode::Sub, {q, emit(Opcode::Shr, {x, constant(31)})});
+}
+
+// Returns the value replacing the instruction, NONE to keep it
+ValueId FunctionSimplifier::simplify(ValueId id) {
+  const auto inst = fn.insts[id]; // Copied, emit() grows the vector
+  if (inst.type != TypeTable::Int || inst.count != 2)
+    return NONE;
+  if (inst.op != Opcode::Add && inst.op != Opcode::Sub &&
+      inst.op != Opcode::Mul && inst.op != Opcode::Div &&
+      inst.op != Opcode::Mod)
+    return NONE;
+
+  auto a = resolve(fn.operand(id, 0));
+  auto b = resolve(fn.operand(id, 1));
+  auto ca = constant_of(a);
+  auto cb = constant_of(b);
+  if (ca && cb) {
+    int64_t x = *ca, y = *cb;
+    if ((inst.op == Opcode::Div || inst.op == Opcode::Mod) &&
+        (y == 0 || (x == INT32_MIN && y == -1)))
+      return NONE;
+    ++rewrites["folded"];
+    switch (inst.op) {
+    case Opcode::Add:
+      return constant(wrap(x + y));
+    case Opcode::Sub:
+      return constant(wrap(x - y));
+    case Opcode::Mul:
+      return constant(wrap(x * y));
+    case Opcode::Div:
+      return constant(wrap(x / y));
+    default:
+      return constant(wrap(x % y));
+    }
+  }
+  if ((inst.op == Opcode::Add || inst.op == Opcode::Mul) && ca) {
+    std::swap(a, b);
+    std::swap(ca, cb);
+  }
+
+  switch (inst.op) {
+  case Opcode::Add:
+  case Opcode::Sub:
+    if (cb == 0) {
+      ++rewrites["identity"];
+      return a;
+    }
+    if (inst.op == Opcode::Sub && a == b) {
+      ++rewrites["identity"];
+      return constant(0);
+    }
+    return NONE;
+  case Opcode::Mul:
+    if (!cb || *cb == INT32_MIN)
+      return NONE;
+    if (*cb == 0 || *cb == 1) {
+      ++rewrites["identity"];
+      return *cb == 0 ? constant(0) : a;
+    }
+    if (is_power_of_two(*cb) || is_power_of_two(-*cb)) {
+      ++rewrites["mul to shift"];
+      auto shifted = emit(
+          Opcode::Shl,
+          {a, constant(static_cast<int32_t>(log2(*cb > 0 ? *cb : -*cb)))});
+      return *cb > 0 ? shifted : emit(Opcode::Sub, {constant(0), shifted});
+    }
+    return NONE;
+  case Opcode::Div: {
+    if (!cb || *cb == 0 || *cb == INT32_MIN)
+      return NONE;
+    if (*cb == 1) {
+      ++rewrites["identity"];
+      return a;
+    }
+    auto d = *cb > 0 ? *cb : -*cb;
+    ValueId q = a;
+    if (d > 1) {
+      ++rewrites[is_power_of_two(d) ? "div to shift" : "div to multiply"];
+      q = divide(a, d, is_non_negative(a));
+    } else {
+      ++rewrites["identity"];
+    }
+    return *cb > 0 ? q : emit(Opcode::Sub, {constant(0), q});
+  }
+  case Opcode::Mod: {
+    if (!cb || *cb == 0 || *cb == INT32_MIN)
+      return NONE;
+    // The sign of a remainder follows the dividend, not the divisor
+    auto d = *cb > 0 ? *cb : -*cb;
+    if (d == 1) {
+      ++rewrites["identity"];
+      return constant(0);
+    }
+    bool non_negative = is_non_negative(a);
+    if (is_power_of_two(d) && non_negative) {
+      ++rewrites["mod to mask"];
+      return emit(Opcode::And, {a, constant(d - 1)});
+    }
+    ++rewrites[is_power_of_two(d) ? "mod to shift" : "mod to multiply"];
+    auto q = divide(a, d, non_negative);
+    auto product =
+        is_power_of_two(d)
+            ? emit(Opcode::Shl, {q, constant(static_cast<int32_t>(log2(d)))})
+            : emit(Opcode::Mul, {q, constant(d)});
+    return emit(Opcode::Sub, {a, product});
+  }
+  default:
+    return NONE;
+  }
+}
+
+std::map<std::string, uint32_t> FunctionSimplifier::run() {
+  for (auto b : reverse_postorder(fn)) {
+    block = b;
+    output.clear();
+    // Copied, the list is rebuilt with the new instructions
+    auto insts = fn.blocks[b].insts;
+    for (auto id : insts) {
+      auto result = simplify(id);
+      if (result == NONE) {
+        output.push_back(id);
+        continue;
+      }
+      replacement[id] = result;
+      fn.insts[id].block = NONE;
+    }
+    fn.blocks[b].insts = output;
+  }
+  for (auto &operand : fn.operands)
+    operand = resolve(operand);
+  return rewrites;
+}
+
+} // namespace
+
+void simplify_arithmetic(Module &module, const PassOptions &options) {
+  spdlog::debug("[ir] Simplifying integer arithmetic");
+  for (auto &fn : module.functions) {
+    if (fn.kind != FunctionKind::Defined)
+      continue;
+    auto rewrites = FunctionSimplifier(module, fn).run();
+    if (rewrites.empty())
+      continue;
+    uint32_t total = 0;
+    std::string details;
+    for (const auto &[name, count] : rewrites) {
+      total += count;
+      details += std::format("{}{} {}", details.empty() ? "" : ", ", count,
+                             name);
+    }
+    remark(options, "peephole", fn,
+           std::format("simplified {} instruction{} ({})", total,
+                       total == 1 ? "" : "s", details));
+  }
+}
+
+} // namespace ir
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "ir.hpp"
+#include "passes.hpp"
+
+namespace ir {
+
+// Rewrites integer arithmetic into cheaper instructions: algebraic identities
+// (`x + 0`, `x * 1`, `x * 0`, `x - x`) and constant operands are folded,
+// multiplications by powers of two become shifts, divisions by constants
+// become shifts or a multiply-high sequence, and remainders by powers of two
+// become masks when the dividend is known not to be negative. Ints are 32
+// bits wide, division truncates towards zero.
+void simplify_arithmetic(Module &module, const PassOptions &options);
+
+} // namespace ir
@@ -0,0 +1,169 @@
+#include "printer.hpp"
+#include <format>
+
+namespace ir {
+
+namespace {
+
+std::string constant_text(const Module &module, const Constant &constant) {
+  const auto &type = module.types[constant.type];
+  switch (type.kind) {
+  case TypeKind::String:
+    return "\"" + constant.text + "\"";
+  case TypeKind::Char:
+    return "'" + constant.text + "'";
+  case TypeKind::Bool:
+    return constant.integer ? "true" : "false";
+  case TypeKind::Float:
+    return constant.text.empty() ? std::format("{}", constant.real)
+                                 : constant.text;
+  case TypeKind::Enum:
+    if (constant.integer >= 0 &&
+        static_cast<size_t>(constant.integer) < type.names.size()) {
+      return type.name + "." + type.names[constant.integer];
+    }
+    return std::to_string(constant.integer);
+  default:
+    return std::to_string(constant.integer);
+  }
+}
+
+void print_inst(std::string &out, const Module &module, const Function &fn,
+                ValueId id) {
+  const auto &inst = fn.insts[id];
+  const auto &types = module.types;
+  auto value = [](ValueId v) { return "%" + std::to_string(v); };
+  auto operands = [&]() {
+    std::string list;
+    for (uint32_t i = 0; i < inst.count; ++i) {
+      if (i > 0)
+        list += ", ";
+      list += value(fn.operand(id, i));
+    }
+    return list;
+  };
+
+  out += "  ";
+  if (inst.type != TypeTable::Void)
+    out += value(id) + " = ";
+  out += opcode_name(inst.op);
+  if (inst.type != TypeTable::Void)
+    out += " " + types.to_string(inst.type);
+
+  switch (inst.op) {
+  case Opcode::Const:
+    out += " " + constant_text(module, module.constants[inst.imm]);
+    break;
+  case Opcode::Param:
+    out += std::format(" {} ({})", inst.imm, fn.param_names[inst.imm]);
+    break;
+  case Opcode::FieldAddr:
+  case Opcode::Field: {
+    auto base = fn.insts[fn.operand(id, 0)].type;
+    if (inst.op == Opcode::FieldAddr)
+      base = types[base].pointee;
+    out += std::format(" {}, {} ({})", operands(), inst.imm,
+                       types[base].names[inst.imm]);
+    break;
+  }
+  case Opcode::Alloca:
+    if (inst.imm > 0)
+      out += std::format(" {} bytes", inst.imm);
+    break;
+  case Opcode::SizeOf:
+    out += " " + types.to_string(inst.imm);
+    break;
+  case Opcode::Call:
+    out += " " + module.functions[inst.imm].name + "(" + operands() + ")";
+    break;
+  case Opcode::Phi:
+    for (uint32_t i = 0; i < inst.count; ++i) {
+      out += std::format("{} [{}, bb{}]", i > 0 ? "," : "",
+                         value(fn.operand(id, i)),
+                         fn.blocks[inst.block].preds[i]);
+    }
+    break;
+  case Opcode::Br:
+    out += std::format(" bb{}", inst.imm);
+    break;
+  case Opcode::CondBr:
+    out += std::format(" {}, bb{}, bb{}", operands(), inst.imm, inst.imm2);
+    break;
+  default:
+    if (inst.count > 0)
+      out += " " + operands();
+    break;
+  }
+  out += "\n";
+}
+
+std::string signature(const Module &module, const Function &fn) {
+  std::string params;
+  for (size_t i = 0; i < fn.params.size(); ++i) {
+    if (i > 0)
+      params += ", ";
+    if (i < fn.param_names.size())
+      params += fn.param_names[i] + ": ";
+    params += module.types.to_string(fn.params[i]);
+  }
+  return fn.name + "(" + params + ") -> " +
+         module.types.to_string(fn.return_type) + (fn.pure ? " pure" : "");
+}
+
+} // namespace
+
+std::string print_function(const Module &module, const Function &fn) {
+  if (fn.kind == FunctionKind::Extern) {
+    auto text = "extern " + signature(module, fn);
+    if (!fn.module_path.empty())
+      text += " from \"" + fn.module_path + "\"";
+    return text + "\n";
+  }
+
+  std::string out = "define " + signature(module, fn) + " {\n";
+  for (BlockId b = 0; b < fn.blocks.size(); ++b) {
+    const auto &block = fn.blocks[b];
+    out += std::format("bb{}:", b);
+    if (!block.preds.empty()) {
+      out += "  ; preds:";
+      for (auto pred : block.preds)
+        out += std::format(" bb{}", pred);
+    }
+    if (block.counted_loop)
+      out += block.preds.empty() ? "  ; counted loop" : ", counted loop";
+    out += "\n";
+    for (auto id : block.insts)
+      print_inst(out, module, fn, id);
+  }
+  return out + "}\n";
+}
+
+std::string print_module(const Module &module) {
+  std::string out;
+  for (const auto &type : module.types.types) {
+    if (type.kind == TypeKind::Struct) {
+      out += "struct " + type.name + " {";
+      for (size_t i = 0; i < type.fields.size(); ++i) {
+        out += std::format("{} {}: {}", i > 0 ? "," : "", type.names[i],
+                           module.types.to_string(type.fields[i]));
+      }
+      out += " }\n";
+    } else if (type.kind == TypeKind::Enum) {
+      out += "enum " + type.name + " {";
+      for (size_t i = 0; i < type.names.size(); ++i)
+        out += std::format("{} {}", i > 0 ? "," : "", type.names[i]);
+      out += " }\n";
+    }
+  }
+  for (const auto &fn : module.functions) {
+    if (fn.kind == FunctionKind::Extern)
+      out += print_function(module, fn);
+  }
+  for (const auto &fn : module.functions) {
+    if (fn.kind == FunctionKind::Defined)
+      out += "\n" + print_function(module, fn);
+  }
+  return out;
+}
+
+} // namespace ir
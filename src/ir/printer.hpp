@@ -0,0 +1,12 @@
+#pragma once
+
+#include "ir.hpp"
+#include <string>
+
+namespace ir {
+
+// Human readable dump of the IR, as written by `enki compile --emit-ir`
+std::string print_module(const Module &module);
+std::string print_function(const Module &module, const Function &fn);
+
+} // namespace ir
@@ -0,0 +1,57 @@
+#include "purity.hpp"
+#include <spdlog/spdlog.h>
+
+namespace ir {
+
+namespace {
+
+bool is_pure_body(const Module &module, const Function &fn) {
+  for (const auto &block : fn.blocks) {
+    for (auto id : block.insts) {
+      const auto &inst = fn.insts[id];
+      switch (inst.op) {
+      case Opcode::Alloca:
+      case Opcode::Load:
+      case Opcode::Store:
+        return false;
+      case Opcode::Call:
+        if (!module.functions[inst.imm].pure)
+          return false;
+        break;
+      default:
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+void compute_purity(Module &module) {
+  for (auto &fn : module.functions) {
+    if (fn.kind == FunctionKind::Defined)
+      fn.pure = true;
+    else if (fn.kind == FunctionKind::Builtin)
+      fn.pure = false;
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto &fn : module.functions) {
+      if (fn.kind == FunctionKind::Defined && fn.pure &&
+          !is_pure_body(module, fn)) {
+        fn.pure = false;
+        changed = true;
+      }
+    }
+  }
+
+  for (const auto &fn : module.functions) {
+    if (fn.kind == FunctionKind::Defined)
+      spdlog::debug("[ir] {} is {}", fn.name, fn.pure ? "pure" : "impure");
+  }
+}
+
+} // namespace ir
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "ir.hpp"
+
+namespace ir {
+
+// Marks defined functions as pure when they neither touch memory nor call
+// anything impure. Builtins write output and are never pure, externs are pure
+// only when declared `@pure`. Recursion alone does not make a function
+// impure, so this starts from every function being pure and removes the flag
+// until nothing changes.
+void compute_purity(Module &module);
+
+} // namespace ir
@@ -0,0 +1,307 @@
+#include "unroll.hpp"
+#include "induction.hpp"
+#include "loops.hpp"
+#include <algorithm>
+#include <format>
+#include <map>
+#include <spdlog/spdlog.h>
+
+namespace ir {
+
+namespace {
+
+// Largest body, in instructions, times the factor that is still unrolled
+constexpr uint32_t max_unrolled_size = 160;
+
+class LoopUnroller {
+public:
+  LoopUnroller(Module &module, Function &fn, const Loop &loop,
+               const CountedLoop &counted, uint32_t factor)
+      : module(module), fn(fn), loop(loop), counted(counted), factor(factor) {}
+
+  // Returns false, changing nothing, when the bound sits so close to the end
+  // of the int range that the unrolled loop's bound would wrap
+  bool run();
+
+private:
+  Module &module;
+  Function &fn;
+  const Loop &loop;
+  const CountedLoop &counted;
+  uint32_t factor;
+
+  BlockId unrolled = NONE; // Header of the unrolled loop
+  std::vector<ValueId> phis;
+  // Value of each header phi when the current copy of the body starts
+  std::map<ValueId, ValueId> incoming;
+  // Branches back to the header in the previous copy: instruction and
+  // whether it is the second target of a CondBr
+  std::vector<std::pair<ValueId, bool>> back_edges;
+  BlockId previous_latch = NONE;
+
+  ValueId constant(BlockId block, int32_t value) {
+    return insert(block, Inst{Opcode::Const, TypeTable::Int, block, 0, 0,
+                              module.add_constant(
+                                  Constant{TypeTable::Int, value})});
+  }
+  // Inserts in front of the block's terminator
+  ValueId insert(BlockId block, Inst inst,
+                 const std::vector<ValueId> &args = {}) {
+    inst.block = block;
+    auto id = fn.add(inst, args);
+    auto &insts = fn.blocks[block].insts;
+    insts.insert(insts.end() - 1, id);
+    return id;
+  }
+  void set_operands(ValueId id, const std::vector<ValueId> &args) {
+    fn.insts[id].first = static_cast<uint32_t>(fn.operands.size());
+    fn.insts[id].count = static_cast<uint32_t>(args.size());
+    fn.operands.insert(fn.operands.end(), args.begin(), args.end());
+  }
+  void copy_body();
+};
+
+void LoopUnroller::copy_body() {
+  std::map<BlockId, BlockId> block_map;
+  for (auto block : loop.blocks) {
+    if (block != loop.header)
+      block_map[block] = fn.add_block();
+  }
+
+  std::map<ValueId, ValueId> value_map;
+  std::vector<ValueId> copies;
+  for (const auto &[block, copy] : block_map) {
+    // Copied, adding instructions can move the original's list
+    auto insts = fn.blocks[block].insts;
+    for (auto id : insts) {
+      auto inst = fn.insts[id];
+      inst.block = copy;
+      std::vector<ValueId> args;
+      for (uint32_t i = 0; i < inst.count; ++i)
+        args.push_back(fn.operand(id, i));
+      auto cloned = fn.add(inst, args);
+      fn.blocks[copy].insts.push_back(cloned);
+      value_map[id] = cloned;
+      copies.push_back(cloned);
+    }
+  }
+
+  auto resolve = [&](ValueId value) {
+    if (auto found = value_map.find(value); found != value_map.end())
+      return found->second;
+    if (auto found = incoming.find(value); found != incoming.end())
+      return found->second;
+    return value;
+  };
+  std::vector<std::pair<ValueId, bool>> edges;
+  for (auto id : copies) {
+    for (uint32_t i = 0; i < fn.insts[id].count; ++i)
+      fn.operand(id, i) = resolve(fn.operand(id, i));
+    auto &inst = fn.insts[id];
+    if (inst.op != Opcode::Br && inst.op != Opcode::CondBr)
+      continue;
+    if (inst.imm == loop.header)
+      edges.push_back({id, false});
+    else
+      inst.imm = block_map.at(inst.imm);
+    if (inst.op == Opcode::CondBr && inst.imm2 == loop.header)
+      edges.push_back({id, true});
+    else if (inst.op == Opcode::CondBr)
+      inst.imm2 = block_map.at(inst.imm2);
+  }
+
+  // The first copy is entered from the unrolled header, the others from the
+  // latch of the copy before them
+  auto entry = block_map.at(counted.body);
+  for (const auto &[block, copy] : block_map) {
+    for (auto pred : fn.blocks[block].preds) {
+      if (pred != loop.header)
+        fn.blocks[copy].preds.push_back(block_map.at(pred));
+      else
+        fn.blocks[copy].preds.push_back(
+            previous_latch == NONE ? unrolled : previous_latch);
+    }
+  }
+  if (previous_latch == NONE) {
+    fn.insts[fn.blocks[unrolled].insts.back()].imm = entry;
+  } else {
+    for (auto [id, second] : back_edges)
+      (second ? fn.insts[id].imm2 : fn.insts[id].imm) = entry;
+  }
+
+  std::map<ValueId, ValueId> next;
+  auto latch_index = static_cast<uint32_t>(
+      std::find(fn.blocks[loop.header].preds.begin(),
+                fn.blocks[loop.header].preds.end(), counted.latch) -
+      fn.blocks[loop.header].preds.begin());
+  for (auto phi : phis)
+    next[phi] = resolve(fn.operand(phi, latch_index));
+  incoming = std::move(next);
+  back_edges = std::move(edges);
+  previous_latch = block_map.at(counted.latch);
+}
+
+bool LoopUnroller::run() {
+  auto header = loop.header;
+  auto preheader = loop.preheader;
+  const auto &header_insts = fn.blocks[header].insts;
+  phis.assign(header_insts.begin(), header_insts.end() - 2);
+
+  // The unrolled loop runs while `factor - 1` more steps stay within the
+  // bound, so its own bound is moved towards the start by that much
+  int64_t distance = int64_t{factor - 1} * counted.step;
+  ValueId limit;
+  ValueId fits = NONE; // Whether the moved bound did not wrap, NONE if known
+  const auto &bound = fn.insts[counted.bound];
+  if (bound.op == Opcode::Const && bound.type == TypeTable::Int) {
+    auto moved = module.constants[bound.imm].integer - distance;
+    if (moved < INT32_MIN || moved > INT32_MAX)
+      return false;
+    limit = constant(preheader, static_cast<int32_t>(moved));
+  } else {
+    auto amount = constant(preheader, static_cast<int32_t>(distance));
+    limit = insert(preheader, Inst{Opcode::Sub, TypeTable::Int},
+                   {counted.bound, amount});
+    // Counting up the limit has to end up below the bound, counting down
+    // above it
+    fits = insert(preheader,
+                  Inst{counted.step > 0 ? Opcode::Lt : Opcode::Gt,
+                       TypeTable::Bool},
+                  {limit, counted.bound});
+  }
+
+  unrolled = fn.add_block();
+  fn.blocks[unrolled].counted_loop = true;
+  auto preheader_index = static_cast<uint32_t>(
+      std::find(fn.blocks[header].preds.begin(), fn.blocks[header].preds.end(),
+                preheader) -
+      fn.blocks[header].preds.begin());
+  for (auto phi : phis) {
+    auto copy =
+        fn.append(unrolled, Inst{Opcode::Phi, fn.insts[phi].type},
+                  {fn.operand(phi, preheader_index), NONE});
+    incoming[phi] = copy;
+  }
+  std::vector<ValueId> compared;
+  for (uint32_t i = 0; i < 2; ++i) {
+    auto operand = fn.operand(counted.condition, i);
+    compared.push_back(operand == counted.induction ? incoming[operand]
+                                                    : limit);
+  }
+  auto condition = fn.append(
+      unrolled, Inst{fn.insts[counted.condition].op, TypeTable::Bool},
+      compared);
+  fn.append(unrolled, Inst{Opcode::CondBr, TypeTable::Void, NONE, 0, 0, NONE,
+                           header},
+            {condition});
+
+  // Keeps the unrolled header's phis, they are completed after the last copy
+  auto unrolled_phis = incoming;
+  for (uint32_t i = 0; i < factor; ++i)
+    copy_body();
+  for (auto [id, second] : back_edges)
+    (second ? fn.insts[id].imm2 : fn.insts[id].imm) = unrolled;
+  fn.blocks[unrolled].preds = {preheader, previous_latch};
+  for (auto phi : phis)
+    fn.operand(unrolled_phis[phi], 1) = incoming[phi];
+
+  // Trips the unrolled loop left over run in the original loop, which is now
+  // entered from the unrolled header
+  auto branch = fn.blocks[preheader].insts.back();
+  if (fits == NONE) {
+    fn.insts[branch].imm = unrolled;
+    fn.blocks[header].preds[preheader_index] = unrolled;
+    for (auto phi : phis)
+      fn.operand(phi, preheader_index) = unrolled_phis[phi];
+    return true;
+  }
+  // With an unknown bound the preheader also skips straight to the original
+  // loop when the unrolled bound would wrap
+  fn.insts[branch].op = Opcode::CondBr;
+  fn.insts[branch].imm = unrolled;
+  fn.insts[branch].imm2 = header;
+  set_operands(branch, {fits});
+  fn.blocks[header].preds.push_back(unrolled);
+  for (auto phi : phis) {
+    std::vector<ValueId> args;
+    for (uint32_t i = 0; i < fn.insts[phi].count; ++i)
+      args.push_back(fn.operand(phi, i));
+    args.push_back(unrolled_phis[phi]);
+    set_operands(phi, args);
+  }
+  return true;
+}
+
+} // namespace
+
+void unroll_loops(Module &module, const PassOptions &options) {
+  spdlog::debug("[ir] Unrolling counted loops");
+  for (auto &fn : module.functions) {
+    if (fn.kind != FunctionKind::Defined)
+      continue;
+    auto idom = compute_dominators(fn);
+    auto loops = find_loops(fn, idom);
+
+    // Every loop is looked at before any is changed, unrolling adds blocks
+    // the loops do not know about
+    std::vector<std::pair<const Loop *, CountedLoop>> candidates;
+    for (const auto &loop : loops) {
+      std::string reason;
+      auto counted = find_counted_loop(module, fn, loop, reason);
+      if (!counted) {
+        remark(options, "unroll", fn,
+               std::format("loop at bb{} is not counted: {}", loop.header,
+                           reason));
+        continue;
+      }
+      fn.blocks[loop.header].counted_loop = true;
+      if (options.unroll_factor <= 1)
+        continue;
+
+      auto nested = std::any_of(loops.begin(), loops.end(), [&](const Loop &l) {
+        return l.header != loop.header && loop.contains[l.header];
+      });
+      uint32_t size = 0;
+      for (auto block : loop.blocks) {
+        if (block != loop.header)
+          size += static_cast<uint32_t>(fn.blocks[block].insts.size());
+      }
+      auto trips = trip_count(module, fn, *counted);
+      if (nested) {
+        reason = "it contains another loop";
+      } else if (size * options.unroll_factor > max_unrolled_size) {
+        reason = std::format("its body has {} instructions, too many to copy "
+                             "{} times",
+                             size, options.unroll_factor);
+      } else if (trips && *trips < options.unroll_factor) {
+        reason = std::format("it only runs {} time{}", *trips,
+                             *trips == 1 ? "" : "s");
+      } else {
+        candidates.push_back({&loop, *counted});
+        continue;
+      }
+      remark(options, "unroll", fn,
+             std::format("counted loop at bb{} not unrolled: {}", loop.header,
+                         reason));
+    }
+
+    for (const auto &[loop, counted] : candidates) {
+      if (!LoopUnroller(module, fn, *loop, counted, options.unroll_factor)
+               .run()) {
+        remark(options, "unroll", fn,
+               std::format("counted loop at bb{} not unrolled: its bound is "
+                           "too close to the end of the int range",
+                           loop->header));
+        continue;
+      }
+      remark(options, "unroll", fn,
+             std::format("unrolled the loop at bb{} by {} (%{} steps by {} "
+                         "while {} %{})",
+                         loop->header, options.unroll_factor,
+                         counted.induction, counted.step,
+                         opcode_name(counted.relation), counted.bound));
+    }
+  }
+}
+
+} // namespace ir
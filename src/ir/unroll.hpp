@@ -0,0 +1,15 @@
+#pragma once
+
+#include "ir.hpp"
+#include "passes.hpp"
+
+namespace ir {
+
+// Tags the headers of counted loops (see induction.hpp) and unrolls the
+// innermost ones by `PassOptions::unroll_factor`. The unrolled loop runs
+// while at least `factor` trips are left, testing the bound once per
+// `factor` copies of the body, and hands the remaining trips to the original
+// loop. Bodies that would grow past a fixed size stay as they are.
+void unroll_loops(Module &module, const PassOptions &options);
+
+} // namespace ir
@@ -0,0 +1,536 @@
+#include "vectorize.hpp"
+#include "induction.hpp"
+#include "loops.hpp"
+#include <algorithm>
+#include <format>
+#include <map>
+#include <spdlog/spdlog.h>
+
+namespace ir {
+
+namespace {
+
+// Pairs of buffers compared at run time before a loop is left vectorized
+constexpr size_t max_overlap_checks = 8;
+
+bool is_lane_type(TypeId type) {
+  return type == TypeTable::Int || type == TypeTable::Float;
+}
+
+class LoopVectorizer {
+public:
+  LoopVectorizer(Module &module, Function &fn, const Loop &loop,
+                 const CountedLoop &counted)
+      : module(module), fn(fn), loop(loop), counted(counted) {}
+
+  // Whether every instruction of the loop can run lane by lane, `reason` says
+  // why not
+  bool analyze(std::string &reason);
+  // Returns false, changing nothing, when the bound is so close to the end of
+  // the int range that the vector loop's bound would wrap
+  bool run();
+
+  size_t overlap_checks() const { return overlaps.size(); }
+  size_t sum_count() const { return sums.size(); }
+
+private:
+  Module &module;
+  Function &fn;
+  const Loop &loop;
+  const CountedLoop &counted;
+
+  ValueId update = NONE; // Steps the induction variable in the body
+  // Header phis adding up a value on every trip, and the add doing it
+  std::map<ValueId, ValueId> sums;
+  std::vector<ValueId> bases; // Buffers accessed in the body, in order
+  std::vector<std::pair<ValueId, ValueId>> overlaps; // Stored buffer, other
+
+  BlockId guard = NONE;
+  std::map<ValueId, ValueId> lanes;  // Scalar value to its vector
+  std::map<ValueId, ValueId> splats; // Values outside the body, splatted
+
+  bool is_outside(ValueId value) const {
+    return !loop.contains[fn.insts[value].block];
+  }
+  // Values that can be given to a vector instruction, computed lane by lane
+  // in the body or the same in every lane
+  bool is_lane_value(ValueId value, TypeId type) const;
+  bool check_phis(std::string &reason);
+  bool check_body(std::string &reason);
+
+  ValueId constant(BlockId block, int32_t value) {
+    return fn.append(block, Inst{Opcode::Const, TypeTable::Int, block, 0, 0,
+                                 module.add_constant(
+                                     Constant{TypeTable::Int, value})});
+  }
+  ValueId vector_value(ValueId value);
+  // Appends to the guard whether any pair of buffers overlaps between the
+  // start and the bound, NONE when there is nothing to check
+  ValueId emit_overlap_checks();
+};
+
+bool LoopVectorizer::is_lane_value(ValueId value, TypeId type) const {
+  const auto &inst = fn.insts[value];
+  if (inst.type != type)
+    return false;
+  if (is_outside(value) || inst.op == Opcode::Const)
+    return true;
+  return inst.op == Opcode::Load || (is_binary(inst.op) && value != update &&
+                                     !is_comparison(inst.op));
+}
+
+bool LoopVectorizer::check_phis(std::string &reason) {
+  const auto &header = fn.blocks[loop.header];
+  auto latch_index = static_cast<uint32_t>(
+      std::find(header.preds.begin(), header.preds.end(), counted.latch) -
+      header.preds.begin());
+  update = fn.operand(counted.induction, latch_index);
+  for (size_t i = 0; i + 2 < header.insts.size(); ++i) {
+    auto phi = header.insts[i];
+    if (phi == counted.induction)
+      continue;
+    auto next = fn.operand(phi, latch_index);
+    const auto &add = fn.insts[next];
+    bool is_sum = add.op == Opcode::Add && add.block == counted.body &&
+                  (fn.operand(next, 0) == phi || fn.operand(next, 1) == phi);
+    if (is_sum && fn.insts[phi].type == TypeTable::Float) {
+      reason = "adding up floats in another order would round differently";
+      return false;
+    }
+    if (!is_sum || fn.insts[phi].type != TypeTable::Int) {
+      reason = "it carries a value other than a sum from one trip to the next";
+      return false;
+    }
+    sums[phi] = next;
+  }
+  return true;
+}
+
+bool LoopVectorizer::check_body(std::string &reason) {
+  // Every use inside the loop, the values of the body are not available
+  // anywhere else
+  std::map<ValueId, std::vector<std::pair<ValueId, uint32_t>>> users;
+  for (auto block : loop.blocks) {
+    for (auto id : fn.blocks[block].insts) {
+      for (uint32_t i = 0; i < fn.insts[id].count; ++i)
+        users[fn.operand(id, i)].push_back({id, i});
+    }
+  }
+
+  for (const auto &[user, index] : users[counted.induction]) {
+    auto op = fn.insts[user].op;
+    if (user != counted.condition && user != update &&
+        !(op == Opcode::ElementAddr && index == 1)) {
+      reason = "the induction variable is used as a value";
+      return false;
+    }
+  }
+  for (const auto &[phi, add] : sums) {
+    if (users[phi].size() != 1 || users[add].size() != 1) {
+      reason = "a sum is read before the end of the loop";
+      return false;
+    }
+  }
+
+  bool stores = false;
+  const auto &body = fn.blocks[counted.body].insts;
+  for (size_t i = 0; i + 1 < body.size(); ++i) {
+    auto id = body[i];
+    const auto &inst = fn.insts[id];
+    if (id == update)
+      continue;
+    switch (inst.op) {
+    case Opcode::Const:
+      if (!is_lane_type(inst.type)) {
+        reason = "it uses a constant other than an int or a float";
+        return false;
+      }
+      break;
+    case Opcode::ElementAddr: {
+      auto base = fn.operand(id, 0);
+      bool only_accessed =
+          std::all_of(users[id].begin(), users[id].end(), [&](auto use) {
+            auto op = fn.insts[use.first].op;
+            return (op == Opcode::Load || op == Opcode::Store) &&
+                   use.second == 0;
+          });
+      if (fn.operand(id, 1) != counted.induction || !is_outside(base) ||
+          !only_accessed) {
+        reason = "it accesses memory other than `p[i]` with a fixed `p`";
+        return false;
+      }
+      if (!is_lane_type(module.types[inst.type].pointee)) {
+        reason = "it accesses elements other than ints and floats";
+        return false;
+      }
+      if (std::find(bases.begin(), bases.end(), base) == bases.end())
+        bases.push_back(base);
+      break;
+    }
+    case Opcode::Load:
+    case Opcode::Store: {
+      auto address = fn.operand(id, 0);
+      if (fn.insts[address].op != Opcode::ElementAddr ||
+          fn.insts[address].block != counted.body) {
+        reason = "it accesses memory other than `p[i]` with a fixed `p`";
+        return false;
+      }
+      if (inst.op == Opcode::Store) {
+        stores = true;
+        auto value = fn.operand(id, 1);
+        if (!is_lane_value(value, fn.insts[value].type)) {
+          reason = "it stores a value that is not computed lane by lane";
+          return false;
+        }
+      }
+      break;
+    }
+    case Opcode::Add:
+    case Opcode::Sub:
+    case Opcode::Mul:
+    case Opcode::Div: {
+      // Integer division has no vector instruction to map to
+      if (!is_lane_type(inst.type) ||
+          (inst.op == Opcode::Div && inst.type != TypeTable::Float)) {
+        reason = std::format("it has a {} of {}", opcode_name(inst.op),
+                             module.types.to_string(inst.type));
+        return false;
+      }
+      auto sum = std::find_if(sums.begin(), sums.end(),
+                              [&](auto entry) { return entry.second == id; });
+      for (uint32_t k = 0; k < 2; ++k) {
+        auto operand = fn.operand(id, k);
+        if (sum != sums.end() && operand == sum->first)
+          continue;
+        if (!is_lane_value(operand, inst.type)) {
+          reason = "it computes with a value that is not computed lane by "
+                   "lane";
+          return false;
+        }
+      }
+      break;
+    }
+    default:
+      reason = std::format("it has a {}", opcode_name(inst.op));
+      return false;
+    }
+  }
+  if (!stores && sums.empty()) {
+    reason = "it neither stores to memory nor adds up a value";
+    return false;
+  }
+
+  // A store through one buffer can change what the next lanes read from, or
+  // write to, another
+  for (auto stored : bases) {
+    bool is_stored = false;
+    for (auto id : body) {
+      const auto &inst = fn.insts[id];
+      if (inst.op == Opcode::Store &&
+          fn.operand(fn.operand(id, 0), 0) == stored)
+        is_stored = true;
+    }
+    if (!is_stored)
+      continue;
+    for (auto other : bases) {
+      if (other == stored)
+        continue;
+      auto seen = std::find(overlaps.begin(), overlaps.end(),
+                            std::make_pair(other, stored));
+      if (seen == overlaps.end())
+        overlaps.push_back({stored, other});
+    }
+  }
+  if (overlaps.size() > max_overlap_checks) {
+    reason = std::format("its buffers would need {} overlap checks",
+                         overlaps.size());
+    return false;
+  }
+  return true;
+}
+
+bool LoopVectorizer::analyze(std::string &reason) {
+  if (counted.step != 1) {
+    reason = "the induction variable does not step by one";
+    return false;
+  }
+  if (loop.blocks.size() != 2) {
+    reason = "its body has more than one block";
+    return false;
+  }
+  return check_phis(reason) && check_body(reason);
+}
+
+ValueId LoopVectorizer::vector_value(ValueId value) {
+  if (auto found = lanes.find(value); found != lanes.end())
+    return found->second;
+  if (auto found = splats.find(value); found != splats.end())
+    return found->second;
+  auto scalar = value;
+  const auto &inst = fn.insts[value];
+  if (!is_outside(value)) {
+    // A constant of the body, copied so the guard can splat it
+    scalar = fn.append(guard, Inst{Opcode::Const, inst.type, guard, 0, 0,
+                                   inst.imm});
+  }
+  auto splat = fn.append(guard, Inst{Opcode::Splat,
+                                     module.types.vector_of(inst.type)},
+                         {scalar});
+  splats[value] = splat;
+  return splat;
+}
+
+ValueId LoopVectorizer::emit_overlap_checks() {
+  if (overlaps.empty())
+    return NONE;
+  auto end = counted.bound;
+  if (counted.relation == Opcode::Le) {
+    end = fn.append(guard, Inst{Opcode::Add, TypeTable::Int},
+                    {end, constant(guard, 1)});
+  }
+  // First and one past the last byte touched through each buffer
+  auto bytes = module.types.pointer_to(TypeTable::Char);
+  std::map<ValueId, std::pair<ValueId, ValueId>> ranges;
+  for (auto base : bases) {
+    auto type = fn.insts[base].type;
+    auto first = fn.append(guard, Inst{Opcode::ElementAddr, type},
+                           {base, counted.start});
+    auto last = fn.append(guard, Inst{Opcode::ElementAddr, type}, {base, end});
+    ranges[base] = {fn.append(guard, Inst{Opcode::Bitcast, bytes}, {first}),
+                    fn.append(guard, Inst{Opcode::Bitcast, bytes}, {last})};
+  }
+  ValueId any = NONE;
+  for (auto [stored, other] : overlaps) {
+    auto [stored_first, stored_last] = ranges[stored];
+    auto [other_first, other_last] = ranges[other];
+    auto before = fn.append(guard, Inst{Opcode::Lt, TypeTable::Bool},
+                            {stored_first, other_last});
+    auto after = fn.append(guard, Inst{Opcode::Lt, TypeTable::Bool},
+                           {other_first, stored_last});
+    auto overlap = fn.append(guard, Inst{Opcode::And, TypeTable::Bool},
+                             {before, after});
+    any = any == NONE ? overlap
+                      : fn.append(guard, Inst{Opcode::Or, TypeTable::Bool},
+                                  {any, overlap});
+  }
+  return any;
+}
+
+bool LoopVectorizer::run() {
+  auto header = loop.header;
+  auto preheader = loop.preheader;
+
+  // The vector loop runs while all lanes stay within the bound, so its bound
+  // is moved towards the start by the lanes after the first
+  ValueId limit;
+  ValueId skip = NONE; // Whether to leave every trip to the original loop
+  const auto &bound = fn.insts[counted.bound];
+  guard = fn.add_block();
+  fn.blocks[guard].preds = {preheader};
+  if (bound.op == Opcode::Const && bound.type == TypeTable::Int) {
+    auto moved = module.constants[bound.imm].integer - (vector_lanes - 1);
+    if (moved < INT32_MIN) {
+      fn.blocks.pop_back();
+      return false;
+    }
+    limit = constant(guard, static_cast<int32_t>(moved));
+  } else {
+    limit = fn.append(guard, Inst{Opcode::Sub, TypeTable::Int},
+                      {counted.bound, constant(guard, vector_lanes - 1)});
+    skip = fn.append(guard, Inst{Opcode::Ge, TypeTable::Bool},
+                     {limit, counted.bound});
+  }
+  if (auto overlap = emit_overlap_checks(); overlap != NONE) {
+    skip = skip == NONE ? overlap
+                        : fn.append(guard, Inst{Opcode::Or, TypeTable::Bool},
+                                    {skip, overlap});
+  }
+  fn.insts[fn.blocks[preheader].insts.back()].imm = guard;
+
+  // The vector loop gets a preheader of its own, so that unrolling it later
+  // finds one
+  auto vector_preheader = fn.add_block();
+  auto vector_header = fn.add_block();
+  auto vector_body = fn.add_block();
+  auto exit = fn.add_block();
+  auto index = fn.append(vector_header, Inst{Opcode::Phi, TypeTable::Int},
+                         {counted.start, NONE});
+  std::map<ValueId, ValueId> partial; // Sum phi to its vector of partial sums
+  for (const auto &[phi, add] : sums) {
+    auto zero = fn.append(guard, Inst{Opcode::Zero,
+                                      module.types.vector_of(TypeTable::Int)});
+    partial[phi] = fn.append(
+        vector_header,
+        Inst{Opcode::Phi, module.types.vector_of(TypeTable::Int)},
+        {zero, NONE});
+  }
+  auto condition =
+      fn.append(vector_header, Inst{counted.relation, TypeTable::Bool},
+                {index, limit});
+  fn.append(vector_header, Inst{Opcode::CondBr, TypeTable::Void, NONE, 0, 0,
+                                vector_body, exit},
+            {condition});
+  fn.blocks[vector_header].preds = {vector_preheader, vector_body};
+
+  // The body once for every lane, in the original order
+  const auto &body = fn.blocks[counted.body].insts;
+  for (size_t i = 0; i + 1 < body.size(); ++i) {
+    auto id = body[i];
+    auto inst = fn.insts[id];
+    if (id == update || inst.op == Opcode::Const)
+      continue;
+    switch (inst.op) {
+    case Opcode::ElementAddr:
+      lanes[id] = fn.append(vector_body, Inst{Opcode::ElementAddr, inst.type},
+                            {fn.operand(id, 0), index});
+      break;
+    case Opcode::Load:
+      lanes[id] = fn.append(vector_body,
+                            Inst{Opcode::VecLoad,
+                                 module.types.vector_of(inst.type)},
+                            {lanes[fn.operand(id, 0)]});
+      break;
+    case Opcode::Store:
+      fn.append(vector_body, Inst{Opcode::VecStore},
+                {lanes[fn.operand(id, 0)], vector_value(fn.operand(id, 1))});
+      break;
+    default: {
+      std::vector<ValueId> args;
+      for (uint32_t k = 0; k < 2; ++k) {
+        auto operand = fn.operand(id, k);
+        args.push_back(partial.contains(operand) ? partial[operand]
+                                                 : vector_value(operand));
+      }
+      lanes[id] = fn.append(
+          vector_body, Inst{inst.op, module.types.vector_of(inst.type)}, args);
+      break;
+    }
+    }
+  }
+  auto next = fn.append(vector_body, Inst{Opcode::Add, TypeTable::Int},
+                        {index, constant(vector_body, vector_lanes)});
+  fn.append(vector_body, Inst{Opcode::Br, TypeTable::Void, NONE, 0, 0,
+                              vector_header});
+  fn.blocks[vector_body].preds = {vector_header};
+  fn.operand(index, 1) = next;
+  for (const auto &[phi, add] : sums)
+    fn.operand(partial[phi], 1) = lanes[add];
+
+  fn.append(vector_preheader, Inst{Opcode::Br, TypeTable::Void, NONE, 0, 0,
+                                   vector_header});
+  fn.blocks[vector_preheader].preds = {guard};
+  if (skip == NONE) {
+    fn.append(guard, Inst{Opcode::Br, TypeTable::Void, NONE, 0, 0,
+                          vector_preheader});
+  } else {
+    fn.append(guard, Inst{Opcode::CondBr, TypeTable::Void, NONE, 0, 0, exit,
+                          vector_preheader},
+              {skip});
+  }
+
+  // The original loop picks up where the vector loop stopped, with the lanes
+  // of each sum added to the value it started with
+  const auto &preds = fn.blocks[header].preds;
+  auto preheader_index = static_cast<uint32_t>(
+      std::find(preds.begin(), preds.end(), preheader) - preds.begin());
+  std::vector<BlockId> exit_preds = {vector_header};
+  if (skip != NONE)
+    exit_preds.insert(exit_preds.begin(), guard);
+  auto merge = [&](ValueId from_guard, ValueId from_loop) {
+    if (skip == NONE)
+      return from_loop;
+    return fn.append(exit, Inst{Opcode::Phi, fn.insts[from_loop].type},
+                     {from_guard, from_loop});
+  };
+  auto resumed = merge(counted.start, index);
+  std::map<ValueId, ValueId> totals;
+  for (const auto &[phi, add] : sums) {
+    auto zero = fn.operand(partial[phi], 0);
+    totals[phi] = merge(zero, partial[phi]);
+  }
+  for (const auto &[phi, add] : sums) {
+    auto reduced = fn.append(exit, Inst{Opcode::ReduceAdd, TypeTable::Int},
+                             {totals[phi]});
+    totals[phi] = fn.append(exit, Inst{Opcode::Add, TypeTable::Int},
+                            {fn.operand(phi, preheader_index), reduced});
+  }
+  fn.append(exit, Inst{Opcode::Br, TypeTable::Void, NONE, 0, 0, header});
+  fn.blocks[exit].preds = exit_preds;
+
+  fn.blocks[header].preds[preheader_index] = exit;
+  fn.operand(counted.induction, preheader_index) = resumed;
+  for (const auto &[phi, add] : sums)
+    fn.operand(phi, preheader_index) = totals[phi];
+  return true;
+}
+
+} // namespace
+
+void vectorize_loops(Module &module, const PassOptions &options) {
+  spdlog::debug("[ir] Vectorizing counted loops");
+  for (auto &fn : module.functions) {
+    if (fn.kind != FunctionKind::Defined)
+      continue;
+    auto idom = compute_dominators(fn);
+    auto loops = find_loops(fn, idom);
+
+    // Every loop is looked at before any is changed, vectorizing adds blocks
+    // the loops do not know about
+    std::vector<std::pair<const Loop *, CountedLoop>> candidates;
+    for (const auto &loop : loops) {
+      std::string reason;
+      auto counted = find_counted_loop(module, fn, loop, reason);
+      auto nested = std::any_of(loops.begin(), loops.end(), [&](const Loop &l) {
+        return l.header != loop.header && loop.contains[l.header];
+      });
+      if (!counted) {
+        reason = "it is not counted, " + reason;
+      } else if (nested) {
+        reason = "it contains another loop";
+      } else if (auto trips = trip_count(module, fn, *counted);
+                 trips && *trips < vector_lanes) {
+        reason = std::format("it only runs {} time{}", *trips,
+                             *trips == 1 ? "" : "s");
+      } else {
+        candidates.push_back({&loop, *counted});
+        continue;
+      }
+      remark(options, "vectorize", fn,
+             std::format("loop at bb{} not vectorized: {}", loop.header,
+                         reason));
+    }
+
+    for (const auto &[loop, counted] : candidates) {
+      LoopVectorizer vectorizer(module, fn, *loop, counted);
+      std::string reason;
+      if (!vectorizer.analyze(reason)) {
+        remark(options, "vectorize", fn,
+               std::format("loop at bb{} not vectorized: {}", loop->header,
+                           reason));
+        continue;
+      }
+      if (!vectorizer.run()) {
+        remark(options, "vectorize", fn,
+               std::format("loop at bb{} not vectorized: its bound is too "
+                           "close to the end of the int range",
+                           loop->header));
+        continue;
+      }
+      std::string details;
+      if (vectorizer.sum_count() > 0) {
+        details += std::format(", {} sum{}", vectorizer.sum_count(),
+                               vectorizer.sum_count() == 1 ? "" : "s");
+      }
+      if (vectorizer.overlap_checks() > 0) {
+        details += std::format(", {} overlap check{} at run time",
+                               vectorizer.overlap_checks(),
+                               vectorizer.overlap_checks() == 1 ? "" : "s");
+      }
+      remark(options, "vectorize", fn,
+             std::format("vectorized the loop at bb{} with {} lanes{}",
+                         loop->header, vector_lanes, details));
+    }
+  }
+}
+
+} // namespace ir
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "ir.hpp"
+#include "passes.hpp"
+
+namespace ir {
+
+// Rewrites innermost counted loops that step by one and work on buffer
+// elements `p[i]` to handle `vector_lanes` elements per trip. The body may
+// load and store ints and floats, compute with +, - and * (and / on floats)
+// and sum ints. A guard in front of the vector loop sends every trip to the
+// original loop when the stored buffers overlap the others, the original
+// loop also runs the trips left over by the vector loop.
+void vectorize_loops(Module &module, const PassOptions &options);
+
+} // namespace ir
@@ -0,0 +1,346 @@
+#include "verify.hpp"
+#include <algorithm>
+#include <format>
+
+namespace ir {
+
+namespace {
+
+class Verifier {
+public:
+  Verifier(const Module &module, const Function &fn,
+           std::vector<std::string> &errors)
+      : module(module), fn(fn), errors(errors) {}
+
+  void run();
+
+private:
+  const Module &module;
+  const Function &fn;
+  std::vector<std::string> &errors;
+  std::vector<uint32_t> position; // Index of each instruction in its block
+  std::vector<BlockId> idom;
+
+  void error(ValueId inst, const std::string &message) {
+    errors.push_back(std::format("{}: %{}: {}", fn.name, inst, message));
+  }
+  void block_error(BlockId block, const std::string &message) {
+    errors.push_back(std::format("{}: bb{}: {}", fn.name, block, message));
+  }
+
+  const IRType &type_of(ValueId value) const {
+    return module.types[fn.insts[value].type];
+  }
+
+  void check_structure();
+  void check_preds();
+  void check_operands(ValueId id);
+  void check_types(ValueId id);
+};
+
+void Verifier::check_structure() {
+  position.assign(fn.insts.size(), NONE);
+  for (BlockId b = 0; b < fn.blocks.size(); ++b) {
+    const auto &insts = fn.blocks[b].insts;
+    if (insts.empty()) {
+      block_error(b, "empty block");
+      continue;
+    }
+    bool phis_allowed = true;
+    for (uint32_t i = 0; i < insts.size(); ++i) {
+      auto id = insts[i];
+      if (id >= fn.insts.size()) {
+        block_error(b, std::format("lists unknown instruction %{}", id));
+        continue;
+      }
+      const auto &inst = fn.insts[id];
+      if (position[id] != NONE)
+        error(id, "listed more than once");
+      position[id] = i;
+      if (inst.block != b)
+        error(id, std::format("belongs to bb{} but is listed in bb{}",
+                              inst.block, b));
+      if (inst.op == Opcode::Phi && !phis_allowed)
+        error(id, "phi after a non-phi instruction");
+      if (inst.op != Opcode::Phi)
+        phis_allowed = false;
+      bool last = i + 1 == insts.size();
+      if (is_terminator(inst.op) && !last)
+        error(id, "terminator in the middle of a block");
+      if (!is_terminator(inst.op) && last)
+        block_error(b, "does not end in a terminator");
+      for (auto target : fn.successors(b)) {
+        if (last && target >= fn.blocks.size())
+          error(id, std::format("branches to unknown block bb{}", target));
+      }
+    }
+  }
+}
+
+// The preds lists have to match the branches exactly, since phi operands are
+// matched to predecessors by position
+void Verifier::check_preds() {
+  std::vector<std::vector<BlockId>> expected(fn.blocks.size());
+  for (BlockId b = 0; b < fn.blocks.size(); ++b) {
+    for (auto succ : fn.successors(b)) {
+      if (succ < fn.blocks.size())
+        expected[succ].push_back(b);
+    }
+  }
+  for (BlockId b = 0; b < fn.blocks.size(); ++b) {
+    auto actual = fn.blocks[b].preds;
+    std::sort(actual.begin(), actual.end());
+    std::sort(expected[b].begin(), expected[b].end());
+    if (actual != expected[b])
+      block_error(b, "predecessor list does not match the branches");
+  }
+  if (!fn.blocks.empty() && !fn.blocks[0].preds.empty())
+    block_error(0, "the entry block has predecessors");
+}
+
+void Verifier::check_operands(ValueId id) {
+  const auto &inst = fn.insts[id];
+  if (inst.first + inst.count > fn.operands.size()) {
+    error(id, "operands out of range");
+    return;
+  }
+  if (inst.op == Opcode::Phi &&
+      inst.count != fn.blocks[inst.block].preds.size()) {
+    error(id, std::format("phi has {} operands for {} predecessors",
+                          inst.count, fn.blocks[inst.block].preds.size()));
+    return;
+  }
+  for (uint32_t i = 0; i < inst.count; ++i) {
+    auto operand = fn.operand(id, i);
+    if (operand >= fn.insts.size() || position[operand] == NONE) {
+      error(id, std::format("uses %{} which is not in any block", operand));
+      continue;
+    }
+    if (fn.insts[operand].type == TypeTable::Void) {
+      error(id, std::format("uses %{} which has no value", operand));
+      continue;
+    }
+    auto def_block = fn.insts[operand].block;
+    // A phi operand only has to be available at the end of its predecessor
+    auto use_block =
+        inst.op == Opcode::Phi ? fn.blocks[inst.block].preds[i] : inst.block;
+    if (idom[use_block] == NONE && use_block != 0)
+      continue; // Unreachable code
+    bool ok = def_block == use_block
+                  ? inst.op == Opcode::Phi || position[operand] < position[id]
+                  : dominates(idom, def_block, use_block);
+    if (!ok)
+      error(id, std::format("uses %{} which does not dominate it", operand));
+  }
+}
+
+void Verifier::check_types(ValueId id) {
+  const auto &inst = fn.insts[id];
+  auto expect = [&](bool condition, const char *message) {
+    if (!condition)
+      error(id, std::format("{}: {}", opcode_name(inst.op), message));
+  };
+  auto operand_type = [&](uint32_t i) {
+    return fn.insts[fn.operand(id, i)].type;
+  };
+
+  if (is_binary(inst.op)) {
+    expect(inst.count == 2, "expects two operands");
+    if (inst.count != 2)
+      return;
+    expect(operand_type(0) == operand_type(1), "operand types differ");
+    if (is_comparison(inst.op)) {
+      expect(inst.type == TypeTable::Bool, "comparisons produce a bool");
+    } else {
+      expect(inst.type == operand_type(0), "result type differs from operands");
+    }
+    return;
+  }
+
+  switch (inst.op) {
+  case Opcode::Const:
+    expect(inst.imm < module.constants.size(), "unknown constant");
+    if (inst.imm < module.constants.size())
+      expect(module.constants[inst.imm].type == inst.type,
+             "type differs from the constant");
+    break;
+  case Opcode::Param:
+    expect(inst.imm < fn.params.size() && fn.params[inst.imm] == inst.type,
+           "does not match the parameter");
+    expect(inst.block == 0, "outside of the entry block");
+    break;
+  case Opcode::Alloca:
+    expect(module.types[inst.type].kind == TypeKind::Pointer,
+           "has to produce a pointer");
+    if (module.types[inst.type].kind == TypeKind::Pointer)
+      expect((module.types[inst.type].pointee == TypeTable::Void) ==
+                 (inst.imm > 0),
+             "needs a byte count exactly for void slots");
+    break;
+  case Opcode::Load:
+    expect(inst.count == 1 && type_of(fn.operand(id, 0)).kind ==
+                                  TypeKind::Pointer &&
+               type_of(fn.operand(id, 0)).pointee == inst.type,
+           "expects a pointer to the result type");
+    break;
+  case Opcode::Store:
+    expect(inst.count == 2 && type_of(fn.operand(id, 0)).kind ==
+                                  TypeKind::Pointer &&
+               type_of(fn.operand(id, 0)).pointee == operand_type(1),
+           "expects a pointer to the stored type");
+    break;
+  case Opcode::FieldAddr:
+  case Opcode::Field: {
+    if (inst.count != 1) {
+      expect(false, "expects one operand");
+      break;
+    }
+    auto base = operand_type(0);
+    if (inst.op == Opcode::FieldAddr) {
+      base = module.types[base].pointee;
+      if (base == NONE) {
+        expect(false, "expects a pointer to a struct");
+        break;
+      }
+    }
+    const auto &struct_type = module.types[base];
+    expect(struct_type.kind == TypeKind::Struct &&
+               inst.imm < struct_type.fields.size(),
+           "expects a struct with the field");
+    if (struct_type.kind == TypeKind::Struct &&
+        inst.imm < struct_type.fields.size()) {
+      auto field = struct_type.fields[inst.imm];
+      expect(inst.op == Opcode::Field
+                 ? inst.type == field
+                 : module.types[inst.type].pointee == field,
+             "result does not match the field type");
+    }
+    break;
+  }
+  case Opcode::MakeStruct: {
+    const auto &struct_type = module.types[inst.type];
+    expect(struct_type.kind == TypeKind::Struct &&
+               inst.count == struct_type.fields.size(),
+           "expects one operand per field");
+    if (struct_type.kind == TypeKind::Struct &&
+        inst.count == struct_type.fields.size()) {
+      for (uint32_t i = 0; i < inst.count; ++i)
+        expect(operand_type(i) == struct_type.fields[i],
+               "operand does not match the field type");
+    }
+    break;
+  }
+  case Opcode::Bitcast:
+    expect(inst.count == 1 &&
+               type_of(fn.operand(id, 0)).kind == TypeKind::Pointer &&
+               module.types[inst.type].kind == TypeKind::Pointer,
+           "only converts between pointers");
+    break;
+  case Opcode::SizeOf:
+    expect(inst.imm < module.types.types.size() &&
+               inst.type == TypeTable::Int,
+           "expects a known type and produces an int");
+    break;
+  case Opcode::ElementAddr:
+    expect(inst.count == 2 && module.types[inst.type].kind ==
+                                  TypeKind::Pointer &&
+               operand_type(0) == inst.type &&
+               operand_type(1) == TypeTable::Int,
+           "expects a pointer of the result type and an int");
+    break;
+  case Opcode::VecLoad:
+  case Opcode::VecStore: {
+    auto vector = inst.op == Opcode::VecLoad
+                      ? inst.type
+                      : (inst.count == 2 ? operand_type(1) : TypeTable::Void);
+    expect(inst.count == (inst.op == Opcode::VecLoad ? 1 : 2) &&
+               module.types[vector].kind == TypeKind::Vector &&
+               type_of(fn.operand(id, 0)).kind == TypeKind::Pointer &&
+               type_of(fn.operand(id, 0)).pointee ==
+                   module.types[vector].pointee,
+           "expects a pointer to the lane type");
+    break;
+  }
+  case Opcode::Splat:
+    expect(inst.count == 1 &&
+               module.types[inst.type].kind == TypeKind::Vector &&
+               module.types[inst.type].pointee == operand_type(0),
+           "expects a value of the lane type");
+    break;
+  case Opcode::ReduceAdd:
+    expect(inst.count == 1 &&
+               type_of(fn.operand(id, 0)).kind == TypeKind::Vector &&
+               type_of(fn.operand(id, 0)).pointee == inst.type,
+           "expects a vector of the result type");
+    break;
+  case Opcode::Call: {
+    if (inst.imm >= module.functions.size()) {
+      expect(false, "unknown callee");
+      break;
+    }
+    const auto &callee = module.functions[inst.imm];
+    expect(inst.type == callee.return_type, "result differs from the callee");
+    if (callee.variadic)
+      break;
+    expect(inst.count == callee.params.size(), "wrong number of arguments");
+    for (uint32_t i = 0; i < std::min<size_t>(inst.count, callee.params.size());
+         ++i) {
+      expect(operand_type(i) == callee.params[i],
+             "argument does not match the parameter type");
+    }
+    break;
+  }
+  case Opcode::Phi:
+    for (uint32_t i = 0; i < inst.count; ++i)
+      expect(operand_type(i) == inst.type, "operand type differs");
+    break;
+  case Opcode::CondBr:
+    expect(inst.count == 1 && operand_type(0) == TypeTable::Bool,
+           "expects a bool condition");
+    break;
+  case Opcode::Ret:
+    if (fn.return_type == TypeTable::Void) {
+      expect(inst.count == 0, "returns a value from a void function");
+    } else {
+      expect(inst.count == 1 && operand_type(0) == fn.return_type,
+             "returns the wrong type");
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+void Verifier::run() {
+  if (fn.blocks.empty()) {
+    errors.push_back(fn.name + ": defined function without blocks");
+    return;
+  }
+  auto errors_before = errors.size();
+  check_structure();
+  check_preds();
+  // Operand checks index blocks and positions, which have to be sane first
+  if (errors.size() != errors_before)
+    return;
+  idom = compute_dominators(fn);
+  for (const auto &block : fn.blocks) {
+    for (auto id : block.insts) {
+      check_operands(id);
+      check_types(id);
+    }
+  }
+}
+
+} // namespace
+
+std::vector<std::string> verify(const Module &module) {
+  std::vector<std::string> errors;
+  for (const auto &fn : module.functions) {
+    if (fn.kind != FunctionKind::Defined)
+      continue;
+    Verifier(module, fn, errors).run();
+  }
+  return errors;
+}
+
+} // namespace ir
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "ir.hpp"
+#include <string>
+#include <vector>
+
+namespace ir {
+
+// Checks the structural invariants every pass relies on: blocks end in
+// exactly one terminator, phis come first and match the predecessors, the
+// predecessor lists agree with the branches, operands are typed consistently
+// and every definition dominates its uses. Returns one message per problem.
+std::vector<std::string> verify(const Module &module);
+
+} // namespace ir
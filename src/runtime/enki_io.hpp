@@ -0,0 +1,114 @@
+#pragma once
+
+/* Buffered output used by programs built with the C++ backend. The generated
+code includes this header instead of <iostream>; print() appends to a
+thread-local buffer that is only written out when it fills up, when flush()
+is called, when eprint() needs the streams ordered, or when the thread exits.
+Formatting matches what iostream produced before (bools as 1/0, floats with
+six significant digits), just without the locale and sync overhead. */
+
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <unistd.h>
+
+namespace enki::io {
+
+inline void write_fd(int fd, const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t written = ::write(fd, data, length);
+    if (written <= 0)
+      return;
+    data += written;
+    length -= static_cast<size_t>(written);
+  }
+}
+
+struct OutputBuffer {
+  static constexpr size_t capacity = 64 * 1024;
+  char data[capacity];
+  size_t length = 0;
+  int fd = STDOUT_FILENO;
+
+  ~OutputBuffer() { flush(); }
+
+  void flush() {
+    write_fd(fd, data, length);
+    length = 0;
+  }
+
+  void append(const char *bytes, size_t count) {
+    if (length + count > capacity) {
+      flush();
+      // Anything larger than the buffer goes straight out
+      if (count > capacity) {
+        write_fd(fd, bytes, count);
+        return;
+      }
+    }
+    std::memcpy(data + length, bytes, count);
+    length += count;
+  }
+};
+
+// Destroyed (and thereby flushed) on return from main, std::exit and thread
+// exit, but not on abort or a crash
+inline thread_local OutputBuffer out;
+
+inline void write(const char *value) { out.append(value, std::strlen(value)); }
+inline void write(const std::string &value) {
+  out.append(value.data(), value.size());
+}
+inline void write(char value) { out.append(&value, 1); }
+inline void write(bool value) { out.append(value ? "1" : "0", 1); }
+
+inline void write(long long value) {
+  char digits[24];
+  auto result = std::to_chars(digits, digits + sizeof(digits), value);
+  out.append(digits, static_cast<size_t>(result.ptr - digits));
+}
+inline void write(int value) { write(static_cast<long long>(value)); }
+inline void write(long value) { write(static_cast<long long>(value)); }
+
+inline void write(double value) {
+  char digits[32];
+  auto result = std::to_chars(digits, digits + sizeof(digits), value,
+                              std::chars_format::general, 6);
+  out.append(digits, static_cast<size_t>(result.ptr - digits));
+}
+inline void write(float value) { write(static_cast<double>(value)); }
+
+inline void write(const void *value) {
+  char digits[24] = {'0', 'x'};
+  auto result = std::to_chars(digits + 2, digits + sizeof(digits),
+                              reinterpret_cast<std::uintptr_t>(value), 16);
+  out.append(digits, static_cast<size_t>(result.ptr - digits));
+}
+
+// enum class values print as their underlying integer
+template <typename T>
+std::enable_if_t<std::is_enum_v<T>> write(T value) {
+  write(static_cast<long long>(value));
+}
+
+template <typename T> void print(const T &value) {
+  write(value);
+  out.append("\n", 1);
+}
+
+inline void flush() { out.flush(); }
+
+// stderr is unbuffered, so pending stdout goes first to keep the two streams
+// in program order when they share a terminal
+template <typename T> void eprint(const T &value) {
+  out.flush();
+  out.fd = STDERR_FILENO;
+  write(value);
+  out.append("\n", 1);
+  out.flush();
+  out.fd = STDOUT_FILENO;
+}
+
+} // namespace enki::io
@@ -0,0 +1,122 @@
+#include "enki_rt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ENKI_OUT_BUFFER_SIZE (64 * 1024)
+
+static char out_buffer[ENKI_OUT_BUFFER_SIZE];
+static size_t out_length = 0;
+static int out_fd = STDOUT_FILENO;
+static bool flush_registered = false;
+
+enki_str enki_str_from_cstr(const char *cstr) {
+  return (enki_str){cstr, (int64_t)strlen(cstr)};
+}
+
+bool enki_str_eq(enki_str left, enki_str right) {
+  return left.len == right.len &&
+         (left.len == 0 || memcmp(left.data, right.data, left.len) == 0);
+}
+
+static void write_all(int fd, const char *data, size_t length) {
+  size_t written = 0;
+  while (written < length) {
+    ssize_t result = write(fd, data + written, length - written);
+    if (result <= 0)
+      break;
+    written += (size_t)result;
+  }
+}
+
+void enki_flush(void) {
+  write_all(out_fd, out_buffer, out_length);
+  out_length = 0;
+}
+
+void enki_eprint_begin(void) {
+  enki_flush();
+  out_fd = STDERR_FILENO;
+}
+
+void enki_eprint_end(void) {
+  enki_flush();
+  out_fd = STDOUT_FILENO;
+}
+
+static void write_bytes(const char *data, size_t length) {
+  if (!flush_registered) {
+    atexit(enki_flush);
+    flush_registered = true;
+  }
+  if (out_length + length > ENKI_OUT_BUFFER_SIZE) {
+    enki_flush();
+    // Anything larger than the buffer goes straight out
+    if (length > ENKI_OUT_BUFFER_SIZE) {
+      write_all(out_fd, data, length);
+      return;
+    }
+  }
+  memcpy(out_buffer + out_length, data, length);
+  out_length += length;
+}
+
+void enki_write_int(int64_t value) {
+  char digits[24];
+  char *end = digits + sizeof(digits);
+  char *cursor = end;
+  uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+  do {
+    *--cursor = (char)('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (value < 0)
+    *--cursor = '-';
+  write_bytes(cursor, (size_t)(end - cursor));
+}
+
+void enki_write_float(double value) {
+  char digits[32];
+  int length = snprintf(digits, sizeof(digits), "%g", value);
+  write_bytes(digits, (size_t)length);
+}
+
+void enki_write_bool(bool value) { write_bytes(value ? "1" : "0", 1); }
+
+void enki_write_char(char value) { write_bytes(&value, 1); }
+
+void enki_write_str(enki_str value) {
+  write_bytes(value.data, (size_t)value.len);
+}
+
+void enki_write_ptr(const void *value) {
+  char digits[32];
+  int length = snprintf(digits, sizeof(digits), "%p", value);
+  write_bytes(digits, (size_t)length);
+}
+
+void enki_write_newline(void) { write_bytes("\n", 1); }
+
+void *enki_alloc(int64_t size) {
+  void *ptr = malloc((size_t)size);
+  if (!ptr && size != 0) {
+    fprintf(stderr, "enki: out of memory allocating %lld bytes\n",
+            (long long)size);
+    abort();
+  }
+  return ptr;
+}
+
+void *enki_realloc(void *ptr, int64_t size) {
+  void *result = realloc(ptr, (size_t)size);
+  if (!result && size != 0) {
+    fprintf(stderr, "enki: out of memory reallocating %lld bytes\n",
+            (long long)size);
+    abort();
+  }
+  return result;
+}
+
+void enki_free(void *ptr) { free(ptr); }
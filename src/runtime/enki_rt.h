@@ -0,0 +1,57 @@
+#ifndef ENKI_RT_H
+#define ENKI_RT_H
+
+/* Minimal runtime for programs built with the C backend (--backend=c). It is
+compiled together with the generated C11 code, and only depends on libc. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Length-prefixed string. Enki strings are immutable, so an enki_str never
+// owns its data, literals point straight into the binary.
+typedef struct enki_str {
+  const char *data;
+  int64_t len;
+} enki_str;
+
+#define ENKI_STR(literal) ((enki_str){(literal), sizeof(literal) - 1})
+
+enki_str enki_str_from_cstr(const char *cstr);
+bool enki_str_eq(enki_str left, enki_str right);
+
+// Integer arithmetic wraps around as in the other backends, where plain C
+// overflow would be undefined. The conversion back to int keeps the low bits
+// with every compiler the runtime is built with.
+static inline int enki_add(int left, int right) {
+  return (int)((unsigned)left + (unsigned)right);
+}
+static inline int enki_sub(int left, int right) {
+  return (int)((unsigned)left - (unsigned)right);
+}
+static inline int enki_mul(int left, int right) {
+  return (int)((unsigned)left * (unsigned)right);
+}
+
+// Buffered stdout writer. Output is flushed when the buffer fills up and when
+// the program exits, never per line. Formatting matches what the C++ backend
+// prints through iostream (bools as 1/0, floats like %g).
+void enki_write_int(int64_t value);
+void enki_write_float(double value);
+void enki_write_bool(bool value);
+void enki_write_char(char value);
+void enki_write_str(enki_str value);
+void enki_write_ptr(const void *value);
+void enki_write_newline(void);
+void enki_flush(void);
+// Bracket the writes of an eprint: pending stdout is flushed first, then
+// everything written until enki_eprint_end goes to stderr
+void enki_eprint_begin(void);
+void enki_eprint_end(void);
+
+// Allocation helpers, abort with a message instead of returning NULL
+void *enki_alloc(int64_t size);
+void *enki_realloc(void *ptr, int64_t size);
+void enki_free(void *ptr);
+
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+
+// FNV-1a, used for the keys of the module cache and the fingerprints of
+// incremental builds. Neither has to resist collisions on purpose, only to
+// be cheap and stable across runs.
+namespace hash {
+
+constexpr uint64_t fnv_offset = 14695981039346656037ull;
+constexpr uint64_t fnv_prime = 1099511628211ull;
+
+inline uint64_t fnv1a(uint64_t hash, std::string_view bytes) {
+  for (unsigned char c : bytes) {
+    hash = (hash ^ c) * fnv_prime;
+  }
+  return hash;
+}
+
+inline uint64_t fnv1a(uint64_t hash, uint64_t value) {
+  return fnv1a(hash, std::string_view(reinterpret_cast<const char *>(&value),
+                                      sizeof(value)));
+}
+
+// Output of another build of enki may differ, so the size and modification
+// time of the running binary stand in for its version
+inline uint64_t executable_key() {
+  static const uint64_t key = [] {
+    uint64_t hash = fnv_offset;
+    std::error_code error;
+    auto exe = std::filesystem::read_symlink("/proc/self/exe", error);
+    if (error) {
+      return hash;
+    }
+    auto size = std::filesystem::file_size(exe, error);
+    if (!error) {
+      hash = fnv1a(hash, static_cast<uint64_t>(size));
+    }
+    auto time = std::filesystem::last_write_time(exe, error);
+    if (!error) {
+      hash = fnv1a(hash, static_cast<uint64_t>(
+                             time.time_since_epoch().count()));
+    }
+    return hash;
+  }();
+  return key;
+}
+
+} // namespace hash
@@ -1,4 +1,5 @@
 #include "logging.hpp"
+#include <atomic>
 #include <cstdlib> // For getenv
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/spdlog.h>
@@ -11,6 +12,27 @@ void logging::setup() {
   spdlog::set_level(spdlog::level::from_str(log_level));
 }
 
+// The language server recovers on more than one thread
+static std::atomic<int> recoverable_errors = 0;
+
+logging::RecoverableErrors::RecoverableErrors() { ++recoverable_errors; }
+logging::RecoverableErrors::~RecoverableErrors() { --recoverable_errors; }
+
+static thread_local std::ostringstream *captured_errors = nullptr;
+
+logging::CapturedErrors::CapturedErrors() : previous(captured_errors) {
+  captured_errors = &output;
+}
+logging::CapturedErrors::~CapturedErrors() { captured_errors = previous; }
+
+void logging::report_errors(const std::string &text) {
+  std::cerr << text;
+  if (recoverable_errors > 0) {
+    throw logging::CompileError(text);
+  }
+  std::exit(1);
+}
+
 std::string get_error_context(const std::string &source_buffer,
                               const Span &span, bool colorize = true) {
   if (source_buffer.empty()) {
@@ -76,18 +98,22 @@ std::string get_error_context(const std::string &source_buffer,
 // Single error logging function with optional parameters
 void log_error_exit(const std::string &message, const Span &span,
                     const std::string &source_buffer) {
+  std::ostream &out = captured_errors ? *captured_errors : std::cerr;
   // Basic error message
   if (span.start.file_name.empty()) {
-    std::cerr << "Error: " << message << std::endl;
+    out << "Error: " << message << std::endl;
   } else {
     // Full context with source code
-    std::cerr << "Error at " << std::string(span.start.file_name) << ":"
-              << (span.start.row + 1) << ":" << (span.start.col + 1) << ": "
-              << message << std::endl;
+    out << "Error at " << std::string(span.start.file_name) << ":"
+        << (span.start.row + 1) << ":" << (span.start.col + 1) << ": "
+        << message << std::endl;
     std::string context = get_error_context(source_buffer, span, /*colorize*/ isatty(STDERR_FILENO));
     if (!context.empty()) {
-      std::cerr << context << std::endl;
+      out << context << std::endl;
     }
   }
+  if (captured_errors || recoverable_errors > 0) {
+    throw logging::CompileError(message, span);
+  }
   std::exit(1);
 }
@@ -5,18 +5,62 @@
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 namespace logging {
 void setup();
-}
+
+// Thrown by log_error_exit instead of exiting while errors are recoverable,
+// the error has already been printed by then
+struct CompileError : std::runtime_error {
+  explicit CompileError(const std::string &message, const Span &span = {})
+      : std::runtime_error(message), span(span) {}
+  // Where the error is, empty for errors that are not about one place
+  Span span;
+};
+
+// Makes errors recoverable for as long as it lives, the REPL uses it to carry
+// on after a mistake in one input. Whatever threw has to be rolled back by
+// the caller.
+class RecoverableErrors {
+public:
+  RecoverableErrors();
+  ~RecoverableErrors();
+  RecoverableErrors(const RecoverableErrors &) = delete;
+  RecoverableErrors &operator=(const RecoverableErrors &) = delete;
+};
+
+// Collects the errors of the current thread for as long as it lives instead
+// of printing them, and makes them recoverable there. Modules are loaded on
+// worker threads under it, so their errors can be reported in a fixed order
+// once all of them are loaded.
+class CapturedErrors {
+public:
+  CapturedErrors();
+  ~CapturedErrors();
+  CapturedErrors(const CapturedErrors &) = delete;
+  CapturedErrors &operator=(const CapturedErrors &) = delete;
+
+  std::string text() const { return output.str(); }
+
+private:
+  std::ostringstream output;
+  std::ostringstream *previous;
+};
+
+// Prints errors collected by a CapturedErrors, then exits like
+// log_error_exit, or throws while errors are recoverable
+[[noreturn]] void report_errors(const std::string &text);
+} // namespace logging
 
 // Helper function to get lines around an error span
 std::string get_error_context(const std::string &source_buffer,
                               const Span &span);
 
-// Single error logging function with optional parameters
+// Single error logging function with optional parameters, exits unless a
+// logging::RecoverableErrors is alive
 void log_error_exit(const std::string &message,
                     const Span &span = Span{{0, 0, 0, ""}, {0, 0, 0, ""}},
                     const std::string &source_buffer = "");
@@ -1,11 +1,15 @@
 #!/usr/bin/env python3
 from collections import namedtuple
 import shutil
-from subprocess import run, PIPE
+from subprocess import run, Popen, PIPE, DEVNULL
+from contextlib import contextmanager
+from queue import Queue, Empty
+from threading import Thread
+import time
 import argparse
 import re
 from ast import literal_eval
-from dataclasses import dataclass
+from dataclasses import dataclass, replace
 from enum import Enum
 from os import system, makedirs
 import os
@@ -32,9 +36,140 @@ class Result(Enum):
 class Expected:
     type: Result
     value: Union[int, str, None]
+    flags: str = ""
+    remarks: Tuple[str, ...] = ()
+    absent: Tuple[str, ...] = () # Text the compiler must not print, see get_remarks
+    runner: str = "" # The enki command running the test instead, see get_runner
+    runs: int = 1 # Compiles in a row, see get_runs
+    server: bool = False # Compiled through `enki serve`, see get_server
+    inputs: Tuple[str, ...] = () # Compiled in a batch with the test, see get_inputs
+    session: str = "" # Language server session instead of a compile, see get_session
+    edit: Tuple[str, ...] = () # Module edited between two compiles, see get_edit
 
 
 def get_expected(filename) -> Optional[Expected]:
+    expected = _get_expected(filename)
+    return replace(expected, flags=get_flags(filename),
+                   remarks=get_remarks(filename),
+                   absent=get_remarks(filename, "noremark"),
+                   runner=get_runner(filename), runs=get_runs(filename),
+                   server=get_server(filename), inputs=get_inputs(filename),
+                   session=get_session(filename), edit=get_edit(filename))
+
+# Header lines that run the test with an enki command instead of compiling it
+RUNNERS = {"vm": "run", "jit": "jit", "repl": "repl"}
+
+def get_runner(filename) -> str:
+    """The command a test runs with instead of being compiled, `enki run`
+    given with a `/// vm` header line, `enki jit` with `/// jit` and
+    `enki repl` with `/// repl`"""
+    with open(filename, encoding="utf8", errors='ignore') as file:
+        for line in file:
+            if not line.startswith("///"):
+                break
+            if line[3:].strip() in RUNNERS:
+                return RUNNERS[line[3:].strip()]
+    return ""
+
+def get_server(filename) -> bool:
+    """Whether the test is compiled by a server of its own, started with
+    `enki serve` and handed the compiles with `--server`, given with a
+    `/// server` header line"""
+    with open(filename, encoding="utf8", errors='ignore') as file:
+        for line in file:
+            if not line.startswith("///"):
+                break
+            if line[3:].strip() == "server":
+                return True
+    return False
+
+def get_inputs(filename) -> Tuple[str, ...]:
+    """Inputs compiled in one batch after the test, given relative to it with
+    `/// inputs: a.enki @list.txt`. The inputs of a list are relative to the
+    directory the tests run from, as for the command line."""
+    inputs = []
+    directory = Path(filename).parent
+    with open(filename, encoding="utf8", errors='ignore') as file:
+        for line in file:
+            if not line.startswith("///"):
+                break
+            line = line[3:].strip()
+            if line.startswith("inputs:"):
+                for name in line.split(":", 1)[1].split():
+                    if name.startswith("@"):
+                        inputs.append(f"@{directory / name[1:]}")
+                    else:
+                        inputs.append(str(directory / name))
+    return tuple(inputs)
+
+def get_session(filename) -> str:
+    """The script of a language server session run on the test instead of
+    compiling it, given relative to it with `/// lsp: session.json`, see
+    run_session"""
+    with open(filename, encoding="utf8", errors='ignore') as file:
+        for line in file:
+            if not line.startswith("///"):
+                break
+            line = line[3:].strip()
+            if line.startswith("lsp:"):
+                return str(Path(filename).parent / line.split(":", 1)[1].strip())
+    return ""
+
+def get_edit(filename) -> Tuple[str, ...]:
+    """A module the test imports and the text it is edited to, given relative
+    to the test with `/// edit: module.enki edited.enki`. The test is compiled
+    in a copy of the two files, once as it is and once after the module was
+    replaced, and the second compile is checked."""
+    with open(filename, encoding="utf8", errors='ignore') as file:
+        for line in file:
+            if not line.startswith("///"):
+                break
+            line = line[3:].strip()
+            if line.startswith("edit:"):
+                return tuple(str(Path(filename).parent / name)
+                             for name in line.split(":", 1)[1].split())
+    return ()
+
+def get_flags(filename) -> str:
+    """Extra compiler flags given with `/// flags: ...` header lines"""
+    flags = []
+    with open(filename, encoding="utf8", errors='ignore') as file:
+        for line in file:
+            if not line.startswith("///"):
+                break
+            line = line[3:].strip()
+            if line.startswith("flags:"):
+                flags.append(line.split(":", 1)[1].strip())
+    return " ".join(flags)
+
+def get_runs(filename) -> int:
+    """How many times the test is compiled in a row, given with `/// runs: n`.
+    Only the last compile is checked, the earlier ones fill the module cache
+    the test has to itself."""
+    with open(filename, encoding="utf8", errors='ignore') as file:
+        for line in file:
+            if not line.startswith("///"):
+                break
+            line = line[3:].strip()
+            if line.startswith("runs:"):
+                return int(line.split(":", 1)[1])
+    return 1
+
+def get_remarks(filename, header="remark") -> Tuple[str, ...]:
+    """Text that must appear in the compiler's stderr, given with
+    `/// remark: "..."` header lines (see `--remarks`), or that must not
+    appear in it with `/// noremark: "..."`"""
+    remarks = []
+    with open(filename, encoding="utf8", errors='ignore') as file:
+        for line in file:
+            if not line.startswith("///"):
+                break
+            line = line[3:].strip()
+            if line.startswith(header + ":"):
+                remarks.append(literal_eval(line.split(":", 1)[1].strip()))
+    return tuple(remarks)
+
+def _get_expected(filename) -> Optional[Expected]:
     with open(filename, encoding="utf8", errors='ignore') as file:
         for line in file:
             if not line.startswith("///"):
@@ -47,7 +182,7 @@ def get_expected(filename) -> Optional[Expected]:
                 return Expected(Result.SKIP_SILENTLY, None)
             if line == "compile":
                 return Expected(Result.COMPILE_SUCCESS, None)
-            if line == "":
+            if line in ("", "server", *RUNNERS) or line.startswith(("flags:", "remark:", "noremark:", "runs:", "inputs:", "lsp:", "edit:")):
                 continue
 
             if ":" not in line:
@@ -89,25 +224,182 @@ def get_expected(filename) -> Optional[Expected]:
 
 def compile_file(compiler, src, output, expected):
     compiler = os.path.abspath(compiler)
+    if expected.edit:
+        return compile_edited(compiler, src, output, expected)
 
-    extra_flags = ""
+    extra_flags = expected.flags
     if expected.type == Result.TYPECHECK:
-        extra_flags = "-t"
+        extra_flags += " -t"
     cmd = f"{compiler} compile -a -o {output} {extra_flags} {src}"
-    return run(
-        cmd,
-        stdout=PIPE,
-        stderr=PIPE,
-        shell=True,
-    )
+    if expected.inputs:
+        # A batch writes every input to its default output under ./build
+        cmd = f"{compiler} compile {extra_flags} {src} {' '.join(expected.inputs)}"
+    with served(compiler, output, expected.server) as socket:
+        if socket:
+            cmd += f" --server={socket}"
+        for _ in range(expected.runs):
+            process = run(
+                cmd,
+                stdout=PIPE,
+                stderr=PIPE,
+                shell=True,
+                env=test_environment(output),
+            )
+    return process
+
+
+def compile_edited(compiler, src, output, expected):
+    """Compiles a copy of the test and of the module it imports, then again
+    after the module was replaced by its edited version"""
+    module, edited = expected.edit
+    directory = Path(f"{output}.edit")
+    shutil.rmtree(directory, ignore_errors=True)
+    makedirs(directory)
+    shutil.copy(src, directory / Path(src).name)
+    shutil.copy(module, directory / Path(module).name)
+    cmd = f"{compiler} compile -a -o {output} {expected.flags} {directory / Path(src).name}"
+    for text in (None, Path(edited).read_text(encoding="utf8")):
+        if text is not None:
+            (directory / Path(module).name).write_text(text, encoding="utf8")
+        process = run(cmd, stdout=PIPE, stderr=PIPE, shell=True,
+                      env=test_environment(output))
+    return process
+
+
+@contextmanager
+def served(compiler, output, server):
+    """The socket of a server started for the test when it asks for one,
+    stopped again once its compiles are done"""
+    if not server:
+        yield None
+        return
+    socket = os.path.abspath(f"{output}.sock")
+    process = Popen([compiler, "serve", f"--socket={socket}"], stdout=DEVNULL,
+                    stderr=DEVNULL, env=test_environment(output))
+    try:
+        for _ in range(100):
+            if os.path.exists(socket) or process.poll() is not None:
+                break
+            time.sleep(0.05)
+        yield socket
+    finally:
+        process.terminate()
+        process.wait()
 
 
-def handle_test(compiler: str, num: int, path: Path, expected: Expected, debug: bool) -> Tuple[bool, str, Path]:
+def test_environment(output):
+    """Every test gets a module cache of its own next to its output, so
+    what it finds there does not depend on the tests that ran before"""
+    return {**os.environ, "ENKI_CACHE_DIR": f"{output}.cache"}
+
+
+def run_with(compiler, runner, src, output, expected):
+    compiler = os.path.abspath(compiler)
+    flags = expected.flags if expected.runner else ""
+    # The REPL reads the file as its input, one statement after the other
+    src = f"< {src}" if runner == "repl" else src
+    return run(f"{compiler} {runner} {flags} {src}", stdout=PIPE, stderr=PIPE,
+               shell=True, env=test_environment(output))
+
+
+def run_session(compiler, src, output, script) -> Tuple[bool, str]:
+    """Plays a script to `enki lsp` with the test as the open document. The
+    script is a list of steps, `{"send": message}` sends a message and
+    `{"expect": message}` waits for the next message the server sends that
+    has at least the fields given, skipping the others. `$URI` and `$TEXT`
+    stand for the test's URI and text. The session passes when every
+    expected message came and the server exited with 0."""
+    uri = Path(src).resolve().as_uri()
+    text = Path(src).read_text(encoding="utf8")
+    def substitute(value):
+        if isinstance(value, dict):
+            return {key: substitute(item) for key, item in value.items()}
+        if isinstance(value, list):
+            return [substitute(item) for item in value]
+        return {"$URI": uri, "$TEXT": text}.get(value, value) if isinstance(value, str) else value
+
+    def matches(message, expected):
+        if isinstance(expected, dict):
+            return isinstance(message, dict) and all(
+                key in message and matches(message[key], value)
+                for key, value in expected.items())
+        if isinstance(expected, list):
+            return isinstance(message, list) and len(message) == len(expected) and all(
+                matches(item, value) for item, value in zip(message, expected))
+        return message == expected
+
+    process = Popen([os.path.abspath(compiler), "lsp"], stdin=PIPE,
+                    stdout=PIPE, stderr=DEVNULL, env=test_environment(output))
+    received = Queue()
+    def read():
+        while True:
+            length = 0
+            while (line := process.stdout.readline().strip()):
+                if line.startswith(b"Content-Length:"):
+                    length = int(line.split(b":")[1])
+            if not length:
+                received.put(None)
+                return
+            received.put(json.loads(process.stdout.read(length)))
+    Thread(target=read, daemon=True).start()
+
+    try:
+        with open(script, encoding="utf8") as file:
+            steps = substitute(json.load(file))
+        for step in steps:
+            if "send" in step:
+                body = json.dumps({"jsonrpc": "2.0", **step["send"]}).encode("utf8")
+                process.stdin.write(b"Content-Length: %d\r\n\r\n" % len(body) + body)
+                process.stdin.flush()
+                continue
+            while True:
+                try:
+                    message = received.get(timeout=10)
+                except Empty:
+                    message = None
+                if message is None:
+                    return False, f"Expected message not received\n  expected: {step['expect']}"
+                if matches(message, step["expect"]):
+                    break
+        process.stdin.close()
+        code = process.wait(timeout=10)
+        if code != 0:
+            return False, f"Expected the server to exit with 0, but got {code}"
+        return True, "(Success)"
+    finally:
+        if process.poll() is None:
+            process.kill()
+            process.wait()
+
+
+def runner_for(expected: Expected, runner: str) -> str:
+    """Programs run with `enki run` or `enki jit` when the test asks for it,
+    or for the whole suite with --vm or --jit, the flags of such a test go to
+    that command. Other tests that pass compiler flags or check remarks are
+    about a backend or a pass, and are always compiled."""
+    if expected.type not in (Result.EXIT_WITH_CODE, Result.EXIT_WITH_OUTPUT,
+                             Result.RUNTIME_FAIL):
+        return ""
+    if expected.runner:
+        return expected.runner
+    return runner if not expected.flags and not expected.remarks and not expected.absent else ""
+
+
+def handle_test(compiler: str, num: int, path: Path, expected: Expected, debug: bool, runner: str) -> Tuple[bool, str, Path]:
     exec_name = f'./build/tests/{path.stem}-{num}'
     if debug:
         print(f"[{num}] {path} || {exec_name}", flush=True)
 
+    if expected.session:
+        return (*run_session(compiler, path, exec_name, expected.session), path)
+
+    if runner := runner_for(expected, runner):
+        return check_run(run_with(compiler, runner, path, exec_name, expected),
+                         expected, path)
+
     process = compile_file(compiler, path, exec_name, expected)
+    if expected.server and "compiling in-process" in process.stdout.decode("utf-8"):
+        return False, "Expected the server to compile, but it was not listening", path
     if expected.type == Result.COMPILE_FAIL:
         if process.returncode == 0:
             return False, "Expected compilation failure, but succeeded", path
@@ -130,7 +422,15 @@ def handle_test(compiler: str, num: int, path: Path, expected: Expected, debug:
         stderr = textwrap.indent(process.stderr.decode("utf-8"), " "*10).strip()
         return False, f"Compilation failed:\n  code: {process.returncode}\n  stdout: {stdout}\n  stderr: {stderr}", path
 
-    elif expected.type in (Result.COMPILE_SUCCESS, Result.TYPECHECK):
+    compile_errors = process.stderr.decode("utf-8")
+    for remark in expected.remarks:
+        if remark not in compile_errors:
+            return False, f"Expected remark not found\n  expected: {repr(remark)}", path
+    for remark in expected.absent:
+        if remark in compile_errors:
+            return False, f"Unexpected remark found\n  unexpected: {repr(remark)}", path
+
+    if expected.type in (Result.COMPILE_SUCCESS, Result.TYPECHECK):
         return True, "(Success)", path
 
     try:
@@ -138,6 +438,11 @@ def handle_test(compiler: str, num: int, path: Path, expected: Expected, debug:
     except FileNotFoundError:
         return False, "Executable not found", path
 
+    return check_run(process, expected, path)
+
+
+def check_run(process, expected: Expected, path: Path) -> Tuple[bool, str, Path]:
+    """Checks the exit code and output of the program against the test"""
     if process.returncode != 0 and expected.type not in [Result.EXIT_WITH_CODE, Result.RUNTIME_FAIL]:
         return False, f"Expected exit code 0, but got {process.returncode}", path
 
@@ -200,6 +505,22 @@ def main():
         action="store_true",
         help="Run single threaded, and print all test names as we go"
     )
+    runners = parser.add_mutually_exclusive_group()
+    runners.add_argument(
+        "--vm",
+        action="store_const",
+        const="run",
+        dest="runner",
+        default="",
+        help="Run the programs with `enki run` instead of compiling them"
+    )
+    runners.add_argument(
+        "--jit",
+        action="store_const",
+        const="jit",
+        dest="runner",
+        help="Run the programs with `enki jit` instead of compiling them"
+    )
     parser.add_argument(
         "files",
         nargs="?",
@@ -247,7 +568,7 @@ def main():
     stats.total = len(tests_to_run)
 
     arguments = [
-        (args.compiler, num, test_path, expected, args.debug)
+        (args.compiler, num, test_path, expected, args.debug, args.runner)
         for num, (test_path, expected) in enumerate(tests_to_run)
     ]
 